@@ -0,0 +1,133 @@
+/*
+ * osmo-fl2k, turns FL2000-based USB 3.0 to VGA adapters into
+ * low cost DACs
+ *
+ * Minimal producer for the shared memory input of fl2k_tcp (-T shm),
+ * it copies samples from stdin into the slots. Build with
+ *   cc -I../include fl2k_shm_producer.c -o fl2k_shm_producer -lrt
+ * and run it after starting fl2k_tcp -T shm, e.g.
+ *   fl2k_shm_producer < samples.bin
+ *
+ * Copyright (C) 2016-2020 by Steve Markgraf <steve@steve-m.de>
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fl2k_shm.h"
+
+/* fl2k_tcp initializes the header after creating the object, so wait
+ * for the magic before trusting it */
+static fl2k_shm_t *shm_attach(const char *name, size_t *size)
+{
+	struct stat st;
+	void *map;
+	int fd, i;
+
+	fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open shared memory %s, is "
+				"fl2k_tcp -T shm running?\n", name);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(fl2k_shm_t)) {
+		fprintf(stderr, "Shared memory %s is too small\n", name);
+		close(fd);
+		return NULL;
+	}
+
+	*size = st.st_size;
+	map = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Failed to map shared memory %s\n", name);
+		return NULL;
+	}
+
+	for (i = 0; i < 100; i++) {
+		if (fl2k_atomic_load_acquire(&((fl2k_shm_t *)map)->magic) ==
+		    FL2K_SHM_MAGIC)
+			break;
+		usleep(10000);
+	}
+
+	if (i == 100 || ((fl2k_shm_t *)map)->version != FL2K_SHM_VERSION) {
+		fprintf(stderr, "Shared memory %s has no or an unsupported "
+				"header\n", name);
+		munmap(map, *size);
+		return NULL;
+	}
+
+	return map;
+}
+
+int main(int argc, char **argv)
+{
+	const char *name = FL2K_SHM_NAME;
+	fl2k_shm_t *shm;
+	uint32_t seen;
+	size_t size, n;
+	char *slot;
+
+	if (argc > 2) {
+		fprintf(stderr, "Usage: fl2k_shm_producer [name (default: %s)]"
+				" < samples\n", FL2K_SHM_NAME);
+		return 1;
+	}
+
+	if (argc == 2)
+		name = argv[1];
+
+	shm = shm_attach(name, &size);
+	if (!shm)
+		return 1;
+
+	fprintf(stderr, "%u slots of %u bytes, %u %s\n", shm->num_slots,
+		shm->slot_len, shm->channels, shm->interleaved ?
+		"interleaved channels" : "channels one after another");
+
+	while (1) {
+		/* sleep until fl2k_tcp released a slot */
+		while (!fl2k_ring_write_avail(&shm->ring)) {
+			seen = fl2k_atomic_load_acquire(&shm->space_bell);
+			if (fl2k_ring_write_avail(&shm->ring))
+				break;
+			fl2k_shm_wait_bell(&shm->space_bell, seen, 100);
+		}
+
+		slot = fl2k_shm_slot(shm, fl2k_ring_write_pos(&shm->ring));
+
+		/* only whole slots are committed */
+		n = fread(slot, 1, shm->slot_len, stdin);
+		if (n < shm->slot_len)
+			break;
+
+		fl2k_ring_write_commit(&shm->ring, 1);
+		fl2k_shm_ring_bell(&shm->data_bell);
+	}
+
+	munmap(shm, size);
+
+	return 0;
+}
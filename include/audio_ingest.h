@@ -0,0 +1,65 @@
+/*
+ * osmo-fl2k, turns FL2000-based USB 3.0 to VGA adapters into
+ * low cost DACs
+ *
+ * Copyright (C) 2016-2020 by Steve Markgraf <steve@steve-m.de>
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIO_INGEST_H
+#define AUDIO_INGEST_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* Asynchronous audio input.
+ *
+ * A thread reads the 16 bit input in large blocks into a ring, so a
+ * slow pipe or disk never stalls the modulator, as long as the ring
+ * doesn't run empty. Regular files are mapped and read sequentially,
+ * pipes and stdin are read non-blocking with whatever is available. */
+
+typedef struct audio_ingest audio_ingest_t;
+
+/* start reading file from its current position, ring_size is the
+ * minimum size of the ring in bytes, 0 selects the default */
+audio_ingest_t *audio_ingest_start(FILE *file, uint32_t ring_size);
+
+/* stop the thread and free the ring, doesn't close the file */
+void audio_ingest_stop(audio_ingest_t *ai);
+
+/* wake up and fail all pending and future reads */
+void audio_ingest_cancel(audio_ingest_t *ai);
+
+/* Wait until count samples are available and copy them to buf. Less
+ * samples are returned only at the end of the input or after
+ * audio_ingest_cancel(), 0 if there are none left */
+size_t audio_ingest_read(audio_ingest_t *ai, int16_t *buf, size_t count);
+
+/* same, but converts the samples to float within [-1, 1] */
+size_t audio_ingest_read_float(audio_ingest_t *ai, float *buf, size_t count);
+
+/* number of samples buffered, without waiting */
+size_t audio_ingest_avail(audio_ingest_t *ai);
+
+/* wait until count samples are buffered, for prebuffering a live input,
+ * returns less only at the end of the input or after
+ * audio_ingest_cancel() */
+size_t audio_ingest_wait(audio_ingest_t *ai, size_t count);
+
+#endif /* AUDIO_INGEST_H */
@@ -0,0 +1,102 @@
+/*
+ * osmo-fl2k, turns FL2000-based USB 3.0 to VGA adapters into
+ * low cost DACs
+ *
+ * Copyright (C) 2016-2020 by Steve Markgraf <steve@steve-m.de>
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FL2K_CONVERT_H
+#define FL2K_CONVERT_H
+
+#include <stdint.h>
+
+/* Library internal buffer format conversion for the R, G, B DACs.
+ *
+ * The FL2000 expects the samples as interleaved B, G, R bytes, with the
+ * two 32 bit halves of every 64 bit word swapped. 8 samples of each
+ * channel thus make up one 24 byte block of the transfer buffer.
+ * len is the length of the output buffer in bytes and has to be a
+ * multiple of 24, offset is added to every input sample. Channels without
+ * an input buffer (NULL) are set to a constant DC level, so every output
+ * block is written exactly once. */
+
+#define FL2K_DC_LEVEL	0
+
+typedef void (*fl2k_convert_fn_t)(char *out, const char *r, const char *g,
+				  const char *b, uint32_t len, uint8_t offset);
+
+typedef struct fl2k_convert_kernel {
+	const char *name;
+	fl2k_convert_fn_t convert;
+	int (*supported)(void);		/* NULL if always available */
+} fl2k_convert_kernel_t;
+
+/* all kernels built into the library, in ascending order of preference,
+ * terminated by an entry with name set to NULL */
+extern const fl2k_convert_kernel_t fl2k_convert_kernels[];
+
+/* select the fastest kernel supported by the CPU we are running on,
+ * can be overridden by setting FL2K_CONVERT to the name of a kernel */
+const fl2k_convert_kernel_t *fl2k_convert_select(void);
+
+/* scalar reference implementations */
+void fl2k_convert_rgb_scalar(char *out, const char *r, const char *g,
+			     const char *b, uint32_t len, uint8_t offset);
+
+void fl2k_convert_r(char *out, const char *in, uint32_t len, uint8_t offset);
+void fl2k_convert_g(char *out, const char *in, uint32_t len, uint8_t offset);
+void fl2k_convert_b(char *out, const char *in, uint32_t len, uint8_t offset);
+
+/* split len interleaved R, G, B samples (len * 3 bytes) into the channels */
+typedef void (*fl2k_deinterleave_fn_t)(const char *in, char *r, char *g,
+				       char *b, uint32_t len);
+
+fl2k_deinterleave_fn_t fl2k_deinterleave_select(void);
+
+void fl2k_deinterleave_rgb_scalar(const char *in, char *r, char *g, char *b,
+				  uint32_t len);
+
+/* Quantization of FL2K_FORMAT_INT16 and FL2K_FORMAT_FLOAT samples to the
+ * unsigned 8 bit samples of the DACs, with a dither of enum fl2k_dither.
+ * The dither state has to be kept per channel, across the buffers. */
+typedef struct fl2k_dither_state {
+	uint32_t seed[4];		/* random generators, one per SIMD lane */
+	int32_t err;			/* noise shaping error, LSB / 256 */
+} fl2k_dither_state_t;
+
+void fl2k_dither_init(fl2k_dither_state_t *d, uint32_t seed);
+
+typedef void (*fl2k_quantize_fn_t)(uint8_t *out, const void *in,
+				   uint32_t len, int format, int dither,
+				   fl2k_dither_state_t *d);
+
+fl2k_quantize_fn_t fl2k_quantize_select(void);
+
+void fl2k_quantize_scalar(uint8_t *out, const void *in, uint32_t len,
+			  int format, int dither, fl2k_dither_state_t *d);
+
+/* like convert, but from samples of another format, which are quantized
+ * in blocks that stay in the cache right before being interleaved, so
+ * there is no separate pass over the buffer */
+void fl2k_convert_rgb_quantized(fl2k_convert_fn_t convert,
+				fl2k_quantize_fn_t quantize, char *out,
+				const void *r, const void *g, const void *b,
+				uint32_t len, int format, int dither,
+				fl2k_dither_state_t d[3]);
+
+#endif /* FL2K_CONVERT_H */
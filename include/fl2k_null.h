@@ -0,0 +1,71 @@
+/*
+ * osmo-fl2k, turns FL2000-based USB 3.0 to VGA adapters into
+ * low cost DACs
+ *
+ * Copyright (C) 2016-2020 by Steve Markgraf <steve@steve-m.de>
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FL2K_NULL_H
+#define FL2K_NULL_H
+
+/* Library internal virtual device, for running the whole pipeline
+ * without an FL2000.
+ *
+ * If the environment variable FL2K_NULL_DEVICE is set to a number, the
+ * library enumerates that many virtual devices instead of the USB ones.
+ * They stand in for libusb below the library: the register accesses go
+ * to a small register file, and submitted bulk transfers are completed
+ * in order through their libusb callback, each one after the time the
+ * DACs need for its samples at the current rate. The completions are
+ * delivered by fl2k_null_handle_events(), called by the thread which
+ * would otherwise handle the libusb events.
+ *
+ * If FL2K_NULL_SINK names a file, the contents of every completed
+ * transfer are written to it, in the interleaved transfer format the
+ * device receives. With several devices, the index is appended to the
+ * name of all but the first, "-" writes the first one to stdout. */
+
+#include <stdint.h>
+#include <libusb.h>
+
+typedef struct fl2k_null fl2k_null_t;
+
+/* number of virtual devices, 0 if they are disabled */
+uint32_t fl2k_null_device_count(void);
+
+fl2k_null_t *fl2k_null_open(uint32_t index);
+void fl2k_null_close(fl2k_null_t *null);
+
+/* same semantics as libusb_control_transfer() */
+int fl2k_null_control(fl2k_null_t *null, uint8_t request_type,
+		      uint16_t index, unsigned char *data, uint16_t len);
+
+/* the sample rate the transfers are output with, this applies to
+ * those already submitted as well */
+void fl2k_null_set_rate(fl2k_null_t *null, double rate);
+
+/* same semantics as libusb_submit_transfer() and
+ * libusb_cancel_transfer() */
+int fl2k_null_submit(fl2k_null_t *null, struct libusb_transfer *xfer);
+int fl2k_null_cancel(fl2k_null_t *null, struct libusb_transfer *xfer);
+
+/* same semantics as libusb_handle_events_timeout_completed() */
+int fl2k_null_handle_events(fl2k_null_t *null, struct timeval *tv,
+			    int *completed);
+
+#endif /* FL2K_NULL_H */
@@ -0,0 +1,121 @@
+/*
+ * osmo-fl2k, turns FL2000-based USB 3.0 to VGA adapters into
+ * low cost DACs
+ *
+ * Copyright (C) 2016-2020 by Steve Markgraf <steve@steve-m.de>
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FL2K_RING_H
+#define FL2K_RING_H
+
+/* Lock-free single producer, single consumer ring.
+ *
+ * The ring only keeps track of the free running read and write counters,
+ * the storage (transfer indices, bytes, ...) is owned by the user, who
+ * accesses the element at fl2k_ring_write_pos() / fl2k_ring_read_pos()
+ * before committing it. The release store of the counter on commit
+ * makes the element contents visible to the other side before the
+ * counter update, so this is safe on weakly-ordered hosts as well.
+ * size has to be a power of two. */
+
+#include <stdint.h>
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <windows.h>
+typedef volatile LONG fl2k_atomic_t;
+#define fl2k_atomic_load_acquire(p)	((uint32_t)InterlockedCompareExchange(p, 0, 0))
+#define fl2k_atomic_load_relaxed(p)	((uint32_t)*(p))
+#define fl2k_atomic_store_release(p, v)	InterlockedExchange(p, (LONG)(v))
+typedef volatile LONG64 fl2k_atomic64_t;
+#define fl2k_atomic64_load(p)		((uint64_t)InterlockedCompareExchange64(p, 0, 0))
+#define fl2k_atomic64_store(p, v)	InterlockedExchange64(p, (LONG64)(v))
+#else
+#include <stdatomic.h>
+typedef atomic_uint fl2k_atomic_t;
+#define fl2k_atomic_load_acquire(p)	atomic_load_explicit(p, memory_order_acquire)
+#define fl2k_atomic_load_relaxed(p)	atomic_load_explicit(p, memory_order_relaxed)
+#define fl2k_atomic_store_release(p, v)	atomic_store_explicit(p, v, memory_order_release)
+typedef atomic_ullong fl2k_atomic64_t;
+#define fl2k_atomic64_load(p)		((uint64_t)atomic_load_explicit(p, memory_order_relaxed))
+#define fl2k_atomic64_store(p, v)	atomic_store_explicit(p, v, memory_order_relaxed)
+#endif
+
+#define FL2K_CACHELINE	64
+
+typedef struct fl2k_ring {
+	fl2k_atomic_t head;		/* written by producer only */
+	char pad0[FL2K_CACHELINE - sizeof(fl2k_atomic_t)];
+	fl2k_atomic_t tail;		/* written by consumer only */
+	char pad1[FL2K_CACHELINE - sizeof(fl2k_atomic_t)];
+	uint32_t size;
+} fl2k_ring_t;
+
+static inline uint32_t fl2k_ring_size_for(uint32_t min_size)
+{
+	uint32_t size = 1;
+
+	while (size < min_size)
+		size <<= 1;
+
+	return size;
+}
+
+static inline void fl2k_ring_init(fl2k_ring_t *ring, uint32_t size)
+{
+	fl2k_atomic_store_release(&ring->head, 0);
+	fl2k_atomic_store_release(&ring->tail, 0);
+	ring->size = size;
+}
+
+/* consumer side */
+static inline uint32_t fl2k_ring_read_avail(fl2k_ring_t *ring)
+{
+	return fl2k_atomic_load_acquire(&ring->head) -
+	       fl2k_atomic_load_relaxed(&ring->tail);
+}
+
+static inline uint32_t fl2k_ring_read_pos(fl2k_ring_t *ring)
+{
+	return fl2k_atomic_load_relaxed(&ring->tail) & (ring->size - 1);
+}
+
+static inline void fl2k_ring_read_commit(fl2k_ring_t *ring, uint32_t n)
+{
+	fl2k_atomic_store_release(&ring->tail,
+				  fl2k_atomic_load_relaxed(&ring->tail) + n);
+}
+
+/* producer side */
+static inline uint32_t fl2k_ring_write_avail(fl2k_ring_t *ring)
+{
+	return ring->size - (fl2k_atomic_load_relaxed(&ring->head) -
+			     fl2k_atomic_load_acquire(&ring->tail));
+}
+
+static inline uint32_t fl2k_ring_write_pos(fl2k_ring_t *ring)
+{
+	return fl2k_atomic_load_relaxed(&ring->head) & (ring->size - 1);
+}
+
+static inline void fl2k_ring_write_commit(fl2k_ring_t *ring, uint32_t n)
+{
+	fl2k_atomic_store_release(&ring->head,
+				  fl2k_atomic_load_relaxed(&ring->head) + n);
+}
+
+#endif /* FL2K_RING_H */
@@ -0,0 +1,115 @@
+/*
+ * osmo-fl2k, turns FL2000-based USB 3.0 to VGA adapters into
+ * low cost DACs
+ *
+ * Copyright (C) 2016-2020 by Steve Markgraf <steve@steve-m.de>
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FL2K_SHM_H
+#define FL2K_SHM_H
+
+/* Shared memory input of fl2k_tcp (-T shm).
+ *
+ * fl2k_tcp creates the POSIX shared memory object and initializes this
+ * header, a producer on the same host maps it, checks magic and version
+ * and then fills the slots, which fl2k_tcp hands to the library without
+ * copying. A slot holds one buffer of FL2K_BUF_LEN samples for each
+ * channel, one after another, or FL2K_BUF_LEN * 3 bytes of interleaved
+ * R, G, B samples. The ring is the single producer, single consumer
+ * ring of fl2k_ring.h, the producer owns the head and fl2k_tcp the tail.
+ *
+ * Both sides can sleep on the doorbells, which are incremented after
+ * every commit (data_bell) or release (space_bell). On Linux they are
+ * futex words, elsewhere waiting falls back to polling.
+ *
+ * contrib/fl2k_shm_producer.c is a minimal producer. */
+
+#include <stdint.h>
+#include "fl2k_ring.h"
+
+#if defined(__linux__)
+#include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#define FL2K_SHM_MAGIC		0x4b324c46	/* "FL2K" */
+#define FL2K_SHM_VERSION	1
+#define FL2K_SHM_NAME		"/fl2k"
+
+typedef struct fl2k_shm {
+	fl2k_atomic_t magic;		/* set last, with release semantics */
+	uint32_t version;
+	uint32_t slot_len;		/* bytes per slot */
+	uint32_t num_slots;		/* power of two */
+	uint32_t channels;		/* buffers per slot */
+	uint32_t interleaved;		/* 1 if a slot holds interleaved R, G, B */
+	uint32_t data_offset;		/* of the first slot, from the header */
+	char pad0[FL2K_CACHELINE - sizeof(fl2k_atomic_t) - 6 * sizeof(uint32_t)];
+
+	fl2k_ring_t ring;
+	char pad1[FL2K_CACHELINE - sizeof(uint32_t)];
+
+	fl2k_atomic_t data_bell;
+	char pad2[FL2K_CACHELINE - sizeof(fl2k_atomic_t)];
+	fl2k_atomic_t space_bell;
+} fl2k_shm_t;
+
+static inline char *fl2k_shm_slot(fl2k_shm_t *shm, uint32_t idx)
+{
+	return (char *)shm + shm->data_offset + (size_t)idx * shm->slot_len;
+}
+
+static inline void fl2k_shm_ring_bell(fl2k_atomic_t *bell)
+{
+	fl2k_atomic_store_release(bell, fl2k_atomic_load_relaxed(bell) + 1);
+#ifdef __linux__
+	syscall(SYS_futex, bell, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+#endif
+}
+
+/* wait until the bell changed from seen, or timeout_ms passed */
+static inline void fl2k_shm_wait_bell(fl2k_atomic_t *bell, uint32_t seen,
+				      unsigned int timeout_ms)
+{
+#ifdef __linux__
+	struct timespec ts;
+
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+
+	if (fl2k_atomic_load_acquire(bell) == seen)
+		syscall(SYS_futex, bell, FUTEX_WAIT, seen, &ts, NULL, 0);
+#else
+	/* no doorbell, just poll */
+	if (fl2k_atomic_load_acquire(bell) != seen)
+		return;
+#ifdef _WIN32
+	Sleep(timeout_ms);
+#else
+	usleep(timeout_ms * 1000);
+#endif
+#endif
+}
+
+#endif /* FL2K_SHM_H */
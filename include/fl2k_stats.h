@@ -0,0 +1,117 @@
+/*
+ * osmo-fl2k, turns FL2000-based USB 3.0 to VGA adapters into
+ * low cost DACs
+ *
+ * Copyright (C) 2016-2020 by Steve Markgraf <steve@steve-m.de>
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef FL2K_STATS_H
+#define FL2K_STATS_H
+
+/* Library internal collection of the statistics returned by
+ * fl2k_get_stats(). The sample worker and the libusb callback each take
+ * the lock once per transfer, so the overhead stays small. */
+
+#include <stdint.h>
+#include <pthread.h>
+#include "osmo-fl2k.h"
+
+/* logarithmic histogram with 4 sub-buckets per power of two */
+#define FL2K_HIST_SUB_BITS	2
+#define FL2K_HIST_BUCKETS	(64 << FL2K_HIST_SUB_BITS)
+
+typedef struct fl2k_timing {
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t min_ns;
+	uint64_t max_ns;
+	uint32_t hist[FL2K_HIST_BUCKETS];
+} fl2k_timing_t;
+
+typedef struct fl2k_stats_state {
+	pthread_mutex_t mutex;
+
+	fl2k_timing_t callback;
+	fl2k_timing_t convert;
+	fl2k_timing_t resubmit;
+	fl2k_timing_t completion;
+	uint64_t last_completion_ns;
+
+	uint32_t depth;
+	uint32_t depth_min;
+	uint32_t depth_max;
+	uint64_t depth_sum;
+	uint64_t depth_hist[FL2K_STATS_DEPTH_BINS];
+
+	uint64_t bytes_submitted;
+	uint64_t buffers_submitted;
+
+	uint32_t underflow_cnt;
+	uint64_t underflow_ts_ns[FL2K_STATS_UNDERFLOWS];
+
+	/* sample rate estimator, the output samples over the completion
+	 * times, see fl2k_stats_completion() */
+	uint64_t rate_start_ns;		/* of the first completion */
+	uint64_t rate_t0_ns;		/* first one after settling, 0 before */
+	uint64_t rate_last_ns;
+	uint64_t rate_samples;		/* output since rate_t0_ns */
+	double rate_w;			/* exponentially weighted regression, */
+	double rate_mt;			/* time in s and samples since */
+	double rate_ms;			/* rate_t0_ns */
+	double rate_ctt;
+	double rate_cts;
+} fl2k_stats_state_t;
+
+/* monotonic clock in ns */
+uint64_t fl2k_time_ns(void);
+
+void fl2k_stats_init(fl2k_stats_state_t *st);
+void fl2k_stats_destroy(fl2k_stats_state_t *st);
+void fl2k_stats_reset(fl2k_stats_state_t *st);
+
+/* called by the sample worker for every transfer, a duration of 0 means
+ * the stage was not run */
+void fl2k_stats_sample(fl2k_stats_state_t *st, uint64_t callback_ns,
+		       uint64_t convert_ns);
+
+/* called by the libusb callback on every completion, start_ns is the
+ * time of the completion, samples the length of the completed transfer,
+ * depth the filled queue depth at that time, and bytes the length of
+ * the submitted transfer, or 0 on an underflow */
+void fl2k_stats_completion(fl2k_stats_state_t *st, uint64_t start_ns,
+			   uint32_t samples, uint32_t depth, uint32_t bytes,
+			   int underflow);
+
+/* restart the sample rate estimate, after the rate was changed */
+void fl2k_stats_rate_reset(fl2k_stats_state_t *st);
+
+/* The rate the samples are output with, measured by the host clock.
+ * rate follows the recent completions, with a time constant of
+ * FL2K_RATE_TAU, rate_total is the average since the estimate started,
+ * over the given number of seconds. Returns -1 if there are not enough
+ * completions yet. */
+int fl2k_stats_rate(fl2k_stats_state_t *st, double *rate, double *rate_total,
+		    double *seconds, uint64_t *samples);
+
+/* for the transfers submitted when starting to stream */
+void fl2k_stats_submitted(fl2k_stats_state_t *st, uint32_t bytes);
+
+void fl2k_stats_get(fl2k_stats_state_t *st, fl2k_stats_t *stats);
+
+#endif /* FL2K_STATS_H */
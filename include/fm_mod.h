@@ -0,0 +1,130 @@
+/*
+ * osmo-fl2k, turns FL2000-based USB 3.0 to VGA adapters into
+ * low cost DACs
+ *
+ * Copyright (C) 2016-2018 by Steve Markgraf <steve@steve-m.de>
+ *
+ * based on FM modulator code from VGASIG:
+ * Copyright (C) 2009 by Bartek Kania <mbk@gnarf.org>
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FM_MOD_H
+#define FM_MOD_H
+
+#include <stdint.h>
+
+/* Block DDS for the FM carrier.
+ *
+ * The phase is a 32 bit fixed point fraction of a full turn, the top
+ * 8 bits index the sine table. Within a block, the frequency rises
+ * linearly by slope per sample, so the phase of sample i is given in
+ * closed form by phase + i * step + slope * i * (i - 1) / 2. This keeps
+ * the SIMD lanes of fm_dds_gen() independent of each other, and all
+ * arithmetic wraps modulo 2^32. The kernel (SSSE3, AVX2 or NEON) is
+ * selected by fm_dds_init() for the CPU we are running on. */
+
+typedef struct fm_dds {
+	uint32_t phase;
+	uint32_t step;			/* phase increment per sample */
+	uint32_t slope;			/* change of step per sample */
+	double scale;			/* phase increment per Hz */
+} fm_dds_t;
+
+void fm_dds_init(fm_dds_t *dds, double sample_rate, double freq, double phase);
+
+/* convert n frequencies and slopes in Hz to phase increments at once */
+void fm_dds_steps(const fm_dds_t *dds, const double *freq,
+		  const double *slope, uint32_t *step, uint32_t *kslope,
+		  uint32_t n);
+
+static inline void fm_dds_set(fm_dds_t *dds, uint32_t step, uint32_t slope)
+{
+	dds->step = step;
+	dds->slope = slope;
+}
+
+/* generate count signed 8 bit carrier samples */
+void fm_dds_gen(fm_dds_t *dds, int8_t *out, uint32_t count);
+
+/* advance the state by count samples without generating them */
+void fm_dds_skip(fm_dds_t *dds, uint32_t count);
+
+/* Parallel synthesis of a buffer. The buffer is described by segments
+ * with the DDS state at their start, which the caller gets by advancing
+ * a single DDS with fm_dds_skip(). Every thread of the pool then
+ * generates an equal share of the buffer, starting in the middle of a
+ * segment if necessary, so the result is phase continuous. */
+
+typedef struct fm_seg {
+	uint32_t offset;		/* position in the output buffer */
+	uint32_t count;
+	fm_dds_t dds;
+} fm_seg_t;
+
+/* generate the samples [start, end) of a buffer described by segments */
+void fm_seg_gen(const fm_seg_t *segs, uint32_t nsegs, int8_t *out,
+		uint32_t start, uint32_t end);
+
+typedef struct fm_pool fm_pool_t;
+
+fm_pool_t *fm_pool_create(uint32_t threads);
+void fm_pool_destroy(fm_pool_t *pool);
+
+/* start generating len samples, described by nsegs segments covering
+ * the whole buffer, the segments and out must stay valid until
+ * fm_pool_wait() returns */
+void fm_pool_run(fm_pool_t *pool, const fm_seg_t *segs, uint32_t nsegs,
+		 int8_t *out, uint32_t len);
+void fm_pool_wait(fm_pool_t *pool);
+
+/* Mixer for several carriers on one DAC.
+ *
+ * Averages n buffers of signed 8 bit samples, so their sum can't clip
+ * and every carrier gets 1/n of the full amplitude. The sums are kept
+ * in 16 bit lanes with SSE2 or NEON. */
+
+#define FM_MIX_MAX	16
+
+void fm_mix(int8_t *const *in, uint32_t n, int8_t *out, uint32_t len);
+
+/* Stereo multiplex (MPX) composer.
+ *
+ * Turns blocks of interleaved 16 bit L/R audio into the composite
+ * baseband signal: L+R, the pilot and L-R DSB-SC modulated on the
+ * subcarrier, plus an optional RDS signal already at its subcarrier.
+ * The subcarrier is derived from the doubled pilot phase, so both stay
+ * locked to each other. The sines come from a linearly interpolated
+ * 4096 entry float table, the mixing is done with SSE2 or NEON. */
+
+typedef struct fm_mpx {
+	uint32_t phase;			/* pilot phase */
+	uint32_t step;
+	float mono;			/* gain of L+R and L-R, per LSB */
+	float pilot;
+	float rds;
+} fm_mpx_t;
+
+void fm_mpx_init(fm_mpx_t *mpx, double sample_rate, double pilot_freq,
+		 int use_rds);
+
+/* compose count samples from count stereo frames of audio, rds may be
+ * NULL if RDS isn't used. The output is within [-1, 1] */
+void fm_mpx_stereo(fm_mpx_t *mpx, const int16_t *audio, const float *rds,
+		   float *out, uint32_t count);
+
+#endif /* FM_MOD_H */
@@ -28,6 +28,7 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stddef.h>
 #include <osmo-fl2k_export.h>
 
 enum fl2k_error {
@@ -41,6 +42,21 @@ enum fl2k_error {
 	FL2K_ERROR_NO_MEM = -11,
 };
 
+enum fl2k_sample_format {
+	FL2K_FORMAT_INT8 = 0,		/* char, see sampletype_signed */
+	FL2K_FORMAT_INT16,		/* int16_t, -32768 to 32767 */
+	FL2K_FORMAT_FLOAT,		/* float, -1.0 to 1.0 */
+};
+
+/* dither added when quantizing FL2K_FORMAT_INT16 and FL2K_FORMAT_FLOAT
+ * samples to the 8 bit DACs */
+enum fl2k_dither {
+	FL2K_DITHER_NONE = 0,		/* rounding only */
+	FL2K_DITHER_TPDF,		/* triangular, +-1 LSB of the DACs */
+	FL2K_DITHER_SHAPED,		/* TPDF, with the noise shaped towards
+					 * fs/2, away from low frequencies */
+};
+
 typedef struct fl2k_data_info {
 	/* information provided by library */
 	void *ctx;
@@ -49,14 +65,42 @@ typedef struct fl2k_data_info {
 	int using_zerocopy;		/* using zerocopy kernel buffers */
 	int device_error;		/* device error happened, terminate application */
 
-	/* filled in by application */
+	/* filled in by application, channels without a buffer are set to
+	 * a constant level, if no buffer is given at all, the transfer
+	 * buffer is sent again with the data it already contains */
 	int sampletype_signed;		/* are samples signed or unsigned? */
 	char *r_buf;			/* pointer to red buffer */
 	char *g_buf;			/* pointer to green buffer */
 	char *b_buf;			/* pointer to blue buffer */
+
+	/* provided by library when using fl2k_start_tx_direct() */
+	char *raw_buf;			/* transfer buffer of 3 * len bytes */
+
+	/* filled in by application, the format of the samples in r_buf,
+	 * g_buf and b_buf (cast to char *), and the dither used for
+	 * quantizing them, sampletype_signed only applies to 8 bit samples */
+	int sample_format;		/* enum fl2k_sample_format */
+	int dither;			/* enum fl2k_dither */
 } fl2k_data_info_t;
 
 typedef struct fl2k_dev fl2k_dev_t;
+typedef struct fl2k_group fl2k_group_t;
+
+#define FL2K_PATH_LEN		32
+#define FL2K_SERIAL_LEN		64
+
+/* entry of the device list, see fl2k_get_device_list() */
+typedef struct fl2k_device_info {
+	uint32_t index;			/* for fl2k_open() */
+	const char *name;
+	uint16_t vid;
+	uint16_t pid;
+	uint32_t speed;			/* of the USB link in Mbit/s, 0 if unknown */
+	char path[FL2K_PATH_LEN];	/* bus and ports, as in "2-1.4", or bus
+					 * and address with libusb < 1.0.16,
+					 * as in "2@5" */
+	char serial[FL2K_SERIAL_LEN];	/* empty if there is none */
+} fl2k_device_info_t;
 
 /** The transfer length was chosen by the following criteria:
  * - Must be a supported resolution of the FL2000DX
@@ -69,12 +113,94 @@ typedef struct fl2k_dev fl2k_dev_t;
 #define FL2K_BUF_LEN		(1280 * 1024)
 #define FL2K_XFER_LEN		(FL2K_BUF_LEN * 3)
 
+/** URB payload length, the transfer length set with fl2k_set_buffer_config()
+ * has to be a multiple of it **/
+#define FL2K_URB_LEN		61440
+
+/** Byte offset of sample n of the red, green and blue DAC in a transfer
+ * buffer. The samples are interleaved as B, G, R bytes, with the two
+ * 32 bit halves of every 64 bit word swapped.
+ **/
+#define FL2K_RAW_R(n)		(((3 * (n)) + 2) ^ 4)
+#define FL2K_RAW_G(n)		(((3 * (n)) + 1) ^ 4)
+#define FL2K_RAW_B(n)		((3 * (n)) ^ 4)
+
+/* If the environment variable FL2K_NULL_DEVICE is set to a number, that
+ * many virtual devices are enumerated instead of the USB ones. They
+ * complete the transfers at the configured sample rate without any
+ * hardware, and append them to the file FL2K_NULL_SINK if it is set. */
 FL2K_API uint32_t fl2k_get_device_count(void);
 
 FL2K_API const char* fl2k_get_device_name(uint32_t index);
 
 FL2K_API int fl2k_open(fl2k_dev_t **dev, uint32_t index);
 
+/*!
+ * Get a snapshot of the connected devices. The library keeps the list
+ * between calls, with libusb hotplug support it is kept up to date by
+ * the hotplug events, otherwise the bus is scanned again on every call.
+ * The serial numbers are only read once per device. The devices are
+ * sorted by their USB path, so the index of a device only changes if
+ * devices are connected or disconnected, the path and the serial number
+ * stay the same across reboots. fl2k_get_device_count(),
+ * fl2k_get_device_name() and fl2k_open() use the same list.
+ *
+ * \param info array for the devices, may be NULL if len is 0
+ * \param len number of entries of info
+ * \return number of connected devices, which may be larger than len
+ */
+FL2K_API int fl2k_get_device_list(fl2k_device_info_t *info, uint32_t len);
+
+/*!
+ * Get the index of the device with a given serial number.
+ *
+ * \param serial the serial number
+ * \return the device index on success, FL2K_ERROR_NOT_FOUND if no device
+ *	   or several devices have this serial number
+ */
+FL2K_API int fl2k_get_index_by_serial(const char *serial);
+
+/*!
+ * Get the index of the device at a given USB path.
+ *
+ * \param path the path, as in the path of struct fl2k_device_info
+ * \return the device index on success, FL2K_ERROR_NOT_FOUND if there is
+ *	   no device at this path
+ */
+FL2K_API int fl2k_get_index_by_path(const char *path);
+
+/*!
+ * Open the device with a given serial number.
+ *
+ * \param dev pointer to the device handle to be returned
+ * \param serial the serial number
+ * \return 0 on success, FL2K_ERROR_NOT_FOUND if no device or several
+ *	   devices have this serial number
+ */
+FL2K_API int fl2k_open_by_serial(fl2k_dev_t **dev, const char *serial);
+
+/*!
+ * Open the device at a given USB path, which only depends on the ports
+ * it is connected to.
+ *
+ * \param dev pointer to the device handle to be returned
+ * \param path the path, as in the path of struct fl2k_device_info
+ * \return 0 on success, FL2K_ERROR_NOT_FOUND if there is no device at
+ *	   this path
+ */
+FL2K_API int fl2k_open_by_path(fl2k_dev_t **dev, const char *path);
+
+/*!
+ * Open a device given by its index, USB path or serial number, as the
+ * -d option of the bundled tools does. A name of only digits is an index.
+ *
+ * \param dev pointer to the device handle to be returned
+ * \param name the index, path or serial number
+ * \return 0 on success, FL2K_ERROR_NOT_FOUND if there is no such device,
+ *	   or several devices have this serial number
+ */
+FL2K_API int fl2k_open_by_name(fl2k_dev_t **dev, const char *name);
+
 FL2K_API int fl2k_close(fl2k_dev_t *dev);
 
 /* configuration functions */
@@ -97,10 +223,118 @@ FL2K_API int fl2k_set_sample_rate(fl2k_dev_t *dev, uint32_t target_freq);
  */
 FL2K_API uint32_t fl2k_get_sample_rate(fl2k_dev_t *dev);
 
+/*!
+ * Get actual sample rate the device is configured to, including the
+ * fractional part.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \return 0 on error, sample rate in Hz otherwise
+ */
+FL2K_API double fl2k_get_exact_sample_rate(fl2k_dev_t *dev);
+
+/*!
+ * Get the sample rates supported by the PLL, in ascending order.
+ *
+ * \param rates array to be filled with the rates in Hz, can be NULL
+ * \param len length of the array
+ * \return overall number of supported rates
+ */
+FL2K_API int fl2k_get_supported_rates(double *rates, uint32_t len);
+
+/*!
+ * Find the rate fl2k_set_sample_rate() would set for a target rate,
+ * without a device. Applications generating samples for the target
+ * rate can compensate the difference by resampling with the ratio.
+ *
+ * \param target_freq the requested sample rate in Hz
+ * \param exact_freq returns the rate that would be used, can be NULL
+ * \param ratio returns exact_freq / target_freq, can be NULL
+ * \return 0 on success
+ */
+FL2K_API int fl2k_plan_sample_rate(double target_freq, double *exact_freq,
+				   double *ratio);
+
 /* streaming functions */
 
 typedef void(*fl2k_tx_cb_t)(fl2k_data_info_t *data_info);
 
+/*!
+ * Configure the buffering used by the next call to one of the
+ * fl2k_start_tx*() functions. Small buffers allow for a low latency,
+ * more and larger buffers make streaming more robust against scheduling
+ * delays. The callbacks get the configured length in data_info->len.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param buf_len samples per buffer and DAC, 3 * buf_len has to be a
+ *		  multiple of FL2K_URB_LEN, set to 0 for FL2K_BUF_LEN
+ * \param buf_num overall number of buffers, has to be larger than inflight,
+ *		  set to 0 for inflight + 2
+ * \param inflight number of buffers submitted to the device at a time,
+ *		   set to 0 for the default (4)
+ * \return 0 on success, FL2K_ERROR_BUSY while streaming,
+ *	   FL2K_ERROR_INVALID_PARAM on invalid configuration
+ * \note a buf_num passed to fl2k_start_tx() overrides inflight and buf_num
+ */
+FL2K_API int fl2k_set_buffer_config(fl2k_dev_t *dev, uint32_t buf_len,
+				    uint32_t buf_num, uint32_t inflight);
+
+/* A buffer configuration and the highest sample rate it was found to
+ * sustain on a host, as measured and saved by fl2k_test -R. */
+typedef struct fl2k_profile {
+	uint32_t buf_len;		/* samples per buffer and DAC */
+	uint32_t buf_num;
+	uint32_t inflight;
+	uint32_t max_rate;		/* in Hz, 0 if unknown */
+} fl2k_profile_t;
+
+/*!
+ * Load a buffer profile. It isn't applied automatically, as the buffer
+ * length changes the length of the buffers the callback has to provide,
+ * see fl2k_data_info_t. The bundled tools apply the default profile with
+ * fl2k_apply_default_profile().
+ *
+ * \param path file to load, NULL for the default profile, which is the
+ *	       file named by the environment variable FL2K_PROFILE, or
+ *	       .fl2k_profile in the home directory
+ * \param profile the profile to be filled in
+ * \return 0 on success, FL2K_ERROR_NOT_FOUND if the file doesn't exist,
+ *	   FL2K_ERROR_INVALID_PARAM if it isn't a valid profile
+ */
+FL2K_API int fl2k_load_profile(const char *path, fl2k_profile_t *profile);
+
+/*!
+ * Save a buffer profile, see fl2k_load_profile().
+ *
+ * \param path file to write, NULL for the default profile
+ * \param profile the profile to be saved
+ * \return 0 on success
+ */
+FL2K_API int fl2k_save_profile(const char *path, const fl2k_profile_t *profile);
+
+/*!
+ * Apply a buffer profile with fl2k_set_buffer_config(). Setting a sample
+ * rate above the max_rate of the profile prints a warning afterwards.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param profile the profile to be applied
+ * \return see fl2k_set_buffer_config()
+ */
+FL2K_API int fl2k_apply_profile(fl2k_dev_t *dev, const fl2k_profile_t *profile);
+
+/*!
+ * Load the default profile and apply it, printing the configuration used
+ * or why the profile was ignored.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param keep_buf_len ignore a profile with a buffer length other than
+ *		       FL2K_BUF_LEN, for callbacks that provide buffers of
+ *		       that length
+ * \return 0 on success, FL2K_ERROR_NOT_FOUND if there is no profile,
+ *	   FL2K_ERROR_INVALID_PARAM if it was ignored, or see
+ *	   fl2k_set_buffer_config()
+ */
+FL2K_API int fl2k_apply_default_profile(fl2k_dev_t *dev, int keep_buf_len);
+
 /*!
  * Starts the tx thread. This function will block until
  * it is being canceled using fl2k_stop_tx()
@@ -109,11 +343,81 @@ typedef void(*fl2k_tx_cb_t)(fl2k_data_info_t *data_info);
  * \param ctx user specific context to pass via the callback function
  * \param buf_num optional buffer count, buf_num * FL2K_BUF_LEN = overall buffer size
  *		  set to 0 for default buffer count (4)
- * \return 0 on success
+ * \return 0 on success, FL2K_ERROR_NO_MEM if the buffers or threads
+ *	   couldn't be allocated
  */
 FL2K_API int fl2k_start_tx(fl2k_dev_t *dev, fl2k_tx_cb_t cb,
 		     void *ctx, uint32_t buf_num);
 
+/*!
+ * Starts the tx thread in zero-copy mode. Instead of filling its own
+ * sample buffers, the application writes the unsigned samples of all DACs
+ * directly into the transfer buffer passed as raw_buf in the callback,
+ * using the byte order described at FL2K_RAW_R(). r_buf, g_buf, b_buf,
+ * sampletype_signed, sample_format and dither are ignored.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param ctx user specific context to pass via the callback function
+ * \param buf_num optional buffer count, see fl2k_start_tx()
+ * \return 0 on success
+ */
+FL2K_API int fl2k_start_tx_direct(fl2k_dev_t *dev, fl2k_tx_cb_t cb,
+				  void *ctx, uint32_t buf_num);
+
+/*!
+ * Starts streaming without a callback, samples are written from any
+ * application thread using fl2k_write_samples() instead.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param sampletype_signed are the samples signed or unsigned?
+ * \param buf_num optional buffer count, see fl2k_start_tx()
+ * \return 0 on success
+ */
+FL2K_API int fl2k_start_tx_write(fl2k_dev_t *dev, int sampletype_signed,
+				 uint32_t buf_num);
+
+/*!
+ * Starts streaming a waveform that repeats every len samples, without
+ * a callback. The waveform is converted into the transfer buffers once,
+ * afterwards the same transfers are resubmitted until fl2k_stop_tx(), so
+ * streaming takes next to no CPU time. The buffers hold a whole number of
+ * periods, the transfer length is chosen to keep them few, which also
+ * makes the memory needed grow with len. The number of transfers in
+ * flight set with fl2k_set_buffer_config() is kept.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param r unsigned samples of the red DAC, NULL for a constant level
+ * \param g unsigned samples of the green DAC, NULL for a constant level
+ * \param b unsigned samples of the blue DAC, NULL for a constant level
+ * \param len length of the period in samples
+ * \return 0 on success, FL2K_ERROR_INVALID_PARAM if the waveform needs
+ *	   too much memory, FL2K_ERROR_BUSY if already streaming,
+ *	   FL2K_ERROR_NO_MEM if the buffers couldn't be allocated
+ */
+FL2K_API int fl2k_start_tx_periodic(fl2k_dev_t *dev, const char *r,
+				    const char *g, const char *b,
+				    uint32_t len);
+
+/*!
+ * Write samples to the device after starting with fl2k_start_tx_write().
+ * The samples are converted directly into the next free transfer buffer,
+ * which is submitted once it is full. The chunk length can be arbitrary.
+ * Only one thread may write samples at a time.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param r_buf samples for the red DAC, NULL to keep it at a constant level
+ * \param g_buf samples for the green DAC, NULL to keep it at a constant level
+ * \param b_buf samples for the blue DAC, NULL to keep it at a constant level
+ * \param len number of samples per channel
+ * \param timeout_ms time to wait for a free transfer buffer, 0 to wait forever
+ * \return number of samples written, FL2K_ERROR_TIMEOUT if none could be
+ *	   written in time, FL2K_ERROR_NO_DEVICE or FL2K_ERROR_BUSY if
+ *	   streaming has stopped
+ */
+FL2K_API int fl2k_write_samples(fl2k_dev_t *dev, const char *r_buf,
+				const char *g_buf, const char *b_buf,
+				uint32_t len, unsigned int timeout_ms);
+
 /*!
  * Cancel all pending asynchronous operations on the device.
  *
@@ -122,6 +426,248 @@ FL2K_API int fl2k_start_tx(fl2k_dev_t *dev, fl2k_tx_cb_t cb,
  */
 FL2K_API int fl2k_stop_tx(fl2k_dev_t *dev);
 
+enum fl2k_thread {
+	FL2K_THREAD_USB = 0,		/* handles the USB transfers */
+	FL2K_THREAD_SAMPLE = 1,		/* runs the callback and conversion */
+};
+
+/*!
+ * Configure CPU affinity and scheduling of a worker thread, applied
+ * when the thread is started by the next fl2k_start_tx*() call. If the
+ * settings can't be applied, e.g. due to missing privileges, a warning
+ * is printed and streaming continues with the default scheduling.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param thread the worker thread, see enum fl2k_thread
+ * \param cpu CPU to pin the thread to, -1 to not pin it
+ * \param rt_priority SCHED_FIFO priority, 0 for the default scheduling
+ * \return 0 on success
+ * \note grouped devices share the event thread of the group, and there
+ *	 is no sample worker when using fl2k_start_tx_write()
+ */
+FL2K_API int fl2k_set_thread_config(fl2k_dev_t *dev, int thread, int cpu,
+				    int rt_priority);
+
+/*!
+ * Lock the transfer buffers allocated by the next fl2k_start_tx*() call
+ * in memory, so they can't be paged out. A warning is printed if this
+ * fails, e.g. because RLIMIT_MEMLOCK is too low.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param enable 1 to lock the buffers, 0 to not lock them (default)
+ * \return 0 on success
+ */
+FL2K_API int fl2k_set_mlock(fl2k_dev_t *dev, int enable);
+
+/* sample buffers */
+
+#define FL2K_BUF_ALIGN		64
+
+enum fl2k_alloc_flags {
+	FL2K_ALLOC_HUGEPAGE = (1 << 0),	/* back with 2 MB pages */
+	FL2K_ALLOC_NUMA = (1 << 1),	/* on the node of the USB controller */
+};
+
+/*!
+ * Allocate a zero filled buffer, aligned to FL2K_BUF_ALIGN bytes for the
+ * SIMD kernels. The library uses the same for its transfer buffers when
+ * zero-copy buffers aren't available.
+ *
+ * With FL2K_ALLOC_HUGEPAGE, the buffer is backed by reserved huge pages
+ * if there are any, otherwise by transparent huge pages, which reduces
+ * TLB misses. The size is rounded up to a multiple of 2 MB then. With
+ * FL2K_ALLOC_NUMA, the memory is preferably placed on the NUMA node of
+ * the USB controller the device is attached to. Both are only supported
+ * on Linux, and silently ignored if they aren't available.
+ *
+ * \param dev the device handle given by fl2k_open(), can be NULL if
+ *	  FL2K_ALLOC_NUMA isn't used
+ * \param len size of the buffer in bytes
+ * \param flags see enum fl2k_alloc_flags
+ * \return the buffer, NULL if there isn't enough memory
+ */
+FL2K_API void *fl2k_alloc_buffer(fl2k_dev_t *dev, size_t len,
+				 unsigned int flags);
+
+/*!
+ * Free a buffer allocated with fl2k_alloc_buffer().
+ *
+ * \param buf the buffer, can be NULL
+ */
+FL2K_API void fl2k_free_buffer(void *buf);
+
+/*!
+ * Keep the transfers, their buffers and the worker threads after
+ * streaming is stopped, until the device is closed. A following
+ * fl2k_start_tx*() call with the same buffer configuration reuses them,
+ * which makes restarting much faster. The workers wait for the next start
+ * without using CPU time.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param enable 1 to keep them, 0 to free them when stopping (default),
+ *	  which frees them right away if they are kept from a previous run
+ * \return 0 on success, FL2K_ERROR_BUSY while streaming
+ */
+FL2K_API int fl2k_set_persistent(fl2k_dev_t *dev, int enable);
+
+/*!
+ * Get the number of samples per DAC the device has output since
+ * streaming was started, counted in whole transfers. Comparing the
+ * counters of several devices allows keeping them aligned.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \return number of samples
+ */
+FL2K_API uint64_t fl2k_get_sample_count(fl2k_dev_t *dev);
+
+/* device groups */
+
+/*!
+ * Create a group of devices that share a single libusb context and
+ * event thread. Grouped devices are opened with fl2k_group_open() and
+ * started together with fl2k_group_start().
+ *
+ * \param group pointer to the group handle to be returned
+ * \return 0 on success
+ */
+FL2K_API int fl2k_group_create(fl2k_group_t **group);
+
+/*!
+ * Open a device as part of a group, use fl2k_close() to close it again.
+ *
+ * \param group the group handle given by fl2k_group_create()
+ * \param dev pointer to the device handle to be returned
+ * \param index index of the device, see fl2k_open()
+ * \return 0 on success
+ */
+FL2K_API int fl2k_group_open(fl2k_group_t *group, fl2k_dev_t **dev,
+			     uint32_t index);
+
+/*!
+ * Start transmitting on all devices of the group. The fl2k_start_tx*()
+ * functions only prepare grouped devices, which then start filling
+ * their spare buffers. This function submits the initial transfers of
+ * all prepared devices interleaved, so they start in lockstep.
+ *
+ * \param group the group handle given by fl2k_group_create()
+ * \return 0 on success, FL2K_ERROR_NOT_FOUND if no device was prepared
+ */
+FL2K_API int fl2k_group_start(fl2k_group_t *group);
+
+/*!
+ * Stop transmitting on all devices of the group, see fl2k_stop_tx().
+ *
+ * \param group the group handle given by fl2k_group_create()
+ * \return 0 on success
+ */
+FL2K_API int fl2k_group_stop(fl2k_group_t *group);
+
+/*!
+ * Destroy a group, all of its devices have to be closed before.
+ *
+ * \param group the group handle given by fl2k_group_create()
+ * \return 0 on success, FL2K_ERROR_BUSY if there are still open devices
+ */
+FL2K_API int fl2k_group_destroy(fl2k_group_t *group);
+
+/* statistics */
+
+#define FL2K_STATS_DEPTH_BINS	16	/* filled queue depth histogram bins */
+#define FL2K_STATS_UNDERFLOWS	16	/* timestamps of the last underflows */
+
+typedef struct fl2k_timing_stats {
+	uint64_t count;			/* number of measurements */
+	uint64_t min_ns;
+	uint64_t avg_ns;
+	uint64_t max_ns;
+	uint64_t p50_ns;		/* percentiles, approximated with */
+	uint64_t p90_ns;		/* a resolution of 25% */
+	uint64_t p99_ns;
+} fl2k_timing_stats_t;
+
+typedef struct fl2k_stats {
+	/* application callback, includes filling the transfer buffer
+	 * when using fl2k_start_tx_direct() */
+	fl2k_timing_stats_t callback;
+	/* conversion of the samples into the transfer buffer */
+	fl2k_timing_stats_t convert;
+	/* USB completion until the next transfer is submitted */
+	fl2k_timing_stats_t resubmit;
+	/* interval between two USB completions */
+	fl2k_timing_stats_t completion;
+
+	/* number of filled transfers waiting for submission, sampled on
+	 * every USB completion, the last bin counts all larger depths */
+	uint32_t queue_depth;		/* most recent depth */
+	uint32_t queue_depth_min;
+	uint32_t queue_depth_max;
+	double queue_depth_avg;
+	uint64_t queue_depth_hist[FL2K_STATS_DEPTH_BINS];
+
+	uint64_t bytes_submitted;
+	uint64_t buffers_submitted;
+
+	/* underflows, the timestamps are in ns of the monotonic clock,
+	 * the most recent one last */
+	uint32_t underflow_cnt;
+	uint32_t underflow_log_len;
+	uint64_t underflow_ts_ns[FL2K_STATS_UNDERFLOWS];
+	uint64_t now_ns;		/* when the statistics were taken */
+} fl2k_stats_t;
+
+/*!
+ * Get the statistics collected since streaming was started.
+ * Slow callbacks or conversions indicate the application or host CPU
+ * is too slow, while a long completion interval with a full queue
+ * points to the USB host controller.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param stats pointer to the structure to be filled in
+ * \return 0 on success
+ */
+FL2K_API int fl2k_get_stats(fl2k_dev_t *dev, fl2k_stats_t *stats);
+
+typedef struct fl2k_rate_estimate {
+	double nominal_rate;		/* set with fl2k_set_sample_rate() */
+	double rate;			/* recent rate, time constant 10 s */
+	double ppm;			/* of rate from nominal_rate */
+	double rate_total;		/* average over the whole estimate */
+	double ppm_total;
+	double seconds;			/* covered by the estimate */
+	uint64_t samples;		/* output within that time */
+} fl2k_rate_estimate_t;
+
+/*!
+ * Get an estimate of the sample rate the DACs actually run at, in
+ * samples per second of the host clock. The crystal of the FL2000 is
+ * usually off by some PPM, so a live source with its own clock, or one
+ * paced by the host clock, slowly gets ahead or behind. The estimate is
+ * a least squares fit of the output samples over the times of the USB
+ * completions, which averages out their jitter. It starts one second
+ * after streaming was started or the sample rate was changed, as the
+ * clock takes a while to settle.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param est pointer to the estimate to be filled in
+ * \return 0 on success, FL2K_ERROR_NOT_FOUND if there are not enough
+ *	   completed transfers yet
+ */
+FL2K_API int fl2k_get_rate_estimate(fl2k_dev_t *dev,
+				    fl2k_rate_estimate_t *est);
+
+/*!
+ * Split interleaved R, G, B samples into separate channel buffers, as
+ * expected for r_buf, g_buf and b_buf. Uses SIMD if the CPU supports it.
+ *
+ * \param in interleaved samples R, G, B, R, G, B, ..., len * 3 bytes
+ * \param r buffer for len samples of the red channel
+ * \param g buffer for len samples of the green channel
+ * \param b buffer for len samples of the blue channel
+ * \param len number of samples per channel
+ */
+FL2K_API void fl2k_deinterleave_rgb(const char *in, char *r, char *g,
+				    char *b, uint32_t len);
+
 /*!
  * Read 4 bytes via the FL2K I2C bus
  *
@@ -129,7 +675,7 @@ FL2K_API int fl2k_stop_tx(fl2k_dev_t *dev);
  * \param i2c_addr address of the I2C device
  * \param reg_addr start address of the 4 bytes to be read
  * \param data pointer to byte array of size 4
- * \return 0 on success
+ * \return the number of bytes read (4) on success, <0 on error
  * \note A read operation will look like this on the bus:
  *       START, I2C_ADDR(W), REG_ADDR,   REP_START, I2C_ADDR(R), DATA[0], STOP
  *       START, I2C_ADDR(W), REG_ADDR+1, REP_START, I2C_ADDR(R), DATA[1], STOP
@@ -156,6 +702,62 @@ FL2K_API int fl2k_i2c_read(fl2k_dev_t *dev, uint8_t i2c_addr,
 FL2K_API int fl2k_i2c_write(fl2k_dev_t *dev, uint8_t i2c_addr,
 			    uint8_t reg_addr, uint8_t *data);
 
+enum fl2k_reg_op_type {
+	FL2K_OP_REG_READ = 0,		/* val = register reg */
+	FL2K_OP_REG_WRITE,		/* register reg = val */
+	FL2K_OP_I2C_READ,		/* like fl2k_i2c_read() */
+	FL2K_OP_I2C_WRITE,		/* like fl2k_i2c_write() */
+};
+
+typedef struct fl2k_reg_op {
+	enum fl2k_reg_op_type type;
+	uint16_t reg;			/* register of the FL2000 */
+	uint32_t val;
+	uint8_t i2c_addr;		/* address of the I2C device */
+	uint8_t reg_addr;		/* start address within the I2C device */
+	uint8_t data[4];		/* the 4 bytes read or written */
+	int status;			/* 0 or a negative error, when done */
+} fl2k_reg_op_t;
+
+typedef void(*fl2k_reg_cb_t)(fl2k_reg_op_t *ops, uint32_t num, void *ctx);
+
+/*!
+ * Execute a batch of register and I2C operations, in order. Every
+ * operation is attempted and gets its own status, except that the rest
+ * of the batch fails with FL2K_ERROR_NO_DEVICE once the device is gone.
+ *
+ * The completion of an I2C operation is polled for with a short
+ * interval that backs off, so a 4 byte access takes about as long as
+ * it is on the bus, instead of a multiple of 10 ms. This can be used
+ * while transmitting, without disturbing the sample stream.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param ops the operations, their results are stored in them
+ * \param num number of operations
+ * \return 0 on success, or the first error of an operation
+ */
+FL2K_API int fl2k_run_reg_ops(fl2k_dev_t *dev, fl2k_reg_op_t *ops,
+			      uint32_t num);
+
+/*!
+ * Queue a batch of register and I2C operations, and return at once. The
+ * batches are executed in the order they were submitted by a thread of
+ * the device, same as with fl2k_run_reg_ops(), then the callback is
+ * called from that thread. It may submit further batches.
+ *
+ * The operations have to stay valid until the callback was called.
+ * fl2k_close() completes all batches that are still queued.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param ops the operations, their results are stored in them
+ * \param num number of operations
+ * \param cb function called once the batch is done, can be NULL
+ * \param ctx user specific context to pass via the callback function
+ * \return 0 on success
+ */
+FL2K_API int fl2k_submit_reg_ops(fl2k_dev_t *dev, fl2k_reg_op_t *ops,
+				 uint32_t num, fl2k_reg_cb_t cb, void *ctx);
+
 #ifdef __cplusplus
 }
 #endif
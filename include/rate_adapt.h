@@ -0,0 +1,80 @@
+/*
+ * osmo-fl2k, turns FL2000-based USB 3.0 to VGA adapters into
+ * low cost DACs
+ *
+ * Copyright (C) 2016-2020 by Steve Markgraf <steve@steve-m.de>
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RATE_ADAPT_H
+#define RATE_ADAPT_H
+
+#include <stdint.h>
+
+/* Adaptation to the clock of a live source.
+ *
+ * A source with its own clock delivers its samples slightly faster or
+ * slower than the DACs consume them, so the buffer in between slowly runs
+ * full or empty. The controller watches the fill level of that buffer and
+ * returns the factor the source has to be consumed faster with, so the
+ * level stays at its target. It is a PI controller on the low pass
+ * filtered level, the proportional part settles within about a minute,
+ * the integral part removes the remaining offset, and the factor stays
+ * within RATE_ADAPT_MAX_DEV, so the pitch of audio doesn't audibly
+ * change. */
+
+#define RATE_ADAPT_MAX_DEV	1e-3
+
+typedef struct rate_adapt {
+	double target;			/* fill level, in s */
+	double level;			/* filtered fill level */
+	double integ;			/* integral part of the factor */
+	double ratio;			/* current factor */
+	int init;
+} rate_adapt_t;
+
+void rate_adapt_init(rate_adapt_t *ra, double target);
+
+/* update with the current fill level, dt after the last update, both in
+ * s, returns the factor */
+double rate_adapt_update(rate_adapt_t *ra, double level, double dt);
+
+/* Fractional resampler for factors close to 1.
+ *
+ * Linear interpolation of signed 8 bit samples. The output only has 8
+ * bits, so the weights of the two input samples only have 8 bits as
+ * well, which keeps the SSE2 and NEON kernels in 16 bit lanes. The
+ * position is a 32.32 fixed point index into the input, which is
+ * advanced by step per output sample. in has to hold
+ * rate_adapt_needed() samples. */
+
+static inline uint64_t rate_adapt_step(double ratio)
+{
+	return (uint64_t)(ratio * 4294967296.0 + 0.5);
+}
+
+/* input samples needed for len output samples */
+static inline uint32_t rate_adapt_needed(uint64_t pos, uint64_t step,
+					 uint32_t len)
+{
+	return (uint32_t)((pos + (uint64_t)len * step) >> 32) + 2;
+}
+
+void rate_adapt_resample_s8(const int8_t *in, int8_t *out, uint32_t len,
+			    uint64_t *pos, uint64_t step);
+
+#endif /* RATE_ADAPT_H */
@@ -27,12 +27,20 @@
 #ifndef RDS_H
 #define RDS_H
 
+#include <stdint.h>
+
 #define RDS_MODULATOR_RATE	(57000 * 4)
 
-void get_rds_samples(double *buffer, int count);
-void set_rds_pi(uint16_t pi_code);
-void set_rds_rt(char *rt);
-void set_rds_ps(char *ps);
-void set_rds_ta(int ta);
+typedef struct rds_encoder rds_encoder_t;
+
+/* each encoder is an independent RDS stream */
+rds_encoder_t *rds_encoder_create(void);
+void rds_encoder_destroy(rds_encoder_t *enc);
+
+void rds_get_samples(rds_encoder_t *enc, float *buffer, uint32_t count);
+void rds_set_pi(rds_encoder_t *enc, uint16_t pi_code);
+void rds_set_rt(rds_encoder_t *enc, const char *rt);
+void rds_set_ps(rds_encoder_t *enc, const char *ps);
+void rds_set_ta(rds_encoder_t *enc, int ta);
 
 #endif /* RDS_H */
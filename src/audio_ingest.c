@@ -0,0 +1,377 @@
+/*
+ * osmo-fl2k, turns FL2000-based USB 3.0 to VGA adapters into
+ * low cost DACs
+ *
+ * Copyright (C) 2016-2020 by Steve Markgraf <steve@steve-m.de>
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "fl2k_ring.h"
+#include "audio_ingest.h"
+
+#define INGEST_RING_SIZE	(4 * 1024 * 1024)
+
+/* maximum size of a single read or copy into the ring, so the reader
+ * gets woken up regularly */
+#define INGEST_CHUNK		(256 * 1024)
+
+/* how often a blocked pipe read checks if we should stop, in ms */
+#define INGEST_POLL_MS		100
+
+struct audio_ingest {
+	fl2k_ring_t ring;
+	uint8_t *buf;
+	FILE *file;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t data_cond;	/* the ring got filled */
+	pthread_cond_t space_cond;	/* the ring got drained */
+	int running;
+	int eof;
+	volatile int cancel;		/* set without the lock */
+	int stop;
+
+#ifndef _WIN32
+	int fd;
+	int fd_flags;			/* to restore O_NONBLOCK on stop */
+	const uint8_t *map;
+	size_t map_len;
+	size_t map_pos;
+#endif
+};
+
+/* wait for free space, returns the contiguous part of it */
+static uint32_t ingest_wait_space(audio_ingest_t *ai)
+{
+	uint32_t n;
+
+	pthread_mutex_lock(&ai->lock);
+	while (!fl2k_ring_write_avail(&ai->ring) && !ai->stop)
+		pthread_cond_wait(&ai->space_cond, &ai->lock);
+	pthread_mutex_unlock(&ai->lock);
+
+	n = fl2k_ring_write_avail(&ai->ring);
+	if (n > ai->ring.size - fl2k_ring_write_pos(&ai->ring))
+		n = ai->ring.size - fl2k_ring_write_pos(&ai->ring);
+	if (n > INGEST_CHUNK)
+		n = INGEST_CHUNK;
+
+	return n;
+}
+
+static void ingest_commit(audio_ingest_t *ai, uint32_t n)
+{
+	fl2k_ring_write_commit(&ai->ring, n);
+
+	pthread_mutex_lock(&ai->lock);
+	pthread_cond_broadcast(&ai->data_cond);
+	pthread_mutex_unlock(&ai->lock);
+}
+
+/* read up to len bytes, returns 0 at the end of the input */
+static long ingest_fill(audio_ingest_t *ai, uint8_t *dst, uint32_t len)
+{
+#ifndef _WIN32
+	struct pollfd pfd;
+	long r;
+
+	if (ai->map) {
+		/* page faults on the mapping happen here, not in the
+		 * modulator */
+		if (len > ai->map_len - ai->map_pos)
+			len = ai->map_len - ai->map_pos;
+
+		memcpy(dst, ai->map + ai->map_pos, len);
+		ai->map_pos += len;
+
+		return len;
+	}
+
+	while (!ai->stop) {
+		r = read(ai->fd, dst, len);
+		if (r >= 0)
+			return r;
+
+		if (errno == EINTR)
+			continue;
+
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+
+		pfd.fd = ai->fd;
+		pfd.events = POLLIN;
+		poll(&pfd, 1, INGEST_POLL_MS);
+	}
+
+	return 0;
+#else
+	return fread(dst, 1, len, ai->file);
+#endif
+}
+
+static void *ingest_worker(void *arg)
+{
+	audio_ingest_t *ai = (audio_ingest_t *)arg;
+	uint32_t n;
+	long r;
+
+	while (!ai->stop) {
+		n = ingest_wait_space(ai);
+		if (!n)
+			continue;
+
+		r = ingest_fill(ai, &ai->buf[fl2k_ring_write_pos(&ai->ring)], n);
+		if (r <= 0)
+			break;
+
+		ingest_commit(ai, r);
+	}
+
+	pthread_mutex_lock(&ai->lock);
+	ai->eof = 1;
+	pthread_cond_broadcast(&ai->data_cond);
+	pthread_mutex_unlock(&ai->lock);
+
+	return NULL;
+}
+
+#ifndef _WIN32
+static void ingest_setup_fd(audio_ingest_t *ai)
+{
+	struct stat st;
+	off_t pos;
+	void *map;
+
+	ai->fd = fileno(ai->file);
+	ai->fd_flags = -1;
+
+	pos = lseek(ai->fd, 0, SEEK_CUR);
+
+	if (!fstat(ai->fd, &st) && S_ISREG(st.st_mode) && pos >= 0 &&
+	    st.st_size > pos) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, ai->fd, 0);
+		if (map != MAP_FAILED) {
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			ai->map = map;
+			ai->map_len = st.st_size;
+			ai->map_pos = pos;
+			return;
+		}
+	}
+
+	/* pipe, or the file can't be mapped */
+	ai->fd_flags = fcntl(ai->fd, F_GETFL);
+	if (ai->fd_flags != -1)
+		fcntl(ai->fd, F_SETFL, ai->fd_flags | O_NONBLOCK);
+}
+#endif
+
+audio_ingest_t *audio_ingest_start(FILE *file, uint32_t ring_size)
+{
+	audio_ingest_t *ai;
+
+	ai = calloc(1, sizeof(audio_ingest_t));
+	if (!ai)
+		return NULL;
+
+	if (!ring_size)
+		ring_size = INGEST_RING_SIZE;
+
+	fl2k_ring_init(&ai->ring, fl2k_ring_size_for(ring_size));
+
+	ai->buf = malloc(ai->ring.size);
+	if (!ai->buf) {
+		free(ai);
+		return NULL;
+	}
+
+	ai->file = file;
+	pthread_mutex_init(&ai->lock, NULL);
+	pthread_cond_init(&ai->data_cond, NULL);
+	pthread_cond_init(&ai->space_cond, NULL);
+
+#ifndef _WIN32
+	ingest_setup_fd(ai);
+#endif
+
+	if (pthread_create(&ai->thread, NULL, ingest_worker, ai)) {
+		audio_ingest_stop(ai);
+		return NULL;
+	}
+
+	ai->running = 1;
+
+	return ai;
+}
+
+/* doesn't take the lock, so it can be used from a signal handler, the
+ * reader notices it within INGEST_POLL_MS */
+void audio_ingest_cancel(audio_ingest_t *ai)
+{
+	ai->cancel = 1;
+}
+
+void audio_ingest_stop(audio_ingest_t *ai)
+{
+	if (!ai)
+		return;
+
+	pthread_mutex_lock(&ai->lock);
+	ai->stop = 1;
+	ai->cancel = 1;
+	pthread_cond_broadcast(&ai->space_cond);
+	pthread_cond_broadcast(&ai->data_cond);
+	pthread_mutex_unlock(&ai->lock);
+
+	if (ai->running)
+		pthread_join(ai->thread, NULL);
+
+#ifndef _WIN32
+	if (ai->map)
+		munmap((void *)ai->map, ai->map_len);
+
+	if (ai->fd_flags != -1)
+		fcntl(ai->fd, F_SETFL, ai->fd_flags);
+#endif
+
+	pthread_cond_destroy(&ai->space_cond);
+	pthread_cond_destroy(&ai->data_cond);
+	pthread_mutex_destroy(&ai->lock);
+	free(ai->buf);
+	free(ai);
+}
+
+static void ingest_abstime(struct timespec *ts, unsigned int timeout_ms)
+{
+#ifndef _WIN32
+	clock_gettime(CLOCK_REALTIME, ts);
+#else
+	timespec_get(ts, TIME_UTC);
+#endif
+	ts->tv_sec += timeout_ms / 1000;
+	ts->tv_nsec += (timeout_ms % 1000) * 1000000L;
+
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+/* wait for len bytes, returns how many of them are available */
+static uint32_t ingest_wait_data(audio_ingest_t *ai, uint32_t len)
+{
+	struct timespec ts;
+	uint32_t avail = fl2k_ring_read_avail(&ai->ring);
+
+	if (avail < len) {
+		pthread_mutex_lock(&ai->lock);
+		while ((avail = fl2k_ring_read_avail(&ai->ring)) < len &&
+		       !ai->eof && !ai->cancel) {
+			ingest_abstime(&ts, INGEST_POLL_MS);
+			pthread_cond_timedwait(&ai->data_cond, &ai->lock, &ts);
+		}
+		pthread_mutex_unlock(&ai->lock);
+
+		if (ai->cancel)
+			return 0;
+	}
+
+	return avail < len ? avail : len;
+}
+
+static void ingest_consume(audio_ingest_t *ai, uint32_t len)
+{
+	fl2k_ring_read_commit(&ai->ring, len);
+
+	pthread_mutex_lock(&ai->lock);
+	pthread_cond_signal(&ai->space_cond);
+	pthread_mutex_unlock(&ai->lock);
+}
+
+size_t audio_ingest_read(audio_ingest_t *ai, int16_t *buf, size_t count)
+{
+	uint32_t len, pos, n;
+
+	/* a request larger than the ring could never be satisfied */
+	if (count > ai->ring.size / 2)
+		count = ai->ring.size / 2;
+
+	len = ingest_wait_data(ai, count * 2) & ~1;
+	pos = fl2k_ring_read_pos(&ai->ring);
+
+	n = ai->ring.size - pos;
+	if (n > len)
+		n = len;
+
+	memcpy(buf, &ai->buf[pos], n);
+	memcpy((uint8_t *)buf + n, ai->buf, len - n);
+
+	ingest_consume(ai, len);
+
+	return len / 2;
+}
+
+size_t audio_ingest_read_float(audio_ingest_t *ai, float *buf, size_t count)
+{
+	const int16_t *ring = (const int16_t *)ai->buf;
+	uint32_t len, pos, mask, i;
+
+	if (count > ai->ring.size / 2)
+		count = ai->ring.size / 2;
+
+	len = ingest_wait_data(ai, count * 2) / 2;
+
+	/* reads are always whole samples, so they stay aligned */
+	pos = fl2k_ring_read_pos(&ai->ring) / 2;
+	mask = ai->ring.size / 2 - 1;
+
+	for (i = 0; i < len; i++)
+		buf[i] = ring[(pos + i) & mask] / 32767.0f;
+
+	ingest_consume(ai, len * 2);
+
+	return len;
+}
+
+size_t audio_ingest_avail(audio_ingest_t *ai)
+{
+	return fl2k_ring_read_avail(&ai->ring) / 2;
+}
+
+size_t audio_ingest_wait(audio_ingest_t *ai, size_t count)
+{
+	if (count > ai->ring.size / 2)
+		count = ai->ring.size / 2;
+
+	return ingest_wait_data(ai, count * 2) / 2;
+}
@@ -0,0 +1,951 @@
+/*
+ * osmo-fl2k, turns FL2000-based USB 3.0 to VGA adapters into
+ * low cost DACs
+ *
+ * Copyright (C) 2016-2020 by Steve Markgraf <steve@steve-m.de>
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Benchmark of the sample processing paths, no device needed.
+ *
+ * Every benchmark repeatedly processes one buffer for the given time and
+ * prints a JSON object per line, with the throughput, the time per
+ * sample and byte and the latency distribution of a single buffer. The
+ * cycles are counted with the TSC on x86, which runs at the nominal
+ * clock of the CPU, elsewhere they are derived from the clock given
+ * with -c, or null if there is none. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#else
+#include <windows.h>
+#include <process.h>
+#include "getopt/getopt.h"
+#define getpid	_getpid
+#endif
+
+#ifndef M_PI
+# define M_PI		3.14159265358979323846	/* pi */
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+#include "osmo-fl2k.h"
+#include "fl2k_convert.h"
+#include "fm_mod.h"
+#include "rds_mod.h"
+#include "audio_ingest.h"
+
+/* latencies kept per benchmark for the percentiles */
+#define MAX_ITERATIONS	(1 << 16)
+
+/* the rates fl2k_fm uses with RDS */
+#define FM_SAMPLE_RATE	100000000
+#define FM_AUDIO_RATE	RDS_MODULATOR_RATE
+#define FM_CARRIER	97000000
+
+typedef struct bench {
+	const char *name;
+	const char *variant;
+	uint64_t samples;		/* per iteration */
+	uint64_t bytes;			/* per iteration */
+	int (*setup)(struct bench *b);
+	int (*run)(struct bench *b);	/* < 0 on error */
+	void (*teardown)(struct bench *b);
+	void *priv;
+} bench_t;
+
+static double min_time = 1.0;
+static double cpu_mhz = 0;
+static uint32_t file_mb = 64;
+static const char *filter = NULL;
+static const char *tmpdir = NULL;
+
+static uint64_t lat[MAX_ITERATIONS];
+static char *in[3], *out;
+static char *deint[3];		/* deinterleaved samples, in stays intact */
+
+void usage(void)
+{
+	fprintf(stderr,
+		"fl2k_bench, benchmark of the osmo-fl2k sample paths\n\n"
+		"Usage:\n"
+		"\t[-t seconds per benchmark (default: 1)]\n"
+		"\t[-f only run benchmarks whose name contains this string]\n"
+		"\t[-c CPU clock in MHz for the cycles without a TSC]\n"
+		"\t[-s size of the test file in MB (default: 64)]\n"
+		"\t[-T directory for the test file (default: /tmp)]\n"
+		"\t[-l list the benchmarks]\n"
+	);
+	exit(1);
+}
+
+static uint64_t bench_ns(void)
+{
+#ifndef _WIN32
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (uint64_t)((double)now.QuadPart * 1e9 / freq.QuadPart);
+#endif
+}
+
+static uint64_t bench_cycles(void)
+{
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void fill_random(char *buf, size_t len, uint32_t seed)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		seed = seed * 1664525 + 1013904223;
+		buf[i] = seed >> 24;
+	}
+}
+
+/* Conversion to the transfer format, as done by the library for every
+ * buffer in callback mode */
+
+static int run_convert(bench_t *b)
+{
+	const fl2k_convert_kernel_t *k = b->priv;
+
+	k->convert(out, in[0], in[1], in[2], FL2K_XFER_LEN, 128);
+	return 0;
+}
+
+static int run_convert_r(bench_t *b)
+{
+	(void)b;
+
+	fl2k_convert_r(out, in[0], FL2K_XFER_LEN, 128);
+	return 0;
+}
+
+static int run_deinterleave(bench_t *b)
+{
+	fl2k_deinterleave_fn_t fn = (fl2k_deinterleave_fn_t)b->priv;
+
+	fn(out, deint[0], deint[1], deint[2], FL2K_BUF_LEN);
+	return 0;
+}
+
+/* Conversion of 16 bit and float samples, quantized to 8 bit on the way */
+
+typedef struct quant_cfg {
+	const char *variant;
+	int format;
+	int dither;
+} quant_cfg_t;
+
+static const quant_cfg_t quant_cfgs[] = {
+	{ "int16", FL2K_FORMAT_INT16, FL2K_DITHER_NONE },
+	{ "int16_tpdf", FL2K_FORMAT_INT16, FL2K_DITHER_TPDF },
+	{ "int16_shaped", FL2K_FORMAT_INT16, FL2K_DITHER_SHAPED },
+	{ "float", FL2K_FORMAT_FLOAT, FL2K_DITHER_NONE },
+	{ "float_tpdf", FL2K_FORMAT_FLOAT, FL2K_DITHER_TPDF },
+	{ "float_shaped", FL2K_FORMAT_FLOAT, FL2K_DITHER_SHAPED },
+};
+
+typedef struct quant_bench {
+	const quant_cfg_t *cfg;
+	const fl2k_convert_kernel_t *kernel;
+	fl2k_quantize_fn_t quantize;
+	fl2k_dither_state_t dither[3];
+	void *buf[3];
+} quant_bench_t;
+
+static void teardown_quantize(bench_t *b)
+{
+	quant_bench_t *q = b->priv;
+	int i;
+
+	if (!q)
+		return;
+
+	for (i = 0; i < 3; i++)
+		free(q->buf[i]);
+
+	free(q);
+}
+
+static int setup_quantize(bench_t *b)
+{
+	quant_bench_t *q = calloc(1, sizeof(quant_bench_t));
+	uint32_t i, c, seed;
+	int16_t *s16;
+	float *f;
+
+	if (!q) {
+		b->priv = NULL;
+		return -1;
+	}
+
+	q->cfg = b->priv;
+	q->kernel = fl2k_convert_select();
+	q->quantize = fl2k_quantize_select();
+	b->priv = q;
+
+	for (c = 0; c < 3; c++) {
+		fl2k_dither_init(&q->dither[c], c);
+
+		q->buf[c] = malloc(FL2K_BUF_LEN * sizeof(float));
+		if (!q->buf[c])
+			return -1;
+
+		s16 = q->buf[c];
+		f = q->buf[c];
+		seed = c + 1;
+
+		for (i = 0; i < FL2K_BUF_LEN; i++) {
+			seed = seed * 1664525 + 1013904223;
+			if (FL2K_FORMAT_INT16 == q->cfg->format)
+				s16[i] = seed >> 16;
+			else
+				f[i] = (int32_t)seed * (1.0f / 2147483648.0f);
+		}
+	}
+
+	return 0;
+}
+
+static int run_quantize(bench_t *b)
+{
+	quant_bench_t *q = b->priv;
+
+	fl2k_convert_rgb_quantized(q->kernel->convert, q->quantize, out,
+				   q->buf[0], q->buf[1], q->buf[2],
+				   FL2K_XFER_LEN, q->cfg->format,
+				   q->cfg->dither, q->dither);
+	return 0;
+}
+
+/* FM carrier synthesis of fl2k_fm: every audio sample is a segment with
+ * its own frequency and slope */
+
+typedef struct fm_bench {
+	fm_dds_t carrier;
+	fm_seg_t *segs;
+	uint32_t nsegs;
+	double *freq, *slope;
+	uint32_t *step, *kslope;
+	fm_pool_t *pool;
+} fm_bench_t;
+
+static int setup_fm(bench_t *b)
+{
+	fm_bench_t *fm;
+	double per_signal = (double)FM_SAMPLE_RATE / FM_AUDIO_RATE;
+	double acc = 0, last = FM_CARRIER;
+	uint32_t i, n, pos;
+
+	fm = calloc(1, sizeof(fm_bench_t));
+	if (!fm)
+		return -1;
+
+	n = FL2K_BUF_LEN / (uint32_t)per_signal + 2;
+	fm->segs = malloc(n * sizeof(fm_seg_t));
+	fm->freq = malloc(n * sizeof(double));
+	fm->slope = malloc(n * sizeof(double));
+	fm->step = malloc(n * sizeof(uint32_t));
+	fm->kslope = malloc(n * sizeof(uint32_t));
+	b->priv = fm;
+
+	if (!fm->segs || !fm->freq || !fm->slope || !fm->step || !fm->kslope)
+		return -1;
+
+	/* a 1 kHz tone at the full deviation */
+	for (i = 0; i < n; i++) {
+		fm->freq[i] = FM_CARRIER + 75000 *
+			      sin(2 * M_PI * 1000 * i / FM_AUDIO_RATE);
+		fm->slope[i] = (fm->freq[i] - last) / per_signal;
+		last = fm->freq[i];
+	}
+
+	fm_dds_init(&fm->carrier, FM_SAMPLE_RATE, FM_CARRIER, 0);
+
+	/* the segments are rebuilt in run_fm_plan() */
+	for (pos = 0, i = 0; pos < FL2K_BUF_LEN; i++) {
+		acc += per_signal;
+		fm->segs[i].offset = pos;
+		fm->segs[i].count = (uint32_t)acc;
+		acc -= fm->segs[i].count;
+		if (fm->segs[i].count > FL2K_BUF_LEN - pos)
+			fm->segs[i].count = FL2K_BUF_LEN - pos;
+		pos += fm->segs[i].count;
+	}
+	fm->nsegs = i;
+
+	if (!strcmp(b->variant, "pool")) {
+		fm->pool = fm_pool_create(4);
+		if (!fm->pool)
+			return -1;
+	}
+
+	return 0;
+}
+
+static void teardown_fm(bench_t *b)
+{
+	fm_bench_t *fm = b->priv;
+
+	if (!fm)
+		return;
+
+	fm_pool_destroy(fm->pool);
+	free(fm->segs);
+	free(fm->freq);
+	free(fm->slope);
+	free(fm->step);
+	free(fm->kslope);
+	free(fm);
+}
+
+/* the single carrier, a constant frequency */
+static int run_fm_dds(bench_t *b)
+{
+	fm_bench_t *fm = b->priv;
+
+	fm_dds_gen(&fm->carrier, (int8_t *)out, FL2K_BUF_LEN);
+	return 0;
+}
+
+/* what fl2k_fm does per buffer, converting the frequencies to phase
+ * increments and planning the segments before generating them */
+static int run_fm_plan(bench_t *b)
+{
+	fm_bench_t *fm = b->priv;
+	uint32_t i;
+
+	fm_dds_steps(&fm->carrier, fm->freq, fm->slope, fm->step,
+		     fm->kslope, fm->nsegs);
+
+	for (i = 0; i < fm->nsegs; i++) {
+		fm_dds_set(&fm->carrier, fm->step[i], fm->kslope[i]);
+		fm->segs[i].dds = fm->carrier;
+		fm_dds_skip(&fm->carrier, fm->segs[i].count);
+	}
+
+	if (fm->pool) {
+		fm_pool_run(fm->pool, fm->segs, fm->nsegs, (int8_t *)out,
+			    FL2K_BUF_LEN);
+		fm_pool_wait(fm->pool);
+	} else {
+		fm_seg_gen(fm->segs, fm->nsegs, (int8_t *)out, 0,
+			   FL2K_BUF_LEN);
+	}
+
+	return 0;
+}
+
+/* three stations sharing a DAC */
+static int run_fm_mix(bench_t *b)
+{
+	int8_t *bufs[3] = { (int8_t *)in[0], (int8_t *)in[1], (int8_t *)in[2] };
+
+	(void)b;
+
+	fm_mix(bufs, 3, (int8_t *)out, FL2K_BUF_LEN);
+	return 0;
+}
+
+/* Stereo multiplex and RDS at the audio rate, in blocks of the size
+ * fl2k_fm uses */
+
+#define AUDIO_BLOCK	1024
+
+static int setup_mpx(bench_t *b)
+{
+	fm_mpx_t *mpx = malloc(sizeof(fm_mpx_t));
+
+	if (!mpx)
+		return -1;
+
+	fm_mpx_init(mpx, FM_AUDIO_RATE, 19000, 1);
+	b->priv = mpx;
+	return 0;
+}
+
+static void teardown_free(bench_t *b)
+{
+	free(b->priv);
+}
+
+static int run_mpx(bench_t *b)
+{
+	fm_mpx_t *mpx = b->priv;
+	const int16_t *audio = (const int16_t *)in[0];
+	const float *rds = (const float *)in[1];
+	float *mpxout = (float *)out;
+	uint32_t i;
+
+	for (i = 0; i < b->samples; i += AUDIO_BLOCK)
+		fm_mpx_stereo(mpx, audio + 2 * i, rds + i, mpxout + i,
+			      AUDIO_BLOCK);
+
+	return 0;
+}
+
+static int setup_rds(bench_t *b)
+{
+	rds_encoder_t *enc = rds_encoder_create();
+
+	if (!enc)
+		return -1;
+
+	rds_set_pi(enc, 0x1234);
+	rds_set_ps(enc, "OSMO-FL2");
+	rds_set_rt(enc, "osmo-fl2k benchmark");
+	b->priv = enc;
+	return 0;
+}
+
+static void teardown_rds(bench_t *b)
+{
+	if (b->priv)
+		rds_encoder_destroy(b->priv);
+}
+
+static int run_rds(bench_t *b)
+{
+	rds_get_samples(b->priv, (float *)out, b->samples);
+	return 0;
+}
+
+/* File input: a test file is read in buffers, wrapping around at its end,
+ * with fread() as fl2k_file does for pipes, through a mapping as it does
+ * for regular files, or through the audio input of fl2k_fm */
+
+typedef struct file_bench {
+	char path[1024];
+	FILE *file;
+	size_t pos, size;
+	char *map;
+	audio_ingest_t *ingest;
+	volatile uint64_t sum;
+} file_bench_t;
+
+static int setup_file(bench_t *b)
+{
+	file_bench_t *fb = calloc(1, sizeof(file_bench_t));
+	size_t i;
+
+	if (!fb)
+		return -1;
+
+	b->priv = fb;
+	fb->size = ((size_t)file_mb << 20) / FL2K_BUF_LEN * FL2K_BUF_LEN;
+	if (!fb->size)
+		fb->size = FL2K_BUF_LEN;
+
+	snprintf(fb->path, sizeof(fb->path), "%s/fl2k_bench.%d", tmpdir,
+		 (int)getpid());
+
+	fb->file = fopen(fb->path, "w+b");
+	if (!fb->file) {
+		fprintf(stderr, "Failed to create %s\n", fb->path);
+		return -1;
+	}
+
+	for (i = 0; i < fb->size; i += FL2K_BUF_LEN) {
+		if (fwrite(in[0], 1, FL2K_BUF_LEN, fb->file) != FL2K_BUF_LEN) {
+			fprintf(stderr, "Failed to write %s\n", fb->path);
+			return -1;
+		}
+	}
+
+	fflush(fb->file);
+	rewind(fb->file);
+
+#ifndef _WIN32
+	if (!strcmp(b->variant, "mmap")) {
+		fb->map = mmap(NULL, fb->size, PROT_READ, MAP_SHARED,
+			       fileno(fb->file), 0);
+		if (fb->map == MAP_FAILED) {
+			fb->map = NULL;
+			return -1;
+		}
+		madvise(fb->map, fb->size, MADV_SEQUENTIAL);
+	}
+#endif
+
+	return 0;
+}
+
+static void teardown_file(bench_t *b)
+{
+	file_bench_t *fb = b->priv;
+
+	if (!fb)
+		return;
+
+	if (fb->ingest)
+		audio_ingest_stop(fb->ingest);
+#ifndef _WIN32
+	if (fb->map)
+		munmap(fb->map, fb->size);
+#endif
+	if (fb->file) {
+		fclose(fb->file);
+		remove(fb->path);
+	}
+	free(fb);
+}
+
+static int run_file_fread(bench_t *b)
+{
+	file_bench_t *fb = b->priv;
+
+	if (fread(out, 1, FL2K_BUF_LEN, fb->file) != FL2K_BUF_LEN) {
+		rewind(fb->file);
+		if (fread(out, 1, FL2K_BUF_LEN, fb->file) != FL2K_BUF_LEN)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* the samples are used in place, so only touch them once like the
+ * conversion would */
+static int run_file_mmap(bench_t *b)
+{
+	file_bench_t *fb = b->priv;
+	const uint64_t *p;
+	uint64_t sum = 0;
+	size_t i;
+
+	if (fb->pos >= fb->size)
+		fb->pos = 0;
+
+	p = (const uint64_t *)(fb->map + fb->pos);
+	for (i = 0; i < FL2K_BUF_LEN / sizeof(uint64_t); i++)
+		sum += p[i];
+
+	fb->sum += sum;
+	fb->pos += FL2K_BUF_LEN;
+	return 0;
+}
+
+static int run_file_ingest(bench_t *b)
+{
+	file_bench_t *fb = b->priv;
+	size_t n, got = 0;
+
+	while (got < b->samples) {
+		if (!fb->ingest) {
+			rewind(fb->file);
+			fb->ingest = audio_ingest_start(fb->file, 0);
+			if (!fb->ingest)
+				return -1;
+		}
+
+		n = audio_ingest_read_float(fb->ingest, (float *)out + got,
+					    b->samples - got);
+		got += n;
+
+		if (got < b->samples) {
+			audio_ingest_stop(fb->ingest);
+			fb->ingest = NULL;
+		}
+	}
+
+	return 0;
+}
+
+#ifndef _WIN32
+/* TCP input of fl2k_tcp: whole buffers received from a sender thread
+ * over the loopback interface */
+
+typedef struct tcp_bench {
+	int listen_sock, sock, peer;
+	pthread_t thread;
+	int running;
+	volatile int stop;
+} tcp_bench_t;
+
+static void *tcp_sender(void *arg)
+{
+	tcp_bench_t *tb = arg;
+	char *buf = malloc(FL2K_BUF_LEN);
+	ssize_t r;
+	size_t done;
+
+	if (!buf)
+		return NULL;
+
+	fill_random(buf, FL2K_BUF_LEN, 3);
+
+	while (!tb->stop) {
+		for (done = 0; done < FL2K_BUF_LEN && !tb->stop; done += r) {
+			r = send(tb->peer, buf + done, FL2K_BUF_LEN - done, 0);
+			if (r <= 0)
+				goto out;
+		}
+	}
+
+out:
+	free(buf);
+	return NULL;
+}
+
+static int setup_tcp(bench_t *b)
+{
+	tcp_bench_t *tb = calloc(1, sizeof(tcp_bench_t));
+	struct sockaddr_in sa;
+	socklen_t len = sizeof(sa);
+	int rcvbuf = 8 * 1024 * 1024;
+
+	if (!tb)
+		return -1;
+
+	b->priv = tb;
+	tb->sock = tb->peer = -1;
+
+	tb->listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (tb->listen_sock < 0)
+		return -1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(tb->listen_sock, (struct sockaddr *)&sa, sizeof(sa)) ||
+	    listen(tb->listen_sock, 1) ||
+	    getsockname(tb->listen_sock, (struct sockaddr *)&sa, &len))
+		return -1;
+
+	tb->sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (tb->sock < 0)
+		return -1;
+
+	/* same as fl2k_tcp */
+	setsockopt(tb->sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	if (connect(tb->sock, (struct sockaddr *)&sa, sizeof(sa)))
+		return -1;
+
+	tb->peer = accept(tb->listen_sock, NULL, NULL);
+	if (tb->peer < 0)
+		return -1;
+
+	if (pthread_create(&tb->thread, NULL, tcp_sender, tb))
+		return -1;
+
+	tb->running = 1;
+	return 0;
+}
+
+static void teardown_tcp(bench_t *b)
+{
+	tcp_bench_t *tb = b->priv;
+
+	if (!tb)
+		return;
+
+	tb->stop = 1;
+	if (tb->sock >= 0)
+		close(tb->sock);
+	if (tb->peer >= 0)
+		shutdown(tb->peer, SHUT_RDWR);
+	if (tb->running)
+		pthread_join(tb->thread, NULL);
+	if (tb->peer >= 0)
+		close(tb->peer);
+	if (tb->listen_sock >= 0)
+		close(tb->listen_sock);
+	free(tb);
+}
+
+static int run_tcp(bench_t *b)
+{
+	tcp_bench_t *tb = b->priv;
+	int flags = !strcmp(b->variant, "waitall") ? MSG_WAITALL : 0;
+	size_t got;
+	ssize_t r;
+
+	for (got = 0; got < FL2K_BUF_LEN; got += r) {
+		r = recv(tb->sock, out + got, FL2K_BUF_LEN - got, flags);
+		if (r <= 0)
+			return -1;
+	}
+
+	return 0;
+}
+#endif
+
+static void report(bench_t *b, uint32_t n, uint64_t ns, uint64_t cycles)
+{
+	double total = (double)b->samples * n;
+	double mean = (double)ns / n, cpb;
+	uint64_t p50, p99;
+
+	/* with -t 0 */
+	if (!n) {
+		fprintf(stderr, "%s (%s): no iterations\n", b->name, b->variant);
+		return;
+	}
+
+	qsort(lat, n, sizeof(uint64_t), cmp_u64);
+	p50 = lat[n / 2];
+	p99 = lat[(uint32_t)(n * 0.99)];
+
+#ifdef HAVE_TSC
+	cpb = (double)cycles / ((double)b->bytes * n);
+#else
+	cpb = cpu_mhz * 1e-3 * ns / ((double)b->bytes * n);
+#endif
+
+	printf("{\"bench\": \"%s\", \"variant\": \"%s\", \"iterations\": %u, "
+	       "\"samples\": %llu, \"bytes\": %llu, "
+	       "\"msps\": %.3f, \"ns_per_sample\": %.4f, ",
+	       b->name, b->variant, n,
+	       (unsigned long long)b->samples, (unsigned long long)b->bytes,
+	       total * 1e3 / ns, (double)ns / total);
+
+#ifndef HAVE_TSC
+	if (cpu_mhz <= 0)
+		printf("\"cycles_per_byte\": null, ");
+	else
+#endif
+		printf("\"cycles_per_byte\": %.4f, ", cpb);
+
+	printf("\"buf_ns_mean\": %.0f, \"buf_ns_min\": %llu, "
+	       "\"buf_ns_p50\": %llu, \"buf_ns_p99\": %llu, "
+	       "\"buf_ns_max\": %llu}\n",
+	       mean, (unsigned long long)lat[0], (unsigned long long)p50,
+	       (unsigned long long)p99, (unsigned long long)lat[n - 1]);
+	fflush(stdout);
+}
+
+static void run_bench(bench_t *b)
+{
+	uint64_t start, now, t, c0, ns = 0;
+	uint32_t n = 0;
+
+	if (b->setup && b->setup(b) < 0) {
+		fprintf(stderr, "Failed to set up %s (%s), skipping\n",
+			b->name, b->variant);
+		goto out;
+	}
+
+	/* warm up the caches and the page tables */
+	if (b->run(b) < 0)
+		goto err;
+
+	c0 = bench_cycles();
+	start = now = bench_ns();
+
+	while (n < MAX_ITERATIONS && (now - start) < min_time * 1e9) {
+		t = now;
+		if (b->run(b) < 0)
+			goto err;
+		now = bench_ns();
+		lat[n++] = now - t;
+		ns += now - t;
+	}
+
+	report(b, n, ns, bench_cycles() - c0);
+	goto out;
+
+err:
+	fprintf(stderr, "%s (%s) failed\n", b->name, b->variant);
+out:
+	if (b->teardown)
+		b->teardown(b);
+}
+
+int main(int argc, char **argv)
+{
+	bench_t benches[32];
+	const fl2k_convert_kernel_t *k;
+	int opt, i, nbench = 0, list = 0;
+	uint32_t audio = FL2K_BUF_LEN / 16 / AUDIO_BLOCK * AUDIO_BLOCK;
+
+	while ((opt = getopt(argc, argv, "t:f:c:s:T:l")) != -1) {
+		switch (opt) {
+		case 't':
+			min_time = atof(optarg);
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		case 'c':
+			cpu_mhz = atof(optarg);
+			break;
+		case 's':
+			file_mb = atoi(optarg);
+			break;
+		case 'T':
+			tmpdir = optarg;
+			break;
+		case 'l':
+			list = 1;
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if (!tmpdir) {
+		tmpdir = getenv("TMPDIR");
+		if (!tmpdir)
+			tmpdir = "/tmp";
+	}
+
+	memset(benches, 0, sizeof(benches));
+
+#define ADD(n, v, s, by, su, r, td) do { \
+	bench_t *b = &benches[nbench++]; \
+	b->name = n; b->variant = v; b->samples = s; b->bytes = by; \
+	b->setup = su; b->run = r; b->teardown = td; \
+} while (0)
+
+	for (k = fl2k_convert_kernels; k->name; k++) {
+		if (k->supported && !k->supported())
+			continue;
+
+		ADD("convert_rgb", k->name, FL2K_XFER_LEN, FL2K_XFER_LEN,
+		    NULL, run_convert, NULL);
+		benches[nbench - 1].priv = (void *)k;
+	}
+
+	ADD("convert_r", "scalar", FL2K_BUF_LEN, FL2K_XFER_LEN,
+	    NULL, run_convert_r, NULL);
+
+	for (i = 0; i < (int)(sizeof(quant_cfgs) / sizeof(quant_cfgs[0])); i++) {
+		ADD("convert_quantized", quant_cfgs[i].variant, FL2K_XFER_LEN,
+		    FL2K_XFER_LEN, setup_quantize, run_quantize,
+		    teardown_quantize);
+		benches[nbench - 1].priv = (void *)&quant_cfgs[i];
+	}
+
+	ADD("deinterleave_rgb", "scalar", FL2K_XFER_LEN, FL2K_XFER_LEN,
+	    NULL, run_deinterleave, NULL);
+	benches[nbench - 1].priv = (void *)fl2k_deinterleave_rgb_scalar;
+	ADD("deinterleave_rgb", "selected", FL2K_XFER_LEN, FL2K_XFER_LEN,
+	    NULL, run_deinterleave, NULL);
+	benches[nbench - 1].priv = (void *)fl2k_deinterleave_select();
+
+	ADD("fm_dds", "single", FL2K_BUF_LEN, FL2K_BUF_LEN,
+	    setup_fm, run_fm_dds, teardown_fm);
+	ADD("fm_modulate", "single", FL2K_BUF_LEN, FL2K_BUF_LEN,
+	    setup_fm, run_fm_plan, teardown_fm);
+	ADD("fm_modulate", "pool", FL2K_BUF_LEN, FL2K_BUF_LEN,
+	    setup_fm, run_fm_plan, teardown_fm);
+	ADD("fm_mix", "3", FL2K_BUF_LEN, FL2K_BUF_LEN * 3,
+	    NULL, run_fm_mix, NULL);
+	ADD("fm_mpx_stereo", "rds", audio, audio * sizeof(float),
+	    setup_mpx, run_mpx, teardown_free);
+	ADD("rds_get_samples", "table", audio, audio * sizeof(float),
+	    setup_rds, run_rds, teardown_rds);
+
+	ADD("file_ingest", "fread", FL2K_BUF_LEN, FL2K_BUF_LEN,
+	    setup_file, run_file_fread, teardown_file);
+#ifndef _WIN32
+	ADD("file_ingest", "mmap", FL2K_BUF_LEN, FL2K_BUF_LEN,
+	    setup_file, run_file_mmap, teardown_file);
+#endif
+	ADD("audio_ingest", "file", audio, audio * sizeof(int16_t),
+	    setup_file, run_file_ingest, teardown_file);
+#ifndef _WIN32
+	ADD("tcp_ingest", "recv", FL2K_BUF_LEN, FL2K_BUF_LEN,
+	    setup_tcp, run_tcp, teardown_tcp);
+	ADD("tcp_ingest", "waitall", FL2K_BUF_LEN, FL2K_BUF_LEN,
+	    setup_tcp, run_tcp, teardown_tcp);
+#endif
+
+#undef ADD
+
+	if (list) {
+		for (i = 0; i < nbench; i++)
+			printf("%s %s\n", benches[i].name, benches[i].variant);
+		return 0;
+	}
+
+	/* large enough for the transfer buffer and the float samples,
+	 * aligned the same way on every run */
+	out = fl2k_alloc_buffer(NULL, FL2K_XFER_LEN * 2, 0);
+	for (i = 0; i < 3; i++) {
+		in[i] = fl2k_alloc_buffer(NULL, FL2K_BUF_LEN * 2, 0);
+		deint[i] = fl2k_alloc_buffer(NULL, FL2K_BUF_LEN, 0);
+		if (!in[i] || !deint[i] || !out) {
+			fprintf(stderr, "malloc error!\n");
+			exit(1);
+		}
+		fill_random(in[i], FL2K_BUF_LEN * 2, i + 1);
+	}
+
+	fill_random(out, FL2K_XFER_LEN * 2, 4);
+
+	/* float RDS input for the multiplexer */
+	for (i = 0; i < (int)audio; i++)
+		((float *)in[1])[i] = (float)in[2][i] / 128;
+
+	for (i = 0; i < nbench; i++) {
+		if (filter && !strstr(benches[i].name, filter))
+			continue;
+
+		run_bench(&benches[i]);
+	}
+
+	fl2k_free_buffer(out);
+	for (i = 0; i < 3; i++) {
+		fl2k_free_buffer(in[i]);
+		fl2k_free_buffer(deint[i]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,862 @@
+/*
+ * osmo-fl2k, turns FL2000-based USB 3.0 to VGA adapters into
+ * low cost DACs
+ *
+ * Copyright (C) 2016-2020 by Steve Markgraf <steve@steve-m.de>
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "osmo-fl2k.h"
+#include "fl2k_convert.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FL2K_CONVERT_X86
+#include <immintrin.h>
+#define FL2K_TARGET(t)	__attribute__((target(t)))
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(__aarch64__)
+#define FL2K_CONVERT_NEON
+#include <arm_neon.h>
+#endif
+
+/* Buffer format conversion functions for R, G, B DACs */
+void fl2k_convert_r(char *out, const char *in, uint32_t len, uint8_t offset)
+{
+	unsigned int i, j = 0;
+
+	if (!in || !out)
+		return;
+
+	for (i = 0; i < len; i += 24) {
+		out[i+ 6] = in[j++] + offset;
+		out[i+ 1] = in[j++] + offset;
+		out[i+12] = in[j++] + offset;
+		out[i+15] = in[j++] + offset;
+		out[i+10] = in[j++] + offset;
+		out[i+21] = in[j++] + offset;
+		out[i+16] = in[j++] + offset;
+		out[i+19] = in[j++] + offset;
+	}
+}
+
+void fl2k_convert_g(char *out, const char *in, uint32_t len, uint8_t offset)
+{
+	unsigned int i, j = 0;
+
+	if (!in || !out)
+		return;
+
+	for (i = 0; i < len; i += 24) {
+		out[i+ 5] = in[j++] + offset;
+		out[i+ 0] = in[j++] + offset;
+		out[i+ 3] = in[j++] + offset;
+		out[i+14] = in[j++] + offset;
+		out[i+ 9] = in[j++] + offset;
+		out[i+20] = in[j++] + offset;
+		out[i+23] = in[j++] + offset;
+		out[i+18] = in[j++] + offset;
+	}
+}
+
+void fl2k_convert_b(char *out, const char *in, uint32_t len, uint8_t offset)
+{
+	unsigned int i, j = 0;
+
+	if (!in || !out)
+		return;
+
+	for (i = 0; i < len; i += 24) {
+		out[i+ 4] = in[j++] + offset;
+		out[i+ 7] = in[j++] + offset;
+		out[i+ 2] = in[j++] + offset;
+		out[i+13] = in[j++] + offset;
+		out[i+ 8] = in[j++] + offset;
+		out[i+11] = in[j++] + offset;
+		out[i+22] = in[j++] + offset;
+		out[i+17] = in[j++] + offset;
+	}
+}
+
+/* Unused channels are read from a small block of samples that convert to
+ * FL2K_DC_LEVEL, which stays in the cache, without advancing the
+ * source pointer */
+
+#define DC_SETUP(blk, offset) \
+	memset(blk, (uint8_t)(FL2K_DC_LEVEL - (offset)), sizeof(blk))
+
+#define DC_CHANNEL(p, step, blk, n) do { \
+		step = (p) ? (n) : 0; \
+		if (!(p)) \
+			p = blk; \
+	} while (0)
+
+#define DC_RESTORE(p, step)	((step) ? (p) : NULL)
+
+/* All three channels in one pass, writing the output sequentially */
+void fl2k_convert_rgb_scalar(char *out, const char *r, const char *g,
+			     const char *b, uint32_t len, uint8_t offset)
+{
+	unsigned int i, rs, gs, bs;
+	char dc[8];
+
+	DC_SETUP(dc, offset);
+	DC_CHANNEL(r, rs, dc, 8);
+	DC_CHANNEL(g, gs, dc, 8);
+	DC_CHANNEL(b, bs, dc, 8);
+
+	for (i = 0; i < len; i += 24, r += rs, g += gs, b += bs) {
+		out[i+ 0] = g[1] + offset;
+		out[i+ 1] = r[1] + offset;
+		out[i+ 2] = b[2] + offset;
+		out[i+ 3] = g[2] + offset;
+		out[i+ 4] = b[0] + offset;
+		out[i+ 5] = g[0] + offset;
+		out[i+ 6] = r[0] + offset;
+		out[i+ 7] = b[1] + offset;
+		out[i+ 8] = b[4] + offset;
+		out[i+ 9] = g[4] + offset;
+		out[i+10] = r[4] + offset;
+		out[i+11] = b[5] + offset;
+		out[i+12] = r[2] + offset;
+		out[i+13] = b[3] + offset;
+		out[i+14] = g[3] + offset;
+		out[i+15] = r[3] + offset;
+		out[i+16] = r[6] + offset;
+		out[i+17] = b[7] + offset;
+		out[i+18] = g[7] + offset;
+		out[i+19] = r[7] + offset;
+		out[i+20] = g[5] + offset;
+		out[i+21] = r[5] + offset;
+		out[i+22] = b[6] + offset;
+		out[i+23] = g[6] + offset;
+	}
+}
+
+#ifdef FL2K_CONVERT_X86
+/* pshufb masks, 16 samples of each channel make up 48 output bytes,
+ * -1 clears the output byte so the three channels can be OR'ed */
+static const int8_t shuf_r[3][16] = {
+	{ -1,  1, -1, -1, -1, -1,  0, -1, -1, -1,  4, -1,  2, -1, -1,  3 },
+	{  6, -1, -1,  7, -1,  5, -1, -1, -1,  9, -1, -1, -1, -1,  8, -1 },
+	{ -1, -1, 12, -1, 10, -1, -1, 11, 14, -1, -1, 15, -1, 13, -1, -1 },
+};
+
+static const int8_t shuf_g[3][16] = {
+	{  1, -1, -1,  2, -1,  0, -1, -1, -1,  4, -1, -1, -1, -1,  3, -1 },
+	{ -1, -1,  7, -1,  5, -1, -1,  6,  9, -1, -1, 10, -1,  8, -1, -1 },
+	{ -1, 12, -1, -1, -1, -1, 11, -1, -1, -1, 15, -1, 13, -1, -1, 14 },
+};
+
+static const int8_t shuf_b[3][16] = {
+	{ -1, -1,  2, -1,  0, -1, -1,  1,  4, -1, -1,  5, -1,  3, -1, -1 },
+	{ -1,  7, -1, -1, -1, -1,  6, -1, -1, -1, 10, -1,  8, -1, -1,  9 },
+	{ 12, -1, -1, 13, -1, 11, -1, -1, -1, 15, -1, -1, -1, -1, 14, -1 },
+};
+
+#define LOAD_MASK(m)	_mm_loadu_si128((const __m128i *)(m))
+
+FL2K_TARGET("ssse3")
+static void fl2k_convert_rgb_ssse3(char *out, const char *r, const char *g,
+				   const char *b, uint32_t len, uint8_t offset)
+{
+	const __m128i off = _mm_set1_epi8((char)offset);
+	const __m128i mr0 = LOAD_MASK(shuf_r[0]), mr1 = LOAD_MASK(shuf_r[1]),
+		      mr2 = LOAD_MASK(shuf_r[2]);
+	const __m128i mg0 = LOAD_MASK(shuf_g[0]), mg1 = LOAD_MASK(shuf_g[1]),
+		      mg2 = LOAD_MASK(shuf_g[2]);
+	const __m128i mb0 = LOAD_MASK(shuf_b[0]), mb1 = LOAD_MASK(shuf_b[1]),
+		      mb2 = LOAD_MASK(shuf_b[2]);
+	__m128i vr, vg, vb, o;
+	uint32_t i, rs, gs, bs;
+	char dc[16];
+
+	DC_SETUP(dc, offset);
+	DC_CHANNEL(r, rs, dc, 16);
+	DC_CHANNEL(g, gs, dc, 16);
+	DC_CHANNEL(b, bs, dc, 16);
+
+	for (i = 0; i + 48 <= len; i += 48, r += rs, g += gs, b += bs) {
+		vr = _mm_add_epi8(_mm_loadu_si128((const __m128i *)r), off);
+		vg = _mm_add_epi8(_mm_loadu_si128((const __m128i *)g), off);
+		vb = _mm_add_epi8(_mm_loadu_si128((const __m128i *)b), off);
+
+		o = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(vr, mr0),
+					      _mm_shuffle_epi8(vg, mg0)),
+				 _mm_shuffle_epi8(vb, mb0));
+		_mm_storeu_si128((__m128i *)(out + i), o);
+
+		o = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(vr, mr1),
+					      _mm_shuffle_epi8(vg, mg1)),
+				 _mm_shuffle_epi8(vb, mb1));
+		_mm_storeu_si128((__m128i *)(out + i + 16), o);
+
+		o = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(vr, mr2),
+					      _mm_shuffle_epi8(vg, mg2)),
+				 _mm_shuffle_epi8(vb, mb2));
+		_mm_storeu_si128((__m128i *)(out + i + 32), o);
+	}
+
+	/* remaining 24 byte block, if any */
+	fl2k_convert_rgb_scalar(out + i, DC_RESTORE(r, rs), DC_RESTORE(g, gs),
+				DC_RESTORE(b, bs), len - i, offset);
+}
+
+#define LOAD_MASK2(m)	_mm256_broadcastsi128_si256(LOAD_MASK(m))
+
+/* pshufb only works within 128 bit lanes, so the low lanes produce output
+ * bytes 0-47, the high lanes bytes 48-95, which get rearranged before
+ * storing */
+FL2K_TARGET("avx2")
+static void fl2k_convert_rgb_avx2(char *out, const char *r, const char *g,
+				  const char *b, uint32_t len, uint8_t offset)
+{
+	const __m256i off = _mm256_set1_epi8((char)offset);
+	const __m256i mr0 = LOAD_MASK2(shuf_r[0]), mr1 = LOAD_MASK2(shuf_r[1]),
+		      mr2 = LOAD_MASK2(shuf_r[2]);
+	const __m256i mg0 = LOAD_MASK2(shuf_g[0]), mg1 = LOAD_MASK2(shuf_g[1]),
+		      mg2 = LOAD_MASK2(shuf_g[2]);
+	const __m256i mb0 = LOAD_MASK2(shuf_b[0]), mb1 = LOAD_MASK2(shuf_b[1]),
+		      mb2 = LOAD_MASK2(shuf_b[2]);
+	__m256i vr, vg, vb, o0, o1, o2;
+	uint32_t i, rs, gs, bs;
+	char dc[32];
+
+	DC_SETUP(dc, offset);
+	DC_CHANNEL(r, rs, dc, 32);
+	DC_CHANNEL(g, gs, dc, 32);
+	DC_CHANNEL(b, bs, dc, 32);
+
+	for (i = 0; i + 96 <= len; i += 96, r += rs, g += gs, b += bs) {
+		vr = _mm256_add_epi8(_mm256_loadu_si256((const __m256i *)r), off);
+		vg = _mm256_add_epi8(_mm256_loadu_si256((const __m256i *)g), off);
+		vb = _mm256_add_epi8(_mm256_loadu_si256((const __m256i *)b), off);
+
+		o0 = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(vr, mr0),
+						     _mm256_shuffle_epi8(vg, mg0)),
+				     _mm256_shuffle_epi8(vb, mb0));
+		o1 = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(vr, mr1),
+						     _mm256_shuffle_epi8(vg, mg1)),
+				     _mm256_shuffle_epi8(vb, mb1));
+		o2 = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(vr, mr2),
+						     _mm256_shuffle_epi8(vg, mg2)),
+				     _mm256_shuffle_epi8(vb, mb2));
+
+		_mm256_storeu_si256((__m256i *)(out + i),
+				    _mm256_permute2x128_si256(o0, o1, 0x20));
+		_mm256_storeu_si256((__m256i *)(out + i + 32),
+				    _mm256_permute2x128_si256(o2, o0, 0x30));
+		_mm256_storeu_si256((__m256i *)(out + i + 64),
+				    _mm256_permute2x128_si256(o1, o2, 0x31));
+	}
+
+	fl2k_convert_rgb_ssse3(out + i, DC_RESTORE(r, rs), DC_RESTORE(g, gs),
+			       DC_RESTORE(b, bs), len - i, offset);
+}
+
+static int fl2k_have_ssse3(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("ssse3");
+}
+
+static int fl2k_have_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+#endif /* FL2K_CONVERT_X86 */
+
+#ifdef FL2K_CONVERT_NEON
+#ifdef __aarch64__
+/* vqtbl3q indices into the table { r[0-15], g[0-15], b[0-15] } */
+static const uint8_t tbl_rgb[3][16] = {
+	{ 17,  1, 34, 18, 32, 16,  0, 33, 36, 20,  4, 37,  2, 35, 19,  3 },
+	{  6, 39, 23,  7, 21,  5, 38, 22, 25,  9, 42, 26, 40, 24,  8, 41 },
+	{ 44, 28, 12, 45, 10, 43, 27, 11, 14, 47, 31, 15, 29, 13, 46, 30 },
+};
+#endif
+
+static void fl2k_convert_rgb_neon(char *out, const char *r, const char *g,
+				  const char *b, uint32_t len, uint8_t offset)
+{
+	const uint8x16_t off = vdupq_n_u8(offset);
+	uint8x16x3_t v;
+	uint32_t i, rs, gs, bs;
+	char dc[16];
+#ifdef __aarch64__
+	const uint8x16_t t0 = vld1q_u8(tbl_rgb[0]), t1 = vld1q_u8(tbl_rgb[1]),
+			 t2 = vld1q_u8(tbl_rgb[2]);
+#else
+	uint8_t tmp[48];
+#endif
+
+	DC_SETUP(dc, offset);
+	DC_CHANNEL(r, rs, dc, 16);
+	DC_CHANNEL(g, gs, dc, 16);
+	DC_CHANNEL(b, bs, dc, 16);
+
+	for (i = 0; i + 48 <= len; i += 48, r += rs, g += gs, b += bs) {
+#ifdef __aarch64__
+		v.val[0] = vaddq_u8(vld1q_u8((const uint8_t *)r), off);
+		v.val[1] = vaddq_u8(vld1q_u8((const uint8_t *)g), off);
+		v.val[2] = vaddq_u8(vld1q_u8((const uint8_t *)b), off);
+
+		vst1q_u8((uint8_t *)out + i, vqtbl3q_u8(v, t0));
+		vst1q_u8((uint8_t *)out + i + 16, vqtbl3q_u8(v, t1));
+		vst1q_u8((uint8_t *)out + i + 32, vqtbl3q_u8(v, t2));
+#else
+		/* interleave as B, G, R and swap the 32 bit words */
+		v.val[0] = vaddq_u8(vld1q_u8((const uint8_t *)b), off);
+		v.val[1] = vaddq_u8(vld1q_u8((const uint8_t *)g), off);
+		v.val[2] = vaddq_u8(vld1q_u8((const uint8_t *)r), off);
+		vst3q_u8(tmp, v);
+
+		vst1q_u32((uint32_t *)(out + i),
+			  vrev64q_u32(vld1q_u32((const uint32_t *)tmp)));
+		vst1q_u32((uint32_t *)(out + i + 16),
+			  vrev64q_u32(vld1q_u32((const uint32_t *)(tmp + 16))));
+		vst1q_u32((uint32_t *)(out + i + 32),
+			  vrev64q_u32(vld1q_u32((const uint32_t *)(tmp + 32))));
+#endif
+	}
+
+	fl2k_convert_rgb_scalar(out + i, DC_RESTORE(r, rs), DC_RESTORE(g, gs),
+				DC_RESTORE(b, bs), len - i, offset);
+}
+#endif /* FL2K_CONVERT_NEON */
+
+const fl2k_convert_kernel_t fl2k_convert_kernels[] = {
+	{ "scalar", fl2k_convert_rgb_scalar, NULL },
+#ifdef FL2K_CONVERT_X86
+	{ "ssse3", fl2k_convert_rgb_ssse3, fl2k_have_ssse3 },
+	{ "avx2", fl2k_convert_rgb_avx2, fl2k_have_avx2 },
+#endif
+#ifdef FL2K_CONVERT_NEON
+	{ "neon", fl2k_convert_rgb_neon, NULL },
+#endif
+	{ NULL, NULL, NULL }
+};
+
+const fl2k_convert_kernel_t *fl2k_convert_select(void)
+{
+	const fl2k_convert_kernel_t *k, *best = &fl2k_convert_kernels[0];
+	const char *override = getenv("FL2K_CONVERT");
+
+	for (k = fl2k_convert_kernels; k->name; k++) {
+		if (k->supported && !k->supported())
+			continue;
+
+		if (override && !strcmp(override, k->name))
+			return k;
+
+		best = k;
+	}
+
+	return best;
+}
+
+/* Splitting of interleaved R, G, B input into the channel buffers */
+
+void fl2k_deinterleave_rgb_scalar(const char *in, char *r, char *g, char *b,
+				  uint32_t len)
+{
+	uint32_t i;
+
+	for (i = 0; i < len; i++, in += 3) {
+		r[i] = in[0];
+		g[i] = in[1];
+		b[i] = in[2];
+	}
+}
+
+#ifdef FL2K_CONVERT_X86
+/* pshufb masks gathering every third byte of the three 16 byte parts
+ * of 48 input bytes */
+static const int8_t deint_shuf[3][3][16] = {
+	{
+		{  0,  3,  6,  9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+		{ -1, -1, -1, -1, -1, -1,  2,  5,  8, 11, 14, -1, -1, -1, -1, -1 },
+		{ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  1,  4,  7, 10, 13 },
+	}, {
+		{  1,  4,  7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+		{ -1, -1, -1, -1, -1,  0,  3,  6,  9, 12, 15, -1, -1, -1, -1, -1 },
+		{ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  2,  5,  8, 11, 14 },
+	}, {
+		{  2,  5,  8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+		{ -1, -1, -1, -1, -1,  1,  4,  7, 10, 13, -1, -1, -1, -1, -1, -1 },
+		{ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  0,  3,  6,  9, 12, 15 },
+	},
+};
+
+FL2K_TARGET("ssse3")
+static void fl2k_deinterleave_rgb_ssse3(const char *in, char *r, char *g,
+					char *b, uint32_t len)
+{
+	char *out[3] = { r, g, b };
+	__m128i m[3][3], v0, v1, v2;
+	uint32_t i, c, q;
+
+	for (c = 0; c < 3; c++)
+		for (q = 0; q < 3; q++)
+			m[c][q] = LOAD_MASK(deint_shuf[c][q]);
+
+	for (i = 0; i + 16 <= len; i += 16, in += 48) {
+		v0 = _mm_loadu_si128((const __m128i *)in);
+		v1 = _mm_loadu_si128((const __m128i *)(in + 16));
+		v2 = _mm_loadu_si128((const __m128i *)(in + 32));
+
+		for (c = 0; c < 3; c++)
+			_mm_storeu_si128((__m128i *)(out[c] + i),
+				_mm_or_si128(_mm_or_si128(
+					_mm_shuffle_epi8(v0, m[c][0]),
+					_mm_shuffle_epi8(v1, m[c][1])),
+					_mm_shuffle_epi8(v2, m[c][2])));
+	}
+
+	fl2k_deinterleave_rgb_scalar(in, r + i, g + i, b + i, len - i);
+}
+#endif /* FL2K_CONVERT_X86 */
+
+#ifdef FL2K_CONVERT_NEON
+static void fl2k_deinterleave_rgb_neon(const char *in, char *r, char *g,
+				       char *b, uint32_t len)
+{
+	uint8x16x3_t v;
+	uint32_t i;
+
+	for (i = 0; i + 16 <= len; i += 16, in += 48) {
+		v = vld3q_u8((const uint8_t *)in);
+		vst1q_u8((uint8_t *)r + i, v.val[0]);
+		vst1q_u8((uint8_t *)g + i, v.val[1]);
+		vst1q_u8((uint8_t *)b + i, v.val[2]);
+	}
+
+	fl2k_deinterleave_rgb_scalar(in, r + i, g + i, b + i, len - i);
+}
+#endif /* FL2K_CONVERT_NEON */
+
+fl2k_deinterleave_fn_t fl2k_deinterleave_select(void)
+{
+#ifdef FL2K_CONVERT_X86
+	if (fl2k_have_ssse3())
+		return fl2k_deinterleave_rgb_ssse3;
+#endif
+#ifdef FL2K_CONVERT_NEON
+	return fl2k_deinterleave_rgb_neon;
+#endif
+
+	return fl2k_deinterleave_rgb_scalar;
+}
+
+/* Quantization of 16 bit and float samples to the 8 bit DACs
+ *
+ * All kernels compute the same: int16 samples are rounded to the upper 8
+ * bits, float samples are scaled by 128 and rounded, saturating at 0 and
+ * 255, with the dither added before rounding. A triangular dither is the
+ * difference of two uniform random numbers, taken from the halves of a
+ * xorshift32 output. Noise shaping feeds the quantization error back,
+ * which is inherently serial and only done by the scalar kernel. */
+
+/* samples per channel quantized at once, small enough for the L1 cache */
+#define QUANTIZE_BLOCK		2048
+
+
+void fl2k_dither_init(fl2k_dither_state_t *d, uint32_t seed)
+{
+	unsigned int i;
+
+	for (i = 0; i < 4; i++) {
+		/* any non-zero value works for xorshift */
+		d->seed[i] = (seed + i + 1) * 2654435761U;
+		if (!d->seed[i])
+			d->seed[i] = 1;
+	}
+
+	d->err = 0;
+}
+
+static uint32_t dither_rand(uint32_t *s)
+{
+	uint32_t x = *s;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*s = x;
+
+	return x;
+}
+
+/* triangular, -1 to 1 LSB of the DACs */
+static float dither_tpdf(uint32_t *s)
+{
+	uint32_t x = dither_rand(s);
+
+	return ((int32_t)(x & 0xffff) - (int32_t)(x >> 16)) * (1.0f / 65536);
+}
+
+/* u is the sample in LSB of the DACs plus 128.5 */
+static uint8_t quantize_float(float u)
+{
+	if (!(u > 0))
+		u = 0;
+	if (u > 255.5f)
+		u = 255.5f;
+
+	return (uint8_t)u;
+}
+
+/* one sample of first order error feedback, in fixed point with 8
+ * fractional bits, the error is bounded without saturation, as the
+ * clipping is done outside of the loop */
+#define SHAPE_SAMPLE(o, x, dith) do { \
+		v = (x) - err; \
+		u = v + 32768 + 128 + (dith); \
+		err = 128 + (dith) - (u & 0xff); \
+		u >>= 8; \
+		(o) = u < 0 ? 0 : (u > 255 ? 255 : u); \
+	} while (0)
+
+#define SHAPE_TPDF(r)	((int32_t)((r) & 0xff) - (int32_t)(((r) >> 8) & 0xff))
+
+static int32_t shape_float(float f)
+{
+	f *= 32768;
+	if (!(f > -32768))
+		f = -32768;
+	if (f > 32767)
+		f = 32767;
+
+	return (int32_t)f;
+}
+
+static void quantize_shaped(uint8_t *out, const void *in, uint32_t len,
+			    int format, fl2k_dither_state_t *d)
+{
+	const int16_t *s16 = in;
+	const float *f = in;
+	int32_t v, u, err = d->err;
+	uint32_t i, r = 0;
+
+	/* the serial dependency is kept short, one random number dithers
+	 * two samples */
+	for (i = 0; i < len; i++) {
+		if (!(i & 1))
+			r = dither_rand(&d->seed[0]);
+		else
+			r >>= 16;
+
+		if (FL2K_FORMAT_INT16 == format)
+			SHAPE_SAMPLE(out[i], s16[i], SHAPE_TPDF(r));
+		else
+			SHAPE_SAMPLE(out[i], shape_float(f[i]), SHAPE_TPDF(r));
+	}
+
+	d->err = err;
+}
+
+void fl2k_quantize_scalar(uint8_t *out, const void *in, uint32_t len,
+			  int format, int dither, fl2k_dither_state_t *d)
+{
+	const int16_t *s16 = in;
+	const float *f = in;
+	uint32_t i, x = 0;
+	int32_t q;
+	float v;
+
+	if (FL2K_DITHER_SHAPED == dither) {
+		quantize_shaped(out, in, len, format, d);
+		return;
+	}
+
+	for (i = 0; i < len; i++) {
+		if (FL2K_FORMAT_INT16 == format) {
+			q = s16[i];
+
+			if (FL2K_DITHER_TPDF == dither) {
+				/* one random number dithers two samples */
+				if (!(i & 1))
+					x = dither_rand(&d->seed[0]);
+				else
+					x >>= 16;
+
+				q += (int32_t)(x & 0xff) - (int32_t)((x >> 8) & 0xff);
+			}
+
+			q = (q + 128) >> 8;
+			if (q > 127)
+				q = 127;
+			if (q < -128)
+				q = -128;
+
+			out[i] = (uint8_t)(q + 128);
+		} else {
+			v = f[i] * 128 + 128.5f;
+
+			if (FL2K_DITHER_TPDF == dither)
+				v += dither_tpdf(&d->seed[0]);
+
+			out[i] = quantize_float(v);
+		}
+	}
+}
+
+#ifdef FL2K_CONVERT_X86
+FL2K_TARGET("sse2")
+static __m128i dither_rand_sse2(__m128i x)
+{
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+	return _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+}
+
+FL2K_TARGET("sse2")
+static __m128i quantize_float_sse2(const float *f, __m128i *s, int dither)
+{
+	const __m128 scale = _mm_set1_ps(128), bias = _mm_set1_ps(128.5f);
+	const __m128 zero = _mm_setzero_ps(), max = _mm_set1_ps(255.5f);
+	const __m128i m16 = _mm_set1_epi32(0xffff);
+	__m128i q[4];
+	__m128 v;
+	int j;
+
+	for (j = 0; j < 4; j++) {
+		v = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(f + j * 4), scale), bias);
+
+		if (dither) {
+			*s = dither_rand_sse2(*s);
+			v = _mm_add_ps(v, _mm_mul_ps(_mm_cvtepi32_ps(
+				_mm_sub_epi32(_mm_and_si128(*s, m16),
+					      _mm_srli_epi32(*s, 16))),
+				_mm_set1_ps(1.0f / 65536)));
+		}
+
+		/* max first, it returns the second operand for NaN */
+		v = _mm_min_ps(_mm_max_ps(v, zero), max);
+		q[j] = _mm_cvttps_epi32(v);
+	}
+
+	return _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]),
+				_mm_packs_epi32(q[2], q[3]));
+}
+
+FL2K_TARGET("sse2")
+static void fl2k_quantize_sse2(uint8_t *out, const void *in, uint32_t len,
+			       int format, int dither, fl2k_dither_state_t *d)
+{
+	const __m128i bias = _mm_set1_epi16(128), m8 = _mm_set1_epi16(0xff);
+	const __m128i sign = _mm_set1_epi8((char)0x80);
+	const int16_t *s16 = in;
+	const float *f = in;
+	__m128i s, lo, hi, d0, d1;
+	uint32_t i = 0;
+
+	if (FL2K_DITHER_SHAPED == dither) {
+		fl2k_quantize_scalar(out, in, len, format, dither, d);
+		return;
+	}
+
+	s = _mm_loadu_si128((const __m128i *)d->seed);
+	d0 = d1 = _mm_setzero_si128();
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		if (FL2K_FORMAT_FLOAT == format) {
+			_mm_storeu_si128((__m128i *)(out + i),
+					 quantize_float_sse2(f + i, &s, dither));
+			continue;
+		}
+
+		lo = _mm_loadu_si128((const __m128i *)(s16 + i));
+		hi = _mm_loadu_si128((const __m128i *)(s16 + i + 8));
+
+		if (dither) {
+			s = dither_rand_sse2(s);
+			d0 = _mm_sub_epi16(_mm_and_si128(s, m8),
+					   _mm_srli_epi16(s, 8));
+			s = dither_rand_sse2(s);
+			d1 = _mm_sub_epi16(_mm_and_si128(s, m8),
+					   _mm_srli_epi16(s, 8));
+		}
+
+		lo = _mm_srai_epi16(_mm_adds_epi16(_mm_adds_epi16(lo, d0), bias), 8);
+		hi = _mm_srai_epi16(_mm_adds_epi16(_mm_adds_epi16(hi, d1), bias), 8);
+
+		_mm_storeu_si128((__m128i *)(out + i),
+				 _mm_xor_si128(_mm_packs_epi16(lo, hi), sign));
+	}
+
+	_mm_storeu_si128((__m128i *)d->seed, s);
+
+	fl2k_quantize_scalar(out + i, FL2K_FORMAT_INT16 == format ?
+			     (const void *)(s16 + i) : (const void *)(f + i),
+			     len - i, format, dither, d);
+}
+
+static int fl2k_have_sse2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+}
+#endif /* FL2K_CONVERT_X86 */
+
+#if defined(FL2K_CONVERT_NEON) && defined(__aarch64__)
+static uint32x4_t dither_rand_neon(uint32x4_t x)
+{
+	x = veorq_u32(x, vshlq_n_u32(x, 13));
+	x = veorq_u32(x, vshrq_n_u32(x, 17));
+	return veorq_u32(x, vshlq_n_u32(x, 5));
+}
+
+static uint8x16_t quantize_float_neon(const float *f, uint32x4_t *s,
+				      int dither)
+{
+	const float32x4_t zero = vdupq_n_f32(0), max = vdupq_n_f32(255.5f);
+	const uint32x4_t m16 = vdupq_n_u32(0xffff);
+	int16x4_t q[4];
+	float32x4_t v;
+	int j;
+
+	for (j = 0; j < 4; j++) {
+		v = vaddq_f32(vmulq_n_f32(vld1q_f32(f + j * 4), 128),
+			      vdupq_n_f32(128.5f));
+
+		if (dither) {
+			*s = dither_rand_neon(*s);
+			v = vaddq_f32(v, vmulq_n_f32(vcvtq_f32_s32(vsubq_s32(
+				vreinterpretq_s32_u32(vandq_u32(*s, m16)),
+				vreinterpretq_s32_u32(vshrq_n_u32(*s, 16)))),
+				1.0f / 65536));
+		}
+
+		/* maxnm returns the number for NaN */
+		v = vminq_f32(vmaxnmq_f32(v, zero), max);
+		q[j] = vqmovn_s32(vcvtq_s32_f32(v));
+	}
+
+	return vcombine_u8(vqmovun_s16(vcombine_s16(q[0], q[1])),
+			   vqmovun_s16(vcombine_s16(q[2], q[3])));
+}
+
+static void fl2k_quantize_neon(uint8_t *out, const void *in, uint32_t len,
+			       int format, int dither, fl2k_dither_state_t *d)
+{
+	const int16x8_t bias = vdupq_n_s16(128);
+	const uint16x8_t m8 = vdupq_n_u16(0xff);
+	const int16_t *s16 = in;
+	const float *f = in;
+	int16x8_t lo, hi, d0, d1;
+	uint32x4_t s;
+	uint16x8_t r;
+	uint32_t i = 0;
+
+	if (FL2K_DITHER_SHAPED == dither) {
+		fl2k_quantize_scalar(out, in, len, format, dither, d);
+		return;
+	}
+
+	s = vld1q_u32(d->seed);
+	d0 = d1 = vdupq_n_s16(0);
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		if (FL2K_FORMAT_FLOAT == format) {
+			vst1q_u8(out + i, quantize_float_neon(f + i, &s, dither));
+			continue;
+		}
+
+		lo = vld1q_s16(s16 + i);
+		hi = vld1q_s16(s16 + i + 8);
+
+		if (dither) {
+			s = dither_rand_neon(s);
+			r = vreinterpretq_u16_u32(s);
+			d0 = vsubq_s16(vreinterpretq_s16_u16(vandq_u16(r, m8)),
+				       vreinterpretq_s16_u16(vshrq_n_u16(r, 8)));
+			s = dither_rand_neon(s);
+			r = vreinterpretq_u16_u32(s);
+			d1 = vsubq_s16(vreinterpretq_s16_u16(vandq_u16(r, m8)),
+				       vreinterpretq_s16_u16(vshrq_n_u16(r, 8)));
+		}
+
+		lo = vshrq_n_s16(vqaddq_s16(vqaddq_s16(lo, d0), bias), 8);
+		hi = vshrq_n_s16(vqaddq_s16(vqaddq_s16(hi, d1), bias), 8);
+
+		vst1q_u8(out + i, veorq_u8(vreinterpretq_u8_s8(
+				vcombine_s8(vmovn_s16(lo), vmovn_s16(hi))),
+				vdupq_n_u8(0x80)));
+	}
+
+	vst1q_u32(d->seed, s);
+
+	fl2k_quantize_scalar(out + i, FL2K_FORMAT_INT16 == format ?
+			     (const void *)(s16 + i) : (const void *)(f + i),
+			     len - i, format, dither, d);
+}
+#endif
+
+fl2k_quantize_fn_t fl2k_quantize_select(void)
+{
+	const char *override = getenv("FL2K_CONVERT");
+
+	/* the scalar kernel can be forced, like for the conversion */
+	if (override && !strcmp(override, "scalar"))
+		return fl2k_quantize_scalar;
+
+#ifdef FL2K_CONVERT_X86
+	if (fl2k_have_sse2())
+		return fl2k_quantize_sse2;
+#endif
+#if defined(FL2K_CONVERT_NEON) && defined(__aarch64__)
+	return fl2k_quantize_neon;
+#endif
+
+	return fl2k_quantize_scalar;
+}
+
+void fl2k_convert_rgb_quantized(fl2k_convert_fn_t convert,
+				fl2k_quantize_fn_t quantize, char *out,
+				const void *r, const void *g, const void *b,
+				uint32_t len, int format, int dither,
+				fl2k_dither_state_t d[3])
+{
+	uint8_t q[3][QUANTIZE_BLOCK];
+	const void *in[3] = { r, g, b };
+	uint32_t i, n, pos, c, size;
+
+	size = (FL2K_FORMAT_INT16 == format) ? sizeof(int16_t) : sizeof(float);
+
+	/* len is a multiple of 24, so every block is as well */
+	for (i = 0, pos = 0; i < len; i += n * 3, pos += n) {
+		n = (len - i) / 3;
+		if (n > QUANTIZE_BLOCK)
+			n = QUANTIZE_BLOCK;
+
+		for (c = 0; c < 3; c++) {
+			if (in[c])
+				quantize(q[c], (const char *)in[c] + pos * size,
+					 n, format, dither, &d[c]);
+		}
+
+		convert(out + i, r ? (const char *)q[0] : NULL,
+			g ? (const char *)q[1] : NULL,
+			b ? (const char *)q[2] : NULL, n * 3, 0);
+	}
+}
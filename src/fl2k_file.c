@@ -28,6 +28,8 @@
 
 #ifndef _WIN32
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #define sleep_ms(ms)	usleep(ms*1000)
 #else
 #include <windows.h>
@@ -43,18 +45,62 @@ static fl2k_dev_t *dev = NULL;
 
 static volatile int do_exit = 0;
 static volatile int repeat = 1;
-FILE *file;
-char *txbuf = NULL;
+
+#define MAX_INPUTS	3
+
+/* Regular files are played from a mapping, the buffers point directly
+ * into it. Files up to cache_limit are copied to RAM instead, followed
+ * by one buffer worth of data from their start, so every buffer is
+ * contiguous and loops are seamless for any file length. Pipes, stdin
+ * and all files on Windows are read with fread(). */
+#define PREFETCH_AHEAD	(64 * 1024 * 1024)
+#define PREFETCH_STEP	(8 * 1024 * 1024)
+
+typedef struct input {
+	FILE *file;
+	const char *name;
+	uint32_t len;			/* bytes per buffer */
+	char *buf;			/* for copies, len bytes */
+	uint32_t repeat_cnt;
+	int got_data;
+	int done;
+#ifndef _WIN32
+	const char *src;		/* mapping or cache, NULL for fread() */
+	char *map;
+	uint64_t size;
+	int cached;
+	uint64_t pos;			/* bytes played, including repeats */
+	uint64_t prefetch_pos;		/* end of the prefetched part */
+#endif
+} input_t;
+
+static input_t inputs[MAX_INPUTS];
+static int num_inputs = 0;
+static int interleaved = 0;
+static int sample_format = FL2K_FORMAT_INT8;
+static int dither = FL2K_DITHER_NONE;
+static char *chanbuf[3];		/* deinterleaved samples */
+static char *silence = NULL;		/* for inputs that already ended */
+
+#ifndef _WIN32
+static long page_size;
+#endif
 
 void usage(void)
 {
 	fprintf(stderr,
 		"fl2k_file, a sample player for FL2K VGA dongles\n\n"
 		"Usage:\n"
-		"\t[-d device_index (default: 0)]\n"
+		"\t[-d device index, USB path or serial number (default: 0)]\n"
 		"\t[-r repeat file (default: 1)]\n"
+		"\t[-c max. file size to cache in RAM in MB (default: 256)]\n"
+		"\t[-I input is interleaved R, G, B samples]\n"
+		"\t[-F sample format s8, s16 or f32 (default: s8)]\n"
+		"\t[-D dither for s16 and f32, none, tpdf or shaped (default: none)]\n"
 		"\t[-s samplerate (default: 100 MS/s)]\n"
-		"\tfilename (use '-' to read from stdin)\n\n"
+		"\t[-A CPU of the USB worker[,CPU of the sample worker] (default: no pinning)]\n"
+		"\t[-P real-time priority of the workers, also locks the buffers in memory]\n"
+		"\tfilename [green filename [blue filename]] (use '-' to read from stdin)\n\n"
 	);
 	exit(1);
 }
@@ -80,10 +126,245 @@ static void sighandler(int signum)
 }
 #endif
 
+
+static void input_repeated(input_t *in)
+{
+	in->repeat_cnt++;
+
+	if (num_inputs > 1)
+		fprintf(stderr, "%s: repeat %d\n", in->name, in->repeat_cnt);
+	else
+		fprintf(stderr, "repeat %d\n", in->repeat_cnt);
+}
+
+/* returns the next buffer, NULL at the end of the input */
+static const char *input_fread(input_t *in)
+{
+	uint32_t left = in->len;
+	size_t r;
+
+	while (!do_exit && (left > 0)) {
+		r = fread(in->buf + (in->len - left), 1, left, in->file);
+
+		if (ferror(in->file))
+			fprintf(stderr, "File Error\n");
+
+		if (r > 0) {
+			left -= r;
+			in->got_data = 1;
+		}
+
+		if (feof(in->file)) {
+			if (repeat && in->got_data) {
+				input_repeated(in);
+				rewind(in->file);
+			} else {
+				in->done = 1;
+				break;
+			}
+		}
+	}
+
+	if (left == in->len)
+		return NULL;
+
+	/* pad the last buffer */
+	memset(in->buf + (in->len - left), 0, left);
+
+	return in->buf;
+}
+
+#ifndef _WIN32
+/* copy len bytes from offset off of the file, wrapping around */
+static void input_copy(input_t *in, char *dst, uint64_t off, uint32_t len)
+{
+	uint32_t n;
+
+	while (len) {
+		n = len;
+		if (n > in->size - off)
+			n = in->size - off;
+
+		memcpy(dst, in->src + off, n);
+		dst += n;
+		len -= n;
+		off = 0;
+	}
+}
+
+/* keep PREFETCH_AHEAD bytes after the cursor in the page cache */
+static void input_prefetch(input_t *in)
+{
+	uint64_t off, end = in->pos + PREFETCH_AHEAD;
+	uint32_t n, align;
+
+	if (!repeat && end > in->size)
+		end = in->size;
+
+	while (in->prefetch_pos < end) {
+		off = in->prefetch_pos % in->size;
+		n = PREFETCH_STEP;
+		if (n > in->size - off)
+			n = in->size - off;
+
+		align = off & (page_size - 1);
+		madvise(in->map + off - align, n + align, MADV_WILLNEED);
+		in->prefetch_pos += n;
+	}
+}
+
+static const char *input_map_read(input_t *in)
+{
+	uint64_t off = in->pos % in->size;
+	const char *p;
+
+	if (!repeat && in->pos + in->len > in->size) {
+		in->done = 1;
+
+		if (in->pos >= in->size)
+			return NULL;
+
+		/* pad the last buffer */
+		memset(in->buf, 0, in->len);
+		input_copy(in, in->buf, off, in->size - in->pos);
+		in->pos = in->size;
+
+		return in->buf;
+	}
+
+	if (in->cached || off + in->len <= in->size) {
+		p = in->src + off;
+	} else {
+		/* the only copy, at the loop boundary */
+		input_copy(in, in->buf, off, in->len);
+		p = in->buf;
+	}
+
+	if (repeat && (in->pos + in->len) / in->size > in->pos / in->size)
+		input_repeated(in);
+
+	in->pos += in->len;
+
+	if (!in->cached)
+		input_prefetch(in);
+
+	return p;
+}
+
+/* map a regular file, returns 0 if it should be read with fread() */
+static int input_map(input_t *in, uint64_t cache_limit)
+{
+	struct stat st;
+	char *cache;
+	void *map;
+	int fd = fileno(in->file);
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || !st.st_size)
+		return 0;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return 0;
+
+	in->map = map;
+	in->size = st.st_size;
+	in->src = in->map;
+	madvise(in->map, in->size, MADV_SEQUENTIAL);
+
+	if (in->size <= cache_limit) {
+		cache = fl2k_alloc_buffer(dev, in->size + in->len,
+					  FL2K_ALLOC_HUGEPAGE |
+					  FL2K_ALLOC_NUMA);
+		if (cache) {
+			memcpy(cache, in->map, in->size);
+			input_copy(in, cache + in->size, 0, in->len);
+			in->src = cache;
+			in->cached = 1;
+
+			munmap(in->map, in->size);
+			in->map = NULL;
+			return 1;
+		}
+	}
+
+	/* small enough to be advised once as a whole */
+	if (in->size <= PREFETCH_AHEAD) {
+		madvise(in->map, in->size, MADV_WILLNEED);
+		in->prefetch_pos = UINT64_MAX;
+	}
+
+	input_prefetch(in);
+
+	return 1;
+}
+#endif
+
+static const char *input_read(input_t *in)
+{
+	if (in->done)
+		return NULL;
+
+#ifndef _WIN32
+	if (in->src)
+		return input_map_read(in);
+#endif
+
+	return input_fread(in);
+}
+
+static int input_open(input_t *in, const char *name, uint32_t len,
+		      uint64_t cache_limit)
+{
+	in->name = name;
+	in->len = len;
+
+	if (strcmp(name, "-") == 0) { /* Read samples from stdin */
+		in->file = stdin;
+#ifdef _WIN32
+		_setmode(_fileno(stdin), _O_BINARY);
+#endif
+	} else {
+		in->file = fopen(name, "rb");
+		if (!in->file) {
+			fprintf(stderr, "Failed to open %s\n", name);
+			return -ENOENT;
+		}
+	}
+
+	in->buf = fl2k_alloc_buffer(dev, len, FL2K_ALLOC_NUMA);
+	if (!in->buf) {
+		fprintf(stderr, "malloc error!\n");
+		return -ENOMEM;
+	}
+
+#ifndef _WIN32
+	if (in->file != stdin && input_map(in, cache_limit))
+		fprintf(stderr, "Playing %s from %s\n", name,
+			in->cached ? "RAM" : "mapped file");
+#endif
+
+	return 0;
+}
+
+static void input_close(input_t *in)
+{
+#ifndef _WIN32
+	if (in->cached)
+		fl2k_free_buffer((char *)in->src);
+	else if (in->map)
+		munmap(in->map, in->size);
+#endif
+
+	fl2k_free_buffer(in->buf);
+
+	if (in->file && (in->file != stdin))
+		fclose(in->file);
+}
+
 void fl2k_callback(fl2k_data_info_t *data_info)
 {
-	int r, left = FL2K_BUF_LEN;
-	static uint32_t repeat_cnt = 0;
+	const char *bufs[MAX_INPUTS];
+	int i, active = 0;
 
 	if (data_info->device_error) {
 		fprintf(stderr, "Device error, exiting.\n");
@@ -92,28 +373,39 @@ void fl2k_callback(fl2k_data_info_t *data_info)
 	}
 
 	data_info->sampletype_signed = 1;
-	data_info->r_buf = txbuf;
+	data_info->sample_format = sample_format;
+	data_info->dither = dither;
 
-	while (!do_exit && (left > 0)) {
-		r = fread(txbuf + (FL2K_BUF_LEN - left), 1, left, file);
+	for (i = 0; i < num_inputs; i++) {
+		bufs[i] = input_read(&inputs[i]);
 
-		if (ferror(file))
-			fprintf(stderr, "File Error\n");
+		if (bufs[i])
+			active++;
+		else
+			bufs[i] = silence;
+	}
 
-		if (feof(file)) {
-			if (repeat && (r > 0)) {
-				repeat_cnt++;
-				fprintf(stderr, "repeat %d\n", repeat_cnt);
-				rewind(file);
-			} else {
-				fl2k_stop_tx(dev);
-				do_exit = 1;
-			}
-		}
+	/* play until the longest input ended */
+	if (!active) {
+		fl2k_stop_tx(dev);
+		do_exit = 1;
+		return;
+	}
 
-		if (r > 0)
-			left -= r;
+	if (interleaved) {
+		fl2k_deinterleave_rgb(bufs[0], chanbuf[0], chanbuf[1],
+				      chanbuf[2], FL2K_BUF_LEN);
+		data_info->r_buf = chanbuf[0];
+		data_info->g_buf = chanbuf[1];
+		data_info->b_buf = chanbuf[2];
+		return;
 	}
+
+	data_info->r_buf = (char *)bufs[0];
+	if (num_inputs > 1)
+		data_info->g_buf = (char *)bufs[1];
+	if (num_inputs > 2)
+		data_info->b_buf = (char *)bufs[2];
 }
 
 int main(int argc, char **argv)
@@ -124,58 +416,115 @@ int main(int argc, char **argv)
 	int r, opt, i;
 	uint32_t samp_rate = 100000000;
 	uint32_t buf_num = 0;
-	int dev_index = 0;
+	const char *dev_name = "0";
+	int usb_cpu = -1, sample_cpu = -1, rt_prio = 0;
 	void *status;
-	char *filename = NULL;
+	uint64_t cache_limit = 256;
+	uint32_t sample_size = 1;
 
-	while ((opt = getopt(argc, argv, "d:r:s:")) != -1) {
+	while ((opt = getopt(argc, argv, "d:r:c:IF:D:s:A:P:")) != -1) {
 		switch (opt) {
 		case 'd':
-			dev_index = (uint32_t)atoi(optarg);
+			/* an index, a USB path or a serial number */
+			dev_name = optarg;
 			break;
 		case 'r':
 			repeat = (int)atoi(optarg);
 			break;
+		case 'c':
+			cache_limit = (uint64_t)atoi(optarg);
+			break;
+		case 'I':
+			interleaved = 1;
+			break;
+		case 'F':
+			if (!strcmp(optarg, "s16")) {
+				sample_format = FL2K_FORMAT_INT16;
+				sample_size = sizeof(int16_t);
+			} else if (!strcmp(optarg, "f32")) {
+				sample_format = FL2K_FORMAT_FLOAT;
+				sample_size = sizeof(float);
+			} else if (strcmp(optarg, "s8")) {
+				usage();
+			}
+			break;
+		case 'D':
+			if (!strcmp(optarg, "tpdf"))
+				dither = FL2K_DITHER_TPDF;
+			else if (!strcmp(optarg, "shaped"))
+				dither = FL2K_DITHER_SHAPED;
+			else if (strcmp(optarg, "none"))
+				usage();
+			break;
 		case 's':
 			samp_rate = (uint32_t)atof(optarg);
 			break;
+		case 'A':
+			if (sscanf(optarg, "%d,%d", &usb_cpu, &sample_cpu) < 1)
+				usage();
+			break;
+		case 'P':
+			rt_prio = atoi(optarg);
+			break;
 		default:
 			usage();
 			break;
 		}
 	}
 
-	if (argc <= optind)
+	num_inputs = argc - optind;
+	if (num_inputs < 1 || num_inputs > MAX_INPUTS ||
+	    (interleaved && (num_inputs > 1 || sample_size > 1)))
 		usage();
-	else
-		filename = argv[optind];
 
-	if (dev_index < 0)
-		exit(1);
-
-	if (strcmp(filename, "-") == 0) { /* Read samples from stdin */
-		file = stdin;
-#ifdef _WIN32
-		_setmode(_fileno(stdin), _O_BINARY);
+#ifndef _WIN32
+	page_size = sysconf(_SC_PAGESIZE);
 #endif
-	} else {
-		file = fopen(filename, "rb");
-		if (!file) {
-			fprintf(stderr, "Failed to open %s\n", filename);
-			return -ENOENT;
-		}
+
+	fl2k_open_by_name(&dev, dev_name);
+	if (NULL == dev) {
+		fprintf(stderr, "Failed to open fl2k device %s.\n", dev_name);
+		goto out;
 	}
 
-	txbuf = malloc(FL2K_BUF_LEN);
-	if (!txbuf) {
+	/* pin and prioritize the workers, this only prints a warning
+	 * if we lack the privileges */
+	fl2k_set_thread_config(dev, FL2K_THREAD_USB, usb_cpu, rt_prio);
+	fl2k_set_thread_config(dev, FL2K_THREAD_SAMPLE, sample_cpu, rt_prio);
+	if (rt_prio > 0)
+		fl2k_set_mlock(dev, 1);
+
+	/* use the buffer configuration measured by fl2k_test -R, if there
+	 * is one and it keeps the buffer length the callback provides */
+	fl2k_apply_default_profile(dev, 1);
+
+	/* the buffers are allocated on the NUMA node of the device */
+	for (i = 0; i < num_inputs; i++) {
+		r = input_open(&inputs[i], argv[optind + i],
+			       interleaved ? FL2K_BUF_LEN * 3 :
+			       FL2K_BUF_LEN * sample_size,
+			       cache_limit * 1024 * 1024);
+		if (r < 0)
+			goto out;
+	}
+
+	/* zero is the center for all signed formats */
+	silence = fl2k_alloc_buffer(dev, (size_t)sample_size * FL2K_BUF_LEN,
+				    FL2K_ALLOC_NUMA);
+	if (!silence) {
 		fprintf(stderr, "malloc error!\n");
 		goto out;
 	}
 
-	fl2k_open(&dev, (uint32_t)dev_index);
-	if (NULL == dev) {
-		fprintf(stderr, "Failed to open fl2k device #%d.\n", dev_index);
-		goto out;
+	if (interleaved) {
+		for (i = 0; i < 3; i++) {
+			chanbuf[i] = fl2k_alloc_buffer(dev, FL2K_BUF_LEN,
+						       FL2K_ALLOC_NUMA);
+			if (!chanbuf[i]) {
+				fprintf(stderr, "malloc error!\n");
+				goto out;
+			}
+		}
 	}
 
 	r = fl2k_start_tx(dev, fl2k_callback, NULL, 0);
@@ -202,14 +551,16 @@ int main(int argc, char **argv)
 	while (!do_exit)
 		sleep_ms(500);
 
+out:
 	fl2k_close(dev);
 
-out:
-	if (txbuf)
-		free(txbuf);
+	for (i = 0; i < num_inputs; i++)
+		input_close(&inputs[i]);
+
+	for (i = 0; i < 3; i++)
+		fl2k_free_buffer(chanbuf[i]);
 
-	if (file && (file != stdin))
-		fclose(file);
+	fl2k_free_buffer(silence);
 
 	return 0;
 }
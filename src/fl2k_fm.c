@@ -45,6 +45,9 @@
 
 #include "osmo-fl2k.h"
 #include "rds_mod.h"
+#include "fm_mod.h"
+#include "audio_ingest.h"
+#include "rate_adapt.h"
 
 #define BUFFER_SAMPLES_SHIFT	16
 #define BUFFER_SAMPLES		(1 << BUFFER_SAMPLES_SHIFT)
@@ -52,48 +55,103 @@
 
 #define AUDIO_BUF_SIZE		1024
 
+/* number of audio samples whose phase increments are converted at once */
+#define FM_RUN_LEN		64
+
+/* interval of the clock reports with a live input, in s */
+#define LIVE_REPORT_TIME	60
+
+#define MAX_STATIONS		FM_MIX_MAX
+
 fl2k_dev_t *dev = NULL;
 int do_exit = 0;
 
 pthread_t fm_thread;
-pthread_mutex_t cb_mutex;
 pthread_mutex_t fm_mutex;
-pthread_cond_t cb_cond;
-pthread_cond_t fm_cond;
 
-FILE *file;
-int8_t *txbuf = NULL;
-int8_t *fmbuf = NULL;
-int8_t *buf1 = NULL;
-int8_t *buf2 = NULL;
+int8_t *fmbuf[2] = { NULL, NULL };
+int fm_threads = 1;
 
 uint32_t samp_rate = 100000000;
+double exact_rate;
 
 /* default signal parameters */
-#define PILOT_FREQ	19000	/* In Hz */
-#define STEREO_CARRIER	38000	/* In Hz */
-
-int delta_freq = 75000;
-int carrier_freq = 97000000;
-int carrier_per_signal;
-int input_freq = 44100;
-int stereo_flag = 0;
-int rds_flag = 0;
-
-double *freqbuf; 
-double *slopebuf; 
-int writepos, readpos;
+#define PILOT_FREQ	19000	/* In Hz, the stereo subcarrier is at twice that */
+
+/* audio buffered with a live input, in ms, 0 if the input isn't live */
+int live_ms = 0;
+
+/* Every station has its own input, modulator thread and carrier. The
+ * FM worker plans the next buffer of all of them, the carriers are
+ * generated in one pass into consecutive parts of fmbuf, and the
+ * stations sharing a DAC are mixed into chanbuf. */
+typedef struct station {
+	const char *filename;
+	FILE *file;
+	audio_ingest_t *ingest;
+	pthread_t thread;
+	pthread_cond_t cond;		/* room in freqbuf */
+
+	int carrier_freq;
+	int delta_freq;
+	int input_freq;
+	int input_freq_specified;
+	int stereo_flag;
+	int rds_flag;
+	int channel;			/* 0, 1, 2 for R, G, B */
+	uint16_t pi;
+	const char *ps;
+	const char *rt;
+	rds_encoder_t *rds;
+
+	int carrier_per_signal;
+	double exact_per_signal;
+
+	double *freqbuf;
+	double *slopebuf;
+	int writepos, readpos;
+
+	/* state of fm_plan_buffer() */
+	fm_dds_t carrier;
+	uint32_t step[FM_RUN_LEN], slope[FM_RUN_LEN];
+	uint32_t run, ri, left;
+	double acc;
+
+	rate_adapt_t adapt;
+	uint64_t planned;
+	size_t live_samples;
+} station_t;
+
+/* the options apply to all stations, unless given per station */
+station_t defaults;
+station_t stations[MAX_STATIONS];
+int num_stations = 0;
+int stations_done = 0;
+
+/* the stations of every DAC */
+int chan_stations[3][MAX_STATIONS];
+int chan_num[3];
+int8_t *chanbuf[2][3];
 
 void usage(void)
 {
 	fprintf(stderr,
 		"fl2k_fm, an FM modulator for FL2K VGA dongles\n\n"
 		"Usage:"
-		"\t[-d device index (default: 0)]\n"
+		"\t[-d device index, USB path or serial number (default: 0)]\n"
 		"\t[-c carrier frequency (default: 9.7 MHz)]\n"
 		"\t[-f FM deviation (default: 75000 Hz, WBFM)]\n"
 		"\t[-i input audio sample rate (default: 44100 Hz for mono FM)]\n"
 		"\t[-s samplerate in Hz (default: 100 MS/s)]\n"
+		"\t[-t number of carrier generation threads (default: 1)]\n"
+		"\t[-A CPU of the USB worker[,CPU of the sample worker] (default: no pinning)]\n"
+		"\t[-P real-time priority of the workers, also locks the buffers in memory]\n"
+		"\t[-r live input: keep this many ms of audio buffered by following its clock]\n"
+		"\t[-S station instead of the filename, can be given several times:\n"
+		"\t    file=name[,carrier=Hz][,deviation=Hz][,rate=Hz][,channel=r|g|b]\n"
+		"\t    [,stereo][,rds][,pi=hex][,ps=name][,rt=text up to the end]\n"
+		"\t    the other options are the defaults, the stations are spread\n"
+		"\t    over R, G and B unless their channel is given]\n"
 		"\t[--rds (enables RDS, forces audio sample rate to 228 kHz)]\n"
 		"\t[--stereo (enables stereo, requires audio sample rate >= 114 kHz)]\n"
 		"\tfilename (use '-' to read from stdin)\n\n"
@@ -101,6 +159,17 @@ void usage(void)
 	exit(1);
 }
 
+static void wake_stations(void)
+{
+	int i;
+
+	for (i = 0; i < num_stations; i++) {
+		if (stations[i].ingest)
+			audio_ingest_cancel(stations[i].ingest);
+		pthread_cond_signal(&stations[i].cond);
+	}
+}
+
 #ifdef _WIN32
 BOOL WINAPI
 sighandler(int signum)
@@ -109,7 +178,7 @@ sighandler(int signum)
 		fprintf(stderr, "Signal caught, exiting!\n");
 		fl2k_stop_tx(dev);
 		do_exit = 1;
-		pthread_cond_signal(&fm_cond);
+		wake_stations();
 		return TRUE;
 	}
 	return FALSE;
@@ -120,325 +189,577 @@ static void sighandler(int signum)
 	fprintf(stderr, "Signal caught, exiting!\n");
 	fl2k_stop_tx(dev);
 	do_exit = 1;
-	pthread_cond_signal(&fm_cond);
+	wake_stations();
 }
 #endif
 
-/* DDS Functions */
-
-#ifndef M_PI
-# define M_PI		3.14159265358979323846	/* pi */
-# define M_PI_2		1.57079632679489661923	/* pi/2 */
-# define M_PI_4		0.78539816339744830962	/* pi/4 */
-# define M_1_PI		0.31830988618379067154	/* 1/pi */
-# define M_2_PI		0.63661977236758134308	/* 2/pi */
-#endif
-#define DDS_2PI		(M_PI * 2)		/* 2 * Pi */
-#define DDS_3PI2	(M_PI_2 * 3)		/* 3/2 * pi */
+/* Signal generation and some helpers */
 
-#define SIN_TABLE_ORDER	8
-#define SIN_TABLE_SHIFT	(32 - SIN_TABLE_ORDER)
-#define SIN_TABLE_LEN	(1 << SIN_TABLE_ORDER)
-#define ANG_INCR	(0xffffffff / DDS_2PI)
+/* A live input has its own clock, so the audio is consumed slightly
+ * faster or slower than the nominal rate, which keeps the amount of it
+ * buffered at live_ms. That includes the audio already modulated into
+ * buffers the device didn't output yet. Called once per buffer, returns
+ * the factor. */
+static double live_ratio(station_t *st)
+{
+	size_t frames = audio_ingest_avail(st->ingest) / (st->stereo_flag ? 2 : 1);
+	uint32_t queued = (st->writepos - st->readpos) & BUFFER_SAMPLES_MASK;
+	uint64_t output = fl2k_get_sample_count(dev);
+	double level;
 
-int8_t sine_table[SIN_TABLE_LEN];
-int sine_table_init = 0;
+	level = (double)(frames + queued) / st->input_freq;
+	if (st->planned > output)
+		level += (st->planned - output) / exact_rate;
 
-typedef struct {
-	double sample_freq;
-	double freq;
-	double fslope;
-	unsigned long int phase;
-	unsigned long int phase_step;
-	unsigned long int phase_slope;
-} dds_t;
+	st->planned += FL2K_BUF_LEN;
 
-static inline void dds_setphase(dds_t *dds, double phase)
-{
-	dds->phase = phase * ANG_INCR;
+	return rate_adapt_update(&st->adapt, level, FL2K_BUF_LEN / exact_rate);
 }
 
-static inline double dds_getphase(dds_t *dds)
+static void live_report(void)
 {
-	return dds->phase / ANG_INCR;
-}
+	static uint64_t buffers = 0;
+	fl2k_rate_estimate_t est;
+	int i, have_est;
 
-static inline void dds_set_freq(dds_t *dds, double freq, double fslope)
-{
-	dds->fslope = fslope;
-	dds->phase_step = (freq / dds->sample_freq) * 2 * M_PI * ANG_INCR;
-
-	/* The slope parameter is used with the FM modulator to create
-	 * a simple but very fast and effective interpolation filter.
-	 * See the fm modulator for details */
-	dds->freq = freq;
-	dds->phase_slope = (fslope / dds->sample_freq) * 2 * M_PI * ANG_INCR;
+	if (++buffers * FL2K_BUF_LEN < LIVE_REPORT_TIME * exact_rate)
+		return;
+
+	buffers = 0;
+	have_est = !fl2k_get_rate_estimate(dev, &est);
+
+	for (i = 0; i < num_stations; i++) {
+		if (num_stations > 1)
+			fprintf(stderr, "Station %d: ", i);
+
+		fprintf(stderr, "Buffered %.0f ms, input clock %+.1f PPM of "
+				"the DAC clock", stations[i].adapt.level * 1000,
+				(stations[i].adapt.ratio - 1) * 1e6);
+
+		if (have_est)
+			fprintf(stderr, ", DAC clock %+.1f PPM", est.ppm);
+
+		fprintf(stderr, "\n");
+	}
 }
 
-dds_t dds_init(double sample_freq, double freq, double phase)
+/* describe the next output buffer of a station by segments with the
+ * carrier state at their start, one for every audio sample, at base in
+ * the buffer of all stations */
+static uint32_t fm_plan_buffer(station_t *st, fm_seg_t *segs, uint32_t base)
 {
-	dds_t dds;
-	int i;
+	fm_dds_t *carrier = &st->carrier;
+	double per_signal = st->exact_per_signal;
+	uint32_t pos, c, nsegs = 0;
+
+	if (live_ms)
+		per_signal /= live_ratio(st);
+
+	for (pos = 0; pos < FL2K_BUF_LEN; pos += c) {
+		c = 0;
+
+		if (!st->left) {
+			if (st->ri == st->run) {
+				/* the previous run is consumed, hand it back
+				 * to the modulator and convert the frequencies
+				 * of the next one into phase increments */
+				st->readpos = (st->readpos + st->run) &
+					      BUFFER_SAMPLES_MASK;
+				pthread_cond_signal(&st->cond);
+
+				st->run = BUFFER_SAMPLES - st->readpos;
+				if (st->run > FM_RUN_LEN)
+					st->run = FM_RUN_LEN;
+
+				fm_dds_steps(carrier, &st->freqbuf[st->readpos],
+					     &st->slopebuf[st->readpos],
+					     st->step, st->slope, st->run);
+				st->ri = 0;
+			}
 
-	dds.sample_freq = sample_freq;
-	dds.phase = phase * ANG_INCR;
-	dds_set_freq(&dds, freq, 0);
+			fm_dds_set(carrier, st->step[st->ri], st->slope[st->ri]);
+			st->ri++;
+
+			/* the sample rate usually isn't a multiple of the
+			 * audio rate, so alternate the number of samples per
+			 * audio sample to keep the audio rate exact on
+			 * average */
+			st->acc += per_signal;
+			st->left = (uint32_t)st->acc;
+			st->acc -= st->left;
+			continue;
+		}
+
+		c = st->left;
+		if (c > FL2K_BUF_LEN - pos)
+			c = FL2K_BUF_LEN - pos;
 
-	/* Initialize sine table, prescaled for 8 bit signed integer */
-	if (!sine_table_init) {
-		double incr = 1.0 / (double)SIN_TABLE_LEN;
-		for (i = 0; i < SIN_TABLE_LEN; i++)
-			sine_table[i] = sin(incr * i * DDS_2PI) * 127;
+		segs[nsegs].offset = base + pos;
+		segs[nsegs].count = c;
+		segs[nsegs].dds = *carrier;
+		nsegs++;
 
-		sine_table_init = 1;
+		fm_dds_skip(carrier, c);
+		st->left -= c;
 	}
 
-	return dds;
+	return nsegs;
 }
 
-static inline int8_t dds_real(dds_t *dds)
+/* mix the stations sharing a DAC, those alone on it are output as they
+ * are */
+static void fm_mix_channels(int cur)
 {
-	int tmp;
+	int8_t *in[MAX_STATIONS];
+	int c, k;
 
-	tmp = dds->phase >> SIN_TABLE_SHIFT;
-	dds->phase += dds->phase_step;
-	dds->phase &= 0xffffffff;
+	for (c = 0; c < 3; c++) {
+		if (chan_num[c] < 2)
+			continue;
 
-	dds->phase_step += dds->phase_slope;
+		for (k = 0; k < chan_num[c]; k++)
+			in[k] = fmbuf[cur] + (size_t)FL2K_BUF_LEN *
+				chan_stations[c][k];
 
-	return sine_table[tmp];
+		fm_mix(in, chan_num[c], chanbuf[cur][c], FL2K_BUF_LEN);
+	}
 }
 
-static inline void dds_real_buf(dds_t *dds, int8_t *buf, int count)
+static int fm_write(int cur)
 {
-	int i;
-	for (i = 0; i < count; i++)
-		buf[i] = dds_real(dds);
-}
+	char *bufs[3];
+	int c;
+
+	for (c = 0; c < 3; c++) {
+		if (!chan_num[c])
+			bufs[c] = NULL;
+		else if (chan_num[c] == 1)
+			bufs[c] = (char *)fmbuf[cur] + (size_t)FL2K_BUF_LEN *
+				  chan_stations[c][0];
+		else
+			bufs[c] = (char *)chanbuf[cur][c];
+	}
 
-/* Signal generation and some helpers */
+	/* blocks until there is room in the transfer queue */
+	return fl2k_write_samples(dev, bufs[0], bufs[1], bufs[2],
+				  FL2K_BUF_LEN, 0);
+}
 
 /* Generate the radio signal using the pre-calculated frequency information
- * in the freq buffer */
+ * in the freq buffers. With several threads, the next buffer is generated
+ * by the pool while the previous one is written to the device. */
 static void *fm_worker(void *arg)
 {
-	register double freq;
-	register double tmp;
-	dds_t carrier;
-	int8_t *tmp_ptr;
-	uint32_t len = 0;
-	uint32_t readlen, remaining;
-	int buf_prefilled = 0;
+	fm_pool_t *pool = NULL;
+	fm_seg_t *segs;
+	uint32_t max_segs = 0, nsegs, len = FL2K_BUF_LEN * num_stations;
+	int i, r, cur = 0, pending = 0;
+	station_t *st;
 
 	/* Prepare the oscillators */
-	carrier = dds_init(samp_rate, carrier_freq, 0);
+	for (i = 0; i < num_stations; i++) {
+		st = &stations[i];
+		fm_dds_init(&st->carrier, exact_rate, st->carrier_freq, 0);
+
+		max_segs += FL2K_BUF_LEN / (st->exact_per_signal >= 1 ?
+					    (uint32_t)st->exact_per_signal : 1) + 2;
+	}
+
+	segs = malloc(max_segs * sizeof(fm_seg_t));
+	if (!segs) {
+		fprintf(stderr, "malloc error!\n");
+		do_exit = 1;
+		wake_stations();
+		pthread_exit(NULL);
+	}
+
+	if (fm_threads > 1) {
+		pool = fm_pool_create(fm_threads);
+		if (!pool)
+			fprintf(stderr, "WARNING: Failed to start %d carrier "
+					"threads, using one.\n", fm_threads);
+	}
 
 	while (!do_exit) {
-		dds_set_freq(&carrier, freqbuf[readpos], slopebuf[readpos]);
-		readpos++;
-		readpos &= BUFFER_SAMPLES_MASK;
-
-		/* check if we reach the end of the buffer */
-		if ((len + carrier_per_signal) > FL2K_BUF_LEN) {
-			readlen = FL2K_BUF_LEN - len;
-			remaining = carrier_per_signal - readlen;
-			dds_real_buf(&carrier, &fmbuf[len], readlen);
-
-			if (buf_prefilled) {
-				/* swap buffers */
-				tmp_ptr = fmbuf;
-				fmbuf = txbuf;
-				txbuf = tmp_ptr;
-				pthread_cond_wait(&cb_cond, &cb_mutex);
-			}
+		nsegs = 0;
+		for (i = 0; i < num_stations; i++)
+			nsegs += fm_plan_buffer(&stations[i], segs + nsegs,
+						(uint32_t)i * FL2K_BUF_LEN);
+
+		if (live_ms)
+			live_report();
 
-			dds_real_buf(&carrier, fmbuf, remaining);
-			len = remaining;
+		if (pool) {
+			fm_pool_run(pool, segs, nsegs, fmbuf[cur], len);
 
-			buf_prefilled = 1;
+			r = pending ? fm_write(cur ^ 1) : 0;
+			fm_pool_wait(pool);
+			fm_mix_channels(cur);
+
+			cur ^= 1;
+			pending = 1;
 		} else {
-			dds_real_buf(&carrier, &fmbuf[len], carrier_per_signal);
-			len += carrier_per_signal;
+			fm_seg_gen(segs, nsegs, fmbuf[0], 0, len);
+			fm_mix_channels(0);
+			r = fm_write(0);
 		}
 
-		pthread_cond_signal(&fm_cond);
+		if (r < 0) {
+			if (!do_exit)
+				fprintf(stderr, "Device error, exiting.\n");
+			do_exit = 1;
+		}
 	}
 
+	/* the modulators check do_exit with the mutex held */
+	pthread_mutex_lock(&fm_mutex);
+	wake_stations();
+	pthread_mutex_unlock(&fm_mutex);
+
+	fm_pool_destroy(pool);
+	free(segs);
+
 	pthread_exit(NULL);
 }
 
-static inline int writelen(int maxlen)
+static inline int writelen(station_t *st, int maxlen)
 {
-	int rp = readpos;
+	int rp = st->readpos;
 	int len;
 	int r;
 
-	if (rp < writepos)
+	if (rp < st->writepos)
 		rp += BUFFER_SAMPLES;
 
-	len = rp - writepos;
+	len = rp - st->writepos;
 
 	r = len > maxlen ? maxlen : len;
 
 	return r;
 }
 
-static inline double modulate_sample(int lastwritepos, double lastfreq, double sample)
+/* wait until the FM worker consumed some of the modulated audio */
+static void wait_room(station_t *st)
 {
-	double freq, slope;
-
-	/* Calculate modulator frequency at this point to lessen
-	 * the calculations needed in the signal generator */
-	freq = sample * delta_freq;
-	freq += carrier_freq;
-
-	/* What we do here is calculate a linear "slope" from
-	the previous sample to this one. This is then used by
-	the modulator to gently increase/decrease the frequency
-	with each sample without the need to recalculate
-	the dds parameters. In fact this gives us a very
-	efficient and pretty good interpolation filter. */
-	slope = freq - lastfreq;
-	slope /= carrier_per_signal;
-	slopebuf[lastwritepos] = slope;
-	freqbuf[writepos] = freq;
-
-	return freq;
+	pthread_mutex_lock(&fm_mutex);
+	if (!do_exit)
+		pthread_cond_wait(&st->cond, &fm_mutex);
+	pthread_mutex_unlock(&fm_mutex);
 }
 
-void fm_modulator_mono(int use_rds)
+/* The input of a station ended. With several stations, it keeps its
+ * carrier without modulation until all of them ended, so the others
+ * aren't cut off. */
+static void station_ended(station_t *st)
 {
-	unsigned int i;
-	size_t len;
+	pthread_mutex_lock(&fm_mutex);
+	if (++stations_done == num_stations)
+		do_exit = 1;
+	pthread_mutex_unlock(&fm_mutex);
+
+	if (num_stations > 1 && !do_exit)
+		fprintf(stderr, "End of %s, the other stations keep "
+				"going\n", st->filename);
+}
+
+/* Modulate and buffer a block of samples: store the modulator frequency
+ * of each sample and the linear slope from the previous one, so the
+ * signal generator can gently sweep the frequency between samples without
+ * recalculating the dds parameters. This gives us a very efficient and
+ * pretty good interpolation filter. */
+static double modulate_block(station_t *st, uint32_t *lastwritepos,
+			     double lastfreq, const float *samples, size_t len)
+{
+	uint32_t lwp = *lastwritepos, wp = st->writepos;
 	double freq;
-	double lastfreq = carrier_freq;
-	int16_t audio_buf[AUDIO_BUF_SIZE];
-	uint32_t lastwritepos = writepos;
-	double sample;
-	double rds_samples[AUDIO_BUF_SIZE];
+	size_t i;
 
-	while (!do_exit) {
-		len = writelen(AUDIO_BUF_SIZE);
-		if (len > 1) {
-			len = fread(audio_buf, 2, len, file);
+	for (i = 0; i < len; i++) {
+		freq = samples[i] * st->delta_freq + st->carrier_freq;
+
+		st->slopebuf[lwp] = (freq - lastfreq) / st->carrier_per_signal;
+		st->freqbuf[wp] = freq;
+
+		lastfreq = freq;
+		lwp = wp;
+		wp = (wp + 1) & BUFFER_SAMPLES_MASK;
+	}
 
-			if (len == 0)
-				do_exit = 1;
+	*lastwritepos = lwp;
+	st->writepos = wp;
 
-			if (use_rds)
-				get_rds_samples(rds_samples, len);
+	return lastfreq;
+}
+
+void fm_modulator_mono(station_t *st)
+{
+	unsigned int i;
+	size_t len, req;
+	double lastfreq = st->carrier_freq;
+	float audio_buf[AUDIO_BUF_SIZE];
+	uint32_t lastwritepos = st->writepos;
+	float rds_samples[AUDIO_BUF_SIZE];
+	int ended = 0;
 
-			for (i = 0; i < len; i++) {
-				sample = audio_buf[i] / 32767.0;
+	while (!do_exit) {
+		req = writelen(st, AUDIO_BUF_SIZE);
+		if (req > 1) {
+			len = ended ? 0 : audio_ingest_read_float(st->ingest,
+								  audio_buf, req);
+
+			if (len == 0) {
+				if (!ended)
+					station_ended(st);
+				ended = 1;
+
+				memset(audio_buf, 0, req * sizeof(float));
+				len = req;
+			}
 
-				if (use_rds) {
-					sample *= 4;
-					sample += rds_samples[i];
-					sample /= 5;
-				}
+			if (st->rds) {
+				rds_get_samples(st->rds, rds_samples, len);
 
-				/* Modulate and buffer the sample */
-				lastfreq = modulate_sample(lastwritepos, lastfreq, sample);
-				lastwritepos = writepos++;
-				writepos %= BUFFER_SAMPLES;
+				for (i = 0; i < len; i++)
+					audio_buf[i] = (audio_buf[i] * 4 +
+							rds_samples[i]) / 5;
 			}
+
+			/* Modulate and buffer the samples */
+			lastfreq = modulate_block(st, &lastwritepos, lastfreq,
+						  audio_buf, len);
 		} else {
-			pthread_cond_wait(&fm_cond, &fm_mutex);
+			wait_room(st);
 		}
 	}
 }
 
-void fm_modulator_stereo(int use_rds)
+void fm_modulator_stereo(station_t *st)
 {
-	unsigned int i;
-	size_t len, sample_cnt;
-	double freq;
-	double lastfreq = carrier_freq;
+	size_t len, req, sample_cnt;
+	double lastfreq = st->carrier_freq;
 	int16_t audio_buf[AUDIO_BUF_SIZE];
-	uint32_t lastwritepos = writepos;
+	uint32_t lastwritepos = st->writepos;
+	int ended = 0;
 
-	dds_t pilot, stereo;
-	double L, R, LpR, LmR, sample;
-	double rds_samples[AUDIO_BUF_SIZE];
+	fm_mpx_t mpx;
+	float mpx_samples[AUDIO_BUF_SIZE / 2];
+	float rds_samples[AUDIO_BUF_SIZE / 2];
 
 	/* Prepare stereo carriers */
-	pilot = dds_init(input_freq, PILOT_FREQ, 0);
-	stereo = dds_init(input_freq, STEREO_CARRIER, 0);
+	fm_mpx_init(&mpx, st->input_freq, PILOT_FREQ, st->rds != NULL);
 
 	while (!do_exit) {
-		len = writelen(AUDIO_BUF_SIZE);
-		if (len > 1 && !(len % 2)) {
-			len = fread(audio_buf, 2, len, file);
-
-			if (len == 0)
-				do_exit = 1;
+		req = writelen(st, AUDIO_BUF_SIZE);
+		if (req > 1 && !(req % 2)) {
+			len = ended ? 0 : audio_ingest_read(st->ingest,
+							    audio_buf, req);
+
+			if (len == 0) {
+				if (!ended)
+					station_ended(st);
+				ended = 1;
+
+				memset(audio_buf, 0, req * sizeof(int16_t));
+				len = req;
+			}
 
 			/* stereo => two audio samples per baseband sample */
 			sample_cnt = len/2;
 
-			if (use_rds)
-				get_rds_samples(rds_samples, sample_cnt);
-
-			for (i = 0; i < sample_cnt; i++) {
-				/* Get samples for both channels, and calculate the 
-				* mono (L+R) and the difference signal used to recreate
-				* the stereo data (L-R). */
-				L = audio_buf[i*2] / 32767.0;
-				R = audio_buf[i*2+1] / 32767.0;
-				LpR = (L + R) / 2;
-				LmR = (L - R) / 2;
-
-				/* Create a composite sample consisting of the mono
-				* signal at baseband, a 19kHz pilot and a the difference
-				* signal DSB-SC modulated on a 38kHz carrier */
-				sample = 4.05 * LpR;					/* Mono signal */
-				sample += 0.9 * (dds_real(&pilot)/127.0);		/* Pilot */
-				sample += 4.05 * LmR * (dds_real(&stereo)/127.0);	/* DSB-SC stereo */
-
-				if (use_rds) {
-					/* add RDS signal */
-					sample += rds_samples[i];
-
-					/* Normalize so we get the signal within [-1, 1] */
-					sample /= 10;
-				} else {
-					sample /= 9;
-				}
-
-				lastfreq = modulate_sample(lastwritepos, lastfreq, sample);
-
-				lastwritepos = writepos++;
-				writepos %= BUFFER_SAMPLES;
-			}
+			if (st->rds)
+				rds_get_samples(st->rds, rds_samples, sample_cnt);
+
+			/* Create composite samples consisting of the mono
+			 * signal (L+R) at baseband, a 19kHz pilot and the
+			 * difference signal (L-R) DSB-SC modulated on a 38kHz
+			 * carrier, plus the RDS signal */
+			fm_mpx_stereo(&mpx, audio_buf,
+				      st->rds ? rds_samples : NULL,
+				      mpx_samples, sample_cnt);
+
+			lastfreq = modulate_block(st, &lastwritepos, lastfreq,
+						  mpx_samples, sample_cnt);
 		} else {
-			pthread_cond_wait(&fm_cond, &fm_mutex);
+			wait_room(st);
 		}
 	}
 }
 
-void fl2k_callback(fl2k_data_info_t *data_info)
+static void *station_worker(void *arg)
 {
-	if (data_info->device_error) {
-		fprintf(stderr, "Device error, exiting.\n");
-		do_exit = 1;
-		pthread_cond_signal(&fm_cond);
+	station_t *st = (station_t *)arg;
+
+	if (st->stereo_flag)
+		fm_modulator_stereo(st);
+	else
+		fm_modulator_mono(st);
+
+	return NULL;
+}
+
+/* Parse a station given as comma separated keys with their values. The
+ * value of rt extends to the end, so the radio text can contain
+ * commas. */
+static int parse_station(station_t *st, char *spec)
+{
+	char *key, *val, *next;
+
+	for (key = spec; key && *key; key = next) {
+		if (!strncmp(key, "rt=", 3)) {
+			st->rt = key + 3;
+			break;
+		}
+
+		next = strchr(key, ',');
+		if (next)
+			*next++ = '\0';
+
+		val = strchr(key, '=');
+		if (val)
+			*val++ = '\0';
+
+		if (!strcmp(key, "stereo") && !val) {
+			st->stereo_flag = 1;
+		} else if (!strcmp(key, "rds") && !val) {
+			st->rds_flag = 1;
+		} else if (!val) {
+			return -1;
+		} else if (!strcmp(key, "file")) {
+			st->filename = val;
+		} else if (!strcmp(key, "carrier")) {
+			st->carrier_freq = (int)atof(val);
+		} else if (!strcmp(key, "deviation")) {
+			st->delta_freq = (int)atof(val);
+		} else if (!strcmp(key, "rate")) {
+			st->input_freq = (int)atof(val);
+			st->input_freq_specified = 1;
+		} else if (!strcmp(key, "channel")) {
+			if (!strcmp(val, "r"))
+				st->channel = 0;
+			else if (!strcmp(val, "g"))
+				st->channel = 1;
+			else if (!strcmp(val, "b"))
+				st->channel = 2;
+			else
+				return -1;
+		} else if (!strcmp(key, "pi")) {
+			st->pi = (uint16_t)strtoul(val, NULL, 16);
+		} else if (!strcmp(key, "ps")) {
+			st->ps = val;
+		} else {
+			return -1;
+		}
+	}
+
+	return st->filename ? 0 : -1;
+}
+
+/* check the parameters of a station and open its input */
+static int station_setup(station_t *st, int stdin_used)
+{
+	if (st->rds_flag && st->input_freq_specified) {
+		if (st->input_freq != RDS_MODULATOR_RATE) {
+			fprintf(stderr, "RDS modulator only works with "
+					"228 kHz audio sample rate!\n");
+			return -1;
+		}
+	} else if (st->rds_flag && !st->input_freq_specified) {
+		st->input_freq = RDS_MODULATOR_RATE;
+	}
+
+	if (st->stereo_flag && st->input_freq < (RDS_MODULATOR_RATE/2)) {
+		fprintf(stderr, "Audio sample rate needs to be at least "
+				"114 kHz for stereo FM!\n");
+		return -1;
+	}
+
+	if (strcmp(st->filename, "-") == 0) { /* Read samples from stdin */
+		if (stdin_used) {
+			fprintf(stderr, "Only one station can read from "
+					"stdin!\n");
+			return -1;
+		}
+
+		st->file = stdin;
+#ifdef _WIN32
+		_setmode(_fileno(stdin), _O_BINARY);
+#endif
+	} else {
+		st->file = fopen(st->filename, "rb");
+		if (!st->file) {
+			fprintf(stderr, "Failed to open %s\n", st->filename);
+			return -1;
+		}
+	}
+
+	/* start reading ahead while we set up the device, a live input
+	 * needs room for more than the audio kept buffered */
+	st->live_samples = (size_t)live_ms * st->input_freq / 1000 *
+			   (st->stereo_flag ? 2 : 1);
+	st->ingest = audio_ingest_start(st->file,
+					(uint32_t)(st->live_samples * 2 * 4));
+	if (!st->ingest) {
+		fprintf(stderr, "Failed to start audio input!\n");
+		return -1;
+	}
+
+	/* Decoded audio */
+	st->freqbuf = malloc(BUFFER_SAMPLES * sizeof(double));
+	st->slopebuf = malloc(BUFFER_SAMPLES * sizeof(double));
+	if (!st->freqbuf || !st->slopebuf) {
+		fprintf(stderr, "malloc error!\n");
+		return -1;
+	}
+	st->readpos = 0;
+	st->writepos = 1;
+
+	if (st->rds_flag) {
+		st->rds = rds_encoder_create();
+		if (!st->rds) {
+			fprintf(stderr, "malloc error!\n");
+			return -1;
+		}
+
+		/* Set RDS parameters */
+		rds_set_pi(st->rds, st->pi);
+		rds_set_ps(st->rds, st->ps);
+		rds_set_rt(st->rds, st->rt);
+
+		if (!st->stereo_flag)
+			fprintf(stderr, "Warning: RDS with mono (without 19 kHz pilot"
+					" tone) doesn't work with all receivers!\n");
 	}
 
-	pthread_cond_signal(&cb_cond);
+	pthread_cond_init(&st->cond, NULL);
 
-	data_info->sampletype_signed = 1;
-	data_info->r_buf = (char *)txbuf;
+	return 0;
+}
+
+static void station_cleanup(station_t *st)
+{
+	audio_ingest_stop(st->ingest);
+
+	if (st->file && st->file != stdin)
+		fclose(st->file);
+
+	free(st->freqbuf);
+	free(st->slopebuf);
+
+	if (st->rds)
+		rds_encoder_destroy(st->rds);
 }
 
 int main(int argc, char **argv)
 {
-	int r, opt;
+	int r, opt, i, c;
 	uint32_t buf_num = 0;
-	int dev_index = 0;
+	const char *dev_name = "0";
+	int usb_cpu = -1, sample_cpu = -1, rt_prio = 0;
 	pthread_attr_t attr;
-	char *filename = NULL;
 	int option_index = 0;
-	int input_freq_specified = 0;
+	int stdin_used = 0, started = 0;
+	char *specs[MAX_STATIONS];
+	int num_specs = 0;
 
 #ifndef _WIN32
 	struct sigaction sigact, sigign;
@@ -446,13 +767,21 @@ int main(int argc, char **argv)
 
 	static struct option long_options[] =
 	{
-		{"stereo", no_argument, &stereo_flag, 1},
-		{"rds",    no_argument, &rds_flag,    1},
+		{"stereo", no_argument, &defaults.stereo_flag, 1},
+		{"rds",    no_argument, &defaults.rds_flag,    1},
 		{0, 0, 0, 0}
 	};
 
+	defaults.delta_freq = 75000;
+	defaults.carrier_freq = 97000000;
+	defaults.input_freq = 44100;
+	defaults.pi = 0x0dac;
+	defaults.ps = "fl2k_fm";
+	defaults.rt = "VGA FM transmitter";
+	defaults.channel = -1;
+
 	while (1) {
-		opt = getopt_long(argc, argv, "d:c:f:i:s:", long_options, &option_index);
+		opt = getopt_long(argc, argv, "d:c:f:i:s:t:A:P:r:S:", long_options, &option_index);
 
 		/* end of options reached */
 		if (opt == -1)
@@ -462,111 +791,171 @@ int main(int argc, char **argv)
 		case 0:
 			break;
 		case 'd':
-			dev_index = (uint32_t)atoi(optarg);
+			/* an index, a USB path or a serial number */
+			dev_name = optarg;
 			break;
 		case 'c':
-			carrier_freq = (uint32_t)atof(optarg);
+			defaults.carrier_freq = (uint32_t)atof(optarg);
 			break;
 		case 'f':
-			delta_freq = (uint32_t)atof(optarg);
+			defaults.delta_freq = (uint32_t)atof(optarg);
 			break;
 		case 'i':
-			input_freq = (uint32_t)atof(optarg);
-			input_freq_specified = 1;
+			defaults.input_freq = (uint32_t)atof(optarg);
+			defaults.input_freq_specified = 1;
 			break;
 		case 's':
 			samp_rate = (uint32_t)atof(optarg);
 			break;
+		case 't':
+			fm_threads = atoi(optarg);
+			break;
+		case 'A':
+			if (sscanf(optarg, "%d,%d", &usb_cpu, &sample_cpu) < 1)
+				usage();
+			break;
+		case 'P':
+			rt_prio = atoi(optarg);
+			break;
+		case 'r':
+			live_ms = atoi(optarg);
+			if (live_ms <= 0)
+				usage();
+			break;
+		case 'S':
+			if (num_specs == MAX_STATIONS) {
+				fprintf(stderr, "At most %d stations are "
+						"supported!\n", MAX_STATIONS);
+				exit(1);
+			}
+			specs[num_specs++] = optarg;
+			break;
 		default:
 			usage();
 			break;
 		}
 	}
 
-	if (argc <= optind) {
+	/* either a single station from the options, or the stations
+	 * given with -S */
+	if (num_specs) {
+		if (argc > optind)
+			usage();
+
+		for (i = 0; i < num_specs; i++) {
+			stations[i] = defaults;
+			stations[i].pi = defaults.pi + i;
+			if (parse_station(&stations[i], specs[i]) < 0) {
+				fprintf(stderr, "Invalid station %s\n",
+					specs[i]);
+				exit(1);
+			}
+		}
+
+		num_stations = num_specs;
+	} else if (argc <= optind) {
 		usage();
 	} else {
-		filename = argv[optind];
+		stations[0] = defaults;
+		stations[0].filename = argv[optind];
+		num_stations = 1;
 	}
 
-	if (dev_index < 0) {
-		exit(1);
-	}
 
-	if (rds_flag && input_freq_specified) {
-		if (input_freq != RDS_MODULATOR_RATE) {
-			fprintf(stderr, "RDS modulator only works with "
-					"228 kHz audio sample rate!\n");
-			exit(1);
-		}
-	} else if (rds_flag && !input_freq_specified) {
-		input_freq = RDS_MODULATOR_RATE;
-	}
+	for (i = 0; i < num_stations; i++) {
+		if (stations[i].channel < 0)
+			stations[i].channel = i % 3;
 
-	if (stereo_flag && input_freq < (RDS_MODULATOR_RATE/2)) {
-		fprintf(stderr, "Audio sample rate needs to be at least "
-				"114 kHz for stereo FM!\n");
-		exit(1);
+		c = stations[i].channel;
+		chan_stations[c][chan_num[c]++] = i;
 	}
 
+	for (i = 0; i < num_stations; i++) {
+		if (station_setup(&stations[i], stdin_used) < 0)
+			exit(1);
 
-	if (strcmp(filename, "-") == 0) { /* Read samples from stdin */
-		file = stdin;
-#ifdef _WIN32
-		_setmode(_fileno(stdin), _O_BINARY);
-#endif
-	} else {
-		file = fopen(filename, "rb");
-		if (!file) {
-			fprintf(stderr, "Failed to open %s\n", filename);
-			return -ENOENT;
-		}
+		if (stations[i].file == stdin)
+			stdin_used = 1;
 	}
 
-	/* allocate buffer */
-	buf1 = malloc(FL2K_BUF_LEN);
-	buf2 = malloc(FL2K_BUF_LEN);
-	if (!buf1 || !buf2) {
-		fprintf(stderr, "malloc error!\n");
-		exit(1);
+	fprintf(stderr, "Samplerate:\t%3.2f MHz\n", (double)samp_rate/1000000);
+	for (i = 0; i < num_stations; i++) {
+		if (num_stations > 1)
+			fprintf(stderr, "Station %d:\t%s on %c\n", i,
+				stations[i].filename, "RGB"[stations[i].channel]);
+
+		fprintf(stderr, "Carrier:\t%3.2f MHz\n",
+			(double)stations[i].carrier_freq/1000000);
+		fprintf(stderr, "Frequencies:\t%3.2f MHz, %3.2f MHz\n",
+			(double)((samp_rate - stations[i].carrier_freq) / 1000000.0),
+			(double)((samp_rate + stations[i].carrier_freq) / 1000000.0));
 	}
 
-	fmbuf = buf1;
-	txbuf = buf2;
-
-	/* Decoded audio */
-	freqbuf = malloc(BUFFER_SAMPLES * sizeof(double));
-	slopebuf = malloc(BUFFER_SAMPLES * sizeof(double));
-	readpos = 0;
-	writepos = 1;
-
-	fprintf(stderr, "Samplerate:\t%3.2f MHz\n", (double)samp_rate/1000000);
-	fprintf(stderr, "Carrier:\t%3.2f MHz\n", (double)carrier_freq/1000000);
-	fprintf(stderr, "Frequencies:\t%3.2f MHz, %3.2f MHz\n", 
-					(double)((samp_rate - carrier_freq) / 1000000.0),
-					(double)((samp_rate + carrier_freq) / 1000000.0));
+	for (c = 0; c < 3; c++) {
+		if (chan_num[c] > 1)
+			fprintf(stderr, "%c:\t\t%d stations, each at 1/%d of "
+					"the amplitude\n", "RGB"[c], chan_num[c],
+					chan_num[c]);
+	}
 
-	pthread_mutex_init(&cb_mutex, NULL);
 	pthread_mutex_init(&fm_mutex, NULL);
-	pthread_cond_init(&cb_cond, NULL);
-	pthread_cond_init(&fm_cond, NULL);
 	pthread_attr_init(&attr);
 
-	fl2k_open(&dev, (uint32_t)dev_index);
+	fl2k_open_by_name(&dev, dev_name);
 	if (NULL == dev) {
-		fprintf(stderr, "Failed to open fl2k device #%d.\n", dev_index);
+		fprintf(stderr, "Failed to open fl2k device %s.\n", dev_name);
 		goto out;
 	}
 
-	r = pthread_create(&fm_thread, &attr, fm_worker, NULL);
+	/* pin and prioritize the workers, this only prints a warning
+	 * if we lack the privileges */
+	fl2k_set_thread_config(dev, FL2K_THREAD_USB, usb_cpu, rt_prio);
+	fl2k_set_thread_config(dev, FL2K_THREAD_SAMPLE, sample_cpu, rt_prio);
+	if (rt_prio > 0)
+		fl2k_set_mlock(dev, 1);
+
+	/* use the buffer configuration measured by fl2k_test -R, if there
+	 * is one, the buffer length doesn't matter when writing samples */
+	fl2k_apply_default_profile(dev, 0);
+
+	/* allocate buffer, on the NUMA node of the device */
+	for (i = 0; i < 2; i++) {
+		fmbuf[i] = fl2k_alloc_buffer(dev, (size_t)FL2K_BUF_LEN *
+					     num_stations, FL2K_ALLOC_HUGEPAGE |
+					     FL2K_ALLOC_NUMA);
+		if (!fmbuf[i]) {
+			fprintf(stderr, "malloc error!\n");
+			goto out;
+		}
+
+		for (c = 0; c < 3; c++) {
+			if (chan_num[c] < 2)
+				continue;
+
+			chanbuf[i][c] = fl2k_alloc_buffer(dev, FL2K_BUF_LEN,
+							  FL2K_ALLOC_NUMA);
+			if (!chanbuf[i][c]) {
+				fprintf(stderr, "malloc error!\n");
+				goto out;
+			}
+		}
+	}
+
+	if (live_ms) {
+		fprintf(stderr, "Buffering %d ms of the live input...\n", live_ms);
+		for (i = 0; i < num_stations; i++) {
+			rate_adapt_init(&stations[i].adapt, live_ms / 1000.0);
+			audio_ingest_wait(stations[i].ingest,
+					  stations[i].live_samples);
+		}
+	}
+
+	r = fl2k_start_tx_write(dev, 1, 0);
 	if (r < 0) {
-		fprintf(stderr, "Error spawning FM worker thread!\n");
+		fprintf(stderr, "Failed to start transmission!\n");
 		goto out;
 	}
 
-	pthread_attr_destroy(&attr);
-	r = fl2k_start_tx(dev, fl2k_callback, NULL, 0);
-
 	/* Set the sample rate */
 	r = fl2k_set_sample_rate(dev, samp_rate);
 	if (r < 0)
@@ -574,14 +963,23 @@ int main(int argc, char **argv)
 
 	/* read back actual frequency */
 	samp_rate = fl2k_get_sample_rate(dev);
+	exact_rate = fl2k_get_exact_sample_rate(dev);
 
 	/* Calculate needed constants */
-	carrier_per_signal = samp_rate / input_freq;
+	for (i = 0; i < num_stations; i++) {
+		stations[i].carrier_per_signal = samp_rate /
+						 stations[i].input_freq;
+		stations[i].exact_per_signal = exact_rate /
+					       stations[i].input_freq;
+	}
 
-	/* Set RDS parameters */
-	set_rds_pi(0x0dac);
-	set_rds_ps("fl2k_fm");
-	set_rds_rt("VGA FM transmitter");
+	/* the FM worker needs the actual sample rate, so start it now */
+	r = pthread_create(&fm_thread, &attr, fm_worker, NULL);
+	pthread_attr_destroy(&attr);
+	if (r != 0) {
+		fprintf(stderr, "Error spawning FM worker thread!\n");
+		goto out;
+	}
 
 #ifndef _WIN32
 	sigact.sa_handler = sighandler;
@@ -596,26 +994,36 @@ int main(int argc, char **argv)
 	SetConsoleCtrlHandler( (PHANDLER_ROUTINE) sighandler, TRUE );
 #endif
 
-	if (stereo_flag) {
-		fm_modulator_stereo(rds_flag);
-	} else {
-		if (rds_flag)
-			fprintf(stderr, "Warning: RDS with mono (without 19 kHz pilot"
-					" tone) doesn't work with all receivers!\n");
-
-		fm_modulator_mono(rds_flag);
+	for (started = 0; started < num_stations; started++) {
+		r = pthread_create(&stations[started].thread, NULL,
+				   station_worker, &stations[started]);
+		if (r != 0) {
+			fprintf(stderr, "Error spawning modulator thread!\n");
+			do_exit = 1;
+			wake_stations();
+			break;
+		}
 	}
 
+	for (i = 0; i < started; i++)
+		pthread_join(stations[i].thread, NULL);
+
+	/* end of input, stop the FM worker blocked in fl2k_write_samples() */
+	do_exit = 1;
+	fl2k_stop_tx(dev);
+	pthread_join(fm_thread, NULL);
+
 out:
 	fl2k_close(dev);
 
-	if (file != stdin)
-		fclose(file);
+	for (i = 0; i < num_stations; i++)
+		station_cleanup(&stations[i]);
 
-	free(freqbuf);
-	free(slopebuf);
-	free(buf1);
-	free(buf2);
+	for (i = 0; i < 2; i++) {
+		fl2k_free_buffer(fmbuf[i]);
+		for (c = 0; c < 3; c++)
+			fl2k_free_buffer(chanbuf[i][c]);
+	}
 
 	return 0;
 }
@@ -0,0 +1,408 @@
+/*
+ * osmo-fl2k, turns FL2000-based USB 3.0 to VGA adapters into
+ * low cost DACs
+ *
+ * Copyright (C) 2016-2020 by Steve Markgraf <steve@steve-m.de>
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "fl2k_null.h"
+#include "fl2k_stats.h"
+
+/* enough for all registers the library uses */
+#define NULL_NUM_REGS		32
+
+/* upper limit of a single wait, so *completed is checked regularly */
+#define NULL_MAX_WAIT_NS	100000000ULL
+
+/* I2C control register, and its status bits */
+#define NULL_I2C_REG		0x8020
+#define NULL_I2C_DONE		(1U << 31)
+#define NULL_I2C_ERR		(0x0fU << 24)
+
+typedef struct null_fifo {
+	struct libusb_transfer **xfer;
+	uint64_t *deadline;		/* of the completion */
+	uint32_t len;
+	uint32_t size;
+} null_fifo_t;
+
+struct fl2k_null {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;		/* a transfer was submitted or cancelled */
+	null_fifo_t pending;		/* in the order of submission */
+	null_fifo_t cancelled;
+	uint64_t next_free;		/* the DACs are done with all pending ones */
+	double rate;
+
+	uint16_t reg_addr[NULL_NUM_REGS];
+	uint32_t reg_val[NULL_NUM_REGS];
+	uint32_t num_regs;
+
+	FILE *sink;
+};
+
+uint32_t fl2k_null_device_count(void)
+{
+	const char *env = getenv("FL2K_NULL_DEVICE");
+	char *end;
+	unsigned long n;
+
+	if (!env || !*env)
+		return 0;
+
+	/* anything but a number enables a single device */
+	n = strtoul(env, &end, 10);
+	if (*end)
+		return 1;
+
+	return (uint32_t)n;
+}
+
+fl2k_null_t *fl2k_null_open(uint32_t index)
+{
+	fl2k_null_t *null;
+	const char *sink = getenv("FL2K_NULL_SINK");
+	char name[1024];
+
+	if (index >= fl2k_null_device_count())
+		return NULL;
+
+	null = calloc(1, sizeof(fl2k_null_t));
+	if (!null)
+		return NULL;
+
+	pthread_mutex_init(&null->mutex, NULL);
+	pthread_cond_init(&null->cond, NULL);
+
+	if (sink && *sink) {
+		if (!index && !strcmp(sink, "-")) {
+			null->sink = stdout;
+		} else {
+			if (index)
+				snprintf(name, sizeof(name), "%s.%u", sink, index);
+			else
+				snprintf(name, sizeof(name), "%s", sink);
+
+			null->sink = fopen(name, "wb");
+			if (!null->sink)
+				fprintf(stderr, "WARNING: Failed to open null "
+						"device sink %s\n", name);
+		}
+	}
+
+	fprintf(stderr, "Using null device #%u\n", index);
+
+	return null;
+}
+
+void fl2k_null_close(fl2k_null_t *null)
+{
+	if (!null)
+		return;
+
+	if (null->sink && null->sink != stdout)
+		fclose(null->sink);
+	else if (null->sink)
+		fflush(null->sink);
+
+	pthread_mutex_destroy(&null->mutex);
+	pthread_cond_destroy(&null->cond);
+	free(null->pending.xfer);
+	free(null->pending.deadline);
+	free(null->cancelled.xfer);
+	free(null->cancelled.deadline);
+	free(null);
+}
+
+static uint32_t *null_reg(fl2k_null_t *null, uint16_t addr, int create)
+{
+	uint32_t i;
+
+	for (i = 0; i < null->num_regs; i++) {
+		if (null->reg_addr[i] == addr)
+			return &null->reg_val[i];
+	}
+
+	if (!create || null->num_regs == NULL_NUM_REGS)
+		return NULL;
+
+	null->reg_addr[null->num_regs] = addr;
+	null->reg_val[null->num_regs] = 0;
+
+	return &null->reg_val[null->num_regs++];
+}
+
+int fl2k_null_control(fl2k_null_t *null, uint8_t request_type,
+		      uint16_t index, unsigned char *data, uint16_t len)
+{
+	uint32_t *reg, val = 0;
+
+	if (!null || !data || len < 4)
+		return LIBUSB_ERROR_IO;
+
+	pthread_mutex_lock(&null->mutex);
+
+	if (request_type & LIBUSB_ENDPOINT_IN) {
+		reg = null_reg(null, index, 0);
+		if (reg)
+			val = *reg;
+
+		data[0] = val & 0xff;
+		data[1] = (val >> 8) & 0xff;
+		data[2] = (val >> 16) & 0xff;
+		data[3] = (val >> 24) & 0xff;
+	} else {
+		val = (data[3] << 24) | (data[2] << 16) | (data[1] << 8) |
+		      data[0];
+
+		/* every I2C access completes at once and is acknowledged */
+		if (NULL_I2C_REG == index)
+			val = (val | NULL_I2C_DONE) & ~NULL_I2C_ERR;
+
+		reg = null_reg(null, index, 1);
+		if (reg)
+			*reg = val;
+	}
+
+	pthread_mutex_unlock(&null->mutex);
+
+	return 4;
+}
+
+static int null_fifo_push(null_fifo_t *fifo, struct libusb_transfer *xfer,
+			  uint64_t deadline)
+{
+	struct libusb_transfer **x;
+	uint64_t *d;
+	uint32_t size;
+
+	if (fifo->len == fifo->size) {
+		size = fifo->size ? fifo->size * 2 : 16;
+
+		x = realloc(fifo->xfer, size * sizeof(*x));
+		if (!x)
+			return LIBUSB_ERROR_IO;
+		fifo->xfer = x;
+
+		d = realloc(fifo->deadline, size * sizeof(*d));
+		if (!d)
+			return LIBUSB_ERROR_IO;
+		fifo->deadline = d;
+
+		fifo->size = size;
+	}
+
+	fifo->xfer[fifo->len] = xfer;
+	fifo->deadline[fifo->len] = deadline;
+	fifo->len++;
+
+	return 0;
+}
+
+static struct libusb_transfer *null_fifo_remove(null_fifo_t *fifo, uint32_t i)
+{
+	struct libusb_transfer *xfer = fifo->xfer[i];
+
+	fifo->len--;
+	memmove(&fifo->xfer[i], &fifo->xfer[i + 1],
+		(fifo->len - i) * sizeof(*fifo->xfer));
+	memmove(&fifo->deadline[i], &fifo->deadline[i + 1],
+		(fifo->len - i) * sizeof(*fifo->deadline));
+
+	return xfer;
+}
+
+static uint64_t null_duration(fl2k_null_t *null, struct libusb_transfer *xfer)
+{
+	return (uint64_t)((xfer->length / 3) * 1e9 / null->rate);
+}
+
+void fl2k_null_set_rate(fl2k_null_t *null, double rate)
+{
+	null_fifo_t *p;
+	uint64_t now = fl2k_time_ns(), t = now;
+	uint32_t i = 0;
+
+	if (!null || rate <= 0)
+		return;
+
+	p = &null->pending;
+	pthread_mutex_lock(&null->mutex);
+
+	/* the rest of the transfer being output takes longer or shorter,
+	 * the following ones are rescheduled */
+	if (p->len && p->deadline[0] > now && null->rate > 0) {
+		t = now + (uint64_t)((p->deadline[0] - now) * null->rate / rate);
+		p->deadline[i++] = t;
+	}
+
+	null->rate = rate;
+
+	for (; i < p->len; i++) {
+		t += null_duration(null, p->xfer[i]);
+		p->deadline[i] = t;
+	}
+
+	null->next_free = t;
+	pthread_cond_signal(&null->cond);
+	pthread_mutex_unlock(&null->mutex);
+}
+
+int fl2k_null_submit(fl2k_null_t *null, struct libusb_transfer *xfer)
+{
+	uint64_t now = fl2k_time_ns();
+	int r;
+
+	if (!null || !xfer || null->rate <= 0)
+		return LIBUSB_ERROR_IO;
+
+	pthread_mutex_lock(&null->mutex);
+
+	/* the DACs output the transfers back to back, starting over if
+	 * they ran out of them */
+	if (null->next_free < now)
+		null->next_free = now;
+
+	null->next_free += null_duration(null, xfer);
+
+	r = null_fifo_push(&null->pending, xfer, null->next_free);
+	if (!r)
+		pthread_cond_signal(&null->cond);
+
+	pthread_mutex_unlock(&null->mutex);
+
+	return r;
+}
+
+int fl2k_null_cancel(fl2k_null_t *null, struct libusb_transfer *xfer)
+{
+	uint32_t i;
+	int r = LIBUSB_ERROR_NOT_FOUND;
+
+	if (!null)
+		return r;
+
+	pthread_mutex_lock(&null->mutex);
+
+	for (i = 0; i < null->pending.len; i++) {
+		if (null->pending.xfer[i] != xfer)
+			continue;
+
+		null_fifo_remove(&null->pending, i);
+		r = null_fifo_push(&null->cancelled, xfer, 0);
+		pthread_cond_signal(&null->cond);
+		break;
+	}
+
+	pthread_mutex_unlock(&null->mutex);
+
+	return r;
+}
+
+static void null_wait(fl2k_null_t *null, uint64_t ns)
+{
+	struct timespec ts;
+
+#ifndef _WIN32
+	clock_gettime(CLOCK_REALTIME, &ts);
+#else
+	timespec_get(&ts, TIME_UTC);
+#endif
+	ts.tv_sec += ns / 1000000000ULL;
+	ts.tv_nsec += ns % 1000000000ULL;
+
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	pthread_cond_timedwait(&null->cond, &null->mutex, &ts);
+}
+
+int fl2k_null_handle_events(fl2k_null_t *null, struct timeval *tv,
+			    int *completed)
+{
+	struct libusb_transfer *xfer;
+	uint64_t now, end, wake;
+	int status;
+
+	if (!null)
+		return LIBUSB_ERROR_IO;
+
+	end = fl2k_time_ns() + (uint64_t)tv->tv_sec * 1000000000ULL +
+	      (uint64_t)tv->tv_usec * 1000;
+
+	pthread_mutex_lock(&null->mutex);
+
+	while (!completed || !*completed) {
+		now = fl2k_time_ns();
+
+		if (null->cancelled.len) {
+			xfer = null_fifo_remove(&null->cancelled, 0);
+			status = LIBUSB_TRANSFER_CANCELLED;
+		} else if (null->pending.len &&
+			   null->pending.deadline[0] <= now) {
+			xfer = null_fifo_remove(&null->pending, 0);
+			status = LIBUSB_TRANSFER_COMPLETED;
+		} else {
+			if (now >= end)
+				break;
+
+			wake = end;
+			if (null->pending.len && null->pending.deadline[0] < wake)
+				wake = null->pending.deadline[0];
+			if (wake - now > NULL_MAX_WAIT_NS)
+				wake = now + NULL_MAX_WAIT_NS;
+
+			null_wait(null, wake - now);
+			continue;
+		}
+
+		/* the callback usually submits the next transfer */
+		pthread_mutex_unlock(&null->mutex);
+
+		xfer->status = status;
+		xfer->actual_length = 0;
+
+		if (LIBUSB_TRANSFER_COMPLETED == status) {
+			xfer->actual_length = xfer->length;
+
+			if (null->sink)
+				fwrite(xfer->buffer, 1, xfer->length, null->sink);
+		}
+
+		xfer->callback(xfer);
+
+		pthread_mutex_lock(&null->mutex);
+
+		/* like libusb, return once the events that are due have
+		 * been handled */
+		end = now;
+	}
+
+	pthread_mutex_unlock(&null->mutex);
+
+	return 0;
+}
@@ -0,0 +1,359 @@
+/*
+ * osmo-fl2k, turns FL2000-based USB 3.0 to VGA adapters into
+ * low cost DACs
+ *
+ * Copyright (C) 2016-2020 by Steve Markgraf <steve@steve-m.de>
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "fl2k_stats.h"
+
+/* The clock of the FL2000 is usually off by a lot when it is started,
+ * typically by more than twice its final error, as Kyle Keen found, so
+ * the completions of the first second are not used for the rate */
+#define FL2K_RATE_SETTLE_NS	1000000000ULL
+
+/* time constant of the recent rate, in s */
+#define FL2K_RATE_TAU		10.0
+
+/* minimum time covered by an estimate, in s */
+#define FL2K_RATE_MIN_TIME	1.0
+
+uint64_t fl2k_time_ns(void)
+{
+#ifndef _WIN32
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER cnt;
+
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+
+	QueryPerformanceCounter(&cnt);
+
+	return (uint64_t)((double)cnt.QuadPart * 1e9 / freq.QuadPart);
+#endif
+}
+
+static unsigned int fl2k_msb(uint64_t v)
+{
+#if defined(__GNUC__)
+	return 63 - __builtin_clzll(v);
+#else
+	unsigned int msb = 0;
+
+	while (v >>= 1)
+		msb++;
+
+	return msb;
+#endif
+}
+
+static unsigned int fl2k_hist_bucket(uint64_t v)
+{
+	unsigned int msb;
+
+	if (v < (1 << FL2K_HIST_SUB_BITS))
+		return (unsigned int)v;
+
+	msb = fl2k_msb(v);
+
+	return ((msb - FL2K_HIST_SUB_BITS + 1) << FL2K_HIST_SUB_BITS) +
+	       ((v >> (msb - FL2K_HIST_SUB_BITS)) &
+		((1 << FL2K_HIST_SUB_BITS) - 1));
+}
+
+/* center of the values falling into a bucket */
+static uint64_t fl2k_hist_value(unsigned int bucket)
+{
+	unsigned int shift;
+	uint64_t low;
+
+	if (bucket < (1 << FL2K_HIST_SUB_BITS))
+		return bucket;
+
+	shift = (bucket >> FL2K_HIST_SUB_BITS) - 1;
+	low = (uint64_t)((1 << FL2K_HIST_SUB_BITS) +
+			 (bucket & ((1 << FL2K_HIST_SUB_BITS) - 1))) << shift;
+
+	return low + ((1ULL << shift) >> 1);
+}
+
+static void fl2k_timing_add(fl2k_timing_t *t, uint64_t ns)
+{
+	if (!t->count || ns < t->min_ns)
+		t->min_ns = ns;
+
+	if (ns > t->max_ns)
+		t->max_ns = ns;
+
+	t->count++;
+	t->sum_ns += ns;
+	t->hist[fl2k_hist_bucket(ns)]++;
+}
+
+static uint64_t fl2k_timing_percentile(fl2k_timing_t *t, unsigned int pct)
+{
+	uint64_t target = (t->count * pct + 99) / 100;
+	uint64_t sum = 0, v;
+	unsigned int i;
+
+	for (i = 0; i < FL2K_HIST_BUCKETS; i++) {
+		sum += t->hist[i];
+
+		if (sum >= target)
+			break;
+	}
+
+	v = fl2k_hist_value(i);
+
+	/* stay within the measured range */
+	if (v < t->min_ns)
+		v = t->min_ns;
+	if (v > t->max_ns)
+		v = t->max_ns;
+
+	return v;
+}
+
+static void fl2k_timing_get(fl2k_timing_t *t, fl2k_timing_stats_t *out)
+{
+	memset(out, 0, sizeof(fl2k_timing_stats_t));
+
+	if (!t->count)
+		return;
+
+	out->count = t->count;
+	out->min_ns = t->min_ns;
+	out->avg_ns = t->sum_ns / t->count;
+	out->max_ns = t->max_ns;
+	out->p50_ns = fl2k_timing_percentile(t, 50);
+	out->p90_ns = fl2k_timing_percentile(t, 90);
+	out->p99_ns = fl2k_timing_percentile(t, 99);
+}
+
+void fl2k_stats_init(fl2k_stats_state_t *st)
+{
+	pthread_mutex_init(&st->mutex, NULL);
+	fl2k_stats_reset(st);
+}
+
+void fl2k_stats_destroy(fl2k_stats_state_t *st)
+{
+	pthread_mutex_destroy(&st->mutex);
+}
+
+void fl2k_stats_reset(fl2k_stats_state_t *st)
+{
+	pthread_mutex_lock(&st->mutex);
+	memset((char *)st + offsetof(fl2k_stats_state_t, callback), 0,
+	       sizeof(fl2k_stats_state_t) -
+	       offsetof(fl2k_stats_state_t, callback));
+	pthread_mutex_unlock(&st->mutex);
+}
+
+void fl2k_stats_sample(fl2k_stats_state_t *st, uint64_t callback_ns,
+		       uint64_t convert_ns)
+{
+	pthread_mutex_lock(&st->mutex);
+
+	if (callback_ns)
+		fl2k_timing_add(&st->callback, callback_ns);
+
+	if (convert_ns)
+		fl2k_timing_add(&st->convert, convert_ns);
+
+	pthread_mutex_unlock(&st->mutex);
+}
+
+/* Add a completion to the regression of the output samples over time.
+ * The USB completions jitter by some 100 us, which a least squares fit
+ * over many of them averages out. The weights of older completions
+ * decay exponentially, so the fit follows a drifting clock, and the
+ * weighted means and covariances are updated incrementally to stay
+ * numerically stable on long runs. */
+static void fl2k_rate_add(fl2k_stats_state_t *st, uint64_t t_ns,
+			  uint32_t samples)
+{
+	double t, s, dt, decay;
+
+	if (!st->rate_start_ns)
+		st->rate_start_ns = t_ns;
+
+	if (t_ns - st->rate_start_ns < FL2K_RATE_SETTLE_NS)
+		return;
+
+	if (!st->rate_t0_ns) {
+		st->rate_t0_ns = t_ns;
+		st->rate_last_ns = t_ns;
+		st->rate_w = 1;
+		return;
+	}
+
+	st->rate_samples += samples;
+
+	t = (t_ns - st->rate_t0_ns) * 1e-9;
+	s = (double)st->rate_samples;
+	/* close to exp(-dt / tau), as the completions are much closer
+	 * to each other than tau */
+	decay = FL2K_RATE_TAU / (FL2K_RATE_TAU +
+				 (t_ns - st->rate_last_ns) * 1e-9);
+	st->rate_last_ns = t_ns;
+
+	st->rate_w = st->rate_w * decay + 1;
+	st->rate_ctt *= decay;
+	st->rate_cts *= decay;
+
+	dt = t - st->rate_mt;
+	st->rate_mt += dt / st->rate_w;
+	st->rate_ms += (s - st->rate_ms) / st->rate_w;
+	st->rate_ctt += dt * (t - st->rate_mt);
+	st->rate_cts += dt * (s - st->rate_ms);
+}
+
+void fl2k_stats_completion(fl2k_stats_state_t *st, uint64_t start_ns,
+			   uint32_t samples, uint32_t depth, uint32_t bytes,
+			   int underflow)
+{
+	uint64_t now = fl2k_time_ns();
+
+	pthread_mutex_lock(&st->mutex);
+
+	fl2k_rate_add(st, start_ns, samples);
+
+	if (st->last_completion_ns)
+		fl2k_timing_add(&st->completion, start_ns - st->last_completion_ns);
+	st->last_completion_ns = start_ns;
+
+	if (!st->resubmit.count || depth < st->depth_min)
+		st->depth_min = depth;
+	if (depth > st->depth_max)
+		st->depth_max = depth;
+
+	st->depth = depth;
+	st->depth_sum += depth;
+	st->depth_hist[depth < FL2K_STATS_DEPTH_BINS ?
+		       depth : FL2K_STATS_DEPTH_BINS - 1]++;
+
+	fl2k_timing_add(&st->resubmit, now - start_ns);
+
+	if (bytes) {
+		st->bytes_submitted += bytes;
+		st->buffers_submitted++;
+	}
+
+	if (underflow) {
+		st->underflow_ts_ns[st->underflow_cnt % FL2K_STATS_UNDERFLOWS] =
+			start_ns;
+		st->underflow_cnt++;
+	}
+
+	pthread_mutex_unlock(&st->mutex);
+}
+
+void fl2k_stats_rate_reset(fl2k_stats_state_t *st)
+{
+	pthread_mutex_lock(&st->mutex);
+	memset((char *)st + offsetof(fl2k_stats_state_t, rate_start_ns), 0,
+	       sizeof(fl2k_stats_state_t) -
+	       offsetof(fl2k_stats_state_t, rate_start_ns));
+	pthread_mutex_unlock(&st->mutex);
+}
+
+int fl2k_stats_rate(fl2k_stats_state_t *st, double *rate, double *rate_total,
+		    double *seconds, uint64_t *samples)
+{
+	double t;
+	int r = -1;
+
+	pthread_mutex_lock(&st->mutex);
+
+	t = (st->rate_last_ns - st->rate_t0_ns) * 1e-9;
+
+	if (st->rate_t0_ns && t >= FL2K_RATE_MIN_TIME && st->rate_ctt > 0) {
+		*rate = st->rate_cts / st->rate_ctt;
+		*rate_total = st->rate_samples / t;
+		*seconds = t;
+		*samples = st->rate_samples;
+		r = 0;
+	}
+
+	pthread_mutex_unlock(&st->mutex);
+
+	return r;
+}
+
+void fl2k_stats_submitted(fl2k_stats_state_t *st, uint32_t bytes)
+{
+	pthread_mutex_lock(&st->mutex);
+	st->bytes_submitted += bytes;
+	st->buffers_submitted++;
+	pthread_mutex_unlock(&st->mutex);
+}
+
+void fl2k_stats_get(fl2k_stats_state_t *st, fl2k_stats_t *stats)
+{
+	uint32_t i, n, first;
+
+	memset(stats, 0, sizeof(fl2k_stats_t));
+
+	pthread_mutex_lock(&st->mutex);
+
+	fl2k_timing_get(&st->callback, &stats->callback);
+	fl2k_timing_get(&st->convert, &stats->convert);
+	fl2k_timing_get(&st->resubmit, &stats->resubmit);
+	fl2k_timing_get(&st->completion, &stats->completion);
+
+	stats->queue_depth = st->depth;
+	stats->queue_depth_min = st->depth_min;
+	stats->queue_depth_max = st->depth_max;
+	if (st->resubmit.count)
+		stats->queue_depth_avg = (double)st->depth_sum / st->resubmit.count;
+	memcpy(stats->queue_depth_hist, st->depth_hist, sizeof(st->depth_hist));
+
+	stats->bytes_submitted = st->bytes_submitted;
+	stats->buffers_submitted = st->buffers_submitted;
+
+	/* oldest logged underflow first */
+	stats->underflow_cnt = st->underflow_cnt;
+	n = st->underflow_cnt < FL2K_STATS_UNDERFLOWS ?
+	    st->underflow_cnt : FL2K_STATS_UNDERFLOWS;
+	first = st->underflow_cnt - n;
+
+	for (i = 0; i < n; i++)
+		stats->underflow_ts_ns[i] =
+			st->underflow_ts_ns[(first + i) % FL2K_STATS_UNDERFLOWS];
+	stats->underflow_log_len = n;
+
+	pthread_mutex_unlock(&st->mutex);
+
+	stats->now_ns = fl2k_time_ns();
+}
@@ -25,6 +25,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #ifndef _WIN32
 #include <unistd.h>
@@ -36,15 +37,20 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h> /* for TCP_NODELAY */
 #include <fcntl.h>
+#include <sys/mman.h>
 #define sleep_ms(ms)	usleep(ms*1000)
 #else
 #include <windows.h>
 #include <winsock2.h>
+#include <ws2tcpip.h>
 #include "getopt/getopt.h"
 #define sleep_ms(ms)	Sleep(ms)
 #endif
 
 #include "osmo-fl2k.h"
+#include "fl2k_ring.h"
+#include "fl2k_shm.h"
+#include "rate_adapt.h"
 
 #ifdef _WIN32
 #pragma comment(lib, "ws2_32.lib")
@@ -56,25 +62,127 @@ typedef int socklen_t;
 #define SOCKADDR struct sockaddr
 #define SOCKET int
 #define SOCKET_ERROR -1
+#define INVALID_SOCKET -1
 #endif
 
-static SOCKET s;
+#ifdef _WIN32
+#define sock_timed_out()	(WSAGetLastError() == WSAETIMEDOUT)
+#else
+#define sock_timed_out()	(errno == EAGAIN || errno == EWOULDBLOCK || \
+				 errno == EINTR)
+#endif
+
+#define MAX_CONNS	3
+
+/* the socket receive buffer we ask for, the kernel may limit it */
+#define SOCK_RCVBUF	(8 * 1024 * 1024)
+
+/* largest datagram of the UDP transport */
+#define UDP_MAX_PACKET	65536
+
+/* datagrams up to this far behind are late ones, a larger step back
+ * means the sender was restarted */
+#define UDP_REORDER_WINDOW	64
+
+/* the receive buffer level is reported this often, in s, when adapting
+ * to the sender's clock */
+#define ADAPT_REPORT_TIME	60
+
+#if defined(__linux__)
+#define HAVE_SHM
+#endif
+
+enum transport {
+	TRANSPORT_TCP,
+	TRANSPORT_UDP,
+	TRANSPORT_SHM,
+};
+
 static fl2k_dev_t *dev = NULL;
 static volatile int do_exit = 0;
-static volatile int connected = 0;
-static char *txbuf = NULL;
-static fd_set readfds;
-static SOCKET sock;
+
+/* The samples arrive in rings of buffer sized slots. With TCP, every
+ * channel has its own connection and ring, or a single one carries
+ * interleaved R, G, B. UDP and shared memory use a single ring whose
+ * slots hold the buffers of all channels. The rings of the sockets are
+ * filled by a thread per connection, the one in shared memory by
+ * another process. The callback only hands out the oldest slot of every
+ * ring and releases it on the next call, once the library is done with
+ * it. */
+typedef struct conn {
+	int port;
+	SOCKET sock;
+	pthread_t thread;
+	fl2k_ring_t ring;
+	char *slots;
+	volatile uint32_t partial;	/* bytes in the slot being filled */
+} conn_t;
+
+static conn_t conns[MAX_CONNS];
+static int num_conns = 0;
+
+static fl2k_ring_t *rings[MAX_CONNS];
+static char *ring_slots[MAX_CONNS];
+static int num_rings = 0;
+static int held = 0;			/* the oldest slots are handed out */
+
+static int transport = TRANSPORT_TCP;
+static int channels = 1;
+static int interleaved = 0;
+static char *addr = NULL;
+static uint32_t slot_len;
+static uint32_t watermark;		/* slots to prebuffer */
+static int recv_flags = 0;
+
+static pthread_mutex_t ring_mutex;
+static pthread_cond_t ring_cond;	/* a slot was released */
+
+static int buffering = 1;
+static uint32_t underflow_cnt = 0;
+static char *chanbuf[3];		/* deinterleaved samples */
+static char *silence = NULL;
+
+/* With -r, the samples are resampled to the clock of the sender. They
+ * are copied from the slots to a stage per channel first, the resampler
+ * needs a few samples beyond the end of a slot. */
+static int adapt = 0;
+static rate_adapt_t ra;
+static double exact_rate;
+static int8_t *stage[3];
+static uint32_t stage_len;
+static uint64_t stage_pos;		/* 32.32 fixed point, into the stage */
+static int8_t *resbuf[3];
+static uint64_t produced = 0;		/* buffers handed to the library */
+
+#ifdef HAVE_SHM
+static fl2k_shm_t *shm = NULL;
+static size_t shm_size;
+#endif
 
 void usage(void)
 {
 	fprintf(stderr,
 		"fl2k_tcp, a spectrum client for FL2K VGA dongles\n\n"
-		"Usage:\t[-a server address]\n"
-		"\t[-d device index (default: 0)]\n"
+		"Usage:\t[-a server address, UDP bind or multicast address, "
+		"shared memory name]\n"
+		"\t[-d device index, USB path or serial number (default: 0)]\n"
 		"\t[-p port (default: 1234)]\n"
 		"\t[-s samplerate in Hz (default: 100 MS/s)]\n"
 		"\t[-b number of buffers (default: 4)]\n"
+		"\t[-T transport: tcp, udp"
+#ifdef HAVE_SHM
+		" or shm"
+#endif
+		" (default: tcp)]\n"
+		"\t[-n number of channels, with TCP one connection each on consecutive ports (default: 1)]\n"
+		"\t[-I the samples are interleaved R, G, B]\n"
+		"\t[-B receive buffer size in MB (default: 32)]\n"
+		"\t[-w prebuffer in percent of the receive buffer (default: 50)]\n"
+		"\t[-W wait for whole buffers in recv() (MSG_WAITALL)]\n"
+		"\t[-r adapt to the sender's sample clock by resampling, keeping the\n"
+		"\t    receive buffer at the prebuffer level]\n"
+		"\t[-A CPU of the USB worker[,CPU of the sample worker] (default: no pinning)]\n"
+		"\t[-P real-time priority of the workers, also locks the buffers in memory]\n"
 	);
 	exit(1);
 }
@@ -100,12 +208,506 @@ static void sighandler(int signum)
 }
 #endif
 
-void fl2k_callback(fl2k_data_info_t *data_info)
+
+static void sock_setup(SOCKET sock)
 {
-	int left = FL2K_BUF_LEN;
-	int received;
-	int r;
+	int rcvbuf = SOCK_RCVBUF;
+#ifdef _WIN32
+	DWORD tv = 1000;
+#else
 	struct timeval tv = { 1, 0 };
+#endif
+
+	/* has to be set before connecting for TCP window scaling */
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (char *)&rcvbuf,
+		   sizeof(rcvbuf));
+
+	/* so the threads notice when we exit */
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof(tv));
+}
+
+/* wait for a free slot, returns NULL if we exit */
+static char *conn_wait_slot(conn_t *c)
+{
+	pthread_mutex_lock(&ring_mutex);
+	while (!fl2k_ring_write_avail(&c->ring) && !do_exit)
+		pthread_cond_wait(&ring_cond, &ring_mutex);
+	pthread_mutex_unlock(&ring_mutex);
+
+	if (do_exit)
+		return NULL;
+
+	return c->slots + (size_t)slot_len * fl2k_ring_write_pos(&c->ring);
+}
+
+/* connect, retrying until it succeeds or we are asked to exit */
+static int conn_connect(conn_t *c)
+{
+	struct sockaddr_in remote;
+	int flag = 1;
+
+	memset(&remote, 0, sizeof(remote));
+	remote.sin_family = AF_INET;
+	remote.sin_port = htons(c->port);
+	remote.sin_addr.s_addr = inet_addr(addr);
+
+	fprintf(stderr, "Connecting to %s:%d...\n", addr, c->port);
+
+	while (!do_exit) {
+		c->sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (c->sock == INVALID_SOCKET)
+			return -1;
+
+		sock_setup(c->sock);
+
+		if (!connect(c->sock, (struct sockaddr *)&remote,
+			     sizeof(remote)))
+			break;
+
+		closesocket(c->sock);
+		c->sock = INVALID_SOCKET;
+		sleep_ms(500);
+	}
+
+	if (do_exit)
+		return -1;
+
+	setsockopt(c->sock, IPPROTO_TCP, TCP_NODELAY, (char *)&flag,
+		   sizeof(flag));
+
+	fprintf(stderr, "Connected to port %d\n", c->port);
+
+	return 0;
+}
+
+/* receive a whole slot, returns -1 if the connection was closed */
+static int conn_recv(conn_t *c, char *buf)
+{
+	uint32_t got = 0;
+	int r;
+
+	while (!do_exit && got < slot_len) {
+		r = recv(c->sock, buf + got, slot_len - got, recv_flags);
+
+		if (r > 0) {
+			got += r;
+			c->partial = got;
+		} else if (r < 0 && sock_timed_out()) {
+			continue;
+		} else {
+			return -1;
+		}
+	}
+
+	return do_exit ? -1 : 0;
+}
+
+static void *tcp_worker(void *arg)
+{
+	conn_t *c = (conn_t *)arg;
+	char *slot;
+
+	while (!do_exit) {
+		if (conn_connect(c) < 0)
+			break;
+
+		while ((slot = conn_wait_slot(c))) {
+			c->partial = 0;
+			if (conn_recv(c, slot) < 0) {
+				if (!do_exit)
+					fprintf(stderr, "Connection to port %d "
+						"was closed, reconnecting\n",
+						c->port);
+				break;
+			}
+
+			c->partial = 0;
+			fl2k_ring_write_commit(&c->ring, 1);
+		}
+
+		closesocket(c->sock);
+		c->sock = INVALID_SOCKET;
+	}
+
+	return NULL;
+}
+
+static int udp_open(conn_t *c)
+{
+	struct sockaddr_in local;
+	struct ip_mreq mreq;
+	uint32_t group = inet_addr(addr);
+	int multicast = (ntohl(group) & 0xf0000000) == 0xe0000000;
+	int flag = 1;
+
+	c->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (c->sock == INVALID_SOCKET)
+		return -1;
+
+	/* several instances can receive the same multicast group */
+	setsockopt(c->sock, SOL_SOCKET, SO_REUSEADDR, (char *)&flag,
+		   sizeof(flag));
+	sock_setup(c->sock);
+
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_port = htons(c->port);
+	local.sin_addr.s_addr = multicast ? htonl(INADDR_ANY) : group;
+
+	if (bind(c->sock, (struct sockaddr *)&local, sizeof(local))) {
+		fprintf(stderr, "Failed to bind to %s:%d\n", addr, c->port);
+		return -1;
+	}
+
+	if (multicast) {
+		mreq.imr_multiaddr.s_addr = group;
+		mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+
+		if (setsockopt(c->sock, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+			       (char *)&mreq, sizeof(mreq))) {
+			fprintf(stderr, "Failed to join %s\n", addr);
+			return -1;
+		}
+	}
+
+	fprintf(stderr, "Receiving %s on %s:%d\n",
+		multicast ? "multicast" : "UDP", addr, c->port);
+
+	return 0;
+}
+
+/* append len bytes to the slots, zeros if data is NULL */
+static int udp_put(conn_t *c, char **slot, uint32_t *fill,
+		   const char *data, uint64_t len)
+{
+	uint32_t n;
+
+	while (len) {
+		if (!*fill && !(*slot = conn_wait_slot(c)))
+			return -1;
+
+		n = slot_len - *fill;
+		if (n > len)
+			n = len;
+
+		if (data) {
+			memcpy(*slot + *fill, data, n);
+			data += n;
+		} else {
+			memset(*slot + *fill, 0, n);
+		}
+
+		*fill += n;
+		len -= n;
+		c->partial = *fill;
+
+		if (*fill == slot_len) {
+			c->partial = *fill = 0;
+			fl2k_ring_write_commit(&c->ring, 1);
+		}
+	}
+
+	return 0;
+}
+
+/* Every datagram starts with a 32 bit sequence number in network byte
+ * order, followed by the samples. All datagrams of a stream carry the
+ * same number of samples, so lost ones are replaced by as many zeros
+ * and the following samples stay in place. Late and duplicate
+ * datagrams are dropped, if the sequence number jumps further back the
+ * stream is picked up from there. */
+static void *udp_worker(void *arg)
+{
+	conn_t *c = (conn_t *)arg;
+	char pkt[UDP_MAX_PACKET];
+	char *slot = NULL;
+	uint32_t seq, expected = 0, gap, lost = 0, len, fill = 0;
+	int r, synced = 0;
+
+	while (!do_exit) {
+		r = recv(c->sock, pkt, sizeof(pkt), 0);
+		if (r < 0) {
+			if (sock_timed_out())
+				continue;
+
+			fprintf(stderr, "UDP receive error, exiting.\n");
+			fl2k_stop_tx(dev);
+			do_exit = 1;
+			break;
+		}
+
+		if (r <= 4)
+			continue;
+
+		memcpy(&seq, pkt, 4);
+		seq = ntohl(seq);
+		len = r - 4;
+
+		if (synced) {
+			gap = seq - expected;
+
+			if ((int32_t)gap < 0 &&
+			    (int32_t)gap >= -UDP_REORDER_WINDOW)
+				continue;
+
+			if ((int32_t)gap < 0) {
+				fprintf(stderr, "Sequence restarted at %u, "
+					"resyncing\n", seq);
+
+				/* the slot being filled belongs to the old
+				 * stream */
+				c->partial = fill = 0;
+			} else if (gap) {
+				lost += gap;
+				fprintf(stderr, "Lost %u datagrams (%u in "
+					"total)\n", gap, lost);
+
+				/* more than the ring holds, drop the slot
+				 * being filled and start over */
+				if ((uint64_t)gap * len >=
+				    (uint64_t)slot_len * c->ring.size)
+					c->partial = fill = 0;
+				else if (udp_put(c, &slot, &fill, NULL,
+						 (uint64_t)gap * len) < 0)
+					break;
+			}
+		}
+
+		synced = 1;
+		expected = seq + 1;
+
+		if (udp_put(c, &slot, &fill, pkt + 4, len) < 0)
+			break;
+	}
+
+	return NULL;
+}
+
+#ifdef HAVE_SHM
+static int shm_create(const char *name, uint32_t num_slots)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t hdr = (sizeof(fl2k_shm_t) + page - 1) & ~(page - 1);
+	void *map;
+	int fd;
+
+	shm_size = hdr + (size_t)slot_len * num_slots;
+
+	fd = shm_open(name, O_CREAT | O_RDWR, 0660);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to create shared memory %s\n", name);
+		return -1;
+	}
+
+	if (ftruncate(fd, shm_size)) {
+		fprintf(stderr, "Failed to resize shared memory %s\n", name);
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Failed to map shared memory %s\n", name);
+		return -1;
+	}
+
+	shm = map;
+	memset(shm, 0, sizeof(fl2k_shm_t));
+	shm->version = FL2K_SHM_VERSION;
+	shm->slot_len = slot_len;
+	shm->num_slots = num_slots;
+	shm->channels = interleaved ? 3 : channels;
+	shm->interleaved = interleaved;
+	shm->data_offset = hdr;
+	fl2k_ring_init(&shm->ring, num_slots);
+	fl2k_atomic_store_release(&shm->magic, FL2K_SHM_MAGIC);
+
+	rings[0] = &shm->ring;
+	ring_slots[0] = fl2k_shm_slot(shm, 0);
+	num_rings = 1;
+
+	fprintf(stderr, "Waiting for samples in shared memory %s\n", name);
+
+	return 0;
+}
+
+static void shm_destroy(const char *name)
+{
+	if (!shm)
+		return;
+
+	munmap(shm, shm_size);
+	shm_unlink(name);
+}
+#endif
+
+static void release_slots(void)
+{
+	int i;
+
+	if (!held)
+		return;
+
+	for (i = 0; i < num_rings; i++)
+		fl2k_ring_read_commit(rings[i], 1);
+
+	held = 0;
+
+#ifdef HAVE_SHM
+	if (shm) {
+		fl2k_shm_ring_bell(&shm->space_bell);
+		return;
+	}
+#endif
+
+	pthread_mutex_lock(&ring_mutex);
+	pthread_cond_broadcast(&ring_cond);
+	pthread_mutex_unlock(&ring_mutex);
+}
+
+/* the channels have to stay in step, so the ring with the fewest
+ * received slots counts */
+static uint32_t rings_avail(void)
+{
+	uint32_t avail, min_avail = UINT32_MAX;
+	int i;
+
+	for (i = 0; i < num_rings; i++) {
+		avail = fl2k_ring_read_avail(rings[i]);
+		if (avail < min_avail)
+			min_avail = avail;
+	}
+
+	return min_avail;
+}
+
+/* the same in samples per channel, including the slots being received */
+static double rings_level(void)
+{
+	double level, min_level = -1;
+	int i;
+
+	for (i = 0; i < num_rings; i++) {
+		level = (double)fl2k_ring_read_avail(rings[i]) * slot_len;
+		if (i < num_conns)
+			level += conns[i].partial;
+		if (min_level < 0 || level < min_level)
+			min_level = level;
+	}
+
+	return min_level * FL2K_BUF_LEN / slot_len;
+}
+
+/* the samples of a channel in the oldest slot */
+static char *slot_buf(int i)
+{
+	if (num_rings > 1)
+		return ring_slots[i] + (size_t)slot_len *
+		       fl2k_ring_read_pos(rings[i]);
+
+	/* the channels one after another in the slot */
+	return ring_slots[0] + (size_t)slot_len * fl2k_ring_read_pos(rings[0]) +
+	       (size_t)FL2K_BUF_LEN * i;
+}
+
+static void rebuffer(void)
+{
+	underflow_cnt++;
+	buffering = 1;
+	fprintf(stderr, "Receive buffer empty (%u times), rebuffering\n",
+		underflow_cnt);
+}
+
+static void adapt_report(void)
+{
+	fl2k_rate_estimate_t est;
+
+	if ((produced * FL2K_BUF_LEN) % (uint64_t)(ADAPT_REPORT_TIME * exact_rate) >=
+	    FL2K_BUF_LEN)
+		return;
+
+	fprintf(stderr, "Buffered %.0f ms, sender clock %+.1f PPM of the "
+			"DAC clock", ra.level * 1000, (ra.ratio - 1) * 1e6);
+
+	if (!fl2k_get_rate_estimate(dev, &est))
+		fprintf(stderr, ", DAC clock %+.1f PPM", est.ppm);
+
+	fprintf(stderr, "\n");
+}
+
+/* Resample the next buffer of every channel into resbuf. The level the
+ * controller keeps includes the samples on the stage and those the
+ * library has queued but the device didn't output yet, its target is
+ * the level once prebuffering first finished. Returns -1 if not enough
+ * samples were received. */
+static int adapt_fill(int nch)
+{
+	static int started = 0;
+	uint64_t queued = produced * FL2K_BUF_LEN, output, step, pos = 0;
+	uint32_t need, used;
+	double level;
+	int i;
+
+	output = fl2k_get_sample_count(dev);
+	queued = queued > output ? queued - output : 0;
+	level = (rings_level() + stage_len + queued) / exact_rate;
+
+	if (!started) {
+		rate_adapt_init(&ra, level);
+		started = 1;
+	}
+
+	step = rate_adapt_step(rate_adapt_update(&ra, level,
+						 FL2K_BUF_LEN / exact_rate));
+	need = rate_adapt_needed(stage_pos, step, FL2K_BUF_LEN);
+
+	while (stage_len < need) {
+		if (!rings_avail())
+			return -1;
+
+		if (interleaved) {
+			fl2k_deinterleave_rgb(slot_buf(0),
+					      (char *)stage[0] + stage_len,
+					      (char *)stage[1] + stage_len,
+					      (char *)stage[2] + stage_len,
+					      FL2K_BUF_LEN);
+		} else {
+			for (i = 0; i < nch; i++)
+				memcpy(stage[i] + stage_len, slot_buf(i),
+				       FL2K_BUF_LEN);
+		}
+
+		stage_len += FL2K_BUF_LEN;
+		held = 1;
+		release_slots();
+	}
+
+	for (i = 0; i < nch; i++) {
+		pos = stage_pos;
+		rate_adapt_resample_s8(stage[i], resbuf[i], FL2K_BUF_LEN,
+				       &pos, step);
+	}
+
+	used = (uint32_t)(pos >> 32);
+	stage_pos = pos & 0xffffffff;
+	stage_len -= used;
+
+	for (i = 0; i < nch; i++)
+		memmove(stage[i], stage[i] + used, stage_len);
+
+	produced++;
+	adapt_report();
+
+	return 0;
+}
+
+void fl2k_callback(fl2k_data_info_t *data_info)
+{
+	char *bufs[MAX_CONNS] = { NULL, NULL, NULL };
+	uint32_t min_avail;
+	int i, nbufs = interleaved ? 1 : channels;
+	int nch = interleaved ? 3 : channels;
 
 	if (data_info->device_error) {
 		fprintf(stderr, "Device error, exiting.\n");
@@ -113,43 +715,73 @@ void fl2k_callback(fl2k_data_info_t *data_info)
 		return;
 	}
 
-	if (!connected)
-		return;
-
 	data_info->sampletype_signed = 1;
-	data_info->r_buf = txbuf;
 
-	while (!do_exit && (left > 0)) {
-		FD_ZERO(&readfds);
-		FD_SET(sock, &readfds);
-		tv.tv_sec = 1;
-		tv.tv_usec = 0;
-		r = select(sock + 1, &readfds, NULL, NULL, &tv);
+	/* the library converted the slots from the last call by now */
+	release_slots();
 
-		if (r) {
-			received = recv(sock, txbuf + (FL2K_BUF_LEN - left), left, 0);
-			if (!received) {
-				fprintf(stderr, "Connection was closed!\n");
-				fl2k_stop_tx(dev);
-				do_exit = 1;
-			}
+	min_avail = rings_avail();
+
+	if (buffering && min_avail >= watermark) {
+		buffering = 0;
+		fprintf(stderr, "Prebuffered %u buffers, starting\n", min_avail);
+	} else if (!buffering && !min_avail && !adapt) {
+		rebuffer();
+	}
 
-			left -= received;
+	if (adapt) {
+		if (!buffering && adapt_fill(nch) < 0) {
+			rebuffer();
+			stage_len = 0;
+			stage_pos = 0;
 		}
+
+		if (buffering) {
+			produced++;
+			data_info->r_buf = silence;
+			data_info->g_buf = nch > 1 ? silence : NULL;
+			data_info->b_buf = nch > 2 ? silence : NULL;
+			return;
+		}
+
+		data_info->r_buf = (char *)resbuf[0];
+		data_info->g_buf = nch > 1 ? (char *)resbuf[1] : NULL;
+		data_info->b_buf = nch > 2 ? (char *)resbuf[2] : NULL;
+		return;
+	}
+
+	for (i = 0; i < nbufs; i++)
+		bufs[i] = buffering ? silence : slot_buf(i);
+
+	held = !buffering;
+
+	if (interleaved) {
+		fl2k_deinterleave_rgb(bufs[0], chanbuf[0], chanbuf[1],
+				      chanbuf[2], FL2K_BUF_LEN);
+		data_info->r_buf = chanbuf[0];
+		data_info->g_buf = chanbuf[1];
+		data_info->b_buf = chanbuf[2];
+		return;
 	}
+
+	data_info->r_buf = bufs[0];
+	if (nbufs > 1)
+		data_info->g_buf = bufs[1];
+	if (nbufs > 2)
+		data_info->b_buf = bufs[2];
 }
 
 int main(int argc, char **argv)
 {
 	int r, opt, i;
-	char *addr = "127.0.0.1";
 	int port = 1234;
 	uint32_t samp_rate = 100000000;
-	struct sockaddr_in local, remote;
 	uint32_t buf_num = 0;
-	int dev_index = 0;
+	uint32_t ring_mb = 32, prebuf_pct = 50, num_slots;
+	const char *dev_name = "0";
+	int usb_cpu = -1, sample_cpu = -1, rt_prio = 0;
 	int dev_given = 0;
-	int flag = 1;
+	void *(*worker)(void *) = tcp_worker;
 
 #ifdef _WIN32
 	WSADATA wsd;
@@ -158,10 +790,11 @@ int main(int argc, char **argv)
 	struct sigaction sigact, sigign;
 #endif
 
-	while ((opt = getopt(argc, argv, "d:s:a:p:b:")) != -1) {
+	while ((opt = getopt(argc, argv, "d:s:a:p:b:T:n:IB:w:WA:P:r")) != -1) {
 		switch (opt) {
 		case 'd':
-			dev_index = (uint32_t)atoi(optarg);
+			/* an index, a USB path or a serial number */
+			dev_name = optarg;
 			dev_given = 1;
 			break;
 		case 's':
@@ -176,6 +809,43 @@ int main(int argc, char **argv)
 		case 'b':
 			buf_num = atoi(optarg);
 			break;
+		case 'T':
+			if (!strcmp(optarg, "tcp"))
+				transport = TRANSPORT_TCP;
+			else if (!strcmp(optarg, "udp"))
+				transport = TRANSPORT_UDP;
+#ifdef HAVE_SHM
+			else if (!strcmp(optarg, "shm"))
+				transport = TRANSPORT_SHM;
+#endif
+			else
+				usage();
+			break;
+		case 'n':
+			channels = atoi(optarg);
+			break;
+		case 'I':
+			interleaved = 1;
+			break;
+		case 'B':
+			ring_mb = atoi(optarg);
+			break;
+		case 'w':
+			prebuf_pct = atoi(optarg);
+			break;
+		case 'W':
+			recv_flags = MSG_WAITALL;
+			break;
+		case 'r':
+			adapt = 1;
+			break;
+		case 'A':
+			if (sscanf(optarg, "%d,%d", &usb_cpu, &sample_cpu) < 1)
+				usage();
+			break;
+		case 'P':
+			rt_prio = atoi(optarg);
+			break;
 		default:
 			usage();
 			break;
@@ -185,21 +855,128 @@ int main(int argc, char **argv)
 	if (argc < optind)
 		usage();
 
-	if (dev_index < 0) {
+
+	if (channels < 1 || channels > MAX_CONNS ||
+	    (interleaved && channels > 1) || prebuf_pct > 100)
+		usage();
+
+	if (!addr) {
+		if (transport == TRANSPORT_UDP)
+			addr = "0.0.0.0";
+		else if (transport == TRANSPORT_SHM)
+			addr = FL2K_SHM_NAME;
+		else
+			addr = "127.0.0.1";
+	}
+
+	/* TCP uses a connection per channel, the others put all channels
+	 * into one slot */
+	if (interleaved)
+		slot_len = FL2K_BUF_LEN * 3;
+	else if (transport == TRANSPORT_TCP)
+		slot_len = FL2K_BUF_LEN;
+	else
+		slot_len = FL2K_BUF_LEN * channels;
+
+	num_slots = fl2k_ring_size_for(((uint64_t)ring_mb << 20) / slot_len);
+	if (num_slots < 2)
+		num_slots = 2;
+
+	watermark = (num_slots * prebuf_pct) / 100;
+	if (watermark < 1)
+		watermark = 1;
+
+	fl2k_open_by_name(&dev, dev_name);
+	if (NULL == dev) {
+		fprintf(stderr, "Failed to open fl2k device %s.\n", dev_name);
 		exit(1);
 	}
 
-	txbuf = malloc(FL2K_BUF_LEN);
+	/* pin and prioritize the workers, this only prints a warning
+	 * if we lack the privileges */
+	fl2k_set_thread_config(dev, FL2K_THREAD_USB, usb_cpu, rt_prio);
+	fl2k_set_thread_config(dev, FL2K_THREAD_SAMPLE, sample_cpu, rt_prio);
+	if (rt_prio > 0)
+		fl2k_set_mlock(dev, 1);
+
+	/* use the buffer configuration measured by fl2k_test -R, if there
+	 * is one and it keeps the buffer length the callback provides */
+	fl2k_apply_default_profile(dev, 1);
+
+	pthread_mutex_init(&ring_mutex, NULL);
+	pthread_cond_init(&ring_cond, NULL);
+
+#ifdef HAVE_SHM
+	if (transport == TRANSPORT_SHM) {
+		if (shm_create(addr, num_slots) < 0)
+			exit(1);
+	} else
+#endif
+	{
+		num_conns = transport == TRANSPORT_TCP && !interleaved ?
+			    channels : 1;
+
+		for (i = 0; i < num_conns; i++) {
+			conns[i].port = port + i;
+			conns[i].sock = INVALID_SOCKET;
+			fl2k_ring_init(&conns[i].ring, num_slots);
+
+			/* on the NUMA node of the device */
+			conns[i].slots = fl2k_alloc_buffer(dev, (size_t)slot_len *
+							   num_slots,
+							   FL2K_ALLOC_HUGEPAGE |
+							   FL2K_ALLOC_NUMA);
+			if (!conns[i].slots) {
+				fprintf(stderr, "malloc error!\n");
+				exit(1);
+			}
+
+			rings[i] = &conns[i].ring;
+			ring_slots[i] = conns[i].slots;
+		}
+
+		num_rings = num_conns;
+	}
+
+	if (transport == TRANSPORT_UDP) {
+		if (udp_open(&conns[0]) < 0)
+			exit(1);
+
+		worker = udp_worker;
+	}
 
-	if (!txbuf) {
+	silence = fl2k_alloc_buffer(dev, interleaved ? FL2K_BUF_LEN * 3 :
+				    FL2K_BUF_LEN, FL2K_ALLOC_NUMA);
+	if (!silence) {
 		fprintf(stderr, "malloc error!\n");
 		exit(1);
 	}
 
-	fl2k_open(&dev, (uint32_t)dev_index);
-	if (NULL == dev) {
-		fprintf(stderr, "Failed to open fl2k device #%d.\n", dev_index);
-		exit(1);
+	if (interleaved) {
+		for (i = 0; i < 3; i++) {
+			chanbuf[i] = fl2k_alloc_buffer(dev, FL2K_BUF_LEN,
+						       FL2K_ALLOC_NUMA);
+			if (!chanbuf[i]) {
+				fprintf(stderr, "malloc error!\n");
+				exit(1);
+			}
+		}
+	}
+
+	if (adapt) {
+		/* a slot is added while the stage holds less than needed */
+		for (i = 0; i < (interleaved ? 3 : channels); i++) {
+			stage[i] = fl2k_alloc_buffer(dev, FL2K_BUF_LEN * 3,
+						     FL2K_ALLOC_NUMA);
+			resbuf[i] = fl2k_alloc_buffer(dev, FL2K_BUF_LEN,
+						      FL2K_ALLOC_NUMA);
+			if (!stage[i] || !resbuf[i]) {
+				fprintf(stderr, "malloc error!\n");
+				exit(1);
+			}
+		}
+
+		fl2k_plan_sample_rate(samp_rate, &exact_rate, NULL);
 	}
 
 	r = fl2k_start_tx(dev, fl2k_callback, NULL, buf_num);
@@ -222,32 +999,49 @@ int main(int argc, char **argv)
 	SetConsoleCtrlHandler( (PHANDLER_ROUTINE) sighandler, TRUE );
 #endif
 
-	sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-
-	memset(&remote, 0, sizeof(remote));
+	fprintf(stderr, "Receive buffer: %u buffers, prebuffering %u\n",
+		num_slots, watermark);
 
-	remote.sin_family = AF_INET;
-	remote.sin_port = htons(port);
-	remote.sin_addr.s_addr = inet_addr(addr);
-
-	fprintf(stderr, "Connecting to %s:%d...\n", addr, port);
-	while (connect(sock, (struct sockaddr *)&remote, sizeof(remote)) != 0) {
-		sleep_ms(500);
-		if (do_exit)
-			goto out;
+	for (i = 0; i < num_conns; i++) {
+		r = pthread_create(&conns[i].thread, NULL, worker, &conns[i]);
+		if (r) {
+			fprintf(stderr, "Error spawning receive thread!\n");
+			do_exit = 1;
+			num_conns = i;
+			break;
+		}
 	}
 
-	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&flag,sizeof(flag));
-	fprintf(stderr, "Connected\n");
-	connected = 1;
-
 	while (!do_exit)
 		sleep_ms(500);
 
-out:
 	fl2k_close(dev);
-	free(txbuf);
-	closesocket(s);
+
+	/* wake up threads waiting for a free slot */
+	pthread_mutex_lock(&ring_mutex);
+	pthread_cond_broadcast(&ring_cond);
+	pthread_mutex_unlock(&ring_mutex);
+
+	for (i = 0; i < num_conns; i++) {
+		pthread_join(conns[i].thread, NULL);
+		if (conns[i].sock != INVALID_SOCKET)
+			closesocket(conns[i].sock);
+		fl2k_free_buffer(conns[i].slots);
+	}
+
+#ifdef HAVE_SHM
+	if (transport == TRANSPORT_SHM)
+		shm_destroy(addr);
+#endif
+
+	for (i = 0; i < 3; i++) {
+		fl2k_free_buffer(chanbuf[i]);
+		fl2k_free_buffer(stage[i]);
+		fl2k_free_buffer(resbuf[i]);
+	}
+
+	fl2k_free_buffer(silence);
+
 #ifdef _WIN32
 	WSACleanup();
 #endif
@@ -52,7 +52,15 @@
 
 #define DEFAULT_SAMPLE_RATE		100000000
 #define PPM_DURATION			10
-#define PPM_DUMP_TIME			1
+
+/* capacity probe: rates from PROBE_RATE_STEP up to the maximum, each one
+ * streamed for PROBE_SETTLE_MS, which isn't measured, and the duration */
+#define PROBE_MAX_RATE			150000000
+#define PROBE_RATE_STEP			10000000
+#define PROBE_SETTLE_MS			1000
+#define PROBE_DURATION			3
+/* fraction the measured rate may fall short of the configured one */
+#define PROBE_RATE_TOLERANCE		0.005
 
 struct time_generic
 	/* holds all the platform specific values */
@@ -76,7 +84,10 @@ static uint32_t samp_rate = DEFAULT_SAMPLE_RATE;
 static unsigned int ppm_duration = PPM_DURATION;
 
 static char *buffer;
-static int cb_cnt = 0;
+static int probe = 0;
+
+static const uint32_t probe_inflight[] = { 2, 4, 8, 16 };
+#define PROBE_CONFIGS	(sizeof(probe_inflight) / sizeof(probe_inflight[0]))
 
 void usage(void)
 {
@@ -84,8 +95,14 @@ void usage(void)
 		"fl2k_test, clock accuracy test for FL2K VGA dongles,\n"
 		"also outputs a square wave at fs/2\n\n"
 		"Usage:\n"
-		"\t[-d device_index (default: 0)]\n"
+		"\t[-d device index, USB path or serial number (default: 0)]\n"
 		"\t[-s samplerate (default: 100 MS/s)]\n"
+		"\t[-p ppm_duration in seconds (default: 10)]\n"
+		"\t[-R run the USB capacity probe instead, sweeping the rates up to\n"
+		"\t    the samplerate (default: 150 MS/s) and the buffer counts,\n"
+		"\t    and saving the best configuration as buffer profile]\n"
+		"\t[-t seconds per probed rate (default: 3)]\n"
+		"\t[-o profile filename (default: $FL2K_PROFILE or ~/.fl2k_profile)]\n"
 	);
 	exit(1);
 }
@@ -149,66 +166,37 @@ static int ppm_gettime(struct time_generic *tg)
 }
 #endif
 
-static int ppm_report(uint64_t nsamples, uint64_t interval)
+static uint64_t gettime_ns(void)
 {
-	double real_rate, ppm;
+	struct time_generic tg;
+
+	memset(&tg, 0, sizeof(tg));
+	ppm_gettime(&tg);
 
-	real_rate = nsamples * 1e9 / interval;
-	ppm = 1e6 * (real_rate / (double)samp_rate - 1.);
-	return (int)round(ppm);
+	return (uint64_t)tg.tv_sec * 1000000000ULL + tg.tv_nsec;
 }
 
-static void ppm_test(uint32_t len)
+/* the library estimates the rate from the times of the completed
+ * transfers, without any callback */
+static void ppm_test(void)
 {
-	static uint64_t nsamples = 0;
-	static uint64_t interval = 0;
-	static uint64_t nsamples_total = 0;
-	static uint64_t interval_total = 0;
-	static struct time_generic ppm_now;
-	static struct time_generic ppm_recent;
-
-	static enum {
-		PPM_INIT_NO,
-		PPM_INIT_DUMP,
-		PPM_INIT_RUN
-	} ppm_init = PPM_INIT_NO;
-
-	ppm_gettime(&ppm_now);
-
-	if (ppm_init != PPM_INIT_RUN) {
-		/*
-		* Kyle Keen wrote:
-		* PPM_DUMP_TIME throws out the first N seconds of data.
-		* The dongle's PPM is usually very bad when first starting up,
-		* typically incorrect by more than twice the final value.
-		* Discarding the first few seconds allows the value to stabilize much faster.
-		*/
-		if (ppm_init == PPM_INIT_NO) {
-			ppm_recent.tv_sec = ppm_now.tv_sec + PPM_DUMP_TIME;
-			ppm_init = PPM_INIT_DUMP;
-			return;
-		}
-		if (ppm_init == PPM_INIT_DUMP && ppm_recent.tv_sec < ppm_now.tv_sec)
-			return;
-		ppm_recent = ppm_now;
-		ppm_init = PPM_INIT_RUN;
+	static uint64_t next_report = 0;
+	fl2k_rate_estimate_t est;
+	uint64_t now = gettime_ns();
+
+	if (fl2k_get_rate_estimate(dev, &est) < 0)
 		return;
-	}
-	nsamples += (uint64_t)len;
-	interval = (uint64_t)(ppm_now.tv_sec - ppm_recent.tv_sec);
-	if (interval < ppm_duration)
+
+	if (!next_report)
+		next_report = now + ppm_duration * 1000000000ULL;
+
+	if (now < next_report)
 		return;
-	interval *= 1000000000UL;
-	interval += (int64_t)(ppm_now.tv_nsec - ppm_recent.tv_nsec);
 
-	nsamples_total += nsamples;
-	interval_total += interval;
+	next_report += ppm_duration * 1000000000ULL;
+
 	printf("real sample rate: %i current PPM: %i cumulative PPM: %i\n",
-		(int)((1000000000UL * nsamples) / interval),
-		ppm_report(nsamples, interval),
-		ppm_report(nsamples_total, interval_total));
-	ppm_recent = ppm_now;
-	nsamples = 0;
+		(int)est.rate, (int)round(est.ppm), (int)round(est.ppm_total));
 }
 
 void fl2k_callback(fl2k_data_info_t *data_info)
@@ -219,15 +207,132 @@ void fl2k_callback(fl2k_data_info_t *data_info)
 		return;
 	}
 
-	/* drop first couple of callbacks until everything is settled */
-	if (cb_cnt > 20) {
-		ppm_test(FL2K_BUF_LEN);
-	} else {
-		/* as data is repetitive, it only needs to be handed
-		 * over until all transfer buffers contain the data */
-		data_info->r_buf = buffer;
-		cb_cnt++;
+	/* the probe converts new data every time, like the other tools */
+	data_info->r_buf = buffer;
+	data_info->g_buf = buffer;
+	data_info->b_buf = buffer;
+}
+
+/* stream at the rate with the number of transfers in flight, returns 1 if
+ * there were no underflows and the DACs got their samples in time */
+static int probe_step(uint32_t rate, uint32_t inflight, uint32_t duration)
+{
+	fl2k_stats_t s0, s1;
+	uint64_t c0, c1, t0, t1;
+	double real_rate, expected_ms;
+	int r, clean;
+
+	/* wait for the previous step to be stopped */
+	while ((r = fl2k_set_buffer_config(dev, 0, 0, inflight)) ==
+	       FL2K_ERROR_BUSY && !do_exit)
+		sleep_ms(10);
+
+	if (r < 0)
+		return 0;
+
+	r = fl2k_start_tx(dev, fl2k_callback, NULL, 0);
+	if (r < 0) {
+		fprintf(stderr, "Failed to start streaming: %d\n", r);
+		do_exit = 1;
+		return 0;
 	}
+
+	fl2k_set_sample_rate(dev, rate);
+	rate = fl2k_get_sample_rate(dev);
+
+	sleep_ms(PROBE_SETTLE_MS);
+
+	fl2k_get_stats(dev, &s0);
+	c0 = fl2k_get_sample_count(dev);
+	t0 = gettime_ns();
+
+	sleep_ms(duration * 1000);
+
+	fl2k_get_stats(dev, &s1);
+	c1 = fl2k_get_sample_count(dev);
+	t1 = gettime_ns();
+
+	fl2k_stop_tx(dev);
+
+	if (do_exit)
+		return 0;
+
+	/* the count advances a whole transfer at a time */
+	real_rate = (c1 - c0 + FL2K_BUF_LEN) * 1e9 / (t1 - t0);
+	expected_ms = FL2K_BUF_LEN * 1e3 / rate;
+
+	clean = s1.underflow_cnt == s0.underflow_cnt &&
+		real_rate >= rate * (1 - PROBE_RATE_TOLERANCE);
+
+	printf("%6.1f MS/s, %2u in flight: %s, %u underflows, %.2f MS/s real, "
+	       "completion interval %.1f ms, p99 %.1f ms, max %.1f ms\n",
+	       rate / 1e6, inflight, clean ? "ok" : "FAILED",
+	       s1.underflow_cnt - s0.underflow_cnt,
+	       (real_rate > rate ? rate : real_rate) / 1e6, expected_ms,
+	       s1.completion.p99_ns / 1e6, s1.completion.max_ns / 1e6);
+	fflush(stdout);
+
+	return clean;
+}
+
+static void probe_run(uint32_t max_rate, uint32_t duration,
+		      const char *profile_path)
+{
+	uint32_t clean_rate[PROBE_CONFIGS];
+	uint32_t rate, best = 0;
+	fl2k_profile_t profile;
+	unsigned int i;
+	int r;
+
+	for (i = 0; i < PROBE_CONFIGS && !do_exit; i++) {
+		clean_rate[i] = 0;
+
+		/* higher rates only get worse once one failed */
+		for (rate = PROBE_RATE_STEP; rate <= max_rate && !do_exit;
+		     rate += PROBE_RATE_STEP) {
+			if (!probe_step(rate, probe_inflight[i], duration))
+				break;
+
+			clean_rate[i] = fl2k_get_sample_rate(dev);
+		}
+	}
+
+	if (do_exit)
+		return;
+
+	printf("\nHighest rate without underflows:\n");
+
+	/* fewer transfers in flight win a tie, for the lower latency */
+	for (i = 0; i < PROBE_CONFIGS; i++) {
+		printf("%2u in flight: %.1f MS/s\n", probe_inflight[i],
+		       clean_rate[i] / 1e6);
+
+		if (clean_rate[i] > clean_rate[best])
+			best = i;
+	}
+
+	if (!clean_rate[best]) {
+		fprintf(stderr, "No configuration streamed without underflows, "
+				"not saving a profile.\n");
+		return;
+	}
+
+	memset(&profile, 0, sizeof(profile));
+	profile.buf_len = FL2K_BUF_LEN;
+	profile.inflight = probe_inflight[best];
+	/* the default of fl2k_set_buffer_config() the probe ran with */
+	profile.buf_num = profile.inflight + 2;
+	profile.max_rate = clean_rate[best];
+
+	printf("\nRecommended: %u in flight, up to %.1f MS/s\n",
+	       profile.inflight, profile.max_rate / 1e6);
+
+	r = fl2k_save_profile(profile_path, &profile);
+	if (r < 0)
+		fprintf(stderr, "Failed to save the profile.\n");
+	else
+		fprintf(stderr, "Saved the profile to %s.\n", profile_path ?
+			profile_path : "the default location");
 }
 
 int main(int argc, char **argv)
@@ -236,20 +341,34 @@ int main(int argc, char **argv)
 	struct sigaction sigact;
 #endif
 	int r, opt, i;
-	uint32_t dev_index = 0;
+	const char *dev_name = "0";
+	uint32_t probe_duration = PROBE_DURATION;
+	int rate_set = 0;
+	char *profile_path = NULL;
 
-	while ((opt = getopt(argc, argv, "d:s:p::h")) != -1) {
+	while ((opt = getopt(argc, argv, "d:s:p::Rt:o:h")) != -1) {
 		switch (opt) {
 		case 'd':
-			dev_index = (uint32_t)atoi(optarg);
+			/* an index, a USB path or a serial number */
+			dev_name = optarg;
 			break;
 		case 's':
 			samp_rate = (uint32_t)atof(optarg);
+			rate_set = 1;
 			break;
 		case 'p':
 			if (optarg)
 				ppm_duration = atoi(optarg);
 			break;
+		case 'R':
+			probe = 1;
+			break;
+		case 't':
+			probe_duration = (uint32_t)atoi(optarg);
+			break;
+		case 'o':
+			profile_path = optarg;
+			break;
 		case 'h':
 		default:
 			usage();
@@ -257,16 +376,16 @@ int main(int argc, char **argv)
 		}
 	}
 
-	buffer = malloc(FL2K_BUF_LEN);
-	if (!buffer)
-		goto exit;
-
-	fl2k_open(&dev, (uint32_t)dev_index);
+	fl2k_open_by_name(&dev, dev_name);
 	if (NULL == dev) {
-	fprintf(stderr, "Failed to open fl2k device #%d.\n", dev_index);
+		fprintf(stderr, "Failed to open fl2k device %s.\n", dev_name);
 		exit(1);
 	}
 
+	buffer = fl2k_alloc_buffer(dev, FL2K_BUF_LEN, FL2K_ALLOC_NUMA);
+	if (!buffer)
+		goto exit;
+
 #ifndef _WIN32
 	sigact.sa_handler = sighandler;
 	sigemptyset(&sigact.sa_mask);
@@ -285,7 +404,23 @@ int main(int argc, char **argv)
 		buffer[i+1] = 0xff;
 	}
 
-	r = fl2k_start_tx(dev, fl2k_callback, NULL, 0);
+	if (probe) {
+		if (!rate_set)
+			samp_rate = PROBE_MAX_RATE;
+
+		fprintf(stderr, "Probing rates up to %.1f MS/s, this takes a "
+				"while...\n", samp_rate / 1e6);
+		probe_run(samp_rate, probe_duration, profile_path);
+		goto exit;
+	}
+
+	/* the square wave repeats every two samples, so the transfers only
+	 * need to be filled once */
+	r = fl2k_start_tx_periodic(dev, buffer, NULL, NULL, 2);
+	if (r < 0) {
+		fprintf(stderr, "Failed to start streaming: %d\n", r);
+		goto exit;
+	}
 
 	/* Set the sample rate */
 	r = fl2k_set_sample_rate(dev, samp_rate);
@@ -297,12 +432,14 @@ int main(int argc, char **argv)
 	fprintf(stderr, "Reporting PPM error measurement every %u seconds...\n", ppm_duration);
 	fprintf(stderr, "Press ^C after a few minutes.\n");
 
-	while (!do_exit)
+	while (!do_exit) {
 		sleep_ms(500);
+		ppm_test();
+	}
 
 exit:
 	fl2k_close(dev);
-	free(buffer);
+	fl2k_free_buffer(buffer);
 
 	return 0;
 }
@@ -0,0 +1,776 @@
+/*
+ * osmo-fl2k, turns FL2000-based USB 3.0 to VGA adapters into
+ * low cost DACs
+ *
+ * Copyright (C) 2016-2018 by Steve Markgraf <steve@steve-m.de>
+ *
+ * based on FM modulator code from VGASIG:
+ * Copyright (C) 2009 by Bartek Kania <mbk@gnarf.org>
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "fm_mod.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FM_DDS_X86
+#include <immintrin.h>
+#define FM_TARGET(t)	__attribute__((target(t)))
+#endif
+
+#if defined(__aarch64__)
+#define FM_DDS_NEON
+#include <arm_neon.h>
+#endif
+
+#ifndef M_PI
+# define M_PI		3.14159265358979323846	/* pi */
+#endif
+
+#define SIN_TABLE_ORDER	8
+#define SIN_TABLE_SHIFT	(32 - SIN_TABLE_ORDER)
+#define SIN_TABLE_LEN	(1 << SIN_TABLE_ORDER)
+#define ANG_INCR	(0xffffffff / (2 * M_PI))
+
+/* The SIMD kernels look up the first quarter of the sine in 16 byte
+ * tables and mirror it for the other quadrants, which gives exactly the
+ * same values as the full table. The entry at pi/2 (127) is the only
+ * one outside the quarter table. */
+static int8_t sine_table[SIN_TABLE_LEN];
+static int8_t quarter_table[SIN_TABLE_LEN / 4];
+static int sine_table_init = 0;
+
+typedef uint32_t (*fm_dds_kernel_t)(fm_dds_t *dds, int8_t *out, uint32_t count);
+static fm_dds_kernel_t fm_dds_kernel = NULL;
+
+/* negative increments wrap around, which isn't defined for a direct
+ * conversion of double to an unsigned type */
+static inline uint32_t fm_dds_incr(double v)
+{
+	return (uint32_t)(int64_t)v;
+}
+
+/* Start phases of the lanes, and their increment per block. Lane j
+ * produces samples j, j + lanes, j + 2 * lanes, ... so its phase
+ * advances by the sum of the lanes steps in between, which itself
+ * grows by lanes * lanes slopes per block */
+static void fm_dds_lanes(const fm_dds_t *dds, uint32_t lanes,
+			 uint32_t *p, uint32_t *d)
+{
+	uint32_t j, k = dds->slope;
+
+	for (j = 0; j < lanes; j++) {
+		p[j] = dds->phase + j * dds->step + k * (j * (j - 1) / 2);
+		d[j] = lanes * dds->step + k * (lanes * (lanes - 1) / 2) +
+		       lanes * j * k;
+	}
+}
+
+/* state after the kernels produced n samples, p0 is the phase of lane 0 */
+static void fm_dds_advance(fm_dds_t *dds, uint32_t n, uint32_t p0)
+{
+	dds->phase = p0;
+	dds->step += n * dds->slope;
+}
+
+#ifdef FM_DDS_X86
+FM_TARGET("ssse3")
+static inline __m128i fm_sine_ssse3(__m128i b, const __m128i *q)
+{
+	const __m128i c64 = _mm_set1_epi8(64);
+	__m128i s, r, m, lo, hi, l, n;
+
+	/* mirror the index in the second and fourth quadrant */
+	s = _mm_cmpeq_epi8(_mm_and_si128(b, c64), c64);
+	r = _mm_and_si128(b, _mm_set1_epi8(63));
+	m = _mm_add_epi8(_mm_sub_epi8(_mm_xor_si128(r, s), s),
+			 _mm_and_si128(s, c64));
+
+	lo = _mm_and_si128(m, _mm_set1_epi8(0x0f));
+	hi = _mm_and_si128(m, _mm_set1_epi8(0x30));
+
+	l = _mm_and_si128(_mm_shuffle_epi8(q[0], lo),
+			  _mm_cmpeq_epi8(hi, _mm_setzero_si128()));
+	l = _mm_or_si128(l, _mm_and_si128(_mm_shuffle_epi8(q[1], lo),
+			 _mm_cmpeq_epi8(hi, _mm_set1_epi8(0x10))));
+	l = _mm_or_si128(l, _mm_and_si128(_mm_shuffle_epi8(q[2], lo),
+			 _mm_cmpeq_epi8(hi, _mm_set1_epi8(0x20))));
+	l = _mm_or_si128(l, _mm_and_si128(_mm_shuffle_epi8(q[3], lo),
+			 _mm_cmpeq_epi8(hi, _mm_set1_epi8(0x30))));
+	l = _mm_or_si128(l, _mm_and_si128(_mm_cmpeq_epi8(m, c64),
+					  _mm_set1_epi8(127)));
+
+	/* negate in the second half of the period */
+	n = _mm_cmpgt_epi8(_mm_setzero_si128(), b);
+
+	return _mm_sub_epi8(_mm_xor_si128(l, n), n);
+}
+
+FM_TARGET("ssse3")
+static uint32_t fm_dds_gen_ssse3(fm_dds_t *dds, int8_t *out, uint32_t count)
+{
+	uint32_t p[16], d[16], i, j;
+	__m128i vp[4], vd[4], q[4], vk, b;
+
+	fm_dds_lanes(dds, 16, p, d);
+	vk = _mm_set1_epi32(16 * 16 * dds->slope);
+
+	for (j = 0; j < 4; j++) {
+		vp[j] = _mm_loadu_si128((const __m128i *)&p[j * 4]);
+		vd[j] = _mm_loadu_si128((const __m128i *)&d[j * 4]);
+		q[j] = _mm_loadu_si128((const __m128i *)&quarter_table[j * 16]);
+	}
+
+	for (i = 0; i + 16 <= count; i += 16) {
+		b = _mm_packus_epi16(
+			_mm_packs_epi32(_mm_srli_epi32(vp[0], SIN_TABLE_SHIFT),
+					_mm_srli_epi32(vp[1], SIN_TABLE_SHIFT)),
+			_mm_packs_epi32(_mm_srli_epi32(vp[2], SIN_TABLE_SHIFT),
+					_mm_srli_epi32(vp[3], SIN_TABLE_SHIFT)));
+
+		for (j = 0; j < 4; j++) {
+			vp[j] = _mm_add_epi32(vp[j], vd[j]);
+			vd[j] = _mm_add_epi32(vd[j], vk);
+		}
+
+		_mm_storeu_si128((__m128i *)&out[i], fm_sine_ssse3(b, q));
+	}
+
+	fm_dds_advance(dds, i, (uint32_t)_mm_cvtsi128_si32(vp[0]));
+
+	return i;
+}
+
+FM_TARGET("avx2")
+static inline __m256i fm_sine_avx2(__m256i b, const __m256i *q)
+{
+	const __m256i c64 = _mm256_set1_epi8(64);
+	__m256i s, r, m, lo, hi, l, n;
+
+	s = _mm256_cmpeq_epi8(_mm256_and_si256(b, c64), c64);
+	r = _mm256_and_si256(b, _mm256_set1_epi8(63));
+	m = _mm256_add_epi8(_mm256_sub_epi8(_mm256_xor_si256(r, s), s),
+			    _mm256_and_si256(s, c64));
+
+	lo = _mm256_and_si256(m, _mm256_set1_epi8(0x0f));
+	hi = _mm256_and_si256(m, _mm256_set1_epi8(0x30));
+
+	l = _mm256_and_si256(_mm256_shuffle_epi8(q[0], lo),
+			     _mm256_cmpeq_epi8(hi, _mm256_setzero_si256()));
+	l = _mm256_or_si256(l, _mm256_and_si256(_mm256_shuffle_epi8(q[1], lo),
+			    _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(0x10))));
+	l = _mm256_or_si256(l, _mm256_and_si256(_mm256_shuffle_epi8(q[2], lo),
+			    _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(0x20))));
+	l = _mm256_or_si256(l, _mm256_and_si256(_mm256_shuffle_epi8(q[3], lo),
+			    _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(0x30))));
+	l = _mm256_or_si256(l, _mm256_and_si256(_mm256_cmpeq_epi8(m, c64),
+						_mm256_set1_epi8(127)));
+
+	n = _mm256_cmpgt_epi8(_mm256_setzero_si256(), b);
+
+	return _mm256_sub_epi8(_mm256_xor_si256(l, n), n);
+}
+
+FM_TARGET("avx2")
+static uint32_t fm_dds_gen_avx2(fm_dds_t *dds, int8_t *out, uint32_t count)
+{
+	uint32_t p[32], d[32], i, j;
+	__m256i vp[4], vd[4], q[4], vk, b;
+	/* the packs work within 128 bit lanes, restore the sample order */
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+	fm_dds_lanes(dds, 32, p, d);
+	vk = _mm256_set1_epi32(32 * 32 * dds->slope);
+
+	for (j = 0; j < 4; j++) {
+		vp[j] = _mm256_loadu_si256((const __m256i *)&p[j * 8]);
+		vd[j] = _mm256_loadu_si256((const __m256i *)&d[j * 8]);
+		q[j] = _mm256_broadcastsi128_si256(
+			_mm_loadu_si128((const __m128i *)&quarter_table[j * 16]));
+	}
+
+	for (i = 0; i + 32 <= count; i += 32) {
+		b = _mm256_packus_epi16(
+			_mm256_packs_epi32(_mm256_srli_epi32(vp[0], SIN_TABLE_SHIFT),
+					   _mm256_srli_epi32(vp[1], SIN_TABLE_SHIFT)),
+			_mm256_packs_epi32(_mm256_srli_epi32(vp[2], SIN_TABLE_SHIFT),
+					   _mm256_srli_epi32(vp[3], SIN_TABLE_SHIFT)));
+		b = _mm256_permutevar8x32_epi32(b, order);
+
+		for (j = 0; j < 4; j++) {
+			vp[j] = _mm256_add_epi32(vp[j], vd[j]);
+			vd[j] = _mm256_add_epi32(vd[j], vk);
+		}
+
+		_mm256_storeu_si256((__m256i *)&out[i], fm_sine_avx2(b, q));
+	}
+
+	fm_dds_advance(dds, i, (uint32_t)_mm256_extract_epi32(vp[0], 0));
+
+	return i;
+}
+#endif /* FM_DDS_X86 */
+
+#ifdef FM_DDS_NEON
+static uint32_t fm_dds_gen_neon(fm_dds_t *dds, int8_t *out, uint32_t count)
+{
+	uint32_t p[16], d[16], i, j;
+	uint32x4_t vp[4], vd[4], vk;
+	uint8x16x4_t q;
+	uint8x16_t b, r, m, odd, l;
+	int8x16_t sl;
+
+	fm_dds_lanes(dds, 16, p, d);
+	vk = vdupq_n_u32(16 * 16 * dds->slope);
+
+	for (j = 0; j < 4; j++) {
+		vp[j] = vld1q_u32(&p[j * 4]);
+		vd[j] = vld1q_u32(&d[j * 4]);
+		q.val[j] = vld1q_u8((const uint8_t *)&quarter_table[j * 16]);
+	}
+
+	for (i = 0; i + 16 <= count; i += 16) {
+		b = vcombine_u8(
+			vshrn_n_u16(vcombine_u16(vshrn_n_u32(vp[0], 16),
+						 vshrn_n_u32(vp[1], 16)), 8),
+			vshrn_n_u16(vcombine_u16(vshrn_n_u32(vp[2], 16),
+						 vshrn_n_u32(vp[3], 16)), 8));
+
+		for (j = 0; j < 4; j++) {
+			vp[j] = vaddq_u32(vp[j], vd[j]);
+			vd[j] = vaddq_u32(vd[j], vk);
+		}
+
+		odd = vtstq_u8(b, vdupq_n_u8(64));
+		r = vandq_u8(b, vdupq_n_u8(63));
+		m = vbslq_u8(odd, vsubq_u8(vdupq_n_u8(64), r), r);
+
+		/* index 64 is out of range of the table and returns 0 */
+		l = vorrq_u8(vqtbl4q_u8(q, m),
+			     vandq_u8(vceqq_u8(m, vdupq_n_u8(64)),
+				      vdupq_n_u8(127)));
+
+		sl = vreinterpretq_s8_u8(l);
+		sl = vbslq_s8(vcltzq_s8(vreinterpretq_s8_u8(b)), vnegq_s8(sl), sl);
+
+		vst1q_s8(&out[i], sl);
+	}
+
+	fm_dds_advance(dds, i, vgetq_lane_u32(vp[0], 0));
+
+	return i;
+}
+#endif /* FM_DDS_NEON */
+
+static void fm_dds_select(void)
+{
+#ifdef FM_DDS_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+		fm_dds_kernel = fm_dds_gen_avx2;
+	else if (__builtin_cpu_supports("ssse3"))
+		fm_dds_kernel = fm_dds_gen_ssse3;
+#endif
+#ifdef FM_DDS_NEON
+	fm_dds_kernel = fm_dds_gen_neon;
+#endif
+}
+
+void fm_dds_init(fm_dds_t *dds, double sample_rate, double freq, double phase)
+{
+	int i;
+
+	dds->scale = 2 * M_PI * ANG_INCR / sample_rate;
+	dds->phase = fm_dds_incr(phase * ANG_INCR);
+	dds->step = fm_dds_incr(freq * dds->scale);
+	dds->slope = 0;
+
+	/* Initialize sine table, prescaled for 8 bit signed integer */
+	if (!sine_table_init) {
+		double incr = 1.0 / (double)SIN_TABLE_LEN;
+		for (i = 0; i < SIN_TABLE_LEN; i++)
+			sine_table[i] = sin(incr * i * 2 * M_PI) * 127;
+
+		for (i = 0; i < SIN_TABLE_LEN / 4; i++)
+			quarter_table[i] = sine_table[i];
+
+		fm_dds_select();
+		sine_table_init = 1;
+	}
+}
+
+void fm_dds_steps(const fm_dds_t *dds, const double *freq,
+		  const double *slope, uint32_t *step, uint32_t *kslope,
+		  uint32_t n)
+{
+	double scale = dds->scale;
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		step[i] = fm_dds_incr(freq[i] * scale);
+		kslope[i] = fm_dds_incr(slope[i] * scale);
+	}
+}
+
+void fm_dds_gen(fm_dds_t *dds, int8_t *out, uint32_t count)
+{
+	uint32_t phase, step, k, i = 0;
+
+	if (fm_dds_kernel)
+		i = fm_dds_kernel(dds, out, count);
+
+	phase = dds->phase;
+	step = dds->step;
+	k = dds->slope;
+
+	for (; i < count; i++) {
+		out[i] = sine_table[phase >> SIN_TABLE_SHIFT];
+		phase += step;
+		step += k;
+	}
+
+	dds->phase = phase;
+	dds->step = step;
+}
+
+void fm_dds_skip(fm_dds_t *dds, uint32_t count)
+{
+	uint32_t tri = (uint32_t)(((uint64_t)count * (count - 1)) / 2);
+
+	if (!count)
+		return;
+
+	dds->phase += count * dds->step + tri * dds->slope;
+	dds->step += count * dds->slope;
+}
+
+/* thread pool */
+
+struct fm_pool {
+	uint32_t threads;
+	pthread_t *thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t start_cond;
+	pthread_cond_t done_cond;
+	uint32_t generation;		/* incremented for every buffer */
+	uint32_t pending;		/* threads still working on it */
+	int terminate;
+
+	const fm_seg_t *segs;
+	uint32_t nsegs;
+	int8_t *out;
+	uint32_t len;
+};
+
+typedef struct fm_pool_worker {
+	fm_pool_t *pool;
+	uint32_t idx;
+} fm_pool_worker_t;
+
+void fm_seg_gen(const fm_seg_t *segs, uint32_t nsegs, int8_t *out,
+		uint32_t start, uint32_t end)
+{
+	uint32_t lo = 0, hi = nsegs, mid, skip, count;
+	fm_dds_t dds;
+
+	if (start >= end)
+		return;
+
+	/* last segment starting at or before start */
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+
+		if (segs[mid].offset <= start)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	for (; lo < nsegs && segs[lo].offset < end; lo++) {
+		dds = segs[lo].dds;
+		skip = 0;
+
+		if (segs[lo].offset < start) {
+			skip = start - segs[lo].offset;
+			fm_dds_skip(&dds, skip);
+		}
+
+		count = segs[lo].count - skip;
+		if (segs[lo].offset + segs[lo].count > end)
+			count = end - segs[lo].offset - skip;
+
+		fm_dds_gen(&dds, out + segs[lo].offset + skip, count);
+	}
+}
+
+static void *fm_pool_thread(void *arg)
+{
+	fm_pool_worker_t *w = (fm_pool_worker_t *)arg;
+	fm_pool_t *pool = w->pool;
+	uint32_t generation = 0, start, end;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	while (1) {
+		while (!pool->terminate && generation == pool->generation)
+			pthread_cond_wait(&pool->start_cond, &pool->mutex);
+
+		if (pool->terminate)
+			break;
+
+		generation = pool->generation;
+		pthread_mutex_unlock(&pool->mutex);
+
+		/* keep the shares a multiple of the SIMD width */
+		start = (uint32_t)(((uint64_t)pool->len * w->idx / pool->threads) & ~31ULL);
+		end = (w->idx == pool->threads - 1) ? pool->len :
+		      (uint32_t)(((uint64_t)pool->len * (w->idx + 1) / pool->threads) & ~31ULL);
+
+		fm_seg_gen(pool->segs, pool->nsegs, pool->out, start, end);
+
+		pthread_mutex_lock(&pool->mutex);
+		if (!--pool->pending)
+			pthread_cond_signal(&pool->done_cond);
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+	free(w);
+
+	return NULL;
+}
+
+fm_pool_t *fm_pool_create(uint32_t threads)
+{
+	fm_pool_t *pool;
+	fm_pool_worker_t *w;
+	uint32_t i;
+
+	if (!threads)
+		return NULL;
+
+	pool = malloc(sizeof(fm_pool_t));
+	if (!pool)
+		return NULL;
+
+	memset(pool, 0, sizeof(fm_pool_t));
+	pool->thread = malloc(threads * sizeof(pthread_t));
+	if (!pool->thread) {
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->start_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	for (i = 0; i < threads; i++) {
+		w = malloc(sizeof(fm_pool_worker_t));
+		if (!w)
+			break;
+
+		w->pool = pool;
+		w->idx = i;
+
+		if (pthread_create(&pool->thread[i], NULL, fm_pool_thread, w)) {
+			free(w);
+			break;
+		}
+
+		/* the shares are computed from the final thread count */
+		pool->threads = i + 1;
+	}
+
+	if (pool->threads < threads) {
+		fm_pool_destroy(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+void fm_pool_destroy(fm_pool_t *pool)
+{
+	uint32_t i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->terminate = 1;
+	pthread_cond_broadcast(&pool->start_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->threads; i++)
+		pthread_join(pool->thread[i], NULL);
+
+	pthread_mutex_destroy(&pool->mutex);
+	pthread_cond_destroy(&pool->start_cond);
+	pthread_cond_destroy(&pool->done_cond);
+	free(pool->thread);
+	free(pool);
+}
+
+void fm_pool_run(fm_pool_t *pool, const fm_seg_t *segs, uint32_t nsegs,
+		 int8_t *out, uint32_t len)
+{
+	pthread_mutex_lock(&pool->mutex);
+	pool->segs = segs;
+	pool->nsegs = nsegs;
+	pool->out = out;
+	pool->len = len;
+	pool->pending = pool->threads;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start_cond);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+void fm_pool_wait(fm_pool_t *pool)
+{
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->pending)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Mixer */
+
+/* The sums of up to FM_MIX_MAX samples, scaled by 16, fit into 16 bits,
+ * the high half of their product with 4096 / n is the average. The
+ * SIMD kernels and the scalar tail compute exactly the same */
+static inline int8_t fm_mix_scale(int32_t sum, int32_t m)
+{
+	return (int8_t)(((int32_t)(int16_t)(sum * 16) * m) >> 16);
+}
+
+void fm_mix(int8_t *const *in, uint32_t n, int8_t *out, uint32_t len)
+{
+	uint32_t i = 0, k;
+	int32_t m, sum;
+#if defined(FM_DDS_X86) && defined(__SSE2__)
+	__m128i vm, zero = _mm_setzero_si128(), v, s, lo, hi;
+#elif defined(FM_DDS_NEON)
+	int16x4_t vm;
+	int16x8_t lo, hi;
+	int8x16_t v;
+#endif
+
+	if (!n || n > FM_MIX_MAX)
+		return;
+
+	if (n == 1) {
+		memcpy(out, in[0], len);
+		return;
+	}
+
+	m = 4096 / n;
+
+#if defined(FM_DDS_X86) && defined(__SSE2__)
+	vm = _mm_set1_epi16((int16_t)m);
+
+	for (; i + 16 <= len; i += 16) {
+		lo = hi = zero;
+
+		for (k = 0; k < n; k++) {
+			v = _mm_loadu_si128((const __m128i *)&in[k][i]);
+
+			/* sign extend by unpacking into the high bytes */
+			lo = _mm_add_epi16(lo, _mm_srai_epi16(
+					   _mm_unpacklo_epi8(v, v), 8));
+			hi = _mm_add_epi16(hi, _mm_srai_epi16(
+					   _mm_unpackhi_epi8(v, v), 8));
+		}
+
+		lo = _mm_mulhi_epi16(_mm_slli_epi16(lo, 4), vm);
+		hi = _mm_mulhi_epi16(_mm_slli_epi16(hi, 4), vm);
+		s = _mm_packs_epi16(lo, hi);
+		_mm_storeu_si128((__m128i *)&out[i], s);
+	}
+#elif defined(FM_DDS_NEON)
+	vm = vdup_n_s16((int16_t)m);
+
+	for (; i + 16 <= len; i += 16) {
+		lo = hi = vdupq_n_s16(0);
+
+		for (k = 0; k < n; k++) {
+			v = vld1q_s8(&in[k][i]);
+			lo = vaddw_s8(lo, vget_low_s8(v));
+			hi = vaddw_s8(hi, vget_high_s8(v));
+		}
+
+		lo = vshlq_n_s16(lo, 4);
+		hi = vshlq_n_s16(hi, 4);
+		lo = vcombine_s16(vshrn_n_s32(vmull_s16(vget_low_s16(lo), vm), 16),
+				  vshrn_n_s32(vmull_s16(vget_high_s16(lo), vm), 16));
+		hi = vcombine_s16(vshrn_n_s32(vmull_s16(vget_low_s16(hi), vm), 16),
+				  vshrn_n_s32(vmull_s16(vget_high_s16(hi), vm), 16));
+		vst1q_s8(&out[i], vcombine_s8(vmovn_s16(lo), vmovn_s16(hi)));
+	}
+#endif
+
+	for (; i < len; i++) {
+		sum = 0;
+		for (k = 0; k < n; k++)
+			sum += in[k][i];
+
+		out[i] = fm_mix_scale(sum, m);
+	}
+}
+
+/* MPX composer */
+
+#define MPX_TABLE_ORDER	12
+#define MPX_TABLE_SHIFT	(32 - MPX_TABLE_ORDER)
+#define MPX_TABLE_LEN	(1 << MPX_TABLE_ORDER)
+#define MPX_FRAC_MASK	((1 << MPX_TABLE_SHIFT) - 1)
+
+/* number of pilot and subcarrier samples generated at once */
+#define MPX_BLOCK	256
+
+/* one additional entry, so the interpolation doesn't have to wrap */
+static float mpx_table[MPX_TABLE_LEN + 1];
+static pthread_once_t mpx_table_once = PTHREAD_ONCE_INIT;
+
+static void fm_mpx_init_table(void)
+{
+	int i;
+
+	for (i = 0; i <= MPX_TABLE_LEN; i++)
+		mpx_table[i] = sin(2 * M_PI * i / MPX_TABLE_LEN);
+}
+
+static inline float fm_mpx_sin(uint32_t phase)
+{
+	uint32_t i = phase >> MPX_TABLE_SHIFT;
+	float frac = (phase & MPX_FRAC_MASK) * (1.0f / (MPX_FRAC_MASK + 1));
+
+	return mpx_table[i] + frac * (mpx_table[i + 1] - mpx_table[i]);
+}
+
+void fm_mpx_init(fm_mpx_t *mpx, double sample_rate, double pilot_freq,
+		 int use_rds)
+{
+	/* headroom for the RDS signal */
+	double norm = use_rds ? 10 : 9;
+
+	pthread_once(&mpx_table_once, fm_mpx_init_table);
+
+	mpx->phase = 0;
+	mpx->step = fm_dds_incr(pilot_freq * 2 * M_PI * ANG_INCR / sample_rate);
+
+	/* 4.05 * (L + R) / 2 and 4.05 * (L - R) / 2, from 16 bit samples */
+	mpx->mono = 4.05 / (2 * 32767.0) / norm;
+	mpx->pilot = 0.9 / norm;
+	mpx->rds = 1 / norm;
+}
+
+/* mix count frames into the composite signal */
+static void fm_mpx_mix(const fm_mpx_t *mpx, const int16_t *audio,
+		       const float *pilot, const float *sub, const float *rds,
+		       float *out, uint32_t count)
+{
+	uint32_t i = 0;
+	float l, r;
+#if defined(FM_DDS_X86) && defined(__SSE2__)
+	const __m128i sum = _mm_set1_epi32(0x00010001);
+	const __m128i diff = _mm_set1_epi32((int)0xffff0001);
+	const __m128 gm = _mm_set1_ps(mpx->mono);
+	const __m128 gp = _mm_set1_ps(mpx->pilot);
+	const __m128 gr = _mm_set1_ps(mpx->rds);
+	__m128i v;
+	__m128 lpr, lmr, o;
+
+	for (; i + 4 <= count; i += 4) {
+		/* pairwise multiply-add of L, R gives L + R and L - R */
+		v = _mm_loadu_si128((const __m128i *)&audio[i * 2]);
+		lpr = _mm_cvtepi32_ps(_mm_madd_epi16(v, sum));
+		lmr = _mm_cvtepi32_ps(_mm_madd_epi16(v, diff));
+
+		o = _mm_add_ps(lpr, _mm_mul_ps(lmr, _mm_loadu_ps(&sub[i])));
+		o = _mm_mul_ps(o, gm);
+		o = _mm_add_ps(o, _mm_mul_ps(_mm_loadu_ps(&pilot[i]), gp));
+
+		if (rds)
+			o = _mm_add_ps(o, _mm_mul_ps(_mm_loadu_ps(&rds[i]), gr));
+
+		_mm_storeu_ps(&out[i], o);
+	}
+#elif defined(FM_DDS_NEON)
+	const float32x4_t gm = vdupq_n_f32(mpx->mono);
+	const float32x4_t gp = vdupq_n_f32(mpx->pilot);
+	const float32x4_t gr = vdupq_n_f32(mpx->rds);
+	int16x4x2_t v;
+	float32x4_t lpr, lmr, o;
+
+	for (; i + 4 <= count; i += 4) {
+		v = vld2_s16(&audio[i * 2]);
+		lpr = vcvtq_f32_s32(vaddl_s16(v.val[0], v.val[1]));
+		lmr = vcvtq_f32_s32(vsubl_s16(v.val[0], v.val[1]));
+
+		o = vmlaq_f32(lpr, lmr, vld1q_f32(&sub[i]));
+		o = vmulq_f32(o, gm);
+		o = vmlaq_f32(o, vld1q_f32(&pilot[i]), gp);
+
+		if (rds)
+			o = vmlaq_f32(o, vld1q_f32(&rds[i]), gr);
+
+		vst1q_f32(&out[i], o);
+	}
+#endif
+
+	for (; i < count; i++) {
+		l = audio[i * 2];
+		r = audio[i * 2 + 1];
+
+		out[i] = mpx->mono * ((l + r) + (l - r) * sub[i]) +
+			 mpx->pilot * pilot[i];
+
+		if (rds)
+			out[i] += mpx->rds * rds[i];
+	}
+}
+
+void fm_mpx_stereo(fm_mpx_t *mpx, const int16_t *audio, const float *rds,
+		   float *out, uint32_t count)
+{
+	float pilot[MPX_BLOCK], sub[MPX_BLOCK];
+	uint32_t phase = mpx->phase, step = mpx->step;
+	uint32_t i, j, n;
+
+	for (i = 0; i < count; i += n) {
+		n = count - i;
+		if (n > MPX_BLOCK)
+			n = MPX_BLOCK;
+
+		/* the doubled phase wraps around twice per pilot period */
+		for (j = 0; j < n; j++) {
+			pilot[j] = fm_mpx_sin(phase);
+			sub[j] = fm_mpx_sin(phase * 2);
+			phase += step;
+		}
+
+		fm_mpx_mix(mpx, &audio[i * 2], pilot, sub,
+			   rds ? &rds[i] : NULL, &out[i], n);
+	}
+
+	mpx->phase = phase;
+}
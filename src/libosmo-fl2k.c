@@ -20,6 +20,10 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE	/* pthread_setaffinity_np() */
+#endif
+
 #include <errno.h>
 #include <signal.h>
 #include <string.h>
@@ -28,13 +32,21 @@
 #include <math.h>
 #include <libusb.h>
 #include <pthread.h>
+#include <time.h>
 
 #ifndef _WIN32
 #include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
 #define sleep_ms(ms)	usleep(ms*1000)
+#define sleep_us(us)	usleep(us)
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #else
 #include <windows.h>
 #define sleep_ms(ms)	Sleep(ms)
+#define sleep_us(us)	Sleep(((us) + 999) / 1000)
 #endif
 
 /*
@@ -54,6 +66,10 @@
 #endif
 
 #include "osmo-fl2k.h"
+#include "fl2k_convert.h"
+#include "fl2k_stats.h"
+#include "fl2k_ring.h"
+#include "fl2k_null.h"
 
 enum fl2k_async_status {
 	FL2K_INACTIVE = 0,
@@ -61,49 +77,132 @@ enum fl2k_async_status {
 	FL2K_RUNNING
 };
 
-typedef enum fl2k_buf_state {
-	BUF_EMPTY = 0,
-	BUF_SUBMITTED,
-	BUF_FILLED,
-} fl2k_buf_state_t;
+enum fl2k_tx_mode {
+	FL2K_TX_CALLBACK = 0,	/* convert application buffers */
+	FL2K_TX_DIRECT,		/* application fills transfer buffers */
+	FL2K_TX_WRITE,		/* application calls fl2k_write_samples() */
+	FL2K_TX_PERIODIC,	/* the same transfers are resubmitted */
+};
 
 typedef struct fl2k_xfer_info {
 	fl2k_dev_t *dev;
-	uint64_t seq;
-	fl2k_buf_state_t state;
+	uint32_t idx;
 } fl2k_xfer_info_t;
 
+/* FIFO of transfer indices, handed over between the sample worker and
+ * the libusb callback */
+typedef struct fl2k_xfer_queue {
+	fl2k_ring_t ring;
+	uint32_t *slot;
+} fl2k_xfer_queue_t;
+
+/* a batch of fl2k_submit_reg_ops(), queued for the control worker */
+typedef struct fl2k_reg_batch {
+	fl2k_reg_op_t *ops;
+	uint32_t num;
+	fl2k_reg_cb_t cb;
+	void *ctx;
+	struct fl2k_reg_batch *next;
+} fl2k_reg_batch_t;
+
+struct fl2k_group {
+	libusb_context *ctx;		/* NULL with null devices */
+	pthread_t event_thread;
+	pthread_mutex_t mutex;		/* protects the device list */
+	fl2k_dev_t *devs;
+	int terminate;
+};
+
 struct fl2k_dev {
 	libusb_context *ctx;
+	fl2k_group_t *group;		/* NULL if not part of a group */
+	fl2k_dev_t *group_next;
+	fl2k_dev_t *finish_next;	/* stopped, to be cleaned up by the group */
+	enum fl2k_async_status finish_status;
+	int armed;			/* transfers wait for fl2k_group_start() */
 	struct libusb_device_handle *devh;
+	fl2k_null_t *null;		/* virtual device instead of devh */
 	uint32_t xfer_num;
 	uint32_t xfer_buf_num;
 	uint32_t xfer_buf_len;
+	uint32_t cfg_buf_len;		/* set by fl2k_set_buffer_config() */
+	uint32_t cfg_buf_num;
+	uint32_t cfg_inflight;
 	struct libusb_transfer **xfer;
 	unsigned char **xfer_buf;
 
 	fl2k_xfer_info_t *xfer_info;
+	fl2k_xfer_queue_t empty_queue;	/* filled by callback, drained by sample worker */
+	fl2k_xfer_queue_t filled_queue;	/* filled by sample worker, drained by callback */
+
+	const fl2k_convert_kernel_t *convert;
+	fl2k_quantize_fn_t quantize;
+	fl2k_dither_state_t dither[3];	/* per channel, kept across buffers */
 
 	fl2k_tx_cb_t cb;
 	void *cb_ctx;
+	enum fl2k_tx_mode tx_mode;
 	enum fl2k_async_status async_status;
 	int async_cancel;
 
 	int use_zerocopy;
-	int terminate;
+	int zerocopy_broken;		/* the usbfs mmap() bug was detected */
+	int terminate;			/* persistent workers have to exit */
+
+	/* with a persistent pool, the transfers, their buffers and the
+	 * workers are kept after stopping, for the next start */
+	int persistent;
+	uint32_t pool_num;		/* transfers allocated */
+	uint32_t pool_len;		/* of their buffers */
 
 	/* thread related */
 	pthread_t usb_worker_thread;
 	pthread_t sample_worker_thread;
+	int usb_worker_alive;
+	int sample_worker_alive;
+	uint32_t tx_gen;		/* incremented on every start */
+	uint32_t usb_gen;		/* last start run by the USB worker */
+	uint32_t sample_gen;		/* last start run by the sample worker */
+	uint32_t sample_done_gen;	/* last start the sample worker finished */
 	pthread_mutex_t buf_mutex;
 	pthread_cond_t buf_cond;
+	int thread_cpu[2];		/* indexed by enum fl2k_thread */
+	int thread_prio[2];
+	int use_mlock;
+
+	/* register and I2C operations, the control worker is started with
+	 * the first batch submitted */
+	pthread_mutex_t ctrl_mutex;	/* held while a batch is executed */
+	pthread_mutex_t ctrl_queue_mutex;
+	pthread_cond_t ctrl_cond;
+	fl2k_reg_batch_t *ctrl_head;
+	fl2k_reg_batch_t *ctrl_tail;
+	pthread_t ctrl_thread;
+	int ctrl_alive;
+	int ctrl_exit;
+
+	/* fl2k_write_samples() state */
+	int wr_idx;			/* transfer being filled, -1 if none */
+	uint32_t wr_pos;		/* samples already in that transfer */
+	uint32_t wr_carry_len;		/* samples of an incomplete block */
+	char wr_carry[3][8];
+	uint8_t wr_offset;
+	uint32_t writers;		/* threads inside fl2k_write_samples() */
+
+	/* waveform of fl2k_start_tx_periodic(), only while starting */
+	const char *periodic[3];
+	uint32_t periodic_len;
+	uint32_t underflows_reported;
 
 	double rate; /* Hz */
+	uint32_t max_rate;		/* from the buffer profile, 0 if none */
 
 	/* status */
 	int dev_lost;
 	int driver_active;
-	uint32_t underflow_cnt;
+	fl2k_atomic_t underflow_cnt;
+	fl2k_atomic64_t sample_cnt;	/* samples of completed transfers */
+	fl2k_stats_state_t stats;
 };
 
 typedef struct fl2k_dongle {
@@ -118,11 +217,44 @@ static fl2k_dongle_t known_devices[] = {
 
 #define DEFAULT_BUF_NUMBER	4
 
+/* upper limit of the transfer buffers for a periodic waveform */
+#define PERIODIC_MAX_BYTES	(256 * 1024 * 1024)
+
 #define CTRL_IN		(LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN)
 #define CTRL_OUT	(LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT)
 #define CTRL_TIMEOUT	300
 #define BULK_TIMEOUT	0
 
+/* I2C controller registers, and the status bits of the control one */
+#define I2C_CTRL_REG	0x8020
+#define I2C_RDATA_REG	0x8024
+#define I2C_WDATA_REG	0x8028
+#define I2C_DONE	(1U << 31)
+#define I2C_ERR		(0x0fU << 24)
+
+/* a 4 byte access takes a few ms on the bus at most, the completion is
+ * polled for with an interval doubling from the minimum to the maximum */
+#define I2C_POLL_MIN_US	100
+#define I2C_POLL_MAX_US	1000
+#define I2C_TIMEOUT_NS	100000000ULL
+
+/* the slowest clock, set during initialization */
+#define FL2K_INIT_CLOCK	0x00416f3f
+
+/* The USB accesses of a device, which go to the null device instead of
+ * libusb if it is a virtual one */
+static int fl2k_control_transfer(fl2k_dev_t *dev, uint8_t request_type,
+				 uint8_t request, uint16_t index,
+				 unsigned char *data, uint16_t len)
+{
+	if (dev->null)
+		return fl2k_null_control(dev->null, request_type, index,
+					 data, len);
+
+	return libusb_control_transfer(dev->devh, request_type, request,
+				       0, index, data, len, CTRL_TIMEOUT);
+}
+
 static int fl2k_read_reg(fl2k_dev_t *dev, uint16_t reg, uint32_t *val)
 {
 	int r;
@@ -131,8 +263,7 @@ static int fl2k_read_reg(fl2k_dev_t *dev, uint16_t reg, uint32_t *val)
 	if (!dev || !val)
 		return FL2K_ERROR_INVALID_PARAM;
 
-	r = libusb_control_transfer(dev->devh, CTRL_IN, 0x40,
-				    0, reg, data, 4, CTRL_TIMEOUT);
+	r = fl2k_control_transfer(dev, CTRL_IN, 0x40, reg, data, 4);
 
 	if (r < 4)
 		fprintf(stderr, "Error, short read from register!\n");
@@ -154,8 +285,7 @@ static int fl2k_write_reg(fl2k_dev_t *dev, uint16_t reg, uint32_t val)
 	data[2] = (val >> 16) & 0xff;
 	data[3] = (val >> 24) & 0xff;
 
-	return libusb_control_transfer(dev->devh, CTRL_OUT, 0x41,
-				       0, reg, data, 4, CTRL_TIMEOUT);
+	return fl2k_control_transfer(dev, CTRL_OUT, 0x41, reg, data, 4);
 }
 
 int fl2k_init_device(fl2k_dev_t *dev)
@@ -168,7 +298,7 @@ int fl2k_init_device(fl2k_dev_t *dev)
 
 	/* set DAC freq to lowest value possible to avoid
 	 * underrun during init */
-	fl2k_write_reg(dev, 0x802c, 0x00416f3f);
+	fl2k_write_reg(dev, 0x802c, FL2K_INIT_CLOCK);
 
 	fl2k_write_reg(dev, 0x8048, 0x7ffb8004);
 	fl2k_write_reg(dev, 0x803c, 0xd701004d);
@@ -225,48 +355,166 @@ static double fl2k_reg_to_freq(uint32_t reg)
 	return sample_clock;
 }
 
-int fl2k_set_sample_rate(fl2k_dev_t *dev, uint32_t target_freq)
+/* All rates reachable with the PLL, sorted by rate. If several register
+ * settings result in the same rate, the one with the least phase noise
+ * is kept, see fl2k_build_rate_table() */
+typedef struct fl2k_rate {
+	double rate;
+	uint32_t reg;
+	uint32_t prio;			/* lower is preferred */
+} fl2k_rate_t;
+
+#define FL2K_MAX_RATES		(4 * 62 * 15)
+
+static fl2k_rate_t rate_table[FL2K_MAX_RATES];
+static uint32_t rate_table_len;
+static pthread_once_t rate_table_once = PTHREAD_ONCE_INIT;
+
+static int fl2k_rate_cmp(const void *a, const void *b)
 {
-	double sample_clock, error, last_error = 1e20f;
-	uint32_t reg = 0, result_reg = 0;
-	uint8_t div, mult, frac, out_div;
+	const fl2k_rate_t *ra = (const fl2k_rate_t *)a;
+	const fl2k_rate_t *rb = (const fl2k_rate_t *)b;
 
-	if (!dev)
-		return FL2K_ERROR_INVALID_PARAM;
+	if (ra->rate != rb->rate)
+		return (ra->rate < rb->rate) ? -1 : 1;
+
+	return (ra->prio < rb->prio) ? -1 : (ra->prio > rb->prio);
+}
+
+static void fl2k_build_rate_table(void)
+{
+	uint32_t reg, i, n = 0;
+	uint8_t div, mult, frac, out_div;
 
 	/* Output divider (accepts value 1-15) 
 	 * works, but adds lots of phase noise, so do not use it */
 	out_div = 1;
 
 	/* Observation: PLL multiplier of 7 works, but has more phase
-	 * noise. Prefer multiplier 6 and 5 */
+	 * noise. Prefer multiplier 6 and 5. The order of the loops
+	 * determines the preference for settings with the same rate. */
 	for (mult = 6; mult >= 3; mult--) {
 		for (div = 63; div > 1; div--) {
 			for (frac = 1; frac <= 15; frac++) {
 				reg =  (mult << 20) | (frac << 16) |
 				       (0x60 << 8) | (out_div << 8) | div;
 
-				sample_clock = fl2k_reg_to_freq(reg);
-				error = sample_clock - (double)target_freq;
-
-				/* Keep closest match */
-				if (fabs(error) < last_error) {
-					result_reg = reg;
-					last_error = fabs(error);
-				}
+				rate_table[n].rate = fl2k_reg_to_freq(reg);
+				rate_table[n].reg = reg;
+				rate_table[n].prio = n;
+				n++;
 			}
 		}
 	}
 
-	sample_clock = fl2k_reg_to_freq(result_reg);
-	error = sample_clock - (double)target_freq;
-	dev->rate = sample_clock;
+	qsort(rate_table, n, sizeof(fl2k_rate_t), fl2k_rate_cmp);
+
+	/* remove duplicates, keeping the preferred setting */
+	rate_table_len = 0;
+	for (i = 0; i < n; i++) {
+		if (rate_table_len &&
+		    rate_table[rate_table_len - 1].rate == rate_table[i].rate)
+			continue;
+
+		rate_table[rate_table_len++] = rate_table[i];
+	}
+}
+
+/* find the closest rate, ties are resolved by the preference */
+static const fl2k_rate_t *fl2k_find_rate(double target_freq)
+{
+	uint32_t lo = 0, hi, mid;
+	const fl2k_rate_t *below, *above;
+	double err_below, err_above;
+
+	pthread_once(&rate_table_once, fl2k_build_rate_table);
+
+	/* first entry >= target */
+	hi = rate_table_len;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if (rate_table[mid].rate < target_freq)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (0 == lo)
+		return &rate_table[0];
+
+	if (rate_table_len == lo)
+		return &rate_table[rate_table_len - 1];
+
+	below = &rate_table[lo - 1];
+	above = &rate_table[lo];
+	err_below = fabs(below->rate - target_freq);
+	err_above = fabs(above->rate - target_freq);
+
+	if (err_below == err_above)
+		return (below->prio < above->prio) ? below : above;
+
+	return (err_below < err_above) ? below : above;
+}
+
+int fl2k_get_supported_rates(double *rates, uint32_t len)
+{
+	uint32_t i;
+
+	pthread_once(&rate_table_once, fl2k_build_rate_table);
+
+	for (i = 0; rates && i < len && i < rate_table_len; i++)
+		rates[i] = rate_table[i].rate;
+
+	return (int)rate_table_len;
+}
+
+int fl2k_plan_sample_rate(double target_freq, double *exact_freq, double *ratio)
+{
+	const fl2k_rate_t *r;
+
+	if (target_freq <= 0)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	r = fl2k_find_rate(target_freq);
+
+	if (exact_freq)
+		*exact_freq = r->rate;
+
+	if (ratio)
+		*ratio = r->rate / target_freq;
+
+	return 0;
+}
+
+int fl2k_set_sample_rate(fl2k_dev_t *dev, uint32_t target_freq)
+{
+	const fl2k_rate_t *r;
+	double error;
+
+	if (!dev)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	r = fl2k_find_rate((double)target_freq);
+	error = r->rate - (double)target_freq;
+	dev->rate = r->rate;
+
+	if (dev->null)
+		fl2k_null_set_rate(dev->null, dev->rate);
+
+	/* the transfers completed so far were output with the old rate */
+	fl2k_stats_rate_reset(&dev->stats);
 
 	if (fabs(error) > 1)
 		fprintf(stderr, "Requested sample rate %d not possible, using"
-		                " %f, error is %f\n", target_freq, sample_clock, error); 
+		                " %f, error is %f\n", target_freq, r->rate, error); 
+
+	if (dev->max_rate && dev->rate > dev->max_rate)
+		fprintf(stderr, "WARNING: Sample rate %f is above %u, the "
+				"highest one the buffer profile was found to "
+				"sustain\n", dev->rate, dev->max_rate);
 
-	return fl2k_write_reg(dev, 0x802c, result_reg);
+	return fl2k_write_reg(dev, 0x802c, r->reg);
 }
 
 uint32_t fl2k_get_sample_rate(fl2k_dev_t *dev)
@@ -277,6 +525,14 @@ uint32_t fl2k_get_sample_rate(fl2k_dev_t *dev)
 	return (uint32_t)dev->rate;
 }
 
+double fl2k_get_exact_sample_rate(fl2k_dev_t *dev)
+{
+	if (!dev)
+		return 0;
+
+	return dev->rate;
+}
+
 static fl2k_dongle_t *find_known_device(uint16_t vid, uint16_t pid)
 {
 	unsigned int i;
@@ -292,708 +548,2572 @@ static fl2k_dongle_t *find_known_device(uint16_t vid, uint16_t pid)
 	return device;
 }
 
-uint32_t fl2k_get_device_count(void)
-{
-	int i,r;
+/* libusb 1.0.16 added hotplug support and libusb_get_port_numbers() */
+#if LIBUSB_API_VERSION >= 0x01000102
+#define HAVE_LIBUSB_HOTPLUG
+#endif
+
+#define FL2K_MAX_PORTS		7	/* maximum depth of USB 3.0 hubs */
+
+typedef struct fl2k_enum_dev {
+	libusb_device *device;		/* referenced */
+	int serial_read;		/* retried until the device opens */
+	int present;			/* seen by the last scan */
+	uint8_t bus;
+	uint8_t ports[FL2K_MAX_PORTS];
+	int num_ports;
+	uint8_t addr;
+	fl2k_device_info_t info;
+} fl2k_enum_dev_t;
+
+/* The device list of the library, sorted by USB path. With hotplug
+ * support the callbacks only run from libusb_handle_events*() on the
+ * context of the list, which is only called by fl2k_enum_update(), so
+ * they are called with the mutex held as well. */
+static struct {
+	pthread_mutex_t mutex;
 	libusb_context *ctx;
-	libusb_device **list;
-	uint32_t device_count = 0;
-	struct libusb_device_descriptor dd;
-	ssize_t cnt;
+	int hotplug;
+	fl2k_enum_dev_t *devs;
+	uint32_t num;
+	uint32_t size;
+} fl2k_enum = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, NULL, 0, 0 };
 
-	r = libusb_init(&ctx);
-	if (r < 0)
+static uint32_t fl2k_speed_mbps(int speed)
+{
+	switch (speed) {
+	case LIBUSB_SPEED_LOW:
+		return 1;
+	case LIBUSB_SPEED_FULL:
+		return 12;
+	case LIBUSB_SPEED_HIGH:
+		return 480;
+	case LIBUSB_SPEED_SUPER:
+		return 5000;
+#if LIBUSB_API_VERSION >= 0x01000106
+	case LIBUSB_SPEED_SUPER_PLUS:
+		return 10000;
+#endif
+	default:
 		return 0;
+	}
+}
 
-	cnt = libusb_get_device_list(ctx, &list);
+/* format the USB path the way the Linux kernel does, as in "2-1.4".
+ * Without the port numbers, which older libusb versions can't tell, the
+ * device address is used instead, as in "2@5", so the path is unique
+ * although it changes when the device is reconnected. */
+static void fl2k_device_path(libusb_device *device, char *path, uint8_t *bus,
+			     uint8_t *ports, int *num_ports)
+{
+	int i, n = 0, len;
 
-	for (i = 0; i < cnt; i++) {
-		libusb_get_device_descriptor(list[i], &dd);
+	*bus = libusb_get_bus_number(device);
+#ifdef HAVE_LIBUSB_HOTPLUG
+	n = libusb_get_port_numbers(device, ports, FL2K_MAX_PORTS);
+	if (n < 0)
+		n = 0;
+#endif
+	*num_ports = n;
 
-		if (find_known_device(dd.idVendor, dd.idProduct))
-			device_count++;
+	if (!n) {
+		snprintf(path, FL2K_PATH_LEN, "%u@%u", *bus,
+			 libusb_get_device_address(device));
+		return;
 	}
 
-	libusb_free_device_list(list, 1);
+	len = snprintf(path, FL2K_PATH_LEN, "%u", *bus);
+	for (i = 0; i < n && len < FL2K_PATH_LEN; i++)
+		len += snprintf(path + len, FL2K_PATH_LEN - len, "%c%u",
+				i ? '.' : '-', ports[i]);
+}
+
+static int fl2k_enum_cmp(const void *a, const void *b)
+{
+	const fl2k_enum_dev_t *x = a, *y = b;
+	int i;
+
+	if (x->bus != y->bus)
+		return x->bus - y->bus;
 
-	libusb_exit(ctx);
+	for (i = 0; i < x->num_ports && i < y->num_ports; i++) {
+		if (x->ports[i] != y->ports[i])
+			return x->ports[i] - y->ports[i];
+	}
+
+	if (x->num_ports != y->num_ports)
+		return x->num_ports - y->num_ports;
 
-	return device_count;
+	return x->addr - y->addr;
 }
 
-const char *fl2k_get_device_name(uint32_t index)
+static fl2k_enum_dev_t *fl2k_enum_find(libusb_device *device)
 {
-	int i,r;
-	libusb_context *ctx;
-	libusb_device **list;
-	struct libusb_device_descriptor dd;
-	fl2k_dongle_t *device = NULL;
-	uint32_t device_count = 0;
-	ssize_t cnt;
+	uint32_t i;
 
-	r = libusb_init(&ctx);
-	if (r < 0)
-		return "";
+	for (i = 0; i < fl2k_enum.num; i++) {
+		if (fl2k_enum.devs[i].device == device)
+			return &fl2k_enum.devs[i];
+	}
 
-	cnt = libusb_get_device_list(ctx, &list);
+	return NULL;
+}
 
-	for (i = 0; i < cnt; i++) {
-		libusb_get_device_descriptor(list[i], &dd);
+static void fl2k_enum_add(libusb_device *device)
+{
+	struct libusb_device_descriptor dd;
+	fl2k_dongle_t *dongle;
+	fl2k_enum_dev_t *e;
+	uint32_t size;
 
-		device = find_known_device(dd.idVendor, dd.idProduct);
+	e = fl2k_enum_find(device);
+	if (e) {
+		e->present = 1;
+		return;
+	}
 
-		if (device) {
-			device_count++;
+	libusb_get_device_descriptor(device, &dd);
+	dongle = find_known_device(dd.idVendor, dd.idProduct);
+	if (!dongle)
+		return;
 
-			if (index == device_count - 1)
-				break;
-		}
+	if (fl2k_enum.num == fl2k_enum.size) {
+		size = fl2k_enum.size ? fl2k_enum.size * 2 : 8;
+		e = realloc(fl2k_enum.devs, size * sizeof(fl2k_enum_dev_t));
+		if (!e)
+			return;
+
+		fl2k_enum.devs = e;
+		fl2k_enum.size = size;
 	}
 
-	libusb_free_device_list(list, 1);
+	e = &fl2k_enum.devs[fl2k_enum.num++];
+	memset(e, 0, sizeof(fl2k_enum_dev_t));
+	e->device = libusb_ref_device(device);
+	e->present = 1;
+	e->info.name = dongle->name;
+	e->info.vid = dd.idVendor;
+	e->info.pid = dd.idProduct;
+	e->info.speed = fl2k_speed_mbps(libusb_get_device_speed(device));
+	fl2k_device_path(device, e->info.path, &e->bus, e->ports,
+			 &e->num_ports);
+	e->addr = libusb_get_device_address(device);
+
+	/* without a serial number string, there is nothing to read */
+	e->serial_read = !dd.iSerialNumber;
+}
 
-	libusb_exit(ctx);
+static void fl2k_enum_remove(fl2k_enum_dev_t *e)
+{
+	uint32_t i = e - fl2k_enum.devs;
 
-	if (device)
-		return device->name;
-	else
-		return "";
+	libusb_unref_device(e->device);
+	fl2k_enum.num--;
+	memmove(e, e + 1, (fl2k_enum.num - i) * sizeof(fl2k_enum_dev_t));
 }
 
-int fl2k_open(fl2k_dev_t **out_dev, uint32_t index)
+#ifdef HAVE_LIBUSB_HOTPLUG
+static int LIBUSB_CALL fl2k_hotplug_cb(libusb_context *ctx,
+				       libusb_device *device,
+				       libusb_hotplug_event event, void *arg)
 {
-	int r;
-	int i;
-	libusb_device **list;
-	fl2k_dev_t *dev = NULL;
-	libusb_device *device = NULL;
-	uint32_t device_count = 0;
-	struct libusb_device_descriptor dd;
-	uint8_t reg;
-	ssize_t cnt;
-
-	dev = malloc(sizeof(fl2k_dev_t));
-	if (NULL == dev)
-		return -ENOMEM;
+	fl2k_enum_dev_t *e;
 
-	memset(dev, 0, sizeof(fl2k_dev_t));
+	(void)ctx;
+	(void)arg;
 
-	r = libusb_init(&dev->ctx);
-	if(r < 0){
-		free(dev);
-		return -1;
+	if (LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED == event) {
+		fl2k_enum_add(device);
+	} else {
+		e = fl2k_enum_find(device);
+		if (e)
+			fl2k_enum_remove(e);
 	}
 
-#if LIBUSB_API_VERSION >= 0x01000106
-	libusb_set_option(dev->ctx, LIBUSB_OPTION_LOG_LEVEL, 3);
-#else
-	libusb_set_debug(dev->ctx, 3);
+	return 0;
+}
 #endif
 
-	dev->dev_lost = 1;
+static void fl2k_enum_scan(void)
+{
+	libusb_device **list;
+	ssize_t cnt, i;
+	uint32_t j;
 
-	cnt = libusb_get_device_list(dev->ctx, &list);
+	cnt = libusb_get_device_list(fl2k_enum.ctx, &list);
+	if (cnt < 0)
+		return;
 
-	for (i = 0; i < cnt; i++) {
-		device = list[i];
+	for (j = 0; j < fl2k_enum.num; j++)
+		fl2k_enum.devs[j].present = 0;
 
-		libusb_get_device_descriptor(list[i], &dd);
+	for (i = 0; i < cnt; i++)
+		fl2k_enum_add(list[i]);
 
-		if (find_known_device(dd.idVendor, dd.idProduct)) {
-			device_count++;
-		}
+	for (j = 0; j < fl2k_enum.num; ) {
+		if (fl2k_enum.devs[j].present)
+			j++;
+		else
+			fl2k_enum_remove(&fl2k_enum.devs[j]);
+	}
 
-		if (index == device_count - 1)
-			break;
+	libusb_free_device_list(list, 1);
+}
 
-		device = NULL;
-	}
+static void fl2k_enum_read_serial(fl2k_enum_dev_t *e)
+{
+	struct libusb_device_descriptor dd;
+	libusb_device_handle *devh;
+	unsigned char serial[FL2K_SERIAL_LEN];
+	int r;
 
-	if (!device) {
-		r = -1;
-		goto err;
-	}
+	/* fails while another process has just claimed the device, or
+	 * before udev has fixed the permissions of a new one */
+	if (libusb_open(e->device, &devh) < 0)
+		return;
 
-	r = libusb_open(device, &dev->devh);
-	libusb_free_device_list(list, 1);
-	if (r < 0) {
-		fprintf(stderr, "usb_open error %d\n", r);
-		if(r == LIBUSB_ERROR_ACCESS)
-			fprintf(stderr, "Please fix the device permissions, e.g. "
-			"by installing the udev rules file\n");
-		goto err;
-	}
+	libusb_get_device_descriptor(e->device, &dd);
+	r = libusb_get_string_descriptor_ascii(devh, dd.iSerialNumber, serial,
+					       sizeof(serial));
+	libusb_close(devh);
 
-	/* If the adapter has an SPI flash for the Windows driver, we
-	 * need to detach the USB mass storage driver first in order to
-	 * open the device */
-	if (libusb_kernel_driver_active(dev->devh, 3) == 1) {
-		fprintf(stderr, "Kernel mass storage driver is attached, "
-				"detaching driver. This may take more than"
-				" 10 seconds!\n");
-		r = libusb_detach_kernel_driver(dev->devh, 3);
-		if (r < 0) {
-			fprintf(stderr, "Failed to detach mass storage "
-					"driver: %d\n", r);
-			goto err;
-		}
-	}
+	if (r < 0)
+		return;
 
-	r = libusb_claim_interface(dev->devh, 0);
-	if (r < 0) {
-		fprintf(stderr, "usb_claim_interface 0 error %d\n", r);
-		goto err;
-	}
+	snprintf(e->info.serial, FL2K_SERIAL_LEN, "%s", serial);
+	e->serial_read = 1;
+}
 
-	r = libusb_set_interface_alt_setting(dev->devh, 0, 1);
-	if (r < 0) {
-		fprintf(stderr, "Failed to switch interface 0 to "
-				"altsetting 1, trying to use interface 1\n");
+/* call with the mutex held */
+static int fl2k_enum_update(void)
+{
+	struct timeval tv = { 0, 0 };
+	uint32_t i;
+	int r;
 
-		r = libusb_claim_interface(dev->devh, 1);
+	if (!fl2k_enum.ctx) {
+		r = libusb_init(&fl2k_enum.ctx);
 		if (r < 0) {
-			fprintf(stderr, "Could not claim interface 1: %d\n", r);
+			fl2k_enum.ctx = NULL;
+			return FL2K_ERROR_NO_DEVICE;
 		}
-	}
 
-	r = fl2k_init_device(dev);
-	if (r < 0)
-		goto err;
+#ifdef HAVE_LIBUSB_HOTPLUG
+		fl2k_enum.hotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG);
+
+		/* the devices already connected are added right away */
+		for (i = 0; fl2k_enum.hotplug &&
+		     i < sizeof(known_devices)/sizeof(fl2k_dongle_t); i++) {
+			r = libusb_hotplug_register_callback(fl2k_enum.ctx,
+				LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+				LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+				LIBUSB_HOTPLUG_ENUMERATE, known_devices[i].vid,
+				known_devices[i].pid, LIBUSB_HOTPLUG_MATCH_ANY,
+				fl2k_hotplug_cb, NULL, NULL);
+			if (r < 0)
+				fl2k_enum.hotplug = 0;
+		}
+#endif
+	}
 
-	dev->dev_lost = 0;
+	if (fl2k_enum.hotplug)
+		libusb_handle_events_timeout_completed(fl2k_enum.ctx, &tv, NULL);
+	else
+		fl2k_enum_scan();
 
-found:
-	*out_dev = dev;
+	qsort(fl2k_enum.devs, fl2k_enum.num, sizeof(fl2k_enum_dev_t),
+	      fl2k_enum_cmp);
 
-	return 0;
-err:
-	if (dev) {
-		if (dev->ctx)
-			libusb_exit(dev->ctx);
+	for (i = 0; i < fl2k_enum.num; i++) {
+		if (!fl2k_enum.devs[i].serial_read)
+			fl2k_enum_read_serial(&fl2k_enum.devs[i]);
 
-		free(dev);
+		fl2k_enum.devs[i].info.index = i;
 	}
 
-	return r;
+	return 0;
 }
 
-int fl2k_close(fl2k_dev_t *dev)
+static void fl2k_null_info(uint32_t index, fl2k_device_info_t *info)
 {
-	if (!dev)
+	memset(info, 0, sizeof(fl2k_device_info_t));
+	info->index = index;
+	info->name = "FL2K null device";
+	snprintf(info->path, FL2K_PATH_LEN, "null-%u", index);
+	snprintf(info->serial, FL2K_SERIAL_LEN, "NULL%04u", index);
+}
+
+int fl2k_get_device_list(fl2k_device_info_t *info, uint32_t len)
+{
+	uint32_t i, num;
+
+	if (!info && len)
 		return FL2K_ERROR_INVALID_PARAM;
 
-	if(!dev->dev_lost) {
-		/* block until all async operations have been completed (if any) */
-		while (FL2K_INACTIVE != dev->async_status)
-			sleep_ms(100);
+	/* the virtual devices replace the USB ones */
+	num = fl2k_null_device_count();
+	if (num) {
+		for (i = 0; i < num && i < len; i++)
+			fl2k_null_info(i, &info[i]);
 
-		fl2k_deinit_device(dev);
+		return (int)num;
 	}
 
-	libusb_release_interface(dev->devh, 0);
-	libusb_close(dev->devh);
-	libusb_exit(dev->ctx);
+	pthread_mutex_lock(&fl2k_enum.mutex);
 
-	free(dev);
+	if (fl2k_enum_update() < 0) {
+		pthread_mutex_unlock(&fl2k_enum.mutex);
+		return 0;
+	}
 
-	return 0;
+	num = fl2k_enum.num;
+	for (i = 0; i < num && i < len; i++)
+		info[i] = fl2k_enum.devs[i].info;
+
+	pthread_mutex_unlock(&fl2k_enum.mutex);
+
+	return (int)num;
 }
 
-static struct libusb_transfer *fl2k_get_next_xfer(fl2k_dev_t *dev,
-					          fl2k_buf_state_t state)
+static int fl2k_info_match(const fl2k_device_info_t *info, uint32_t index,
+			   const char *serial, const char *path)
 {
-	unsigned int i;
-	int next_buf = -1;
-	uint64_t next_seq = 0;
-	fl2k_xfer_info_t *xfer_info;
+	if (serial)
+		return !strcmp(info->serial, serial);
 
-	for (i = 0; i < dev->xfer_buf_num; i++) {
-		xfer_info = (fl2k_xfer_info_t *)dev->xfer[i]->user_data;
-		if (!xfer_info)
-			continue;
+	if (path)
+		return !strcmp(info->path, path);
+
+	return info->index == index;
+}
 
-		if (xfer_info->state == state) {
-			if (state == BUF_EMPTY) {
-				return dev->xfer[i];
-			} else if ((xfer_info->seq < next_seq) || next_buf < 0) {
-				next_seq = xfer_info->seq;
-				next_buf = i;
+/* find a device by serial number, by path if serial is NULL, or by
+ * index if both are NULL. A serial number or path that several devices
+ * share isn't found, rather than opening the wrong one. */
+static int fl2k_lookup_device(uint32_t index, const char *serial,
+			      const char *path, fl2k_device_info_t *info)
+{
+	fl2k_device_info_t null_info;
+	uint32_t i, num;
+	int r = FL2K_ERROR_NOT_FOUND;
+
+	num = fl2k_null_device_count();
+	if (num) {
+		for (i = 0; i < num; i++) {
+			fl2k_null_info(i, &null_info);
+			if (fl2k_info_match(&null_info, index, serial, path)) {
+				*info = null_info;
+				return 0;
 			}
 		}
+
+		return r;
 	}
 
-	if ((state == BUF_FILLED) && (next_buf >= 0))
-		return dev->xfer[next_buf];
-	else
-		return NULL;
+	pthread_mutex_lock(&fl2k_enum.mutex);
+
+	if (fl2k_enum_update() < 0) {
+		pthread_mutex_unlock(&fl2k_enum.mutex);
+		return r;
+	}
+
+	for (i = 0; i < fl2k_enum.num; i++) {
+		if (!fl2k_info_match(&fl2k_enum.devs[i].info, index, serial,
+				     path))
+			continue;
+
+		if (!r) {
+			r = FL2K_ERROR_NOT_FOUND;
+			break;
+		}
+
+		*info = fl2k_enum.devs[i].info;
+		r = 0;
+	}
+
+	pthread_mutex_unlock(&fl2k_enum.mutex);
+
+	return r;
+}
+
+uint32_t fl2k_get_device_count(void)
+{
+	int num = fl2k_get_device_list(NULL, 0);
+
+	return num > 0 ? (uint32_t)num : 0;
+}
+
+const char *fl2k_get_device_name(uint32_t index)
+{
+	fl2k_device_info_t info;
+
+	if (fl2k_lookup_device(index, NULL, NULL, &info) < 0)
+		return "";
+
+	return info.name;
+}
+
+int fl2k_get_index_by_serial(const char *serial)
+{
+	fl2k_device_info_t info;
+	int r;
+
+	if (!serial)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	r = fl2k_lookup_device(0, serial, NULL, &info);
+
+	return r < 0 ? r : (int)info.index;
+}
+
+int fl2k_get_index_by_path(const char *path)
+{
+	fl2k_device_info_t info;
+	int r;
+
+	if (!path)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	r = fl2k_lookup_device(0, NULL, path, &info);
+
+	return r < 0 ? r : (int)info.index;
+}
+
+static int _fl2k_open(fl2k_dev_t **out_dev, const fl2k_device_info_t *info,
+		      fl2k_group_t *group)
+{
+	int r;
+	int i;
+	libusb_device **list;
+	fl2k_dev_t *dev = NULL;
+	libusb_device *device = NULL;
+	struct libusb_device_descriptor dd;
+	char path[FL2K_PATH_LEN];
+	uint8_t bus, ports[FL2K_MAX_PORTS];
+	int num_ports;
+	ssize_t cnt;
+
+	dev = malloc(sizeof(fl2k_dev_t));
+	if (NULL == dev)
+		return -ENOMEM;
+
+	memset(dev, 0, sizeof(fl2k_dev_t));
+
+	dev->convert = fl2k_convert_select();
+	dev->quantize = fl2k_quantize_select();
+	dev->cfg_buf_len = FL2K_XFER_LEN;
+	dev->cfg_inflight = DEFAULT_BUF_NUMBER;
+	dev->thread_cpu[FL2K_THREAD_USB] = -1;
+	dev->thread_cpu[FL2K_THREAD_SAMPLE] = -1;
+	pthread_mutex_init(&dev->buf_mutex, NULL);
+	pthread_cond_init(&dev->buf_cond, NULL);
+	pthread_mutex_init(&dev->ctrl_mutex, NULL);
+	pthread_mutex_init(&dev->ctrl_queue_mutex, NULL);
+	pthread_cond_init(&dev->ctrl_cond, NULL);
+	fl2k_stats_init(&dev->stats);
+
+	if (fl2k_null_device_count()) {
+		dev->group = group;
+		dev->null = fl2k_null_open(info->index);
+		if (!dev->null) {
+			r = -1;
+			goto err;
+		}
+
+		r = fl2k_init_device(dev);
+		if (r < 0)
+			goto err;
+
+		fl2k_null_set_rate(dev->null, fl2k_reg_to_freq(FL2K_INIT_CLOCK));
+		goto found;
+	}
+
+	if (group) {
+		/* share the context of the group */
+		dev->group = group;
+		dev->ctx = group->ctx;
+	} else {
+		r = libusb_init(&dev->ctx);
+		if(r < 0){
+			pthread_mutex_destroy(&dev->buf_mutex);
+			pthread_cond_destroy(&dev->buf_cond);
+			pthread_mutex_destroy(&dev->ctrl_mutex);
+			pthread_mutex_destroy(&dev->ctrl_queue_mutex);
+			pthread_cond_destroy(&dev->ctrl_cond);
+			fl2k_stats_destroy(&dev->stats);
+			free(dev);
+			return -1;
+		}
+
+#if LIBUSB_API_VERSION >= 0x01000106
+		libusb_set_option(dev->ctx, LIBUSB_OPTION_LOG_LEVEL, 3);
+#else
+		libusb_set_debug(dev->ctx, 3);
+#endif
+	}
+
+	dev->dev_lost = 1;
+
+	/* the device list of the library belongs to another context, the
+	 * device is looked up again by its path */
+	cnt = libusb_get_device_list(dev->ctx, &list);
+
+	for (i = 0; i < cnt; i++) {
+		libusb_get_device_descriptor(list[i], &dd);
+
+		if (!find_known_device(dd.idVendor, dd.idProduct))
+			continue;
+
+		fl2k_device_path(list[i], path, &bus, ports, &num_ports);
+		if (!strcmp(path, info->path)) {
+			device = list[i];
+			break;
+		}
+	}
+
+	if (!device) {
+		if (cnt >= 0)
+			libusb_free_device_list(list, 1);
+		r = -1;
+		goto err;
+	}
+
+	r = libusb_open(device, &dev->devh);
+	libusb_free_device_list(list, 1);
+	if (r < 0) {
+		fprintf(stderr, "usb_open error %d\n", r);
+		if(r == LIBUSB_ERROR_ACCESS)
+			fprintf(stderr, "Please fix the device permissions, e.g. "
+			"by installing the udev rules file\n");
+		goto err;
+	}
+
+	/* If the adapter has an SPI flash for the Windows driver, we
+	 * need to detach the USB mass storage driver first in order to
+	 * open the device */
+	if (libusb_kernel_driver_active(dev->devh, 3) == 1) {
+		fprintf(stderr, "Kernel mass storage driver is attached, "
+				"detaching driver. This may take more than"
+				" 10 seconds!\n");
+		r = libusb_detach_kernel_driver(dev->devh, 3);
+		if (r < 0) {
+			fprintf(stderr, "Failed to detach mass storage "
+					"driver: %d\n", r);
+			goto err;
+		}
+	}
+
+	r = libusb_claim_interface(dev->devh, 0);
+	if (r < 0) {
+		fprintf(stderr, "usb_claim_interface 0 error %d\n", r);
+		goto err;
+	}
+
+	r = libusb_set_interface_alt_setting(dev->devh, 0, 1);
+	if (r < 0) {
+		fprintf(stderr, "Failed to switch interface 0 to "
+				"altsetting 1, trying to use interface 1\n");
+
+		r = libusb_claim_interface(dev->devh, 1);
+		if (r < 0) {
+			fprintf(stderr, "Could not claim interface 1: %d\n", r);
+		}
+	}
+
+	r = fl2k_init_device(dev);
+	if (r < 0)
+		goto err;
+
+	dev->dev_lost = 0;
+
+found:
+	if (group) {
+		pthread_mutex_lock(&group->mutex);
+		dev->group_next = group->devs;
+		group->devs = dev;
+		pthread_mutex_unlock(&group->mutex);
+	}
+
+	*out_dev = dev;
+
+	return 0;
+err:
+	if (dev) {
+		if (dev->ctx && !group)
+			libusb_exit(dev->ctx);
+
+		fl2k_null_close(dev->null);
+
+		pthread_mutex_destroy(&dev->buf_mutex);
+		pthread_cond_destroy(&dev->buf_cond);
+		pthread_mutex_destroy(&dev->ctrl_mutex);
+		pthread_mutex_destroy(&dev->ctrl_queue_mutex);
+		pthread_cond_destroy(&dev->ctrl_cond);
+		fl2k_stats_destroy(&dev->stats);
+		free(dev);
+	}
+
+	return r;
+}
+
+int fl2k_open(fl2k_dev_t **out_dev, uint32_t index)
+{
+	fl2k_device_info_t info;
+	int r;
+
+	r = fl2k_lookup_device(index, NULL, NULL, &info);
+	if (r < 0)
+		return r;
+
+	return _fl2k_open(out_dev, &info, NULL);
+}
+
+int fl2k_open_by_serial(fl2k_dev_t **out_dev, const char *serial)
+{
+	fl2k_device_info_t info;
+	int r;
+
+	if (!serial)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	r = fl2k_lookup_device(0, serial, NULL, &info);
+	if (r < 0)
+		return r;
+
+	return _fl2k_open(out_dev, &info, NULL);
+}
+
+int fl2k_open_by_path(fl2k_dev_t **out_dev, const char *path)
+{
+	fl2k_device_info_t info;
+	int r;
+
+	if (!path)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	r = fl2k_lookup_device(0, NULL, path, &info);
+	if (r < 0)
+		return r;
+
+	return _fl2k_open(out_dev, &info, NULL);
+}
+
+int fl2k_open_by_name(fl2k_dev_t **out_dev, const char *name)
+{
+	int r;
+
+	if (!name || !*name)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	if (strspn(name, "0123456789") == strlen(name))
+		return fl2k_open(out_dev, (uint32_t)atoi(name));
+
+	/* opened directly, looking up the index first would enumerate
+	 * twice and could open another device */
+	r = fl2k_open_by_path(out_dev, name);
+	if (FL2K_ERROR_NOT_FOUND == r)
+		r = fl2k_open_by_serial(out_dev, name);
+
+	return r;
+}
+
+static int _fl2k_free_async_buffers(fl2k_dev_t *dev);
+static void fl2k_free_pool(fl2k_dev_t *dev);
+
+static void fl2k_group_remove(fl2k_dev_t *dev)
+{
+	fl2k_group_t *group = dev->group;
+	fl2k_dev_t **p;
+
+	pthread_mutex_lock(&group->mutex);
+	for (p = &group->devs; *p; p = &(*p)->group_next) {
+		if (*p == dev) {
+			*p = dev->group_next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&group->mutex);
+}
+
+int fl2k_close(fl2k_dev_t *dev)
+{
+	if (!dev)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	/* complete the queued register operations */
+	if (dev->ctrl_alive) {
+		pthread_mutex_lock(&dev->ctrl_queue_mutex);
+		dev->ctrl_exit = 1;
+		pthread_cond_signal(&dev->ctrl_cond);
+		pthread_mutex_unlock(&dev->ctrl_queue_mutex);
+		pthread_join(dev->ctrl_thread, NULL);
+	}
+
+	if(!dev->dev_lost) {
+		/* block until all async operations have been completed (if any) */
+		while (FL2K_INACTIVE != dev->async_status)
+			sleep_ms(100);
+
+		fl2k_deinit_device(dev);
+	}
+
+	if (dev->group) {
+		/* the event thread of the group frees the transfers, unless
+		 * they are persistent */
+		while (dev->xfer && !dev->persistent)
+			sleep_ms(100);
+
+		fl2k_group_remove(dev);
+	}
+
+	fl2k_free_pool(dev);
+
+	if (dev->null) {
+		fl2k_null_close(dev->null);
+	} else {
+		libusb_release_interface(dev->devh, 0);
+		libusb_close(dev->devh);
+
+		if (!dev->group)
+			libusb_exit(dev->ctx);
+	}
+
+	pthread_mutex_destroy(&dev->buf_mutex);
+	pthread_cond_destroy(&dev->buf_cond);
+	pthread_mutex_destroy(&dev->ctrl_mutex);
+	pthread_mutex_destroy(&dev->ctrl_queue_mutex);
+	pthread_cond_destroy(&dev->ctrl_cond);
+	fl2k_stats_destroy(&dev->stats);
+	free(dev);
+
+	return 0;
+}
+
+static int fl2k_xfer_queue_alloc(fl2k_xfer_queue_t *queue, uint32_t len)
+{
+	uint32_t size = fl2k_ring_size_for(len);
+
+	queue->slot = malloc(size * sizeof(uint32_t));
+	if (!queue->slot)
+		return FL2K_ERROR_NO_MEM;
+
+	fl2k_ring_init(&queue->ring, size);
+
+	return 0;
+}
+
+static void fl2k_xfer_queue_free(fl2k_xfer_queue_t *queue)
+{
+	free(queue->slot);
+	queue->slot = NULL;
+}
+
+/* the queue is sized to hold all transfers, so this can't fail */
+static void fl2k_xfer_queue_push(fl2k_xfer_queue_t *queue, uint32_t idx)
+{
+	queue->slot[fl2k_ring_write_pos(&queue->ring)] = idx;
+	fl2k_ring_write_commit(&queue->ring, 1);
+}
+
+static int fl2k_xfer_queue_pop(fl2k_xfer_queue_t *queue)
+{
+	int idx;
+
+	if (!fl2k_ring_read_avail(&queue->ring))
+		return -1;
+
+	idx = queue->slot[fl2k_ring_read_pos(&queue->ring)];
+	fl2k_ring_read_commit(&queue->ring, 1);
+
+	return idx;
+}
+
+static void fl2k_wake_sample_worker(fl2k_dev_t *dev)
+{
+	pthread_mutex_lock(&dev->buf_mutex);
+	pthread_cond_broadcast(&dev->buf_cond);
+	pthread_mutex_unlock(&dev->buf_mutex);
+}
+
+static int fl2k_submit_transfer(fl2k_dev_t *dev, struct libusb_transfer *xfer)
+{
+	if (dev->null)
+		return fl2k_null_submit(dev->null, xfer);
+
+	return libusb_submit_transfer(xfer);
+}
+
+static int fl2k_cancel_transfer(fl2k_dev_t *dev, struct libusb_transfer *xfer)
+{
+	if (dev->null)
+		return fl2k_null_cancel(dev->null, xfer);
+
+	return libusb_cancel_transfer(xfer);
+}
+
+static int fl2k_handle_events(fl2k_dev_t *dev, struct timeval *tv,
+			      int *completed)
+{
+	if (dev->null)
+		return fl2k_null_handle_events(dev->null, tv, completed);
+
+	return libusb_handle_events_timeout_completed(dev->ctx, tv, completed);
+}
+
+static void LIBUSB_CALL _libusb_callback(struct libusb_transfer *xfer)
+{
+	fl2k_xfer_info_t *xfer_info = (fl2k_xfer_info_t *)xfer->user_data;
+	fl2k_dev_t *dev = (fl2k_dev_t *)xfer_info->dev;
+	uint64_t start = fl2k_time_ns();
+	uint32_t depth;
+	int next_idx;
+	int r = 0;
+
+	if (LIBUSB_TRANSFER_COMPLETED == xfer->status) {
+		fl2k_atomic64_store(&dev->sample_cnt,
+				    fl2k_atomic64_load(&dev->sample_cnt) +
+				    dev->xfer_buf_len / 3);
+
+		if (FL2K_TX_PERIODIC == dev->tx_mode) {
+			/* the transfers hold consecutive parts of the
+			 * waveform and are submitted round robin, the one
+			 * after those in flight is not pending */
+			if (FL2K_RUNNING == dev->async_status) {
+				next_idx = (xfer_info->idx + dev->xfer_num) %
+					   dev->xfer_buf_num;
+				r = fl2k_submit_transfer(dev, dev->xfer[next_idx]);
+				fl2k_stats_completion(&dev->stats, start,
+						      dev->xfer_buf_len / 3,
+						      dev->xfer_buf_num -
+						      dev->xfer_num,
+						      r ? 0 : dev->xfer_buf_len, 0);
+			}
+		} else if (FL2K_RUNNING == dev->async_status) {
+			/* resubmit transfer */
+			/* get next transfer */
+			depth = fl2k_ring_read_avail(&dev->filled_queue.ring);
+			next_idx = fl2k_xfer_queue_pop(&dev->filled_queue);
+
+			if (next_idx >= 0) {
+				/* Submit next filled transfer */
+				r = fl2k_submit_transfer(dev, dev->xfer[next_idx]);
+				fl2k_stats_completion(&dev->stats, start,
+						      dev->xfer_buf_len / 3, depth,
+						      r ? 0 : dev->xfer_buf_len, 0);
+				fl2k_xfer_queue_push(&dev->empty_queue,
+						     xfer_info->idx);
+				fl2k_wake_sample_worker(dev);
+			} else {
+				/* We need to re-submit the transfer
+				 * in any case, as otherwise the device
+				 * stops to output data and hangs
+				 * (happens only in the hacked 'gapless'
+				 * mode without HSYNC and VSYNC)  */
+				r = fl2k_submit_transfer(dev, xfer);
+				fl2k_stats_completion(&dev->stats, start,
+						      dev->xfer_buf_len / 3, depth,
+						      r ? 0 : dev->xfer_buf_len, 1);
+				fl2k_atomic_store_release(&dev->underflow_cnt,
+					fl2k_atomic_load_relaxed(&dev->underflow_cnt) + 1);
+				fl2k_wake_sample_worker(dev);
+			}
+		}
+	}
+
+	if (((LIBUSB_TRANSFER_CANCELLED != xfer->status) &&
+	     (LIBUSB_TRANSFER_COMPLETED != xfer->status)) ||
+	     (r == LIBUSB_ERROR_NO_DEVICE)) {
+			dev->dev_lost = 1;
+			fl2k_stop_tx(dev);
+			fl2k_wake_sample_worker(dev);
+			fprintf(stderr, "cb transfer status: %d, submit "
+				"transfer %d, canceling...\n", xfer->status, r);
+	}
+}
+
+/* apply the affinity and scheduling settings to the calling worker,
+ * failing is not fatal, as it needs privileges we might not have */
+static void fl2k_setup_thread(fl2k_dev_t *dev, enum fl2k_thread thread)
+{
+	const char *name = (FL2K_THREAD_USB == thread) ? "USB" : "sample";
+	int cpu = dev->thread_cpu[thread];
+	struct sched_param param;
+#ifdef __linux__
+	cpu_set_t set;
+
+	if (cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+			fprintf(stderr, "WARNING: Failed to pin %s worker "
+					"to CPU %d\n", name, cpu);
+	}
+#else
+	if (cpu >= 0)
+		fprintf(stderr, "WARNING: CPU affinity not supported on this "
+				"platform\n");
+#endif
+
+	if (dev->thread_prio[thread] > 0) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = dev->thread_prio[thread];
+
+		if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param))
+			fprintf(stderr, "WARNING: Failed to set real-time "
+					"priority of %s worker, insufficient "
+					"privileges?\n", name);
+	}
+}
+
+#define FL2K_HUGEPAGE_LEN	(2 * 1024 * 1024)
+#define FL2K_MAX_NUMA_NODES	1024
+#define FL2K_MPOL_PREFERRED	1
+
+/* in front of every buffer of fl2k_alloc_buffer(), padded to
+ * FL2K_BUF_ALIGN so the buffer itself stays aligned */
+typedef struct fl2k_alloc_hdr {
+	void *base;			/* of the allocation */
+	size_t len;
+	int mapped;			/* by mmap() instead of the heap */
+} fl2k_alloc_hdr_t;
+
+#ifdef __linux__
+/* the node of the PCI device which the root hub of the bus belongs to,
+ * -1 if unknown */
+static int fl2k_numa_node(fl2k_dev_t *dev)
+{
+	char path[64];
+	FILE *f;
+	int node = -1;
+
+	if (!dev || dev->null || !dev->devh)
+		return -1;
+
+	snprintf(path, sizeof(path), "/sys/bus/usb/devices/usb%u/../numa_node",
+		 libusb_get_bus_number(libusb_get_device(dev->devh)));
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	if (fscanf(f, "%d", &node) != 1)
+		node = -1;
+
+	fclose(f);
+
+	return node;
+}
+
+/* has to be done before the pages are touched for the first time,
+ * libnuma isn't needed for the single system call */
+static void fl2k_bind_node(void *addr, size_t len, int node)
+{
+#ifdef SYS_mbind
+	unsigned long mask[FL2K_MAX_NUMA_NODES / (8 * sizeof(unsigned long))];
+
+	if (node < 0 || node >= FL2K_MAX_NUMA_NODES)
+		return;
+
+	memset(mask, 0, sizeof(mask));
+	mask[node / (8 * sizeof(unsigned long))] =
+		1UL << (node % (8 * sizeof(unsigned long)));
+
+	/* only a preference, the kernel falls back to other nodes */
+	syscall(SYS_mbind, addr, len, FL2K_MPOL_PREFERRED, mask,
+		FL2K_MAX_NUMA_NODES + 1, 0);
+#else
+	(void)addr;
+	(void)len;
+	(void)node;
+#endif
+}
+
+/* anonymous mapping which is zero filled by the kernel, the length is
+ * updated if it had to be rounded up */
+static void *fl2k_map_buffer(size_t *len, unsigned int flags)
+{
+	size_t huge_len = (*len + FL2K_HUGEPAGE_LEN - 1) &
+			  ~(size_t)(FL2K_HUGEPAGE_LEN - 1);
+	uint8_t *p, *aligned;
+
+	if (!(flags & FL2K_ALLOC_HUGEPAGE)) {
+		p = mmap(NULL, *len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		return (MAP_FAILED != p) ? p : NULL;
+	}
+
+	*len = huge_len;
+
+#ifdef MAP_HUGETLB
+	/* reserved huge pages, if the administrator set some aside */
+	p = mmap(NULL, huge_len, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (MAP_FAILED != p)
+		return p;
+#endif
+
+	/* otherwise transparent huge pages, which need a region aligned
+	 * to their size, the excess is unmapped again */
+	p = mmap(NULL, huge_len + FL2K_HUGEPAGE_LEN, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == p)
+		return NULL;
+
+	aligned = (uint8_t *)(((uintptr_t)p + FL2K_HUGEPAGE_LEN - 1) &
+			      ~(uintptr_t)(FL2K_HUGEPAGE_LEN - 1));
+
+	if (aligned > p)
+		munmap(p, aligned - p);
+	if (aligned < p + FL2K_HUGEPAGE_LEN)
+		munmap(aligned + huge_len, p + FL2K_HUGEPAGE_LEN - aligned);
+
+#ifdef MADV_HUGEPAGE
+	madvise(aligned, huge_len, MADV_HUGEPAGE);
+#endif
+
+	return aligned;
+}
+#endif
+
+void *fl2k_alloc_buffer(fl2k_dev_t *dev, size_t len, unsigned int flags)
+{
+	fl2k_alloc_hdr_t *hdr;
+	void *base = NULL;
+	size_t total = len + FL2K_BUF_ALIGN;
+	int mapped = 0;
+
+#ifdef __linux__
+	if (flags) {
+		base = fl2k_map_buffer(&total, flags);
+		if (!base)
+			return NULL;
+
+		if (flags & FL2K_ALLOC_NUMA)
+			fl2k_bind_node(base, total, fl2k_numa_node(dev));
+
+		mapped = 1;
+	}
+#else
+	(void)dev;
+	(void)flags;
+#endif
+
+	if (!mapped) {
+#ifdef _WIN32
+		base = _aligned_malloc(total, FL2K_BUF_ALIGN);
+#else
+		if (posix_memalign(&base, FL2K_BUF_ALIGN, total))
+			base = NULL;
+#endif
+		if (!base)
+			return NULL;
+
+		memset(base, 0, total);
+	}
+
+	hdr = base;
+	hdr->base = base;
+	hdr->len = total;
+	hdr->mapped = mapped;
+
+	return (uint8_t *)base + FL2K_BUF_ALIGN;
+}
+
+void fl2k_free_buffer(void *buf)
+{
+	fl2k_alloc_hdr_t *hdr;
+
+	if (!buf)
+		return;
+
+	hdr = (fl2k_alloc_hdr_t *)((uint8_t *)buf - FL2K_BUF_ALIGN);
+
+#ifdef __linux__
+	if (hdr->mapped) {
+		munmap(hdr->base, hdr->len);
+		return;
+	}
+#endif
+
+#ifdef _WIN32
+	_aligned_free(hdr->base);
+#else
+	free(hdr->base);
+#endif
+}
+
+/* keep the transfer buffers from being paged out, zerocopy buffers
+ * are kernel memory and locked anyway */
+static void fl2k_lock_buffers(fl2k_dev_t *dev, int lock)
+{
+#ifndef _WIN32
+	unsigned int i;
+
+	if (!dev->use_mlock || dev->use_zerocopy || !dev->xfer_buf)
+		return;
+
+	for (i = 0; i < dev->pool_num; ++i) {
+		if (!dev->xfer_buf[i])
+			continue;
+
+		if (!lock) {
+			munlock(dev->xfer_buf[i], dev->pool_len);
+		} else if (mlock(dev->xfer_buf[i], dev->pool_len) < 0) {
+			fprintf(stderr, "WARNING: Failed to lock transfer "
+					"buffers in memory, check "
+					"RLIMIT_MEMLOCK (ulimit -l)\n");
+			break;
+		}
+	}
+#endif
+}
+
+static uint32_t fl2k_gcd(uint32_t a, uint32_t b)
+{
+	uint32_t t;
+
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+/* convert the periodic waveform into the transfer buffers, transfer i
+ * starts at sample i * buf_len of the repeated waveform */
+static int fl2k_fill_periodic(fl2k_dev_t *dev)
+{
+	uint32_t buf_len = dev->xfer_buf_len / 3, len = dev->periodic_len;
+	uint32_t i, c, pos, n, done, nbufs;
+	char *tmp[3] = { NULL, NULL, NULL };
+	int r = 0;
+
+	/* the buffers repeat after len / gcd(len, buf_len) transfers */
+	nbufs = len / fl2k_gcd(len, buf_len);
+
+	for (c = 0; c < 3; c++) {
+		if (!dev->periodic[c])
+			continue;
+
+		tmp[c] = malloc(buf_len);
+		if (!tmp[c]) {
+			r = FL2K_ERROR_NO_MEM;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < dev->xfer_buf_num; i++) {
+		if (i >= nbufs) {
+			memcpy(dev->xfer_buf[i], dev->xfer_buf[i % nbufs],
+			       dev->xfer_buf_len);
+			continue;
+		}
+
+		for (c = 0; c < 3; c++) {
+			if (!tmp[c])
+				continue;
+
+			pos = (uint32_t)(((uint64_t)i * buf_len) % len);
+			for (done = 0; done < buf_len; done += n, pos = 0) {
+				n = len - pos;
+				if (n > buf_len - done)
+					n = buf_len - done;
+
+				memcpy(tmp[c] + done, dev->periodic[c] + pos, n);
+			}
+		}
+
+		dev->convert->convert((char *)dev->xfer_buf[i], tmp[0], tmp[1],
+				      tmp[2], dev->xfer_buf_len, 0);
+	}
+
+out:
+	for (c = 0; c < 3; c++)
+		free(tmp[c]);
+
+	return r;
+}
+
+static const char *incr_usbfs = "Please increase your allowed usbfs buffer"
+				" size with the following command:\n"
+				"echo 0 > /sys/module/usbcore/parameters/"
+				"usbfs_memory_mb\n";
+
+static int fl2k_alloc_transfers(fl2k_dev_t *dev)
+{
+	unsigned int i, flags;
+
+	dev->pool_num = dev->xfer_buf_num;
+	dev->pool_len = dev->xfer_buf_len;
+
+	dev->xfer = malloc(dev->xfer_buf_num * sizeof(struct libusb_transfer *));
+
+	for (i = 0; i < dev->xfer_buf_num; ++i)
+		dev->xfer[i] = libusb_alloc_transfer(0);
+
+	dev->xfer_buf = malloc(dev->xfer_buf_num * sizeof(unsigned char *));
+	memset(dev->xfer_buf, 0, dev->xfer_buf_num * sizeof(unsigned char *));
+
+	dev->xfer_info = malloc(dev->xfer_buf_num * sizeof(fl2k_xfer_info_t));
+	memset(dev->xfer_info, 0, dev->xfer_buf_num * sizeof(fl2k_xfer_info_t));
+
+	if (fl2k_xfer_queue_alloc(&dev->empty_queue, dev->xfer_buf_num) < 0 ||
+	    fl2k_xfer_queue_alloc(&dev->filled_queue, dev->xfer_buf_num) < 0)
+		return FL2K_ERROR_NO_MEM;
+
+#if defined (__linux__) && LIBUSB_API_VERSION >= 0x01000105
+	/* the null device has no kernel buffers, and the result of the check
+	 * for the mmap() bug holds as long as the device is open */
+	dev->use_zerocopy = !dev->null && !dev->zerocopy_broken;
+	if (dev->use_zerocopy)
+		fprintf(stderr, "Allocating %d zero-copy buffers\n",
+			dev->xfer_buf_num);
+
+	for (i = 0; dev->use_zerocopy && i < dev->xfer_buf_num; ++i) {
+		dev->xfer_buf[i] = libusb_dev_mem_alloc(dev->devh, dev->xfer_buf_len);
+
+		if (dev->xfer_buf[i]) {
+			/* Check if Kernel usbfs mmap() bug is present: if the
+			 * mapping is correct, the buffers point to memory that
+			 * was memset to 0 by the Kernel, otherwise, they point
+			 * to random memory. We check if the buffers are zeroed
+			 * and otherwise fall back to buffers in userspace.
+			 */
+			if (dev->xfer_buf[i][0] || memcmp(dev->xfer_buf[i],
+							  dev->xfer_buf[i] + 1,
+							  dev->xfer_buf_len - 1)) {
+				fprintf(stderr, "Detected Kernel usbfs mmap() "
+						"bug, falling back to buffers "
+						"in userspace\n");
+				dev->use_zerocopy = 0;
+				dev->zerocopy_broken = 1;
+				break;
+			}
+		} else {
+			fprintf(stderr, "Failed to allocate zero-copy "
+					"buffer for transfer %d\n%sFalling "
+					"back to buffers in userspace\n",
+					i, incr_usbfs);
+			dev->use_zerocopy = 0;
+			break;
+		}
+	}
+
+	/* zero-copy buffer allocation failed (partially or completely)
+	 * we need to free the buffers again if already allocated */
+	if (!dev->use_zerocopy) {
+		for (i = 0; i < dev->xfer_buf_num; ++i) {
+			if (dev->xfer_buf[i])
+				libusb_dev_mem_free(dev->devh,
+						    dev->xfer_buf[i],
+						    dev->xfer_buf_len);
+		}
+	}
+#endif
+
+	/* no zero-copy available, allocate buffers in userspace, small ones
+	 * would waste most of a huge page */
+	if (!dev->use_zerocopy) {
+		flags = FL2K_ALLOC_NUMA;
+		if (dev->xfer_buf_len >= FL2K_HUGEPAGE_LEN)
+			flags |= FL2K_ALLOC_HUGEPAGE;
+
+		for (i = 0; i < dev->xfer_buf_num; ++i) {
+			dev->xfer_buf[i] = fl2k_alloc_buffer(dev,
+							     dev->xfer_buf_len,
+							     flags);
+
+			if (!dev->xfer_buf[i])
+				return FL2K_ERROR_NO_MEM;
+		}
+
+		fl2k_lock_buffers(dev, 1);
+	}
+
+	return 0;
+}
+
+static int fl2k_alloc_submit_transfers(fl2k_dev_t *dev)
+{
+	unsigned int i;
+	int r = 0;
+
+	if (!dev)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	if (dev->xfer && dev->pool_num == dev->xfer_buf_num &&
+	    dev->pool_len == dev->xfer_buf_len) {
+		/* a persistent pool of the same configuration, only the
+		 * transfers submitted first need to be cleared, the others
+		 * are filled before being submitted */
+		for (i = 0; i < dev->xfer_num; ++i)
+			memset(dev->xfer_buf[i], 0, dev->xfer_buf_len);
+
+		fl2k_ring_init(&dev->empty_queue.ring,
+			       fl2k_ring_size_for(dev->xfer_buf_num));
+		fl2k_ring_init(&dev->filled_queue.ring,
+			       fl2k_ring_size_for(dev->xfer_buf_num));
+	} else {
+		_fl2k_free_async_buffers(dev);
+
+		r = fl2k_alloc_transfers(dev);
+		if (r < 0)
+			return r;
+	}
+
+	/* fill transfers */
+	for (i = 0; i < dev->xfer_buf_num; ++i) {
+		libusb_fill_bulk_transfer(dev->xfer[i],
+					  dev->devh,
+					  0x01,
+					  dev->xfer_buf[i],
+					  dev->xfer_buf_len,
+					  _libusb_callback,
+					  &dev->xfer_info[i],
+					  0);
+
+		/* a reused transfer keeps the status of its last run */
+		dev->xfer[i]->status = LIBUSB_TRANSFER_COMPLETED;
+
+		dev->xfer_info[i].dev = dev;
+		dev->xfer_info[i].idx = i;
+	}
+
+	if (FL2K_TX_PERIODIC == dev->tx_mode) {
+		r = fl2k_fill_periodic(dev);
+		if (r < 0)
+			return r;
+	}
+
+	/* transfers of grouped devices are submitted by fl2k_group_start(),
+	 * until then the sample worker can fill the spare ones */
+	if (dev->group) {
+		for (i = dev->xfer_num; i < dev->xfer_buf_num; ++i)
+			fl2k_xfer_queue_push(&dev->empty_queue, i);
+
+		dev->armed = 1;
+		return 0;
+	}
+
+	/* submit transfers */
+	for (i = 0; i < dev->xfer_num; ++i) {
+		r = fl2k_submit_transfer(dev, dev->xfer[i]);
+
+		if (r < 0) {
+			fprintf(stderr, "Failed to submit transfer %i\n%s",
+					i, incr_usbfs);
+			break;
+		}
+
+		fl2k_stats_submitted(&dev->stats, dev->xfer_buf_len);
+	}
+
+	/* the remaining transfers can be filled by the sample worker */
+	for (; i < dev->xfer_buf_num; ++i)
+		fl2k_xfer_queue_push(&dev->empty_queue, i);
+
+	return 0;
+}
+
+static int _fl2k_free_async_buffers(fl2k_dev_t *dev)
+{
+	unsigned int i;
+
+	if (!dev)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	if (dev->xfer) {
+		for (i = 0; i < dev->pool_num; ++i) {
+			if (dev->xfer[i]) {
+				libusb_free_transfer(dev->xfer[i]);
+			}
+		}
+
+		free(dev->xfer);
+		dev->xfer = NULL;
+	}
+
+	if (dev->xfer_buf) {
+		fl2k_lock_buffers(dev, 0);
+
+		for (i = 0; i < dev->pool_num; ++i) {
+			if (dev->xfer_buf[i]) {
+				if (dev->use_zerocopy) {
+#if defined (__linux__) && LIBUSB_API_VERSION >= 0x01000105
+					libusb_dev_mem_free(dev->devh,
+							    dev->xfer_buf[i],
+							    dev->pool_len);
+#endif
+				} else {
+					fl2k_free_buffer(dev->xfer_buf[i]);
+				}
+			}
+		}
+
+		free(dev->xfer_buf);
+		dev->xfer_buf = NULL;
+	}
+
+	free(dev->xfer_info);
+	dev->xfer_info = NULL;
+
+	fl2k_xfer_queue_free(&dev->empty_queue);
+	fl2k_xfer_queue_free(&dev->filled_queue);
+	dev->pool_num = 0;
+
+	return 0;
+}
+
+/* cancel the transfers of a device that is stopping, returns 1 once
+ * none of them is pending anymore */
+static int fl2k_cancel_transfers(fl2k_dev_t *dev,
+				 enum fl2k_async_status *next_status)
+{
+	struct timeval zerotv = { 0, 0 };
+	unsigned int i;
+	int r;
+
+	*next_status = FL2K_INACTIVE;
+
+	if (!dev->xfer)
+		return 1;
+
+	for (i = 0; i < dev->xfer_buf_num; ++i) {
+		if (!dev->xfer[i])
+			continue;
+
+		if (LIBUSB_TRANSFER_CANCELLED !=
+				dev->xfer[i]->status) {
+			r = fl2k_cancel_transfer(dev, dev->xfer[i]);
+			/* handle events after canceling
+			 * to allow transfer status to
+			 * propagate */
+			fl2k_handle_events(dev, &zerotv, NULL);
+			if (r < 0)
+				continue;
+
+			*next_status = FL2K_CANCELING;
+		}
+	}
+
+	if (dev->dev_lost || FL2K_INACTIVE == *next_status) {
+		/* handle any events that still need to
+		 * be handled before exiting after we
+		 * just cancelled all transfers */
+		fl2k_handle_events(dev, &zerotv, NULL);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int fl2k_uses_sample_worker(enum fl2k_tx_mode mode)
+{
+	return FL2K_TX_CALLBACK == mode || FL2K_TX_DIRECT == mode;
+}
+
+/* returns 1 if the worker calling it is persistent and waits for the
+ * next start, decided before the device becomes inactive, as that allows
+ * changing the setting */
+static int fl2k_finish_tx(fl2k_dev_t *dev, enum fl2k_async_status next_status)
+{
+	int persistent = dev->persistent;
+
+	/* wake up sample worker */
+	fl2k_wake_sample_worker(dev);
+
+	/* wait for sample worker thread or application writing samples
+	 * to finish before freeing buffers */
+	if (FL2K_TX_WRITE == dev->tx_mode) {
+		pthread_mutex_lock(&dev->buf_mutex);
+		while (dev->writers)
+			pthread_cond_wait(&dev->buf_cond, &dev->buf_mutex);
+		pthread_mutex_unlock(&dev->buf_mutex);
+	} else if (fl2k_uses_sample_worker(dev->tx_mode) && persistent) {
+		pthread_mutex_lock(&dev->buf_mutex);
+		while (dev->sample_done_gen != dev->tx_gen)
+			pthread_cond_wait(&dev->buf_cond, &dev->buf_mutex);
+		pthread_mutex_unlock(&dev->buf_mutex);
+	} else if (fl2k_uses_sample_worker(dev->tx_mode)) {
+		pthread_join(dev->sample_worker_thread, NULL);
+		dev->sample_worker_alive = 0;
+	}
+
+	if (!persistent) {
+		_fl2k_free_async_buffers(dev);
+
+		/* the USB worker exits after this */
+		if (!dev->group)
+			dev->usb_worker_alive = 0;
+	}
+
+	dev->armed = 0;
+	dev->async_status = next_status;
+
+	return persistent;
+}
+
+/* the sample worker or the application writing samples is done with the
+ * current start, so fl2k_finish_tx() doesn't block */
+static int fl2k_tx_idle(fl2k_dev_t *dev)
+{
+	int idle = 1;
+
+	pthread_mutex_lock(&dev->buf_mutex);
+	if (FL2K_TX_WRITE == dev->tx_mode)
+		idle = !dev->writers;
+	else if (fl2k_uses_sample_worker(dev->tx_mode))
+		idle = (dev->sample_done_gen == dev->tx_gen);
+	pthread_mutex_unlock(&dev->buf_mutex);
+
+	return idle;
+}
+
+/* park a worker until the next start, returns 0 if it has to exit */
+static int fl2k_wait_start(fl2k_dev_t *dev, uint32_t *gen, int sample)
+{
+	int run;
+
+	pthread_mutex_lock(&dev->buf_mutex);
+
+	while (!dev->terminate) {
+		/* the sample worker sits out starts that don't need it */
+		if (*gen != dev->tx_gen && sample &&
+		    !fl2k_uses_sample_worker(dev->tx_mode))
+			*gen = dev->tx_gen;
+
+		if (*gen != dev->tx_gen)
+			break;
+
+		pthread_cond_wait(&dev->buf_cond, &dev->buf_mutex);
+	}
+
+	run = !dev->terminate;
+	if (run)
+		*gen = dev->tx_gen;
+
+	pthread_mutex_unlock(&dev->buf_mutex);
+
+	return run;
+}
+
+/* stop the parked workers of a persistent pool and free it */
+static void fl2k_free_pool(fl2k_dev_t *dev)
+{
+	pthread_mutex_lock(&dev->buf_mutex);
+	dev->terminate = 1;
+	pthread_cond_broadcast(&dev->buf_cond);
+	pthread_mutex_unlock(&dev->buf_mutex);
+
+	if (dev->usb_worker_alive)
+		pthread_join(dev->usb_worker_thread, NULL);
+	if (dev->sample_worker_alive)
+		pthread_join(dev->sample_worker_thread, NULL);
+
+	dev->usb_worker_alive = 0;
+	dev->sample_worker_alive = 0;
+	dev->terminate = 0;
+
+	_fl2k_free_async_buffers(dev);
+}
+
+static void *fl2k_usb_worker(void *arg)
+{
+	fl2k_dev_t *dev = (fl2k_dev_t *)arg;
+	struct timeval tv = { 1, 0 };
+	enum fl2k_async_status next_status;
+	int r = 0;
+
+	fl2k_setup_thread(dev, FL2K_THREAD_USB);
+
+	while (fl2k_wait_start(dev, &dev->usb_gen, 0)) {
+		next_status = FL2K_INACTIVE;
+
+		while (FL2K_RUNNING == dev->async_status)
+			r = fl2k_handle_events(dev, &tv, &dev->async_cancel);
+
+		while (FL2K_INACTIVE != dev->async_status) {
+			r = fl2k_handle_events(dev, &tv, &dev->async_cancel);
+			if (r < 0) {
+				/*fprintf(stderr, "handle_events returned: %d\n", r);*/
+				if (r == LIBUSB_ERROR_INTERRUPTED) /* stray signal */
+					continue;
+				break;
+			}
+
+			if (FL2K_CANCELING == dev->async_status &&
+			    fl2k_cancel_transfers(dev, &next_status))
+				break;
+		}
+
+		if (!fl2k_finish_tx(dev, next_status))
+			break;
+	}
+
+	pthread_exit(NULL);
+}
+
+/* handles the events of all devices in a group */
+static void *fl2k_group_worker(void *arg)
+{
+	fl2k_group_t *group = (fl2k_group_t *)arg;
+	struct timeval tv = { 0, 100000 };
+	struct timeval zerotv = { 0, 0 };
+	fl2k_dev_t *dev, *finished;
+	int r;
+
+	while (!group->terminate) {
+		if (!group->ctx) {
+			/* null devices, poll them for due completions, a
+			 * millisecond is short compared to a transfer */
+			pthread_mutex_lock(&group->mutex);
+			for (dev = group->devs; dev; dev = dev->group_next)
+				fl2k_handle_events(dev, &zerotv, NULL);
+			pthread_mutex_unlock(&group->mutex);
+			sleep_ms(1);
+		} else {
+			r = libusb_handle_events_timeout_completed(group->ctx,
+								   &tv, NULL);
+			if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+				sleep_ms(10);
+		}
+
+		/* clean up after devices that have been stopped, once their
+		 * sample worker returned from the application callback, so a
+		 * slow one doesn't stall the others. That is done outside of
+		 * the lock, fl2k_close() waits for it, so they stay in the
+		 * group meanwhile. */
+		finished = NULL;
+		pthread_mutex_lock(&group->mutex);
+		for (dev = group->devs; dev; dev = dev->group_next) {
+			if (!dev->xfer || FL2K_RUNNING == dev->async_status ||
+			    FL2K_INACTIVE == dev->async_status)
+				continue;
+
+			if (!fl2k_cancel_transfers(dev, &dev->finish_status))
+				continue;
+
+			fl2k_wake_sample_worker(dev);
+			if (!fl2k_tx_idle(dev))
+				continue;
+
+			dev->finish_next = finished;
+			finished = dev;
+		}
+		pthread_mutex_unlock(&group->mutex);
+
+		while (finished) {
+			dev = finished;
+			finished = dev->finish_next;
+			fl2k_finish_tx(dev, dev->finish_status);
+		}
+	}
+
+	pthread_exit(NULL);
+}
+
+static void fl2k_abstime(struct timespec *ts, unsigned int timeout_ms)
+{
+#ifndef _WIN32
+	clock_gettime(CLOCK_REALTIME, ts);
+#else
+	timespec_get(ts, TIME_UTC);
+#endif
+	ts->tv_sec += timeout_ms / 1000;
+	ts->tv_nsec += (timeout_ms % 1000) * 1000000L;
+
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+/* get an empty transfer, waiting up to timeout_ms (0: forever) for one,
+ * returns FL2K_ERROR_BUSY if streaming was stopped in the meantime */
+static int fl2k_get_empty_xfer(fl2k_dev_t *dev, unsigned int timeout_ms)
+{
+	struct timespec ts;
+	int idx = fl2k_xfer_queue_pop(&dev->empty_queue);
+	int r = 0;
+
+	if (idx < 0) {
+		if (timeout_ms)
+			fl2k_abstime(&ts, timeout_ms);
+
+		pthread_mutex_lock(&dev->buf_mutex);
+		while (FL2K_RUNNING == dev->async_status && !r &&
+		       (idx = fl2k_xfer_queue_pop(&dev->empty_queue)) < 0) {
+			if (timeout_ms)
+				r = pthread_cond_timedwait(&dev->buf_cond,
+							   &dev->buf_mutex, &ts);
+			else
+				pthread_cond_wait(&dev->buf_cond, &dev->buf_mutex);
+		}
+		pthread_mutex_unlock(&dev->buf_mutex);
+	}
+
+	/* in the meantime, the device might be gone */
+	if (FL2K_RUNNING != dev->async_status)
+		return FL2K_ERROR_BUSY;
+
+	if (idx < 0)
+		return FL2K_ERROR_TIMEOUT;
+
+	return idx;
+}
+
+static void fl2k_report_underflows(fl2k_dev_t *dev, uint32_t underflow_cnt)
+{
+	if (underflow_cnt > dev->underflows_reported) {
+		fprintf(stderr, "Underflow! Skipped %d buffers\n",
+				underflow_cnt - dev->underflows_reported);
+		dev->underflows_reported = underflow_cnt;
+	}
+}
+
+static void fl2k_sample_run(fl2k_dev_t *dev)
+{
+	int r = 0;
+	unsigned int i, j;
+	char *out_buf = NULL;
+	uint8_t offset;
+	fl2k_data_info_t data_info;
+	uint32_t underflow_cnt;
+	uint64_t t0, t1, t2;
+	int idx;
+
+	while (FL2K_RUNNING == dev->async_status) {
+		memset(&data_info, 0, sizeof(fl2k_data_info_t));
+
+		underflow_cnt = fl2k_atomic_load_acquire(&dev->underflow_cnt);
+		data_info.len = dev->xfer_buf_len / 3;
+		data_info.underflow_cnt = underflow_cnt;
+		data_info.using_zerocopy = dev->use_zerocopy;
+		data_info.ctx = dev->cb_ctx;
+
+		fl2k_report_underflows(dev, underflow_cnt);
+
+		/* in direct mode, the application fills the transfer
+		 * buffer itself */
+		if (FL2K_TX_DIRECT == dev->tx_mode) {
+			idx = fl2k_get_empty_xfer(dev, 0);
+			if (idx < 0)
+				break;
+
+			data_info.raw_buf = (char *)dev->xfer[idx]->buffer;
+
+			t0 = fl2k_time_ns();
+			if (dev->cb)
+				dev->cb(&data_info);
+
+			fl2k_stats_sample(&dev->stats, fl2k_time_ns() - t0, 0);
+			fl2k_xfer_queue_push(&dev->filled_queue, idx);
+			continue;
+		}
+
+		/* call application callback to get samples */
+		t0 = fl2k_time_ns();
+		if (dev->cb)
+			dev->cb(&data_info);
+
+		t1 = fl2k_time_ns();
+
+		idx = fl2k_get_empty_xfer(dev, 0);
+		if (idx < 0)
+			break;
+
+		/* We have an empty USB transfer buffer */
+		out_buf = (char *)dev->xfer[idx]->buffer;
+		offset = data_info.sampletype_signed ? 128 : 0;
+
+		/* Re-arrange and copy bytes in buffer for DACs, if the
+		 * application didn't provide any buffer, the transfer is
+		 * sent again with the data it already contains */
+		t2 = fl2k_time_ns();
+		if (!data_info.r_buf && !data_info.g_buf && !data_info.b_buf) {
+			/* nothing to convert */
+		} else if (FL2K_FORMAT_INT16 == data_info.sample_format ||
+			   FL2K_FORMAT_FLOAT == data_info.sample_format) {
+			fl2k_convert_rgb_quantized(dev->convert->convert,
+						   dev->quantize, out_buf,
+						   data_info.r_buf,
+						   data_info.g_buf,
+						   data_info.b_buf,
+						   dev->xfer_buf_len,
+						   data_info.sample_format,
+						   data_info.dither,
+						   dev->dither);
+		} else {
+			dev->convert->convert(out_buf, data_info.r_buf,
+					      data_info.g_buf, data_info.b_buf,
+					      dev->xfer_buf_len, offset);
+		}
+
+		fl2k_stats_sample(&dev->stats, t1 - t0, fl2k_time_ns() - t2);
+		fl2k_xfer_queue_push(&dev->filled_queue, idx);
+	}
+
+	/* notify application if we've lost the device */
+	if (dev->dev_lost && dev->cb) {
+		data_info.raw_buf = NULL;
+		data_info.device_error = 1;
+		dev->cb(&data_info);
+	}
+}
+
+static void *fl2k_sample_worker(void *arg)
+{
+	fl2k_dev_t *dev = (fl2k_dev_t *)arg;
+	int persistent;
+
+	fl2k_setup_thread(dev, FL2K_THREAD_SAMPLE);
+
+	while (fl2k_wait_start(dev, &dev->sample_gen, 1)) {
+		/* can't change until the device is inactive, which waits
+		 * for this run to be finished */
+		persistent = dev->persistent;
+
+		fl2k_sample_run(dev);
+
+		pthread_mutex_lock(&dev->buf_mutex);
+		dev->sample_done_gen = dev->sample_gen;
+		pthread_cond_broadcast(&dev->buf_cond);
+		pthread_mutex_unlock(&dev->buf_mutex);
+
+		if (!persistent)
+			break;
+	}
+
+	pthread_exit(NULL);
+}
+
+
+/* choose the transfer length for a periodic waveform which needs the
+ * least memory for its transfers, and of those the fewest transfers.
+ * The number of transfers is a multiple of the distinct buffers the
+ * waveform spans, at least the number in flight, and they hold at least
+ * the samples of the configured transfers in flight, so a waveform that
+ * fits any length doesn't end up with tiny transfers. */
+static int fl2k_plan_periodic(fl2k_dev_t *dev)
+{
+	uint32_t step = FL2K_URB_LEN / 3, len = dev->periodic_len;
+	uint32_t m, buf_len, nbufs, best_len = 0, best_num = 0;
+	uint64_t min_samples, num, bytes, best_bytes = 0;
+
+	min_samples = (uint64_t)dev->xfer_num * (dev->cfg_buf_len / 3);
+
+	for (m = dev->cfg_buf_len / 3 / step; m > 0; m--) {
+		buf_len = m * step;
+		nbufs = len / fl2k_gcd(len, buf_len);
+
+		num = (min_samples + buf_len - 1) / buf_len;
+		if (num < dev->xfer_num)
+			num = dev->xfer_num;
+		num = (num + nbufs - 1) / nbufs * nbufs;
+		bytes = num * buf_len * 3;
+
+		if (!best_len || bytes < best_bytes ||
+		    (bytes == best_bytes && num < best_num)) {
+			best_len = buf_len;
+			best_num = num;
+			best_bytes = bytes;
+		}
+	}
+
+	if (!best_len || best_bytes > PERIODIC_MAX_BYTES) {
+		fprintf(stderr, "Periodic waveform of %u samples needs too "
+				"much memory\n", len);
+		return FL2K_ERROR_INVALID_PARAM;
+	}
+
+	dev->xfer_buf_len = best_len * 3;
+	dev->xfer_buf_num = best_num;
+
+	return 0;
 }
 
-static void LIBUSB_CALL _libusb_callback(struct libusb_transfer *xfer)
+static int _fl2k_start_tx(fl2k_dev_t *dev, enum fl2k_tx_mode mode,
+			  fl2k_tx_cb_t cb, void *ctx, uint32_t buf_num)
 {
-	fl2k_xfer_info_t *xfer_info = (fl2k_xfer_info_t *)xfer->user_data;
-	fl2k_xfer_info_t *next_xfer_info;
-	fl2k_dev_t *dev = (fl2k_dev_t *)xfer_info->dev;
-	struct libusb_transfer *next_xfer = NULL;
 	int r = 0;
+	int i;
+	pthread_attr_t attr;
 
-	if (LIBUSB_TRANSFER_COMPLETED == xfer->status) {
-		/* resubmit transfer */
-		if (FL2K_RUNNING == dev->async_status) {
-			/* get next transfer */
-			next_xfer = fl2k_get_next_xfer(dev, BUF_FILLED);
+	dev->async_status = FL2K_RUNNING;
+	dev->async_cancel = 0;
 
-			if (next_xfer) {
-				next_xfer_info = (fl2k_xfer_info_t *) next_xfer->user_data;
+	dev->tx_mode = mode;
+	dev->cb = cb;
+	dev->cb_ctx = ctx;
 
-				/* Submit next filled transfer */
-				next_xfer_info->state = BUF_SUBMITTED;
-				r = libusb_submit_transfer(next_xfer);
-				xfer_info->state = BUF_EMPTY;
-				pthread_cond_signal(&dev->buf_cond);
-			} else {
-				/* We need to re-submit the transfer
-				 * in any case, as otherwise the device
-				 * stops to output data and hangs
-				 * (happens only in the hacked 'gapless'
-				 * mode without HSYNC and VSYNC)  */
-				r = libusb_submit_transfer(xfer);
-				pthread_cond_signal(&dev->buf_cond);
-				dev->underflow_cnt++;
-			}
+	if (buf_num > 0) {
+		dev->xfer_num = buf_num;
+		dev->xfer_buf_num = 0;
+	} else {
+		dev->xfer_num = dev->cfg_inflight;
+		dev->xfer_buf_num = dev->cfg_buf_num;
+	}
+
+	/* by default, have two spare buffers that can be filled while
+	 * the others are submitted */
+	if (dev->xfer_buf_num <= dev->xfer_num)
+		dev->xfer_buf_num = dev->xfer_num + 2;
+
+	dev->xfer_buf_len = dev->cfg_buf_len;
+
+	if (FL2K_TX_PERIODIC == mode) {
+		r = fl2k_plan_periodic(dev);
+		if (r < 0) {
+			dev->async_status = FL2K_INACTIVE;
+			return r;
 		}
 	}
 
-	if (((LIBUSB_TRANSFER_CANCELLED != xfer->status) &&
-	     (LIBUSB_TRANSFER_COMPLETED != xfer->status)) ||
-	     (r == LIBUSB_ERROR_NO_DEVICE)) {
-			dev->dev_lost = 1;
-			fl2k_stop_tx(dev);
-			pthread_cond_signal(&dev->buf_cond);
-			fprintf(stderr, "cb transfer status: %d, submit "
-				"transfer %d, canceling...\n", xfer->status, r);
+	for (i = 0; i < 3; i++)
+		fl2k_dither_init(&dev->dither[i], i);
+
+	fl2k_atomic_store_release(&dev->underflow_cnt, 0);
+	fl2k_atomic64_store(&dev->sample_cnt, 0);
+	dev->underflows_reported = 0;
+	fl2k_stats_reset(&dev->stats);
+
+	dev->wr_idx = -1;
+	dev->wr_pos = 0;
+	dev->wr_carry_len = 0;
+
+	/* the workers are started first, they wait for the next tx_gen, so
+	 * a failure below finds them parked and no transfer submitted */
+	pthread_attr_init(&attr);
+
+	/* the events of grouped devices are handled by the group */
+	if (!dev->group && !dev->usb_worker_alive) {
+		dev->usb_gen = dev->tx_gen;
+		if (pthread_create(&dev->usb_worker_thread, &attr,
+				   fl2k_usb_worker, (void *)dev)) {
+			fprintf(stderr, "Error spawning USB worker thread!\n");
+			pthread_attr_destroy(&attr);
+			r = FL2K_ERROR_NO_MEM;
+			goto cleanup;
+		}
+
+		dev->usb_worker_alive = 1;
+	}
+
+	/* when writing samples, the application thread does the work, a
+	 * periodic waveform needs none */
+	if (fl2k_uses_sample_worker(mode) && !dev->sample_worker_alive) {
+		dev->sample_gen = dev->tx_gen;
+		if (pthread_create(&dev->sample_worker_thread, &attr,
+				   fl2k_sample_worker, (void *)dev)) {
+			fprintf(stderr, "Error spawning sample worker thread!\n");
+			pthread_attr_destroy(&attr);
+			r = FL2K_ERROR_NO_MEM;
+			goto cleanup;
+		}
+
+		dev->sample_worker_alive = 1;
 	}
+
+	pthread_attr_destroy(&attr);
+
+	r = fl2k_alloc_submit_transfers(dev);
+	if (r < 0)
+		goto cleanup;
+
+	/* wake up the workers */
+	pthread_mutex_lock(&dev->buf_mutex);
+	dev->tx_gen++;
+	pthread_cond_broadcast(&dev->buf_cond);
+	pthread_mutex_unlock(&dev->buf_mutex);
+
+	return 0;
+
+cleanup:
+	/* stop the parked workers, including those of a persistent pool,
+	 * before freeing the buffers, the next start creates them again */
+	fl2k_free_pool(dev);
+	dev->armed = 0;
+	dev->async_status = FL2K_INACTIVE;
+	return r;
 }
 
-static int fl2k_alloc_submit_transfers(fl2k_dev_t *dev)
+int fl2k_start_tx(fl2k_dev_t *dev, fl2k_tx_cb_t cb, void *ctx,
+		  uint32_t buf_num)
 {
-	unsigned int i;
-	int r = 0;
-	const char *incr_usbfs = "Please increase your allowed usbfs buffer"
-				 " size with the following command:\n"
-				 "echo 0 > /sys/module/usbcore/parameters/"
-				 "usbfs_memory_mb\n";
+	if (!dev || !cb)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	return _fl2k_start_tx(dev, FL2K_TX_CALLBACK, cb, ctx, buf_num);
+}
+
+int fl2k_start_tx_direct(fl2k_dev_t *dev, fl2k_tx_cb_t cb, void *ctx,
+			 uint32_t buf_num)
+{
+	if (!dev || !cb)
+		return FL2K_ERROR_INVALID_PARAM;
 
+	return _fl2k_start_tx(dev, FL2K_TX_DIRECT, cb, ctx, buf_num);
+}
+
+int fl2k_start_tx_write(fl2k_dev_t *dev, int sampletype_signed,
+			uint32_t buf_num)
+{
 	if (!dev)
 		return FL2K_ERROR_INVALID_PARAM;
 
-	dev->xfer = malloc(dev->xfer_buf_num * sizeof(struct libusb_transfer *));
+	dev->wr_offset = sampletype_signed ? 128 : 0;
 
-	for (i = 0; i < dev->xfer_buf_num; ++i)
-		dev->xfer[i] = libusb_alloc_transfer(0);
+	return _fl2k_start_tx(dev, FL2K_TX_WRITE, NULL, NULL, buf_num);
+}
 
-	dev->xfer_buf = malloc(dev->xfer_buf_num * sizeof(unsigned char *));
-	memset(dev->xfer_buf, 0, dev->xfer_buf_num * sizeof(unsigned char *));
+int fl2k_start_tx_periodic(fl2k_dev_t *dev, const char *r, const char *g,
+			   const char *b, uint32_t len)
+{
+	int ret;
 
-	dev->xfer_info = malloc(dev->xfer_buf_num * sizeof(fl2k_xfer_info_t));
-	memset(dev->xfer_info, 0, dev->xfer_buf_num * sizeof(fl2k_xfer_info_t));
+	if (!dev || !len || (!r && !g && !b))
+		return FL2K_ERROR_INVALID_PARAM;
 
-#if defined (__linux__) && LIBUSB_API_VERSION >= 0x01000105
-	fprintf(stderr, "Allocating %d zero-copy buffers\n", dev->xfer_buf_num);
+	if (FL2K_INACTIVE != dev->async_status)
+		return FL2K_ERROR_BUSY;
 
-	dev->use_zerocopy = 1;
-	for (i = 0; i < dev->xfer_buf_num; ++i) {
-		dev->xfer_buf[i] = libusb_dev_mem_alloc(dev->devh, dev->xfer_buf_len);
+	/* the waveform is only needed until it has been converted */
+	dev->periodic[0] = r;
+	dev->periodic[1] = g;
+	dev->periodic[2] = b;
+	dev->periodic_len = len;
 
-		if (dev->xfer_buf[i]) {
-			/* Check if Kernel usbfs mmap() bug is present: if the
-			 * mapping is correct, the buffers point to memory that
-			 * was memset to 0 by the Kernel, otherwise, they point
-			 * to random memory. We check if the buffers are zeroed
-			 * and otherwise fall back to buffers in userspace.
-			 */
-			if (dev->xfer_buf[i][0] || memcmp(dev->xfer_buf[i],
-							  dev->xfer_buf[i] + 1,
-							  dev->xfer_buf_len - 1)) {
-				fprintf(stderr, "Detected Kernel usbfs mmap() "
-						"bug, falling back to buffers "
-						"in userspace\n");
-				dev->use_zerocopy = 0;
+	ret = _fl2k_start_tx(dev, FL2K_TX_PERIODIC, NULL, NULL, 0);
+
+	memset(dev->periodic, 0, sizeof(dev->periodic));
+
+	return ret;
+}
+
+int fl2k_write_samples(fl2k_dev_t *dev, const char *r, const char *g,
+		       const char *b, uint32_t len, unsigned int timeout_ms)
+{
+	const char *in[3] = { r, g, b };
+	uint32_t done = 0, n, buf_len;
+	uint64_t t0, convert_ns = 0;
+	char *out;
+	int i, ret = 0;
+
+	if (!dev || FL2K_TX_WRITE != dev->tx_mode)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	pthread_mutex_lock(&dev->buf_mutex);
+	if (FL2K_RUNNING != dev->async_status) {
+		pthread_mutex_unlock(&dev->buf_mutex);
+		return dev->dev_lost ? FL2K_ERROR_NO_DEVICE : FL2K_ERROR_BUSY;
+	}
+	dev->writers++;
+	pthread_mutex_unlock(&dev->buf_mutex);
+
+	buf_len = dev->xfer_buf_len / 3;
+
+	while (done < len) {
+		if (dev->wr_idx < 0) {
+			ret = fl2k_get_empty_xfer(dev, timeout_ms);
+			if (ret < 0)
 				break;
+
+			fl2k_report_underflows(dev,
+				fl2k_atomic_load_acquire(&dev->underflow_cnt));
+
+			dev->wr_idx = ret;
+			dev->wr_pos = 0;
+		}
+
+		out = (char *)dev->xfer[dev->wr_idx]->buffer + dev->wr_pos * 3;
+
+		if (dev->wr_carry_len || (len - done) < 8) {
+			/* the conversion works on blocks of 8 samples, keep
+			 * incomplete blocks until the next call */
+			n = 8 - dev->wr_carry_len;
+			if (n > len - done)
+				n = len - done;
+
+			for (i = 0; i < 3; i++) {
+				if (in[i])
+					memcpy(&dev->wr_carry[i][dev->wr_carry_len],
+					       in[i] + done, n);
+				else
+					memset(&dev->wr_carry[i][dev->wr_carry_len],
+					       (uint8_t)(FL2K_DC_LEVEL - dev->wr_offset), n);
 			}
+
+			dev->wr_carry_len += n;
+			done += n;
+
+			if (dev->wr_carry_len < 8)
+				break;
+
+			t0 = fl2k_time_ns();
+			dev->convert->convert(out, dev->wr_carry[0],
+					      dev->wr_carry[1], dev->wr_carry[2],
+					      24, dev->wr_offset);
+			convert_ns += fl2k_time_ns() - t0;
+			dev->wr_carry_len = 0;
+			n = 8;
 		} else {
-			fprintf(stderr, "Failed to allocate zero-copy "
-					"buffer for transfer %d\n%sFalling "
-					"back to buffers in userspace\n",
-					i, incr_usbfs);
-			dev->use_zerocopy = 0;
-			break;
+			n = (len - done) & ~7;
+			if (n > buf_len - dev->wr_pos)
+				n = buf_len - dev->wr_pos;
+
+			t0 = fl2k_time_ns();
+			dev->convert->convert(out, r ? r + done : NULL,
+					      g ? g + done : NULL,
+					      b ? b + done : NULL,
+					      n * 3, dev->wr_offset);
+			convert_ns += fl2k_time_ns() - t0;
+			done += n;
 		}
-	}
 
-	/* zero-copy buffer allocation failed (partially or completely)
-	 * we need to free the buffers again if already allocated */
-	if (!dev->use_zerocopy) {
-		for (i = 0; i < dev->xfer_buf_num; ++i) {
-			if (dev->xfer_buf[i])
-				libusb_dev_mem_free(dev->devh,
-						    dev->xfer_buf[i],
-						    dev->xfer_buf_len);
+		dev->wr_pos += n;
+
+		/* transfer is complete, hand it over for submission */
+		if (dev->wr_pos == buf_len) {
+			fl2k_xfer_queue_push(&dev->filled_queue, dev->wr_idx);
+			dev->wr_idx = -1;
 		}
 	}
+
+	if (convert_ns)
+		fl2k_stats_sample(&dev->stats, 0, convert_ns);
+
+	pthread_mutex_lock(&dev->buf_mutex);
+	dev->writers--;
+	pthread_cond_broadcast(&dev->buf_cond);
+	pthread_mutex_unlock(&dev->buf_mutex);
+
+	return done ? (int)done : ret;
+}
+
+int fl2k_set_buffer_config(fl2k_dev_t *dev, uint32_t buf_len,
+			   uint32_t buf_num, uint32_t inflight)
+{
+	if (!dev)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	if (FL2K_INACTIVE != dev->async_status)
+		return FL2K_ERROR_BUSY;
+
+	if (!buf_len)
+		buf_len = FL2K_BUF_LEN;
+
+	if (!inflight)
+		inflight = DEFAULT_BUF_NUMBER;
+
+	/* avoid missing samples between the transfers */
+	if (((uint64_t)buf_len * 3) % FL2K_URB_LEN ||
+	    ((uint64_t)buf_len * 3) > UINT32_MAX)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	if (buf_num && buf_num <= inflight)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	dev->cfg_buf_len = buf_len * 3;
+	dev->cfg_buf_num = buf_num;
+	dev->cfg_inflight = inflight;
+
+	return 0;
+}
+
+static const char *fl2k_profile_path(const char *path, char *buf,
+				     size_t len)
+{
+	const char *home;
+
+	if (path)
+		return path;
+
+	path = getenv("FL2K_PROFILE");
+	if (path && *path)
+		return path;
+
+	home = getenv("HOME");
+#ifdef _WIN32
+	if (!home)
+		home = getenv("USERPROFILE");
 #endif
+	if (!home)
+		return NULL;
 
-	/* no zero-copy available, allocate buffers in userspace */
-	if (!dev->use_zerocopy) {
-		for (i = 0; i < dev->xfer_buf_num; ++i) {
-			dev->xfer_buf[i] = malloc(dev->xfer_buf_len);
+	snprintf(buf, len, "%s/.fl2k_profile", home);
 
-			if (!dev->xfer_buf[i])
-				return FL2K_ERROR_NO_MEM;
-		}
-	}
+	return buf;
+}
 
-	/* fill transfers */
-	for (i = 0; i < dev->xfer_buf_num; ++i) {
-		libusb_fill_bulk_transfer(dev->xfer[i],
-					  dev->devh,
-					  0x01,
-					  dev->xfer_buf[i],
-					  dev->xfer_buf_len,
-					  _libusb_callback,
-					  &dev->xfer_info[i],
-					  0);
+int fl2k_load_profile(const char *path, fl2k_profile_t *profile)
+{
+	char buf[1024], line[256], key[32];
+	unsigned long val;
+	FILE *f;
 
-		dev->xfer_info[i].dev = dev;
-		dev->xfer_info[i].state = BUF_EMPTY;
+	if (!profile)
+		return FL2K_ERROR_INVALID_PARAM;
 
-		/* if we allocate the memory through the Kernel, it is
-		 * already cleared */
-		if (!dev->use_zerocopy)
-			memset(dev->xfer_buf[i], 0, dev->xfer_buf_len);
-	}
+	path = fl2k_profile_path(path, buf, sizeof(buf));
+	if (!path)
+		return FL2K_ERROR_NOT_FOUND;
 
-	/* submit transfers */
-	for (i = 0; i < dev->xfer_num; ++i) {
-		r = libusb_submit_transfer(dev->xfer[i]);
-		dev->xfer_info[i].state = BUF_SUBMITTED;
+	f = fopen(path, "r");
+	if (!f)
+		return FL2K_ERROR_NOT_FOUND;
 
-		if (r < 0) {
-			fprintf(stderr, "Failed to submit transfer %i\n%s",
-					i, incr_usbfs);
-			break;
-		}
+	memset(profile, 0, sizeof(fl2k_profile_t));
+
+	/* one "key value" pair per line, unknown keys are skipped so
+	 * newer profiles can be read */
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || sscanf(line, "%31s %lu", key, &val) != 2)
+			continue;
+
+		if (!strcmp(key, "buf_len"))
+			profile->buf_len = val;
+		else if (!strcmp(key, "buf_num"))
+			profile->buf_num = val;
+		else if (!strcmp(key, "inflight"))
+			profile->inflight = val;
+		else if (!strcmp(key, "max_rate"))
+			profile->max_rate = val;
 	}
 
+	fclose(f);
+
+	if (!profile->inflight)
+		return FL2K_ERROR_INVALID_PARAM;
+
 	return 0;
 }
 
-static int _fl2k_free_async_buffers(fl2k_dev_t *dev)
+int fl2k_save_profile(const char *path, const fl2k_profile_t *profile)
 {
-	unsigned int i;
+	char buf[1024];
+	FILE *f;
+	int r;
+
+	if (!profile)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	path = fl2k_profile_path(path, buf, sizeof(buf));
+	if (!path)
+		return FL2K_ERROR_NOT_FOUND;
+
+	f = fopen(path, "w");
+	if (!f)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	fprintf(f, "# osmo-fl2k buffer profile\n");
+	fprintf(f, "buf_len %u\n", profile->buf_len);
+	fprintf(f, "buf_num %u\n", profile->buf_num);
+	fprintf(f, "inflight %u\n", profile->inflight);
+	fprintf(f, "max_rate %u\n", profile->max_rate);
+
+	r = ferror(f);
+	if (fclose(f) || r)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	return 0;
+}
+
+int fl2k_apply_profile(fl2k_dev_t *dev, const fl2k_profile_t *profile)
+{
+	int r;
+
+	if (!dev || !profile)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	r = fl2k_set_buffer_config(dev, profile->buf_len, profile->buf_num,
+				   profile->inflight);
+	if (r < 0)
+		return r;
+
+	dev->max_rate = profile->max_rate;
+
+	return 0;
+}
+
+int fl2k_apply_default_profile(fl2k_dev_t *dev, int keep_buf_len)
+{
+	fl2k_profile_t profile;
+	uint32_t buf_len, inflight;
+	int r;
 
 	if (!dev)
 		return FL2K_ERROR_INVALID_PARAM;
 
-	if (dev->xfer) {
-		for (i = 0; i < dev->xfer_buf_num; ++i) {
-			if (dev->xfer[i]) {
-				libusb_free_transfer(dev->xfer[i]);
-			}
-		}
+	r = fl2k_load_profile(NULL, &profile);
+	if (r < 0)
+		return r;
 
-		free(dev->xfer);
-		dev->xfer = NULL;
+	buf_len = profile.buf_len ? profile.buf_len : FL2K_BUF_LEN;
+	if (keep_buf_len && buf_len != FL2K_BUF_LEN) {
+		fprintf(stderr, "WARNING: Ignoring buffer profile, its buffer "
+				"length differs from %u samples\n", FL2K_BUF_LEN);
+		return FL2K_ERROR_INVALID_PARAM;
 	}
 
-	if (dev->xfer_buf) {
-		for (i = 0; i < dev->xfer_buf_num; ++i) {
-			if (dev->xfer_buf[i]) {
-				if (dev->use_zerocopy) {
-#if defined (__linux__) && LIBUSB_API_VERSION >= 0x01000105
-					libusb_dev_mem_free(dev->devh,
-							    dev->xfer_buf[i],
-							    dev->xfer_buf_len);
-#endif
-				} else {
-					free(dev->xfer_buf[i]);
-				}
-			}
-		}
-
-		free(dev->xfer_buf);
-		dev->xfer_buf = NULL;
+	r = fl2k_apply_profile(dev, &profile);
+	if (r < 0) {
+		fprintf(stderr, "WARNING: Ignoring invalid buffer profile\n");
+		return r;
 	}
 
+	/* print what fl2k_set_buffer_config() made of the defaults */
+	inflight = profile.inflight ? profile.inflight : DEFAULT_BUF_NUMBER;
+	fprintf(stderr, "Using buffer profile: %u samples, %u in flight, %u "
+			"buffers\n", buf_len, inflight, profile.buf_num ?
+			profile.buf_num : inflight + 2);
+
 	return 0;
 }
 
-static void *fl2k_usb_worker(void *arg)
+int fl2k_get_stats(fl2k_dev_t *dev, fl2k_stats_t *stats)
 {
-	fl2k_dev_t *dev = (fl2k_dev_t *)arg;
-	struct timeval tv = { 1, 0 };
-	struct timeval zerotv = { 0, 0 };
-	enum fl2k_async_status next_status = FL2K_INACTIVE;
-	int r = 0;
-	unsigned int i;
-
-	while (FL2K_RUNNING == dev->async_status) {
-		r = libusb_handle_events_timeout_completed(dev->ctx, &tv,
-							   &dev->async_cancel);
-	}
+	if (!dev || !stats)
+		return FL2K_ERROR_INVALID_PARAM;
 
-	while (FL2K_INACTIVE != dev->async_status) {
-		r = libusb_handle_events_timeout_completed(dev->ctx, &tv,
-							   &dev->async_cancel);
-		if (r < 0) {
-			/*fprintf(stderr, "handle_events returned: %d\n", r);*/
-			if (r == LIBUSB_ERROR_INTERRUPTED) /* stray signal */
-				continue;
-			break;
-		}
+	fl2k_stats_get(&dev->stats, stats);
 
-		if (FL2K_CANCELING == dev->async_status) {
-			next_status = FL2K_INACTIVE;
+	return 0;
+}
 
-			if (!dev->xfer)
-				break;
+int fl2k_get_rate_estimate(fl2k_dev_t *dev, fl2k_rate_estimate_t *est)
+{
+	if (!dev || !est)
+		return FL2K_ERROR_INVALID_PARAM;
 
-			for (i = 0; i < dev->xfer_buf_num; ++i) {
-				if (!dev->xfer[i])
-					continue;
+	memset(est, 0, sizeof(fl2k_rate_estimate_t));
+	est->nominal_rate = dev->rate;
 
-				if (LIBUSB_TRANSFER_CANCELLED !=
-						dev->xfer[i]->status) {
-					r = libusb_cancel_transfer(dev->xfer[i]);
-					/* handle events after canceling
-					 * to allow transfer status to
-					 * propagate */
-					libusb_handle_events_timeout_completed(dev->ctx,
-									       &zerotv, NULL);
-					if (r < 0)
-						continue;
-
-					next_status = FL2K_CANCELING;
-				}
-			}
+	if (fl2k_stats_rate(&dev->stats, &est->rate, &est->rate_total,
+			    &est->seconds, &est->samples) < 0 || dev->rate <= 0)
+		return FL2K_ERROR_NOT_FOUND;
 
-			if (dev->dev_lost || FL2K_INACTIVE == next_status) {
-				/* handle any events that still need to
-				 * be handled before exiting after we
-				 * just cancelled all transfers */
-				libusb_handle_events_timeout_completed(dev->ctx,
-								       &zerotv, NULL);
-				break;
-			}
-		}
-	}
+	est->ppm = 1e6 * (est->rate / dev->rate - 1.);
+	est->ppm_total = 1e6 * (est->rate_total / dev->rate - 1.);
 
-	/* wake up sample worker */
-	pthread_cond_signal(&dev->buf_cond);
+	return 0;
+}
 
-	/* wait for sample worker thread to finish before freeing buffers */
-	pthread_join(dev->sample_worker_thread, NULL);  
-	_fl2k_free_async_buffers(dev);
-	dev->async_status = next_status;
+static fl2k_deinterleave_fn_t deinterleave;
+static pthread_once_t deinterleave_once = PTHREAD_ONCE_INIT;
 
-	pthread_exit(NULL);
+static void fl2k_select_deinterleave(void)
+{
+	deinterleave = fl2k_deinterleave_select();
 }
 
-/* Buffer format conversion functions for R, G, B DACs */
-static inline void fl2k_convert_r(char *out,
-				  char *in,
-				  uint32_t len,
-				  uint8_t offset)
+void fl2k_deinterleave_rgb(const char *in, char *r, char *g, char *b,
+			   uint32_t len)
 {
-	unsigned int i, j = 0;
-
-	if (!in || !out)
-		return;
-
-	for (i = 0; i < len; i += 24) {
-		out[i+ 6] = in[j++] + offset;
-		out[i+ 1] = in[j++] + offset;
-		out[i+12] = in[j++] + offset;
-		out[i+15] = in[j++] + offset;
-		out[i+10] = in[j++] + offset;
-		out[i+21] = in[j++] + offset;
-		out[i+16] = in[j++] + offset;
-		out[i+19] = in[j++] + offset;
-	}
+	pthread_once(&deinterleave_once, fl2k_select_deinterleave);
+	deinterleave(in, r, g, b, len);
 }
 
-static inline void fl2k_convert_g(char *out,
-				  char *in,
-				  uint32_t len,
-				  uint8_t offset)
+int fl2k_set_thread_config(fl2k_dev_t *dev, int thread, int cpu,
+			   int rt_priority)
 {
-	unsigned int i, j = 0;
+	if (!dev || (FL2K_THREAD_USB != thread && FL2K_THREAD_SAMPLE != thread))
+		return FL2K_ERROR_INVALID_PARAM;
 
-	if (!in || !out)
-		return;
+	if (rt_priority < 0 || (rt_priority > 0 &&
+	    rt_priority > sched_get_priority_max(SCHED_FIFO)))
+		return FL2K_ERROR_INVALID_PARAM;
 
-	for (i = 0; i < len; i += 24) {
-		out[i+ 5] = in[j++] + offset;
-		out[i+ 0] = in[j++] + offset;
-		out[i+ 3] = in[j++] + offset;
-		out[i+14] = in[j++] + offset;
-		out[i+ 9] = in[j++] + offset;
-		out[i+20] = in[j++] + offset;
-		out[i+23] = in[j++] + offset;
-		out[i+18] = in[j++] + offset;
-	}
+	dev->thread_cpu[thread] = cpu < 0 ? -1 : cpu;
+	dev->thread_prio[thread] = rt_priority;
+
+	return 0;
 }
 
-static inline void fl2k_convert_b(char *out,
-				  char *in,
-				  uint32_t len,
-				  uint8_t offset)
+int fl2k_set_mlock(fl2k_dev_t *dev, int enable)
 {
-	unsigned int i, j = 0;
+	if (!dev)
+		return FL2K_ERROR_INVALID_PARAM;
 
-	if (!in || !out)
-		return;
+	if (FL2K_INACTIVE != dev->async_status)
+		return FL2K_ERROR_BUSY;
 
-	for (i = 0; i < len; i += 24) {
-		out[i+ 4] = in[j++] + offset;
-		out[i+ 7] = in[j++] + offset;
-		out[i+ 2] = in[j++] + offset;
-		out[i+13] = in[j++] + offset;
-		out[i+ 8] = in[j++] + offset;
-		out[i+11] = in[j++] + offset;
-		out[i+22] = in[j++] + offset;
-		out[i+17] = in[j++] + offset;
-	}
+	dev->use_mlock = enable;
+
+	return 0;
 }
 
-static void *fl2k_sample_worker(void *arg)
+int fl2k_set_persistent(fl2k_dev_t *dev, int enable)
 {
-	int r = 0;
-	unsigned int i, j;
-	fl2k_dev_t *dev = (fl2k_dev_t *)arg;
-	fl2k_xfer_info_t *xfer_info = NULL;
-	struct libusb_transfer *xfer = NULL;
-	char *out_buf = NULL;
-	fl2k_data_info_t data_info;
-	uint32_t underflows = 0;
-	uint64_t buf_cnt = 0;
+	if (!dev)
+		return FL2K_ERROR_INVALID_PARAM;
 
-	while (FL2K_RUNNING == dev->async_status) {
-		memset(&data_info, 0, sizeof(fl2k_data_info_t));
+	if (FL2K_INACTIVE != dev->async_status)
+		return FL2K_ERROR_BUSY;
 
-		data_info.len = FL2K_BUF_LEN;
-		data_info.underflow_cnt = dev->underflow_cnt;
-		data_info.ctx = dev->cb_ctx;
+	if (dev->persistent && !enable)
+		fl2k_free_pool(dev);
 
-		if (dev->underflow_cnt > underflows) {
-			fprintf(stderr, "Underflow! Skipped %d buffers\n",
-					dev->underflow_cnt - underflows);
-			underflows = dev->underflow_cnt;
-		}
+	dev->persistent = enable;
 
-		/* call application callback to get samples */
-		if (dev->cb)
-			dev->cb(&data_info);
+	return 0;
+}
 
-		xfer = fl2k_get_next_xfer(dev, BUF_EMPTY);
+uint64_t fl2k_get_sample_count(fl2k_dev_t *dev)
+{
+	if (!dev)
+		return 0;
 
-		if (!xfer) {
-			pthread_cond_wait(&dev->buf_cond, &dev->buf_mutex);
-			/* in the meantime, the device might be gone */
-			if (FL2K_RUNNING != dev->async_status)
-				break;
+	return fl2k_atomic64_load(&dev->sample_cnt);
+}
 
-			xfer = fl2k_get_next_xfer(dev, BUF_EMPTY);
-			if (!xfer) {
-				fprintf(stderr, "no free transfer, skipping"
-						" input buffer\n");
-				continue;
-			}
-		}
+int fl2k_group_create(fl2k_group_t **out_group)
+{
+	fl2k_group_t *group;
+	int r;
 
-		/* We have an empty USB transfer buffer */
-		xfer_info = (fl2k_xfer_info_t *)xfer->user_data;
-		out_buf = (char *)xfer->buffer;
+	if (!out_group)
+		return FL2K_ERROR_INVALID_PARAM;
 
-		/* Re-arrange and copy bytes in buffer for DACs */
-		fl2k_convert_r(out_buf, data_info.r_buf, dev->xfer_buf_len,
-			       data_info.sampletype_signed ? 128 : 0);
+	group = malloc(sizeof(fl2k_group_t));
+	if (!group)
+		return FL2K_ERROR_NO_MEM;
 
-		fl2k_convert_g(out_buf, data_info.g_buf, dev->xfer_buf_len,
-			       data_info.sampletype_signed ? 128 : 0);
+	memset(group, 0, sizeof(fl2k_group_t));
 
-		fl2k_convert_b(out_buf, data_info.b_buf, dev->xfer_buf_len,
-			       data_info.sampletype_signed ? 128 : 0);
+	/* the null devices don't need a libusb context */
+	if (!fl2k_null_device_count()) {
+		r = libusb_init(&group->ctx);
+		if (r < 0) {
+			free(group);
+			return FL2K_ERROR_NO_DEVICE;
+		}
 
-		xfer_info->seq = buf_cnt++;
-		xfer_info->state = BUF_FILLED;
+#if LIBUSB_API_VERSION >= 0x01000106
+		libusb_set_option(group->ctx, LIBUSB_OPTION_LOG_LEVEL, 3);
+#else
+		libusb_set_debug(group->ctx, 3);
+#endif
 	}
 
-	/* notify application if we've lost the device */
-	if (dev->dev_lost && dev->cb) {
-		data_info.device_error = 1;
-		dev->cb(&data_info);
+	pthread_mutex_init(&group->mutex, NULL);
+
+	r = pthread_create(&group->event_thread, NULL, fl2k_group_worker,
+			   (void *)group);
+	if (r != 0) {
+		fprintf(stderr, "Error spawning group event thread!\n");
+		pthread_mutex_destroy(&group->mutex);
+		if (group->ctx)
+			libusb_exit(group->ctx);
+		free(group);
+		return FL2K_ERROR_BUSY;
 	}
 
-	pthread_exit(NULL);
-}
+	*out_group = group;
 
+	return 0;
+}
 
-int fl2k_start_tx(fl2k_dev_t *dev, fl2k_tx_cb_t cb, void *ctx,
-		  uint32_t buf_num)
+int fl2k_group_open(fl2k_group_t *group, fl2k_dev_t **dev, uint32_t index)
 {
-	int r = 0;
-	int i;
-	pthread_attr_t attr;
+	fl2k_device_info_t info;
+	int r;
 
-	if (!dev || !cb)
+	if (!group || !dev)
 		return FL2K_ERROR_INVALID_PARAM;
 
-	dev->async_status = FL2K_RUNNING;
-	dev->async_cancel = 0;
+	r = fl2k_lookup_device(index, NULL, NULL, &info);
+	if (r < 0)
+		return r;
 
-	dev->cb = cb;
-	dev->cb_ctx = ctx;
+	return _fl2k_open(dev, &info, group);
+}
 
-	if (buf_num > 0)
-		dev->xfer_num = buf_num;
-	else
-		dev->xfer_num = DEFAULT_BUF_NUMBER;
+int fl2k_group_start(fl2k_group_t *group)
+{
+	fl2k_dev_t *dev;
+	uint32_t i, max_num = 0;
+	int r, started = 0;
 
-	/* have two spare buffers that can be filled while the
-	 * others are submitted */
-	dev->xfer_buf_num = dev->xfer_num + 2;
-	dev->xfer_buf_len = FL2K_XFER_LEN;
+	if (!group)
+		return FL2K_ERROR_INVALID_PARAM;
 
-	r = fl2k_alloc_submit_transfers(dev);
-	if (r < 0)
-		goto cleanup;
+	pthread_mutex_lock(&group->mutex);
 
-	pthread_mutex_init(&dev->buf_mutex, NULL);
-	pthread_cond_init(&dev->buf_cond, NULL);
-	pthread_attr_init(&attr);
+	for (dev = group->devs; dev; dev = dev->group_next) {
+		if (dev->armed && FL2K_RUNNING == dev->async_status &&
+		    dev->xfer_num > max_num)
+			max_num = dev->xfer_num;
+	}
 
-	r = pthread_create(&dev->usb_worker_thread, &attr,
-			   fl2k_usb_worker, (void *)dev);
-	if (r < 0) {
-		fprintf(stderr, "Error spawning USB worker thread!\n");
-		goto cleanup;
+	/* submit the initial transfers of all devices interleaved, so
+	 * they start as simultaneously as possible */
+	for (i = 0; i < max_num; i++) {
+		for (dev = group->devs; dev; dev = dev->group_next) {
+			if (!dev->armed || FL2K_RUNNING != dev->async_status ||
+			    i >= dev->xfer_num)
+				continue;
+
+			r = fl2k_submit_transfer(dev, dev->xfer[i]);
+			if (r < 0) {
+				fprintf(stderr, "Failed to submit transfer %i\n", i);
+				fl2k_stop_tx(dev);
+				continue;
+			}
+
+			fl2k_stats_submitted(&dev->stats, dev->xfer_buf_len);
+		}
 	}
 
-	r = pthread_create(&dev->sample_worker_thread, &attr,
-			   fl2k_sample_worker, (void *)dev);
-	if (r < 0) {
-		fprintf(stderr, "Error spawning sample worker thread!\n");
-		goto cleanup;
+	for (dev = group->devs; dev; dev = dev->group_next) {
+		if (dev->armed && FL2K_RUNNING == dev->async_status)
+			started++;
+
+		dev->armed = 0;
 	}
 
-	pthread_attr_destroy(&attr);
+	pthread_mutex_unlock(&group->mutex);
+
+	return started ? 0 : FL2K_ERROR_NOT_FOUND;
+}
+
+int fl2k_group_stop(fl2k_group_t *group)
+{
+	fl2k_dev_t *dev;
+
+	if (!group)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	pthread_mutex_lock(&group->mutex);
+	for (dev = group->devs; dev; dev = dev->group_next) {
+		if (FL2K_RUNNING == dev->async_status)
+			fl2k_stop_tx(dev);
+	}
+	pthread_mutex_unlock(&group->mutex);
 
 	return 0;
+}
 
-cleanup:
-	_fl2k_free_async_buffers(dev);
-	return FL2K_ERROR_BUSY;
+int fl2k_group_destroy(fl2k_group_t *group)
+{
+	if (!group)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	if (group->devs)
+		return FL2K_ERROR_BUSY;
+
+	group->terminate = 1;
+	pthread_join(group->event_thread, NULL);
+
+	pthread_mutex_destroy(&group->mutex);
+	if (group->ctx)
+		libusb_exit(group->ctx);
+	free(group);
 
+	return 0;
 }
 
 int fl2k_stop_tx(fl2k_dev_t *dev)
@@ -1015,103 +3135,257 @@ int fl2k_stop_tx(fl2k_dev_t *dev)
 	return FL2K_ERROR_BUSY;
 }
 
-int fl2k_i2c_read(fl2k_dev_t *dev, uint8_t i2c_addr, uint8_t reg_addr, uint8_t *data)
+/* wait for the I2C operation to complete, reg is the last value read
+ * and valid is set if there was one */
+static int fl2k_i2c_wait(fl2k_dev_t *dev, uint32_t *reg, int *valid)
+{
+	uint64_t deadline = fl2k_time_ns() + I2C_TIMEOUT_NS;
+	uint32_t interval = I2C_POLL_MIN_US;
+	int r;
+
+	while (1) {
+		sleep_us(interval);
+		if (interval < I2C_POLL_MAX_US)
+			interval *= 2;
+
+		r = fl2k_read_reg(dev, I2C_CTRL_REG, reg);
+		if (r < 0)
+			return r;
+
+		*valid = 1;
+
+		/* check if operation completed */
+		if (*reg & I2C_DONE)
+			break;
+
+		if (fl2k_time_ns() > deadline)
+			return FL2K_ERROR_TIMEOUT;
+	}
+
+	/* check if slave responded and all data was transferred */
+	if (*reg & I2C_ERR)
+		return FL2K_ERROR_NOT_FOUND;
+
+	return 0;
+}
+
+/* ctrl is the value of the I2C control register, kept from the end of
+ * the previous operation of a batch, as nothing else changes it */
+static int fl2k_i2c_op(fl2k_dev_t *dev, fl2k_reg_op_t *op, uint32_t *ctrl,
+		       int *ctrl_valid)
 {
-	int i, r, timeout = 1;
+	int r, read = (FL2K_OP_I2C_READ == op->type);
 	uint32_t reg;
 
-	if (!dev)
-		return FL2K_ERROR_INVALID_PARAM;
+	if (!read) {
+		r = fl2k_control_transfer(dev, CTRL_OUT, 0x41, I2C_WDATA_REG,
+					  op->data, 4);
+		if (r < 0)
+			return r;
+	}
 
-	r = fl2k_read_reg(dev, 0x8020, &reg);
-	if (r < 0)
-		return r;
+	if (!*ctrl_valid) {
+		r = fl2k_read_reg(dev, I2C_CTRL_REG, ctrl);
+		if (r < 0)
+			return r;
+	}
 
 	/* apply mask, clearing bit 30 disables periodic repetition of read */
-	reg &= 0x3ffc0000;
+	reg = *ctrl & 0x3ffc0000;
 
 	/* set I2C register and address, select I2C read (bit 7) */
-	reg |= (1 << 28) | (reg_addr << 8) | (1 << 7) | (i2c_addr & 0x7f);
+	reg |= (1 << 28) | (op->reg_addr << 8) | (op->i2c_addr & 0x7f);
+	if (read)
+		reg |= (1 << 7);
+
+	*ctrl_valid = 0;
 
-	r = fl2k_write_reg(dev, 0x8020, reg);
+	r = fl2k_write_reg(dev, I2C_CTRL_REG, reg);
 	if (r < 0)
 		return r;
 
-	for (i = 0; i < 10; i++) {
-		sleep_ms(10);
+	r = fl2k_i2c_wait(dev, ctrl, ctrl_valid);
+	if (r < 0)
+		return r;
 
-		r = fl2k_read_reg(dev, 0x8020, &reg);
+	if (read) {
+		r = fl2k_control_transfer(dev, CTRL_IN, 0x40, I2C_RDATA_REG,
+					  op->data, 4);
 		if (r < 0)
 			return r;
+	}
 
-		/* check if operation completed */ 
-		if (reg & (1 << 31)) {
-			timeout = 0;
-			break;
+	return 0;
+}
+
+int fl2k_run_reg_ops(fl2k_dev_t *dev, fl2k_reg_op_t *ops, uint32_t num)
+{
+	uint32_t i, ctrl = 0;
+	int r, ret = 0, ctrl_valid = 0, lost = 0;
+	fl2k_reg_op_t *op;
+
+	if (!dev || (!ops && num))
+		return FL2K_ERROR_INVALID_PARAM;
+
+	pthread_mutex_lock(&dev->ctrl_mutex);
+
+	for (i = 0; i < num; i++) {
+		op = &ops[i];
+
+		if (lost || dev->dev_lost) {
+			r = FL2K_ERROR_NO_DEVICE;
+		} else {
+			switch (op->type) {
+			case FL2K_OP_REG_READ:
+				r = fl2k_read_reg(dev, op->reg, &op->val);
+				break;
+			case FL2K_OP_REG_WRITE:
+				r = fl2k_write_reg(dev, op->reg, op->val);
+				if (I2C_CTRL_REG == op->reg)
+					ctrl_valid = 0;
+				break;
+			case FL2K_OP_I2C_READ:
+			case FL2K_OP_I2C_WRITE:
+				r = fl2k_i2c_op(dev, op, &ctrl, &ctrl_valid);
+				break;
+			default:
+				r = FL2K_ERROR_INVALID_PARAM;
+				break;
+			}
+		}
+
+		if (LIBUSB_ERROR_NO_DEVICE == r) {
+			r = FL2K_ERROR_NO_DEVICE;
+			lost = 1;
 		}
+
+		op->status = (r < 0) ? r : 0;
+		if (r < 0 && !ret)
+			ret = r;
 	}
 
-	if (timeout)
-		return FL2K_ERROR_TIMEOUT;
+	pthread_mutex_unlock(&dev->ctrl_mutex);
 
-	/* check if slave responded and all data was read */
-	if (reg & (0x0f << 24))
-		return FL2K_ERROR_NOT_FOUND;
+	return ret;
+}
+
+/* executes the submitted batches, until fl2k_close() is called and
+ * none are left */
+static void *fl2k_ctrl_worker(void *arg)
+{
+	fl2k_dev_t *dev = (fl2k_dev_t *)arg;
+	fl2k_reg_batch_t *batch;
+
+	pthread_mutex_lock(&dev->ctrl_queue_mutex);
+
+	while (1) {
+		batch = dev->ctrl_head;
+		if (!batch) {
+			if (dev->ctrl_exit)
+				break;
+
+			pthread_cond_wait(&dev->ctrl_cond,
+					  &dev->ctrl_queue_mutex);
+			continue;
+		}
 
-	/* read data from register 0x8024 */
-	return libusb_control_transfer(dev->devh, CTRL_IN, 0x40,
-				       0, 0x8024, data, 4, CTRL_TIMEOUT);
+		dev->ctrl_head = batch->next;
+		if (!dev->ctrl_head)
+			dev->ctrl_tail = NULL;
+
+		pthread_mutex_unlock(&dev->ctrl_queue_mutex);
+
+		fl2k_run_reg_ops(dev, batch->ops, batch->num);
+		if (batch->cb)
+			batch->cb(batch->ops, batch->num, batch->ctx);
+		free(batch);
+
+		pthread_mutex_lock(&dev->ctrl_queue_mutex);
+	}
+
+	pthread_mutex_unlock(&dev->ctrl_queue_mutex);
+
+	return NULL;
 }
 
-int fl2k_i2c_write(fl2k_dev_t *dev, uint8_t i2c_addr, uint8_t reg_addr, uint8_t *data)
+int fl2k_submit_reg_ops(fl2k_dev_t *dev, fl2k_reg_op_t *ops, uint32_t num,
+			fl2k_reg_cb_t cb, void *ctx)
 {
-	int i, r, timeout = 1;
-	uint32_t reg;
+	fl2k_reg_batch_t *batch;
 
-	if (!dev)
+	if (!dev || (!ops && num))
 		return FL2K_ERROR_INVALID_PARAM;
 
-	/* write data to register 0x8028 */
-	r = libusb_control_transfer(dev->devh, CTRL_OUT, 0x41,
-				    0, 0x8028, data, 4, CTRL_TIMEOUT);
+	batch = malloc(sizeof(fl2k_reg_batch_t));
+	if (!batch)
+		return FL2K_ERROR_NO_MEM;
 
-	if (r < 0)
-		return r;
+	batch->ops = ops;
+	batch->num = num;
+	batch->cb = cb;
+	batch->ctx = ctx;
+	batch->next = NULL;
 
-	r = fl2k_read_reg(dev, 0x8020, &reg);
-	if (r < 0)
-		return r;
+	pthread_mutex_lock(&dev->ctrl_queue_mutex);
 
-	/* apply mask, clearing bit 30 disables periodic repetition of read */
-	reg &= 0x3ffc0000;
+	if (!dev->ctrl_alive) {
+		if (pthread_create(&dev->ctrl_thread, NULL, fl2k_ctrl_worker,
+				   dev)) {
+			pthread_mutex_unlock(&dev->ctrl_queue_mutex);
+			free(batch);
+			return FL2K_ERROR_NO_MEM;
+		}
+
+		dev->ctrl_alive = 1;
+	}
+
+	if (dev->ctrl_tail)
+		dev->ctrl_tail->next = batch;
+	else
+		dev->ctrl_head = batch;
+	dev->ctrl_tail = batch;
+
+	pthread_cond_signal(&dev->ctrl_cond);
+	pthread_mutex_unlock(&dev->ctrl_queue_mutex);
+
+	return 0;
+}
+
+int fl2k_i2c_read(fl2k_dev_t *dev, uint8_t i2c_addr, uint8_t reg_addr, uint8_t *data)
+{
+	fl2k_reg_op_t op;
+	int r;
+
+	if (!dev || !data)
+		return FL2K_ERROR_INVALID_PARAM;
 
-	/* set I2C register and address */
-	reg |= (1 << 28) | (reg_addr << 8) | (i2c_addr & 0x7f);
+	memset(&op, 0, sizeof(op));
+	op.type = FL2K_OP_I2C_READ;
+	op.i2c_addr = i2c_addr;
+	op.reg_addr = reg_addr;
 
-	r = fl2k_write_reg(dev, 0x8020, reg);
+	r = fl2k_run_reg_ops(dev, &op, 1);
 	if (r < 0)
 		return r;
 
-	for (i = 0; i < 10; i++) {
-		sleep_ms(10);
+	memcpy(data, op.data, 4);
 
-		r = fl2k_read_reg(dev, 0x8020, &reg);
-		if (r < 0)
-			return r;
+	/* like the data transfer, return the number of bytes read */
+	return 4;
+}
 
-		/* check if operation completed */ 
-		if (reg & (1 << 31)) {
-			timeout = 0;
-			break;
-		}
-	}
+int fl2k_i2c_write(fl2k_dev_t *dev, uint8_t i2c_addr, uint8_t reg_addr, uint8_t *data)
+{
+	fl2k_reg_op_t op;
 
-	if (timeout)
-		return FL2K_ERROR_TIMEOUT;
+	if (!dev || !data)
+		return FL2K_ERROR_INVALID_PARAM;
 
-	/* check if slave responded and all data was written */
-	if (reg & (0x0f << 24))
-		return FL2K_ERROR_NOT_FOUND;
+	memset(&op, 0, sizeof(op));
+	op.type = FL2K_OP_I2C_WRITE;
+	op.i2c_addr = i2c_addr;
+	op.reg_addr = reg_addr;
+	memcpy(op.data, data, 4);
 
-	return FL2K_SUCCESS;
+	return fl2k_run_reg_ops(dev, &op, 1);
 }
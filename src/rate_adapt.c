@@ -0,0 +1,215 @@
+/*
+ * osmo-fl2k, turns FL2000-based USB 3.0 to VGA adapters into
+ * low cost DACs
+ *
+ * Copyright (C) 2016-2020 by Steve Markgraf <steve@steve-m.de>
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdint.h>
+
+#include "rate_adapt.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    defined(__SSE2__)
+#define RATE_ADAPT_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(__aarch64__)
+#define RATE_ADAPT_NEON
+#include <arm_neon.h>
+#endif
+
+/* time constant of the level filter, in s */
+#define LEVEL_TAU		2.0
+
+/* time constant of the proportional part, in s, the integral gain is
+ * chosen for critical damping */
+#define ADAPT_TIME		60.0
+#define ADAPT_KP		(1.0 / ADAPT_TIME)
+#define ADAPT_KI		(ADAPT_KP * ADAPT_KP / 4)
+
+static double clamp_dev(double v)
+{
+	if (v > RATE_ADAPT_MAX_DEV)
+		return RATE_ADAPT_MAX_DEV;
+	if (v < -RATE_ADAPT_MAX_DEV)
+		return -RATE_ADAPT_MAX_DEV;
+
+	return v;
+}
+
+void rate_adapt_init(rate_adapt_t *ra, double target)
+{
+	ra->target = target;
+	ra->level = target;
+	ra->integ = 0;
+	ra->ratio = 1;
+	ra->init = 0;
+}
+
+double rate_adapt_update(rate_adapt_t *ra, double level, double dt)
+{
+	double err;
+
+	if (!ra->init) {
+		ra->level = level;
+		ra->init = 1;
+	} else {
+		ra->level += (level - ra->level) * dt / (LEVEL_TAU + dt);
+	}
+
+	/* a level above the target means the source is faster */
+	err = ra->level - ra->target;
+
+	ra->integ = clamp_dev(ra->integ + err * ADAPT_KI * dt);
+	ra->ratio = 1 + clamp_dev(err * ADAPT_KP + ra->integ);
+
+	return ra->ratio;
+}
+
+/* interpolate n samples, the fraction of output sample j is frac + j * d,
+ * which doesn't wrap around within the run, so input sample j and the
+ * following one are used. The weighted sums stay within 16 bits */
+static void resample_run(const int8_t *x, int8_t *out, uint32_t n,
+			 uint32_t frac, uint32_t d)
+{
+	uint32_t j = 0;
+	int w1;
+#if defined(RATE_ADAPT_SSE2)
+	const __m128i full = _mm_set1_epi16(256);
+	const __m128i rnd = _mm_set1_epi16(128);
+	const __m128i inc = _mm_set1_epi32((int)(d * 16));
+	__m128i f0, f1, f2, f3, w1lo, w1hi, a, b, lo, hi;
+
+	f0 = _mm_add_epi32(_mm_set1_epi32((int)frac),
+			   _mm_setr_epi32(0, (int)d, (int)(d * 2), (int)(d * 3)));
+	f1 = _mm_add_epi32(f0, _mm_set1_epi32((int)(d * 4)));
+	f2 = _mm_add_epi32(f1, _mm_set1_epi32((int)(d * 4)));
+	f3 = _mm_add_epi32(f2, _mm_set1_epi32((int)(d * 4)));
+
+	for (; j + 16 <= n; j += 16) {
+		/* the top 8 bits of the fractions are the weights */
+		w1lo = _mm_packs_epi32(_mm_srli_epi32(f0, 24),
+				       _mm_srli_epi32(f1, 24));
+		w1hi = _mm_packs_epi32(_mm_srli_epi32(f2, 24),
+				       _mm_srli_epi32(f3, 24));
+
+		a = _mm_loadu_si128((const __m128i *)&x[j]);
+		b = _mm_loadu_si128((const __m128i *)&x[j + 1]);
+
+		/* sign extend by unpacking into the high bytes */
+		lo = _mm_add_epi16(
+			_mm_mullo_epi16(_mm_srai_epi16(_mm_unpacklo_epi8(a, a), 8),
+					_mm_sub_epi16(full, w1lo)),
+			_mm_mullo_epi16(_mm_srai_epi16(_mm_unpacklo_epi8(b, b), 8),
+					w1lo));
+		hi = _mm_add_epi16(
+			_mm_mullo_epi16(_mm_srai_epi16(_mm_unpackhi_epi8(a, a), 8),
+					_mm_sub_epi16(full, w1hi)),
+			_mm_mullo_epi16(_mm_srai_epi16(_mm_unpackhi_epi8(b, b), 8),
+					w1hi));
+
+		lo = _mm_srai_epi16(_mm_add_epi16(lo, rnd), 8);
+		hi = _mm_srai_epi16(_mm_add_epi16(hi, rnd), 8);
+
+		_mm_storeu_si128((__m128i *)&out[j], _mm_packs_epi16(lo, hi));
+
+		f0 = _mm_add_epi32(f0, inc);
+		f1 = _mm_add_epi32(f1, inc);
+		f2 = _mm_add_epi32(f2, inc);
+		f3 = _mm_add_epi32(f3, inc);
+	}
+#elif defined(RATE_ADAPT_NEON)
+	const uint32_t lanes[4] = { 0, d, d * 2, d * 3 };
+	const int16x8_t full = vdupq_n_s16(256);
+	const uint32x4_t inc = vdupq_n_u32(d * 16);
+	uint32x4_t f0, f1, f2, f3;
+	int16x8_t w1lo, w1hi, lo, hi;
+	int8x16_t a, b;
+
+	f0 = vaddq_u32(vdupq_n_u32(frac), vld1q_u32(lanes));
+	f1 = vaddq_u32(f0, vdupq_n_u32(d * 4));
+	f2 = vaddq_u32(f1, vdupq_n_u32(d * 4));
+	f3 = vaddq_u32(f2, vdupq_n_u32(d * 4));
+
+	for (; j + 16 <= n; j += 16) {
+		w1lo = vreinterpretq_s16_u16(vcombine_u16(vshrn_n_u32(f0, 24),
+							  vshrn_n_u32(f1, 24)));
+		w1hi = vreinterpretq_s16_u16(vcombine_u16(vshrn_n_u32(f2, 24),
+							  vshrn_n_u32(f3, 24)));
+
+		a = vld1q_s8(&x[j]);
+		b = vld1q_s8(&x[j + 1]);
+
+		lo = vmlaq_s16(vmulq_s16(vmovl_s8(vget_low_s8(a)),
+					 vsubq_s16(full, w1lo)),
+			       vmovl_s8(vget_low_s8(b)), w1lo);
+		hi = vmlaq_s16(vmulq_s16(vmovl_s8(vget_high_s8(a)),
+					 vsubq_s16(full, w1hi)),
+			       vmovl_s8(vget_high_s8(b)), w1hi);
+
+		/* rounding shift */
+		vst1q_s8(&out[j], vcombine_s8(vqmovn_s16(vrshrq_n_s16(lo, 8)),
+					      vqmovn_s16(vrshrq_n_s16(hi, 8))));
+
+		f0 = vaddq_u32(f0, inc);
+		f1 = vaddq_u32(f1, inc);
+		f2 = vaddq_u32(f2, inc);
+		f3 = vaddq_u32(f3, inc);
+	}
+#endif
+
+	for (; j < n; j++) {
+		w1 = (int)((frac + j * d) >> 24);
+		out[j] = (int8_t)((x[j] * (256 - w1) + x[j + 1] * w1 + 128) >> 8);
+	}
+}
+
+void rate_adapt_resample_s8(const int8_t *in, int8_t *out, uint32_t len,
+			    uint64_t *pos, uint64_t step)
+{
+	int64_t d = (int64_t)(step - (1ULL << 32));
+	uint64_t p = *pos, fp;
+	uint32_t i = 0, n;
+
+	while (i < len) {
+		/* the run ends when the fraction wraps around, and the
+		 * input advances by two samples or none at once */
+		fp = p & 0xffffffff;
+
+		if (d > 0)
+			n = (uint32_t)(((1ULL << 32) - fp + d - 1) / d);
+		else if (d < 0)
+			n = (uint32_t)(fp / -d + 1);
+		else
+			n = len - i;
+
+		if (n > len - i)
+			n = len - i;
+
+		resample_run(in + (p >> 32), out + i, n, (uint32_t)fp,
+			     (uint32_t)d);
+
+		p += n * step;
+		i += n;
+	}
+
+	*pos = p;
+}
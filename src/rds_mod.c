@@ -28,6 +28,9 @@
 #include <string.h>
 #include <time.h>
 #include <stdlib.h>
+#include <pthread.h>
+
+#include "rds_mod.h"
 
 #define RT_LENGTH	64
 #define PS_LENGTH	8
@@ -35,13 +38,6 @@
 
 extern double waveform_biphase[576];
 
-struct {
-	uint16_t pi;
-	int ta;
-	char ps[PS_LENGTH+1];
-	char rt[RT_LENGTH+1];
-} rds_params = { 0 };
-
 /* The RDS error-detection code generator polynomial is
    x^10 + x^8 + x^7 + x^5 + x^4 + x^3 + x^0
 */
@@ -53,8 +49,74 @@ struct {
 #define BITS_PER_GROUP (GROUP_LENGTH * (BLOCK_SIZE+POLY_DEG))
 #define SAMPLES_PER_BIT 192
 #define FILTER_SIZE (sizeof(waveform_biphase)/sizeof(double))
-#define SAMPLE_BUFFER_SIZE (SAMPLES_PER_BIT + FILTER_SIZE)
+#define FILTER_BITS (FILTER_SIZE / SAMPLES_PER_BIT)
 
+struct rds_encoder {
+	uint16_t pi;
+	int ta;
+	char ps[PS_LENGTH+1];
+	char rt[RT_LENGTH+1];
+
+	/* group sequence */
+	int state;
+	int ps_state;
+	int rt_state;
+	int latest_minutes;
+
+	int bit_buffer[BITS_PER_GROUP];
+	int bit_pos;
+	int cur_output;
+
+	/* differentially encoded values of the last FILTER_BITS bits,
+	 * the newest one in bit 0 */
+	unsigned int history;
+	unsigned int bits_sent;		/* saturates at FILTER_BITS */
+	unsigned int sample_pos;	/* position within the current bit */
+	int started;
+	const float *waveform;		/* waveform of the current bit */
+	float startup[SAMPLES_PER_BIT];
+};
+
+/* The biphase FIR spans FILTER_BITS bits, so every sample is the sum of
+ * the waveforms of the current and the previous two bits, each inverted
+ * or not. As 57 kHz is a quarter of the sample rate and a bit is a
+ * multiple of 4 samples long, the carrier phase only depends on the
+ * position within the bit. All 8 combinations are precomputed, already
+ * modulated onto the carrier, so generating samples is a table copy. */
+static float bit_waveforms[1 << FILTER_BITS][SAMPLES_PER_BIT];
+static pthread_once_t bit_waveforms_once = PTHREAD_ONCE_INIT;
+
+/* carrier for sample s of a bit, the output lags the bit by one sample */
+static const int carrier[4] = { 0, 1, 0, -1 };
+
+static void rds_waveform(float *out, unsigned int history, unsigned int nbits)
+{
+	unsigned int s, j;
+	double val;
+
+	for (s = 0; s < SAMPLES_PER_BIT; s++) {
+		val = 0;
+
+		/* bit j is the j-th previous one, it contributes the part
+		 * of its waveform j bits after its start */
+		for (j = 0; j < nbits; j++) {
+			if (history & (1 << j))
+				val -= waveform_biphase[j*SAMPLES_PER_BIT + s];
+			else
+				val += waveform_biphase[j*SAMPLES_PER_BIT + s];
+		}
+
+		out[s] = val * carrier[(s + 1) & 3];
+	}
+}
+
+static void rds_init_waveforms(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < (1 << FILTER_BITS); i++)
+		rds_waveform(bit_waveforms[i], i, FILTER_BITS);
+}
 
 uint16_t offset_words[] = { 0x0FC, 0x198, 0x168, 0x1B4 };
 // We don't handle offset word C' here for the sake of simplicity
@@ -82,9 +144,8 @@ uint16_t crc(uint16_t block)
 /* Possibly generates a CT (clock time) group if the minute has just changed
    Returns 1 if the CT group was generated, 0 otherwise
 */
-int get_rds_ct_group(uint16_t *blocks)
+static int get_rds_ct_group(rds_encoder_t *enc, uint16_t *blocks)
 {
-	static int latest_minutes = -1;
 	int l, mjd, offset;
 
 	// Check time
@@ -94,9 +155,9 @@ int get_rds_ct_group(uint16_t *blocks)
 	now = time(NULL);
 	utc = gmtime(&now);
 
-	if(utc->tm_min != latest_minutes) {
+	if(utc->tm_min != enc->latest_minutes) {
 		// Generate CT group
-		latest_minutes = utc->tm_min;
+		enc->latest_minutes = utc->tm_min;
 
 		l = utc->tm_mon <= 1 ? 1 : 0;
 		mjd = 14956 + utc->tm_mday + 
@@ -131,41 +192,38 @@ int get_rds_ct_group(uint16_t *blocks)
    pattern. 'ps_state' and 'rt_state' keep track of where we are in the PS (0A) sequence
    or RT (2A) sequence, respectively.
 */
-void get_rds_group(int *buffer)
+static void get_rds_group(rds_encoder_t *enc, int *buffer)
 {
-	static int state = 0;
-	static int ps_state = 0;
-	static int rt_state = 0;
-	uint16_t blocks[GROUP_LENGTH] = { rds_params.pi, 0, 0, 0 };
+	uint16_t blocks[GROUP_LENGTH] = { enc->pi, 0, 0, 0 };
 	uint16_t block, check;
 	int i, j;
 
 	// Generate block content
-	if (!get_rds_ct_group(blocks)) { // CT (clock time) has priority on other group types
-		if (state < 4) {
-			blocks[1] = 0x0400 | ps_state;
+	if (!get_rds_ct_group(enc, blocks)) { // CT (clock time) has priority on other group types
+		if (enc->state < 4) {
+			blocks[1] = 0x0400 | enc->ps_state;
 
-			if (rds_params.ta)
+			if (enc->ta)
 				blocks[1] |= 0x0010;
 
 			blocks[2] = 0xCDCD;	 // no AF
-			blocks[3] = rds_params.ps[ps_state*2] << 8 | rds_params.ps[ps_state*2+1];
-			ps_state++;
+			blocks[3] = enc->ps[enc->ps_state*2] << 8 | enc->ps[enc->ps_state*2+1];
+			enc->ps_state++;
 
-			if (ps_state >= 4)
-				ps_state = 0;
+			if (enc->ps_state >= 4)
+				enc->ps_state = 0;
 		} else { // state == 5
-			blocks[1] = 0x2400 | rt_state;
-			blocks[2] = rds_params.rt[rt_state*4+0] << 8 | rds_params.rt[rt_state*4+1];
-			blocks[3] = rds_params.rt[rt_state*4+2] << 8 | rds_params.rt[rt_state*4+3];
-			rt_state++;
-			if (rt_state >= 16)
-				rt_state = 0;
+			blocks[1] = 0x2400 | enc->rt_state;
+			blocks[2] = enc->rt[enc->rt_state*4+0] << 8 | enc->rt[enc->rt_state*4+1];
+			blocks[3] = enc->rt[enc->rt_state*4+2] << 8 | enc->rt[enc->rt_state*4+3];
+			enc->rt_state++;
+			if (enc->rt_state >= 16)
+				enc->rt_state = 0;
 		}
 
-		state++;
-		if (state >= 5)
-			state = 0;
+		enc->state++;
+		if (enc->state >= 5)
+			enc->state = 0;
 	}
 	
 	// Calculate the checkword for each block and emit the bits
@@ -183,120 +241,116 @@ void get_rds_group(int *buffer)
 	}
 }
 
-/* Get a number of RDS samples. This generates the envelope of the waveform using
-   pre-generated elementary waveform samples, and then it amplitude-modulates the 
-   envelope with a 57 kHz carrier, which is very efficient as 57 kHz is 4 times the
-   sample frequency we are working at (228 kHz).
+/* advance to the next bit and select its waveform */
+static void rds_next_bit(rds_encoder_t *enc)
+{
+	if (enc->bit_pos >= BITS_PER_GROUP) {
+		get_rds_group(enc, enc->bit_buffer);
+		enc->bit_pos = 0;
+	}
+
+	// do differential encoding
+	enc->cur_output ^= enc->bit_buffer[enc->bit_pos++];
+	enc->history = ((enc->history << 1) | enc->cur_output) &
+		       ((1 << FILTER_BITS) - 1);
+
+	if (enc->bits_sent < FILTER_BITS)
+		enc->bits_sent++;
+
+	/* the first bits have no predecessors yet */
+	if (enc->bits_sent < FILTER_BITS) {
+		rds_waveform(enc->startup, enc->history, enc->bits_sent);
+		enc->waveform = enc->startup;
+	} else {
+		enc->waveform = bit_waveforms[enc->history];
+	}
+
+	enc->sample_pos = 0;
+}
+
+rds_encoder_t *rds_encoder_create(void)
+{
+	rds_encoder_t *enc;
+
+	pthread_once(&bit_waveforms_once, rds_init_waveforms);
+
+	enc = malloc(sizeof(rds_encoder_t));
+	if (!enc)
+		return NULL;
+
+	memset(enc, 0, sizeof(rds_encoder_t));
+	enc->latest_minutes = -1;
+	enc->bit_pos = BITS_PER_GROUP;
+	enc->sample_pos = SAMPLES_PER_BIT;
+
+	return enc;
+}
+
+void rds_encoder_destroy(rds_encoder_t *enc)
+{
+	free(enc);
+}
+
+/* Get a number of RDS samples, already modulated onto the 57 kHz
+   carrier, which is 4 times the sample frequency we are working at
+   (228 kHz).
  */
-void get_rds_samples(double *buffer, uint32_t count)
+void rds_get_samples(rds_encoder_t *enc, float *buffer, uint32_t count)
 {
-	static int bit_buffer[BITS_PER_GROUP];
-	static int bit_pos = BITS_PER_GROUP;
-	static double sample_buffer[SAMPLE_BUFFER_SIZE] = {0};
-
-	static int prev_output = 0;
-	static int cur_output = 0;
-	static int cur_bit = 0;
-	static int sample_count = SAMPLES_PER_BIT;
-	static int inverting = 0;
-	static int phase = 0;
-
-	static unsigned int in_sample_index = 0;
-	static unsigned int out_sample_index = SAMPLE_BUFFER_SIZE-1;
-
-	unsigned int i, j, idx;
-	double val, sample;
-	double *src;
-
-	for (i = 0; i < count; i++) {
-		if (sample_count >= SAMPLES_PER_BIT) {
-			if (bit_pos >= BITS_PER_GROUP) {
-				get_rds_group(bit_buffer);
-				bit_pos = 0;
-			}
-
-			// do differential encoding
-			cur_bit = bit_buffer[bit_pos];
-			prev_output = cur_output;
-			cur_output = prev_output ^ cur_bit;
-
-			inverting = (cur_output == 1);
-
-			src = waveform_biphase;
-			idx = in_sample_index;
-
-			for (j = 0; j < FILTER_SIZE; j++) {
-				val = *src++;
-				if (inverting)
-					val = -val;
-
-				sample_buffer[idx++] += val;
-
-				if (idx >= SAMPLE_BUFFER_SIZE)
-					idx = 0;
-			}
-
-			in_sample_index += SAMPLES_PER_BIT;
-			if (in_sample_index >= SAMPLE_BUFFER_SIZE)
-				in_sample_index -= SAMPLE_BUFFER_SIZE;
-
-			bit_pos++;
-			sample_count = 0;
-		}
+	uint32_t i = 0, n;
 
-		sample = sample_buffer[out_sample_index];
-		sample_buffer[out_sample_index] = 0;
-		out_sample_index++;
-		if (out_sample_index >= SAMPLE_BUFFER_SIZE)
-			out_sample_index = 0;
-
-		// modulate at 57 kHz
-		// use phase for this
-		switch (phase) {
-			case 0:
-			case 2: sample = 0; break;
-			case 1: break;
-			case 3: sample = -sample; break;
-		}
-		phase++;
-		if (phase >= 4)
-			phase = 0;
+	/* the output lags the first bit by one sample */
+	if (!enc->started && count) {
+		buffer[i++] = 0;
+		enc->started = 1;
+	}
+
+	while (i < count) {
+		if (enc->sample_pos >= SAMPLES_PER_BIT)
+			rds_next_bit(enc);
+
+		n = SAMPLES_PER_BIT - enc->sample_pos;
+		if (n > count - i)
+			n = count - i;
+
+		memcpy(&buffer[i], &enc->waveform[enc->sample_pos],
+		       n * sizeof(float));
 
-		*buffer++ = sample;
-		sample_count++;
+		enc->sample_pos += n;
+		i += n;
 	}
 }
 
-void set_rds_pi(uint16_t pi_code)
+void rds_set_pi(rds_encoder_t *enc, uint16_t pi_code)
 {
-	rds_params.pi = pi_code;
+	enc->pi = pi_code;
 }
 
-void set_rds_rt(char *rt)
+void rds_set_rt(rds_encoder_t *enc, const char *rt)
 {
 	int i;
 
-	strncpy(rds_params.rt, rt, 64);
+	strncpy(enc->rt, rt, 64);
 
 	for (i = 0; i < 64; i++) {
-		if (rds_params.rt[i] == 0)
-			rds_params.rt[i] = 32;
+		if (enc->rt[i] == 0)
+			enc->rt[i] = 32;
 	}
 }
 
-void set_rds_ps(char *ps)
+void rds_set_ps(rds_encoder_t *enc, const char *ps)
 {
 	int i;
 
-	strncpy(rds_params.ps, ps, 8);
+	strncpy(enc->ps, ps, 8);
 
 	for (i = 0; i < 8; i++) {
-		if (rds_params.ps[i] == 0)
-			rds_params.ps[i] = 32;
+		if (enc->ps[i] == 0)
+			enc->ps[i] = 32;
 	}
 }
 
-void set_rds_ta(int ta)
+void rds_set_ta(rds_encoder_t *enc, int ta)
 {
-	rds_params.ta = ta;
+	enc->ta = ta;
 }